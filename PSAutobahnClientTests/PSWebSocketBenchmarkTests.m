@@ -0,0 +1,2730 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <XCTest/XCTest.h>
+#import "PSWebSocketMask.h"
+#import "PSWebSocketUTF8Decoder.h"
+#import "PSWebSocketBuffer.h"
+#import "PSWebSocket.h"
+#import "PSWebSocketDriver.h"
+#import "PSWebSocketDeflater.h"
+#import "PSWebSocketInflater.h"
+#import "PSWebSocketStreamTransport.h"
+#import "PSWebSocketSocketTransport.h"
+#import "PSWebSocketZlibPool.h"
+#import "PSWebSocketHTTPParser.h"
+#import "PSWebSocketServer.h"
+#import "PSWebSocketTimingWheel.h"
+#import <sys/socket.h>
+#import <netinet/in.h>
+#import <unistd.h>
+#import <sys/resource.h>
+#import <malloc/malloc.h>
+#import <mach/mach.h>
+#import <stdatomic.h>
+
+static const NSUInteger PSBenchmarkPayloadLength = 64 * 1024 * 1024;
+static const NSUInteger PSBenchmarkIterations = 10;
+
+// results are also appended to this file as JSON lines when it is set
+static NSString *const PSBenchmarkResultsPathKey = @"PS_BENCHMARK_RESULTS";
+
+#pragma mark - Allocation Counting
+
+// counts allocations made through the default malloc zone while enabled
+static _Atomic uint64_t PSBenchmarkAllocationCount = 0;
+static void *(*PSBenchmarkZoneMalloc)(malloc_zone_t *zone, size_t size);
+static void *(*PSBenchmarkZoneCalloc)(malloc_zone_t *zone, size_t count, size_t size);
+static void *(*PSBenchmarkZoneRealloc)(malloc_zone_t *zone, void *pointer, size_t size);
+
+static void *PSBenchmarkCountingMalloc(malloc_zone_t *zone, size_t size) {
+    atomic_fetch_add_explicit(&PSBenchmarkAllocationCount, 1, memory_order_relaxed);
+    return PSBenchmarkZoneMalloc(zone, size);
+}
+static void *PSBenchmarkCountingCalloc(malloc_zone_t *zone, size_t count, size_t size) {
+    atomic_fetch_add_explicit(&PSBenchmarkAllocationCount, 1, memory_order_relaxed);
+    return PSBenchmarkZoneCalloc(zone, count, size);
+}
+static void *PSBenchmarkCountingRealloc(malloc_zone_t *zone, void *pointer, size_t size) {
+    atomic_fetch_add_explicit(&PSBenchmarkAllocationCount, 1, memory_order_relaxed);
+    return PSBenchmarkZoneRealloc(zone, pointer, size);
+}
+static void PSBenchmarkCountAllocations(BOOL count) {
+    malloc_zone_t *zone = malloc_default_zone();
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), 0, VM_PROT_READ | VM_PROT_WRITE);
+    if(count && zone->malloc != PSBenchmarkCountingMalloc) {
+        PSBenchmarkZoneMalloc = zone->malloc;
+        PSBenchmarkZoneCalloc = zone->calloc;
+        PSBenchmarkZoneRealloc = zone->realloc;
+        zone->malloc = PSBenchmarkCountingMalloc;
+        zone->calloc = PSBenchmarkCountingCalloc;
+        zone->realloc = PSBenchmarkCountingRealloc;
+    } else if(!count && zone->malloc == PSBenchmarkCountingMalloc) {
+        zone->malloc = PSBenchmarkZoneMalloc;
+        zone->calloc = PSBenchmarkZoneCalloc;
+        zone->realloc = PSBenchmarkZoneRealloc;
+    }
+    vm_protect(mach_task_self(), (vm_address_t)zone, sizeof(*zone), 0, VM_PROT_READ);
+}
+
+@interface PSBenchmarkRecordingTransport : NSObject <PSWebSocketTransport>
+@property (nonatomic, assign) NSUInteger writeCount;
+@property (nonatomic, strong) NSMutableData *written;
+@property (nonatomic, assign) BOOL stalled;
+@end
+@implementation PSBenchmarkRecordingTransport {
+    dispatch_queue_t _queue;
+}
+
+@synthesize delegate = _delegate;
+@synthesize status = _status;
+
+- (void)setStalled:(BOOL)stalled {
+    _stalled = stalled;
+    if(!stalled && _queue) {
+        dispatch_async(_queue, ^{
+            [_delegate transport:self handleEvent:NSStreamEventHasSpaceAvailable];
+        });
+    }
+}
+
+- (NSError *)error {
+    return nil;
+}
+- (NSData *)remoteAddress {
+    return nil;
+}
+- (void)scheduleOnQueue:(dispatch_queue_t)queue {
+    _queue = queue;
+}
+- (void)open {
+    _status = NSStreamStatusOpen;
+    _written = [NSMutableData data];
+}
+- (void)close {
+    _status = NSStreamStatusClosed;
+}
+- (BOOL)hasBytesAvailable {
+    return NO;
+}
+- (BOOL)hasSpaceAvailable {
+    return _status == NSStreamStatusOpen && !_stalled;
+}
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length {
+    return 0;
+}
+- (NSInteger)writeChunks:(const struct iovec *)chunks count:(NSUInteger)count {
+    NSUInteger length = 0;
+    for(NSUInteger i = 0; i < count; ++i) {
+        [_written appendBytes:chunks[i].iov_base length:chunks[i].iov_len];
+        length += chunks[i].iov_len;
+    }
+    ++_writeCount;
+    return length;
+}
+
+@end
+
+@interface PSBenchmarkMessageCounter : NSObject <PSWebSocketDelegate>
+@property (nonatomic, strong) dispatch_semaphore_t semaphore;
+@property (nonatomic, assign) NSUInteger messagesExpected;
+@property (atomic, assign) NSUInteger messagesReceived;
+@property (atomic, assign) NSUInteger deliveries;
+@property (atomic, assign) NSUInteger largestBatchCount;
+@property (atomic, assign) NSUInteger highWaterMarkCount;
+@property (atomic, assign) NSUInteger lowWaterMarkCount;
+@end
+@implementation PSBenchmarkMessageCounter
+
+- (void)receiveCount:(NSUInteger)count {
+    self.deliveries += 1;
+    self.largestBatchCount = MAX(self.largestBatchCount, count);
+    self.messagesReceived += count;
+    if(self.messagesReceived == self.messagesExpected) {
+        dispatch_semaphore_signal(self.semaphore);
+    }
+}
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    [self receiveCount:1];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+    dispatch_semaphore_signal(self.semaphore);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+    dispatch_semaphore_signal(self.semaphore);
+}
+- (void)webSocketDidReachHighWaterMark:(PSWebSocket *)webSocket {
+    self.highWaterMarkCount += 1;
+}
+- (void)webSocketDidDrainToLowWaterMark:(PSWebSocket *)webSocket {
+    self.lowWaterMarkCount += 1;
+}
+
+@end
+
+@interface PSBenchmarkBatchCounter : PSBenchmarkMessageCounter
+@end
+@implementation PSBenchmarkBatchCounter
+
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages {
+    [self receiveCount:messages.count];
+}
+
+@end
+
+/**
+ *  Keeps every message received, in order, and also signals once open.
+ */
+@interface PSBenchmarkMessageCollector : PSBenchmarkMessageCounter
+@property (nonatomic, strong, readonly) NSMutableArray *messages;
+@end
+@implementation PSBenchmarkMessageCollector
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _messages = [NSMutableArray array];
+    }
+    return self;
+}
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+    dispatch_semaphore_signal(self.semaphore);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    [_messages addObject:message];
+    [super webSocket:webSocket didReceiveMessage:message];
+}
+
+@end
+
+/**
+ *  Records the order delegate callbacks arrive in, called inline.
+ */
+@interface PSBenchmarkEventRecorder : NSObject <PSWebSocketDelegate>
+@property (nonatomic, strong) dispatch_semaphore_t semaphore;
+@property (nonatomic, strong, readonly) NSMutableArray *events;
+@end
+@implementation PSBenchmarkEventRecorder
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _events = [NSMutableArray array];
+    }
+    return self;
+}
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    [_events addObject:@"message"];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages {
+    for(NSUInteger i = 0; i < messages.count; ++i) {
+        [_events addObject:@"message"];
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didBeginMessage:(PSWebSocketMessageType)type {
+    [_events addObject:@"begin"];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessageChunk:(NSData *)chunk {
+    [_events addObject:@"chunk"];
+}
+- (void)webSocketDidFinishMessage:(PSWebSocket *)webSocket {
+    [_events addObject:@"finish"];
+    dispatch_semaphore_signal(_semaphore);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+    dispatch_semaphore_signal(_semaphore);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+    dispatch_semaphore_signal(_semaphore);
+}
+
+@end
+
+/**
+ *  One end of a pair of drivers talking to each other in memory.
+ */
+@interface PSBenchmarkDriverPeer : NSObject <PSWebSocketDriverDelegate>
+@property (nonatomic, strong) PSWebSocketDriver *driver;
+@property (nonatomic, strong) NSMutableData *written;
+@property (nonatomic, assign) NSUInteger messageCount;
+@property (nonatomic, assign) BOOL opened;
+@property (nonatomic, strong) NSError *error;
+@end
+@implementation PSBenchmarkDriverPeer
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _written = [NSMutableData data];
+    }
+    return self;
+}
+- (void)setDriver:(PSWebSocketDriver *)driver {
+    _driver = driver;
+    _driver.delegate = self;
+}
+- (void)driverDidOpen:(PSWebSocketDriver *)driver {
+    _opened = YES;
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceiveMessage:(id)message {
+    ++_messageCount;
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceivePing:(NSData *)ping {
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceivePong:(NSData *)pong {
+}
+- (void)driver:(PSWebSocketDriver *)driver didFailWithError:(NSError *)error {
+    _error = error;
+}
+- (void)driver:(PSWebSocketDriver *)driver didCloseWithCode:(NSInteger)code reason:(NSString *)reason {
+}
+- (void)driver:(PSWebSocketDriver *)driver write:(NSData *)data {
+    [_written appendData:data];
+}
+
+@end
+
+/**
+ *  Server that echoes every message back to its sender.
+ */
+@interface PSBenchmarkEchoServer : NSObject <PSWebSocketServerDelegate>
+@property (nonatomic, strong) dispatch_semaphore_t semaphore;
+@property (nonatomic, strong) dispatch_group_t openGroup;
+@property (nonatomic, assign) BOOL discardsMessages;
+@property (atomic, strong) NSError *error;
+@property (nonatomic, strong, readonly) NSMutableArray *webSockets;
+@end
+@implementation PSBenchmarkEchoServer
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _webSockets = [NSMutableArray array];
+    }
+    return self;
+}
+- (void)serverDidStart:(PSWebSocketServer *)server {
+    dispatch_semaphore_signal(_semaphore);
+}
+- (void)server:(PSWebSocketServer *)server didFailWithError:(NSError *)error {
+    self.error = error;
+    dispatch_semaphore_signal(_semaphore);
+}
+- (void)serverDidStop:(PSWebSocketServer *)server {
+}
+- (void)server:(PSWebSocketServer *)server webSocketDidOpen:(PSWebSocket *)webSocket {
+    [_webSockets addObject:webSocket];
+    if(_openGroup) {
+        dispatch_group_leave(_openGroup);
+    }
+}
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    if(!_discardsMessages) {
+        [webSocket send:message];
+    }
+}
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+}
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+}
+
+@end
+
+/**
+ *  Client that sends messages one at a time, each after the echo of the
+ *  previous one, and records the round trip of each.
+ */
+@interface PSBenchmarkLoadClient : NSObject <PSWebSocketDelegate>
+@property (nonatomic, strong) PSWebSocket *webSocket;
+@property (nonatomic, strong) dispatch_group_t openGroup;
+@property (nonatomic, strong) dispatch_group_t finishGroup;
+@property (nonatomic, assign) NSUInteger messagesRemaining;
+@property (nonatomic, assign) NSUInteger messageLength;
+@property (nonatomic, assign) CFAbsoluteTime openStart;
+@property (nonatomic, assign) NSTimeInterval openLatency;
+@property (nonatomic, strong, readonly) NSMutableData *latencies;
+@property (nonatomic, assign) BOOL failed;
+@end
+@implementation PSBenchmarkLoadClient
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _latencies = [NSMutableData data];
+    }
+    return self;
+}
+- (void)sendNext {
+    NSMutableData *message = [NSMutableData dataWithLength:MAX(_messageLength, sizeof(CFAbsoluteTime))];
+    CFAbsoluteTime now = CFAbsoluteTimeGetCurrent();
+    memcpy(message.mutableBytes, &now, sizeof(now));
+    [_webSocket send:message];
+}
+- (void)finish {
+    dispatch_group_leave(_finishGroup);
+    _finishGroup = nil;
+}
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+    _openLatency = CFAbsoluteTimeGetCurrent() - _openStart;
+    dispatch_group_leave(_openGroup);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    CFAbsoluteTime sent;
+    memcpy(&sent, [message bytes], sizeof(sent));
+    NSTimeInterval latency = CFAbsoluteTimeGetCurrent() - sent;
+    [_latencies appendBytes:&latency length:sizeof(latency)];
+    if(--_messagesRemaining > 0) {
+        [self sendNext];
+    } else if(_finishGroup) {
+        [self finish];
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+    _failed = YES;
+    if(_openLatency == 0.0) {
+        dispatch_group_leave(_openGroup);
+    }
+    if(_finishGroup) {
+        [self finish];
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+    if(_finishGroup) {
+        [self finish];
+    }
+}
+
+@end
+
+/**
+ *  Client that leaves receiveGroup on the next message it receives.
+ */
+@interface PSBenchmarkSubscriber : NSObject <PSWebSocketDelegate>
+@property (nonatomic, strong) PSWebSocket *webSocket;
+@property (nonatomic, strong) dispatch_group_t openGroup;
+@property (atomic, strong) dispatch_group_t receiveGroup;
+@property (nonatomic, assign) BOOL opened;
+@property (nonatomic, assign) BOOL failed;
+@end
+@implementation PSBenchmarkSubscriber
+
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+    _opened = YES;
+    dispatch_group_leave(_openGroup);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    dispatch_group_t receiveGroup = self.receiveGroup;
+    self.receiveGroup = nil;
+    if(receiveGroup) {
+        dispatch_group_leave(receiveGroup);
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+    _failed = YES;
+    if(!_opened) {
+        dispatch_group_leave(_openGroup);
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+}
+
+@end
+
+@interface PSWebSocketBenchmarkTests : XCTestCase <PSWebSocketDelegate, PSWebSocketDriverDelegate> {
+    dispatch_semaphore_t _semaphore;
+    NSUInteger _messagesExpected;
+    NSUInteger _messagesReceived;
+    NSMutableArray *_driverEvents;
+    NSMutableData *_driverChunks;
+    NSMutableArray *_driverWrites;
+    NSUInteger _driverMessageCount;
+    id _driverMessage;
+    NSData *_driverHandshake;
+    NSError *_driverError;
+    BOOL _expectsDriverError;
+    BOOL _discardDriverWrites;
+}
+
+@end
+@implementation PSWebSocketBenchmarkTests
+
+#pragma mark - Helpers
+
+- (NSTimeInterval)timeIterations:(NSUInteger)iterations block:(void (^)(void))block {
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for(NSUInteger i = 0; i < iterations; ++i) {
+        block();
+    }
+    return CFAbsoluteTimeGetCurrent() - start;
+}
+- (void)logName:(NSString *)name bytes:(NSUInteger)bytes duration:(NSTimeInterval)duration {
+    NSLog(@"[PSWebSocketBenchmarkTests][%@]: %.3f GB/s", name, ((double)bytes / duration) / 1e9);
+    [self recordResult:name metrics:@{@"bytes_per_second": @((double)bytes / duration)}];
+}
+- (void)recordResult:(NSString *)name metrics:(NSDictionary *)metrics {
+    NSMutableDictionary *result = [metrics mutableCopy];
+    result[@"name"] = name;
+    NSData *json = [NSJSONSerialization dataWithJSONObject:result options:NSJSONWritingSortedKeys error:nil];
+    NSLog(@"[PSWebSocketBenchmarkTests][result]: %@", [[NSString alloc] initWithData:json encoding:NSUTF8StringEncoding]);
+
+    NSString *path = [[NSProcessInfo processInfo] environment][PSBenchmarkResultsPathKey];
+    if(path.length == 0) {
+        return;
+    }
+    if(![[NSFileManager defaultManager] fileExistsAtPath:path]) {
+        [[NSFileManager defaultManager] createFileAtPath:path contents:nil attributes:nil];
+    }
+    NSFileHandle *fileHandle = [NSFileHandle fileHandleForWritingAtPath:path];
+    [fileHandle seekToEndOfFile];
+    [fileHandle writeData:json];
+    [fileHandle writeData:[NSData dataWithBytes:"\n" length:1]];
+    [fileHandle closeFile];
+}
+- (NSTimeInterval)percentile:(double)percentile ofSortedLatencies:(NSData *)latencies {
+    NSUInteger count = latencies.length / sizeof(NSTimeInterval);
+    if(count == 0) {
+        return 0.0;
+    }
+    NSUInteger rank = MIN(MAX((NSUInteger)ceil(percentile / 100.0 * count), 1), count);
+    return ((const NSTimeInterval *)latencies.bytes)[rank - 1];
+}
+
+#pragma mark - Masking
+
+- (void)testMaskMatchesByteLoop {
+    uint8_t maskKey[4] = {0x12, 0x34, 0x56, 0x78};
+    NSMutableData *expected = [NSMutableData dataWithLength:1027];
+    arc4random_buf(expected.mutableBytes, expected.length);
+
+    for(NSUInteger head = 0; head < 16; ++head) {
+        for(NSUInteger split = 0; split < 64; ++split) {
+            NSMutableData *actual = [expected mutableCopy];
+            NSMutableData *reference = [expected mutableCopy];
+            uint8_t *actualBytes = (uint8_t *)actual.mutableBytes + head;
+            uint8_t *referenceBytes = (uint8_t *)reference.mutableBytes + head;
+            NSUInteger length = actual.length - head;
+
+            PSWebSocketMaskBytes(actualBytes, split, maskKey, 0);
+            PSWebSocketMaskBytes(actualBytes + split, length - split, maskKey, split);
+            for(NSUInteger i = 0; i < length; ++i) {
+                referenceBytes[i] = referenceBytes[i] ^ maskKey[i % sizeof(maskKey)];
+            }
+            XCTAssertEqualObjects(actual, reference, @"Masking kernel diverged at head %@ split %@", @(head), @(split));
+        }
+    }
+}
+- (void)testMaskThroughput {
+    uint8_t maskKey[4] = {0x12, 0x34, 0x56, 0x78};
+    NSMutableData *data = [NSMutableData dataWithLength:PSBenchmarkPayloadLength];
+    uint8_t *bytes = data.mutableBytes;
+    NSUInteger length = data.length;
+
+    NSTimeInterval loop = [self timeIterations:PSBenchmarkIterations block:^{
+        for(NSUInteger i = 0; i < length; ++i) {
+            bytes[i] = bytes[i] ^ maskKey[i % sizeof(maskKey)];
+        }
+    }];
+    NSTimeInterval kernel = [self timeIterations:PSBenchmarkIterations block:^{
+        PSWebSocketMaskBytes(bytes, length, maskKey, 0);
+    }];
+
+    [self logName:@"mask byte loop" bytes:length * PSBenchmarkIterations duration:loop];
+    [self logName:@"mask kernel" bytes:length * PSBenchmarkIterations duration:kernel];
+}
+
+#pragma mark - Buffer
+
+- (void)testBufferSegmentsRoundTrip {
+    NSMutableData *expected = [NSMutableData dataWithLength:[PSWebSocketBuffer segmentLength] * 3 + 123];
+    arc4random_buf(expected.mutableBytes, expected.length);
+    NSUInteger allocated = [PSWebSocketBuffer allocatedMemoryUsage];
+
+    @autoreleasepool {
+        PSWebSocketBuffer *buffer = [[PSWebSocketBuffer alloc] init];
+        for(NSUInteger offset = 0; offset < expected.length; offset += 1000) {
+            [buffer appendBytes:(const uint8_t *)expected.bytes + offset length:MIN(1000, expected.length - offset)];
+        }
+        XCTAssertEqual(buffer.bytesAvailable, expected.length);
+        XCTAssertEqual(buffer.contiguousBytesAvailable, [PSWebSocketBuffer segmentLength]);
+
+        NSMutableData *actual = [NSMutableData data];
+        [buffer consumeLength:0];
+        [actual appendBytes:buffer.bytes length:100];
+        [buffer consumeLength:100];
+        [buffer makeContiguous:[PSWebSocketBuffer segmentLength] + 50];
+        XCTAssertEqual(buffer.contiguousBytesAvailable, [PSWebSocketBuffer segmentLength] + 50);
+        while(buffer.hasBytesAvailable) {
+            NSUInteger length = buffer.contiguousBytesAvailable;
+            [actual appendBytes:buffer.bytes length:length];
+            [buffer consumeLength:length];
+        }
+        XCTAssertEqualObjects(actual, expected);
+        XCTAssertEqual([PSWebSocketBuffer allocatedMemoryUsage], allocated, @"Consumed segments should be released");
+    }
+}
+
+#pragma mark - Loopback
+
+- (PSWebSocketDriver *)openServerDriver {
+    return [self openServerDriverWithExtensions:nil];
+}
+- (PSWebSocketDriver *)openServerDriverWithExtensions:(NSString *)extensions {
+    return [self openServerDriverWithExtensions:extensions compressionPolicy:nil];
+}
+- (PSWebSocketDriver *)openServerDriverWithExtensions:(NSString *)extensions compressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy {
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    [request setValue:extensions forHTTPHeaderField:@"Sec-WebSocket-Extensions"];
+    _driverEvents = [NSMutableArray array];
+    _driverChunks = [NSMutableData data];
+    _driverWrites = [NSMutableArray array];
+    PSWebSocketDriver *driver = [PSWebSocketDriver serverDriverWithRequest:request];
+    driver.delegate = self;
+    driver.compressionPolicy = compressionPolicy;
+    [driver start];
+    _driverHandshake = _driverWrites.firstObject;
+    [_driverWrites removeAllObjects];
+    return driver;
+}
+- (NSData *)maskedBinaryFrameWithLength:(NSUInteger)length {
+    NSMutableData *frame = [NSMutableData dataWithLength:14 + length];
+    uint8_t *bytes = frame.mutableBytes;
+    bytes[0] = 0x82;
+    bytes[1] = 0x80 | 127;
+    for(NSUInteger i = 0; i < 8; ++i) {
+        bytes[2 + i] = (uint8_t)((uint64_t)length >> (56 - i * 8));
+    }
+    arc4random_buf(bytes + 10, 4 + length);
+    return frame;
+}
+- (NSTimeInterval)timeLoopbackMessages:(NSUInteger)count frame:(NSData *)frame maximumReadLength:(NSUInteger)maximumReadLength {
+    CFReadStreamRef readStream = NULL;
+    CFWriteStreamRef writeStream = NULL;
+    CFReadStreamRef responseReadStream = NULL;
+    CFWriteStreamRef responseWriteStream = NULL;
+    CFStreamCreateBoundPair(NULL, &readStream, &writeStream, 1024 * 1024);
+    CFStreamCreateBoundPair(NULL, &responseReadStream, &responseWriteStream, 64 * 1024);
+    NSOutputStream *clientStream = CFBridgingRelease(writeStream);
+    CFRelease(responseReadStream);
+
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request
+                                                      inputStream:CFBridgingRelease(readStream)
+                                                     outputStream:CFBridgingRelease(responseWriteStream)];
+    webSocket.delegate = self;
+    webSocket.delegateQueue = dispatch_queue_create(nil, nil);
+    webSocket.maximumReadLength = maximumReadLength;
+
+    _semaphore = dispatch_semaphore_create(0);
+    _messagesExpected = count;
+    _messagesReceived = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [webSocket open];
+    [clientStream open];
+    for(NSUInteger i = 0; i < count; ++i) {
+        NSUInteger offset = 0;
+        while(offset < frame.length) {
+            NSInteger writeLength = [clientStream write:(const uint8_t *)frame.bytes + offset maxLength:frame.length - offset];
+            XCTAssertGreaterThan(writeLength, 0);
+            if(writeLength <= 0) {
+                break;
+            }
+            offset += writeLength;
+        }
+    }
+    XCTAssertEqual(dispatch_semaphore_wait(_semaphore, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)), 0);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+    [clientStream close];
+    webSocket.delegate = nil;
+    return duration;
+}
+- (void)testLoopbackBinaryThroughput {
+    NSUInteger count = 64;
+    NSData *frame = [self maskedBinaryFrameWithLength:1024 * 1024];
+    NSTimeInterval fixed = [self timeLoopbackMessages:count frame:frame maximumReadLength:4096];
+    NSTimeInterval adaptive = [self timeLoopbackMessages:count frame:frame maximumReadLength:256 * 1024];
+
+    [self logName:@"loopback 1MB binary 4KB reads" bytes:frame.length * count duration:fixed];
+    [self logName:@"loopback 1MB binary adaptive reads" bytes:frame.length * count duration:adaptive];
+}
+- (NSTimeInterval)timeSocketPairMessages:(NSUInteger)count frame:(NSData *)frame socketTransport:(BOOL)socketTransport {
+    int handles[2];
+    XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, handles), 0);
+
+    id <PSWebSocketTransport> transport = nil;
+    if(socketTransport) {
+        transport = [PSWebSocketSocketTransport transportWithNativeHandle:handles[0]];
+    } else {
+        CFReadStreamRef readStream = NULL;
+        CFWriteStreamRef writeStream = NULL;
+        CFStreamCreatePairWithSocket(NULL, handles[0], &readStream, &writeStream);
+        CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+        transport = [PSWebSocketStreamTransport transportWithInputStream:CFBridgingRelease(readStream)
+                                                            outputStream:CFBridgingRelease(writeStream)];
+    }
+
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request transport:transport];
+    webSocket.delegate = self;
+    webSocket.delegateQueue = dispatch_queue_create(nil, nil);
+
+    _semaphore = dispatch_semaphore_create(0);
+    _messagesExpected = count;
+    _messagesReceived = 0;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [webSocket open];
+    for(NSUInteger i = 0; i < count; ++i) {
+        NSUInteger offset = 0;
+        while(offset < frame.length) {
+            ssize_t writeLength = write(handles[1], (const uint8_t *)frame.bytes + offset, frame.length - offset);
+            XCTAssertGreaterThan(writeLength, 0);
+            if(writeLength <= 0) {
+                break;
+            }
+            offset += writeLength;
+        }
+    }
+    XCTAssertEqual(dispatch_semaphore_wait(_semaphore, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)), 0);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+    close(handles[1]);
+    webSocket.delegate = nil;
+    return duration;
+}
+- (void)testTransportLoopbackThroughput {
+    NSUInteger largeCount = 64;
+    NSData *largeFrame = [self maskedBinaryFrameWithLength:1024 * 1024];
+    NSUInteger smallCount = 100000;
+    NSData *smallFrame = [self maskedBinaryFrameWithLength:128];
+
+    NSTimeInterval streamLarge = [self timeSocketPairMessages:largeCount frame:largeFrame socketTransport:NO];
+    NSTimeInterval socketLarge = [self timeSocketPairMessages:largeCount frame:largeFrame socketTransport:YES];
+    NSTimeInterval streamSmall = [self timeSocketPairMessages:smallCount frame:smallFrame socketTransport:NO];
+    NSTimeInterval socketSmall = [self timeSocketPairMessages:smallCount frame:smallFrame socketTransport:YES];
+
+    [self logName:@"socketpair 1MB binary stream transport" bytes:largeFrame.length * largeCount duration:streamLarge];
+    [self logName:@"socketpair 1MB binary socket transport" bytes:largeFrame.length * largeCount duration:socketLarge];
+    [self logName:@"socketpair 128B binary stream transport" bytes:smallFrame.length * smallCount duration:streamSmall];
+    [self logName:@"socketpair 128B binary socket transport" bytes:smallFrame.length * smallCount duration:socketSmall];
+}
+
+- (PSWebSocket *)openWebSocketOverTransport:(PSBenchmarkRecordingTransport *)transport delegate:(id <PSWebSocketDelegate>)delegate {
+    return [self openWebSocketOverTransport:transport delegate:delegate timingWheel:nil];
+}
+- (PSWebSocket *)openWebSocketOverTransport:(PSBenchmarkRecordingTransport *)transport delegate:(id <PSWebSocketDelegate>)delegate timingWheel:(PSWebSocketTimingWheel *)timingWheel {
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request transport:transport];
+    webSocket.delegate = delegate;
+    webSocket.delegateQueue = dispatch_queue_create(nil, nil);
+    webSocket.timingWheel = timingWheel;
+    [webSocket open];
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    return webSocket;
+}
+- (void)testCorkCoalescesWrites {
+    PSBenchmarkRecordingTransport *transport = [[PSBenchmarkRecordingTransport alloc] init];
+    PSWebSocket *webSocket = [self openWebSocketOverTransport:transport delegate:self];
+
+    NSData *payload = [NSMutableData dataWithLength:16];
+    NSUInteger count = 32;
+    NSUInteger frameLength = 2 + payload.length;
+
+    // uncorked every message is its own write
+    NSUInteger writeCount = transport.writeCount;
+    NSUInteger writtenLength = transport.written.length;
+    for(NSUInteger i = 0; i < count; ++i) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount - writeCount, count);
+
+    // corked the burst leaves in one write
+    writeCount = transport.writeCount;
+    writtenLength = transport.written.length;
+    [webSocket cork];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount, writeCount);
+    [webSocket uncork];
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount - writeCount, 1);
+    XCTAssertEqual(transport.written.length - writtenLength, count * frameLength);
+
+    // batches behave the same
+    writeCount = transport.writeCount;
+    NSMutableArray *messages = [NSMutableArray array];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [messages addObject:payload];
+    }
+    [webSocket sendMessages:messages];
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount - writeCount, 1);
+
+    // a length bound releases held frames without uncorking
+    PSWebSocketFlushPolicy *flushPolicy = [PSWebSocketFlushPolicy defaultPolicy];
+    flushPolicy.maximumLength = 8 * frameLength;
+    webSocket.flushPolicy = flushPolicy;
+    writeCount = transport.writeCount;
+    [webSocket cork];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount - writeCount, count / 8);
+    [webSocket uncork];
+
+    // a delay bound holds frames from uncorked sends until it passes
+    flushPolicy.maximumLength = 0;
+    flushPolicy.maximumDelay = 0.05;
+    webSocket.flushPolicy = flushPolicy;
+    writeCount = transport.writeCount;
+    for(NSUInteger i = 0; i < count; ++i) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount, writeCount);
+    [NSThread sleepForTimeInterval:0.2];
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+    XCTAssertEqual(transport.writeCount - writeCount, 1);
+
+    webSocket.delegate = nil;
+}
+- (PSWebSocket *)stalledWebSocketWithPolicy:(PSWebSocketSlowConsumerPolicy)policy
+                                  transport:(PSBenchmarkRecordingTransport *)transport
+                                    counter:(PSBenchmarkMessageCounter *)counter {
+    return [self stalledWebSocketWithPolicy:policy transport:transport counter:counter timingWheel:nil];
+}
+- (PSWebSocket *)stalledWebSocketWithPolicy:(PSWebSocketSlowConsumerPolicy)policy
+                                  transport:(PSBenchmarkRecordingTransport *)transport
+                                    counter:(PSBenchmarkMessageCounter *)counter
+                                timingWheel:(PSWebSocketTimingWheel *)timingWheel {
+    PSWebSocket *webSocket = [self openWebSocketOverTransport:transport delegate:counter timingWheel:timingWheel];
+    webSocket.callsDelegateInline = YES;
+    webSocket.highWaterMark = 10 * 18;
+    webSocket.lowWaterMark = 2 * 18;
+    webSocket.slowConsumerPolicy = policy;
+    transport.stalled = YES;
+    return webSocket;
+}
+- (void)testSlowConsumerPolicies {
+    NSUInteger count = 20;
+    NSUInteger frameLength = 18;
+    NSMutableArray *payloads = [NSMutableArray array];
+    for(NSUInteger i = 0; i < count; ++i) {
+        NSMutableData *payload = [NSMutableData dataWithLength:frameLength - 2];
+        ((uint8_t *)payload.mutableBytes)[0] = (uint8_t)i;
+        [payloads addObject:payload];
+    }
+
+    // queueing only reports crossing the marks
+    PSBenchmarkRecordingTransport *transport = [[PSBenchmarkRecordingTransport alloc] init];
+    PSBenchmarkMessageCounter *counter = [[PSBenchmarkMessageCounter alloc] init];
+    PSWebSocket *webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyQueue transport:transport counter:counter];
+    NSUInteger writtenLength = transport.written.length;
+    for(NSData *payload in payloads) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.bufferedAmount, count * frameLength);
+    XCTAssertEqual(counter.highWaterMarkCount, 1);
+    transport.stalled = NO;
+    XCTAssertEqual(webSocket.bufferedAmount, 0);
+    XCTAssertEqual(counter.lowWaterMarkCount, 1);
+    XCTAssertEqual(transport.written.length - writtenLength, count * frameLength);
+    webSocket.delegate = nil;
+
+    // dropping the newest refuses sends once the mark is reached
+    transport = [[PSBenchmarkRecordingTransport alloc] init];
+    webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyDropNewest transport:transport counter:counter];
+    for(NSData *payload in payloads) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.bufferedAmount, 10 * frameLength);
+    webSocket.delegate = nil;
+
+    // dropping the oldest keeps the most recent messages below the mark
+    transport = [[PSBenchmarkRecordingTransport alloc] init];
+    webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyDropOldest transport:transport counter:counter];
+    writtenLength = transport.written.length;
+    for(NSData *payload in payloads) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.bufferedAmount, 9 * frameLength);
+    transport.stalled = NO;
+    XCTAssertEqual(webSocket.bufferedAmount, 0);
+    const uint8_t *written = (const uint8_t *)transport.written.bytes + writtenLength;
+    for(NSUInteger i = 0; i < 9; ++i) {
+        XCTAssertEqual(written[i * frameLength + 2], count - 9 + i);
+    }
+    webSocket.delegate = nil;
+
+    // disconnecting closes with a policy violation
+    transport = [[PSBenchmarkRecordingTransport alloc] init];
+    webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyDisconnect transport:transport counter:counter];
+    for(NSData *payload in payloads) {
+        [webSocket send:payload];
+    }
+    XCTAssertGreaterThanOrEqual(webSocket.readyState, PSWebSocketReadyStateClosing);
+    webSocket.delegate = nil;
+
+    // blocking holds the sending thread until output drains
+    transport = [[PSBenchmarkRecordingTransport alloc] init];
+    webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyBlock transport:transport counter:counter];
+    dispatch_semaphore_t sent = dispatch_semaphore_create(0);
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        for(NSData *payload in payloads) {
+            [webSocket send:payload];
+            // wait for the send to be queued so the mark is crossed in order
+            (void)webSocket.bufferedAmount;
+        }
+        dispatch_semaphore_signal(sent);
+    });
+    XCTAssertNotEqual(dispatch_semaphore_wait(sent, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC)), 0);
+    transport.stalled = NO;
+    XCTAssertEqual(dispatch_semaphore_wait(sent, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    webSocket.delegate = nil;
+
+    // but never holds up the event loop the websocket belongs to, sends
+    // made there are queued past the mark
+    dispatch_queue_t loopQueue = dispatch_queue_create(nil, nil);
+    PSWebSocketTimingWheel *loopWheel = [[PSWebSocketTimingWheel alloc] initWithQueue:loopQueue resolution:0.01];
+    transport = [[PSBenchmarkRecordingTransport alloc] init];
+    webSocket = [self stalledWebSocketWithPolicy:PSWebSocketSlowConsumerPolicyBlock transport:transport counter:counter timingWheel:loopWheel];
+    dispatch_async(loopQueue, ^{
+        for(NSData *payload in payloads) {
+            [webSocket send:payload];
+        }
+        dispatch_semaphore_signal(sent);
+    });
+    XCTAssertEqual(dispatch_semaphore_wait(sent, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertEqual(webSocket.bufferedAmount, count * frameLength);
+    transport.stalled = NO;
+    XCTAssertEqual(webSocket.bufferedAmount, 0);
+    webSocket.delegate = nil;
+}
+- (void)testStatisticsAndHeartbeat {
+    // driver counters see every frame parsed
+    PSWebSocketDriver *driver = [self openServerDriver];
+    NSMutableData *wire = [NSMutableData data];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x89 length:0]];
+    for(NSUInteger i = 0; i < 100; ++i) {
+        [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:30]];
+    }
+    XCTAssertEqual([self executeDriver:driver wire:wire readLength:1000], wire.length);
+    PSWebSocketStatistics *statistics = driver.statistics;
+    XCTAssertEqual(statistics.framesReceived, 101);
+    XCTAssertEqual(statistics.messagesReceived, 100);
+
+    // websocket counters match what reached the transport
+    PSBenchmarkRecordingTransport *transport = [[PSBenchmarkRecordingTransport alloc] init];
+    PSBenchmarkMessageCounter *counter = [[PSBenchmarkMessageCounter alloc] init];
+    counter.semaphore = dispatch_semaphore_create(0);
+    PSWebSocket *webSocket = [self openWebSocketOverTransport:transport delegate:counter];
+    NSData *payload = [NSMutableData dataWithLength:16];
+    for(NSUInteger i = 0; i < 32; ++i) {
+        [webSocket send:payload];
+    }
+    XCTAssertEqual(webSocket.bufferedAmount, 0);
+    statistics = webSocket.statistics;
+    XCTAssertEqual(statistics.messagesSent, 32);
+    XCTAssertEqual(statistics.framesSent, 32);
+    XCTAssertEqual(statistics.bytesSent, transport.written.length);
+    XCTAssertEqual(statistics.outputBufferLength, 0);
+
+    // a peer that never answers heartbeats is failed once enough are missed
+    webSocket.maximumMissedHeartbeats = 2;
+    webSocket.heartbeatInterval = 0.05;
+    XCTAssertEqual(dispatch_semaphore_wait(counter.semaphore, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0);
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateClosed);
+    XCTAssertEqual(webSocket.statistics.missedHeartbeats, 2);
+    XCTAssertEqual(webSocket.statistics.framesSent, 32 + 2);
+    webSocket.delegate = nil;
+}
+
+- (NSTimeInterval)timeSocketPairDelivery:(PSBenchmarkMessageCounter *)counter count:(NSUInteger)count inline:(BOOL)callsDelegateInline {
+    int handles[2];
+    XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, handles), 0);
+    id <PSWebSocketTransport> transport = [PSWebSocketSocketTransport transportWithNativeHandle:handles[0]];
+
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request transport:transport];
+    webSocket.delegate = counter;
+    webSocket.delegateQueue = dispatch_queue_create(nil, nil);
+    webSocket.maximumMessageBatchCount = 64;
+    webSocket.callsDelegateInline = callsDelegateInline;
+
+    NSUInteger wireCount = 1000;
+    NSMutableData *wire = [NSMutableData data];
+    for(NSUInteger i = 0; i < wireCount; ++i) {
+        [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:30]];
+    }
+    counter.semaphore = dispatch_semaphore_create(0);
+    counter.messagesExpected = count;
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    [webSocket open];
+    for(NSUInteger i = 0; i < count / wireCount; ++i) {
+        NSUInteger offset = 0;
+        while(offset < wire.length) {
+            ssize_t writeLength = write(handles[1], (const uint8_t *)wire.bytes + offset, wire.length - offset);
+            XCTAssertGreaterThan(writeLength, 0);
+            if(writeLength <= 0) {
+                break;
+            }
+            offset += writeLength;
+        }
+    }
+    XCTAssertEqual(dispatch_semaphore_wait(counter.semaphore, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)), 0);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+    XCTAssertEqual(counter.messagesReceived, count);
+
+    close(handles[1]);
+    webSocket.delegate = nil;
+    return duration;
+}
+- (void)testBatchedDelegateDelivery {
+    NSUInteger count = 200000;
+    PSBenchmarkMessageCounter *single = [[PSBenchmarkMessageCounter alloc] init];
+    PSBenchmarkBatchCounter *batched = [[PSBenchmarkBatchCounter alloc] init];
+    PSBenchmarkBatchCounter *inlined = [[PSBenchmarkBatchCounter alloc] init];
+    NSTimeInterval singleDuration = [self timeSocketPairDelivery:single count:count inline:NO];
+    NSTimeInterval batchedDuration = [self timeSocketPairDelivery:batched count:count inline:NO];
+    NSTimeInterval inlinedDuration = [self timeSocketPairDelivery:inlined count:count inline:YES];
+
+    XCTAssertEqual(single.deliveries, count);
+    XCTAssertLessThan(batched.deliveries, count);
+    XCTAssertLessThanOrEqual(batched.largestBatchCount, 64);
+    XCTAssertLessThan(inlined.deliveries, count);
+
+    NSLog(@"[PSWebSocketBenchmarkTests][30B messages per message]: %.0f msgs/s", count / singleDuration);
+    NSLog(@"[PSWebSocketBenchmarkTests][30B messages batched]: %.0f msgs/s", count / batchedDuration);
+    NSLog(@"[PSWebSocketBenchmarkTests][30B messages batched inline]: %.0f msgs/s", count / inlinedDuration);
+}
+
+- (void)testStreamedMessagesFollowBatchedMessages {
+    int handles[2];
+    XCTAssertEqual(socketpair(AF_UNIX, SOCK_STREAM, 0, handles), 0);
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]];
+    [request setValue:@"websocket" forHTTPHeaderField:@"Upgrade"];
+    [request setValue:@"Upgrade" forHTTPHeaderField:@"Connection"];
+    [request setValue:@"13" forHTTPHeaderField:@"Sec-WebSocket-Version"];
+    [request setValue:@"dGhlIHNhbXBsZSBub25jZQ==" forHTTPHeaderField:@"Sec-WebSocket-Key"];
+    PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request transport:[PSWebSocketSocketTransport transportWithNativeHandle:handles[0]]];
+    PSBenchmarkEventRecorder *recorder = [[PSBenchmarkEventRecorder alloc] init];
+    recorder.semaphore = dispatch_semaphore_create(0);
+    webSocket.delegate = recorder;
+    webSocket.delegateQueue = dispatch_queue_create(nil, nil);
+    webSocket.callsDelegateInline = YES;
+    webSocket.maximumMessageBatchCount = 64;
+    [webSocket open];
+
+    // the pong handler switches to streaming while the first two messages
+    // are still waiting in the batch, so what follows is streamed
+    NSData *pingData = [@"order" dataUsingEncoding:NSUTF8StringEncoding];
+    __weak PSWebSocket *weakWebSocket = webSocket;
+    [webSocket ping:pingData handler:^(NSData *pongData) {
+        [recorder.events addObject:@"pong"];
+        weakWebSocket.streamsMessages = YES;
+    }];
+    (void)webSocket.bufferedAmount;
+
+    // everything in one write so a single pump reads it all
+    NSMutableData *wire = [NSMutableData data];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:30]];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:30]];
+    [wire appendData:[self maskedFrameWithHeaderByte:0x8A payload:pingData]];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:100]];
+    XCTAssertEqual(write(handles[1], wire.bytes, wire.length), (ssize_t)wire.length);
+    XCTAssertEqual(dispatch_semaphore_wait(recorder.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+
+    NSArray *expected = @[@"message", @"message", @"pong", @"begin"];
+    XCTAssertGreaterThan(recorder.events.count, expected.count);
+    XCTAssertEqualObjects([recorder.events subarrayWithRange:NSMakeRange(0, MIN(expected.count, recorder.events.count))], expected);
+    XCTAssertEqualObjects(recorder.events.lastObject, @"finish");
+
+    webSocket.delegate = nil;
+    close(handles[1]);
+}
+- (void)testDriverStreamsMessageChunks {
+    PSWebSocketDriver *driver = [self openServerDriver];
+    driver.streamsMessages = YES;
+
+    // two masked fragments of one binary message split across many executes
+    NSMutableData *first = [[self maskedBinaryFrameWithLength:70000] mutableCopy];
+    ((uint8_t *)first.mutableBytes)[0] = 0x02;
+    NSMutableData *second = [[self maskedBinaryFrameWithLength:5000] mutableCopy];
+    ((uint8_t *)second.mutableBytes)[0] = 0x80;
+    NSMutableData *expected = [NSMutableData data];
+    for(NSData *frame in @[first, second]) {
+        NSMutableData *payload = [[frame subdataWithRange:NSMakeRange(14, frame.length - 14)] mutableCopy];
+        PSWebSocketMaskBytes(payload.mutableBytes, payload.length, (const uint8_t *)frame.bytes + 10, 0);
+        [expected appendData:payload];
+    }
+    NSMutableData *wire = [first mutableCopy];
+    [wire appendData:second];
+
+    NSUInteger offset = 0;
+    while(offset < wire.length) {
+        NSUInteger length = MIN(4096, wire.length - offset);
+        offset += [driver execute:(uint8_t *)wire.mutableBytes + offset maxLength:length];
+    }
+
+    XCTAssertEqualObjects(_driverEvents.firstObject, @"begin");
+    XCTAssertEqualObjects(_driverEvents.lastObject, @"finish");
+    XCTAssertGreaterThan(_driverEvents.count, 3);
+    XCTAssertEqualObjects(_driverChunks, expected);
+}
+
+- (void)testDriverSendsFragments {
+    PSWebSocketDriver *driver = [self openServerDriver];
+    NSData *fragment = [@"fragment" dataUsingEncoding:NSUTF8StringEncoding];
+    [driver sendFragment:fragment type:PSWebSocketMessageTypeText first:YES final:NO];
+    [driver sendPing:[NSData data]];
+    [driver sendFragment:fragment type:PSWebSocketMessageTypeText first:NO final:NO];
+    [driver sendFragment:fragment type:PSWebSocketMessageTypeText first:NO final:YES];
+
+    // header and payload are written separately
+    XCTAssertEqual(_driverWrites.count, 8);
+    const uint8_t expected[] = {0x01, 0x89, 0x00, 0x80};
+    for(NSUInteger i = 0; i < sizeof(expected); ++i) {
+        XCTAssertEqual(((const uint8_t *)[_driverWrites[i * 2] bytes])[0], expected[i], @"Unexpected first header byte for frame %@", @(i));
+    }
+}
+
+- (NSData *)maskedShortFrameWithHeaderByte:(uint8_t)headerByte length:(NSUInteger)length {
+    NSParameterAssert(length < 126);
+    NSMutableData *frame = [NSMutableData dataWithLength:6 + length];
+    uint8_t *bytes = frame.mutableBytes;
+    bytes[0] = headerByte;
+    bytes[1] = 0x80 | (uint8_t)length;
+    arc4random_buf(bytes + 2, 4);
+    memset(bytes + 6, 'a', length);
+    PSWebSocketMaskBytes(bytes + 6, length, bytes + 2, 0);
+    return frame;
+}
+- (NSUInteger)executeDriver:(PSWebSocketDriver *)driver wire:(NSMutableData *)wire readLength:(NSUInteger)readLength {
+    // a header split by a read is left for the next call, like the socket's input buffer does
+    NSUInteger offset = 0;
+    while(offset < wire.length) {
+        NSUInteger length = MIN(offset + readLength, wire.length) - offset;
+        NSUInteger consumed = [driver execute:(uint8_t *)wire.mutableBytes + offset maxLength:length];
+        if(consumed == 0) {
+            break;
+        }
+        offset += consumed;
+    }
+    return offset;
+}
+- (void)testDriverParsesInterleavedSmallFrames {
+    PSWebSocketDriver *driver = [self openServerDriver];
+
+    // a text message fragmented around a ping, then whole binary messages
+    NSMutableData *wire = [NSMutableData data];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x01 length:30]];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x89 length:0]];
+    [wire appendData:[self maskedShortFrameWithHeaderByte:0x80 length:30]];
+    for(NSUInteger i = 0; i < 1000; ++i) {
+        [wire appendData:[self maskedShortFrameWithHeaderByte:0x82 length:30]];
+    }
+
+    _driverMessageCount = 0;
+    XCTAssertEqual([self executeDriver:driver wire:wire readLength:1000], wire.length);
+    XCTAssertEqual(_driverMessageCount, 1001);
+    XCTAssertEqualObjects(_driverEvents.firstObject, @"message");
+}
+- (void)testDriverSmallMessageThroughput {
+    PSWebSocketDriver *driver = [self openServerDriver];
+    NSUInteger count = 1000000;
+    NSData *frame = [self maskedShortFrameWithHeaderByte:0x82 length:30];
+    NSMutableData *wire = [NSMutableData dataWithCapacity:frame.length * count];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [wire appendData:frame];
+    }
+
+    _driverEvents = nil;
+    _driverMessageCount = 0;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    XCTAssertEqual([self executeDriver:driver wire:wire readLength:64 * 1024], wire.length);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+    XCTAssertEqual(_driverMessageCount, count);
+    NSLog(@"[PSWebSocketBenchmarkTests][30B binary driver]: %.0f msgs/s", count / duration);
+}
+- (NSData *)maskedFrameWithHeaderByte:(uint8_t)headerByte payload:(NSData *)payload {
+    NSMutableData *frame = [NSMutableData dataWithLength:14 + payload.length];
+    uint8_t *bytes = frame.mutableBytes;
+    bytes[0] = headerByte;
+    bytes[1] = 0x80 | 127;
+    for(NSUInteger i = 0; i < 8; ++i) {
+        bytes[2 + i] = (uint8_t)((uint64_t)payload.length >> (56 - i * 8));
+    }
+    arc4random_buf(bytes + 10, 4);
+    memcpy(bytes + 14, payload.bytes, payload.length);
+    PSWebSocketMaskBytes(bytes + 14, payload.length, bytes + 10, 0);
+    return frame;
+}
+- (void)testDriverMessageDeliveryModes {
+    NSString *text = @"caf\u00e9 \u20ac \U0001F600 and some ASCII to make it longer than a tagged pointer";
+    NSString *ascii = @"plain ASCII text long enough not to fit in a tagged pointer string";
+    NSData *binary = [self matrixPayloadWithLength:1000 text:NO];
+    for(NSNumber *delivery in @[@(PSWebSocketMessageDeliveryString), @(PSWebSocketMessageDeliveryStringNoCopy), @(PSWebSocketMessageDeliveryUTF8Data)]) {
+        PSWebSocketDriver *driver = [self openServerDriver];
+        driver.messageDelivery = delivery.integerValue;
+        for(NSString *string in @[text, ascii]) {
+            NSMutableData *wire = [[self maskedFrameWithHeaderByte:0x81 payload:[string dataUsingEncoding:NSUTF8StringEncoding]] mutableCopy];
+            XCTAssertEqual([self executeDriver:driver wire:wire readLength:wire.length], wire.length);
+            if(delivery.integerValue == PSWebSocketMessageDeliveryUTF8Data) {
+                XCTAssertTrue([_driverMessage isKindOfClass:[PSWebSocketUTF8Data class]]);
+                XCTAssertEqualObjects(_driverMessage, [string dataUsingEncoding:NSUTF8StringEncoding]);
+                XCTAssertEqual([_driverMessage ascii], [string isEqualToString:ascii]);
+                XCTAssertEqualObjects([_driverMessage string], string);
+            } else {
+                XCTAssertEqualObjects(_driverMessage, string);
+            }
+        }
+
+        NSMutableData *wire = [[self maskedFrameWithHeaderByte:0x82 payload:binary] mutableCopy];
+        XCTAssertEqual([self executeDriver:driver wire:wire readLength:wire.length], wire.length);
+        XCTAssertEqualObjects(_driverMessage, binary);
+        if(delivery.integerValue == PSWebSocketMessageDeliveryString) {
+            XCTAssertTrue([_driverMessage isKindOfClass:[NSMutableData class]]);
+        } else {
+            XCTAssertTrue([_driverMessage isKindOfClass:[PSWebSocketDataView class]]);
+            XCTAssertEqual([_driverMessage copy], _driverMessage);
+        }
+    }
+}
+- (void)testNoCopyStringsOutliveTheirBuffer {
+    NSString *ascii = @"plain ASCII text long enough not to fit in a tagged pointer string";
+    for(NSNumber *delivery in @[@(PSWebSocketMessageDeliveryStringNoCopy), @(PSWebSocketMessageDeliveryUTF8Data)]) {
+        NSString *string = nil;
+        __weak PSWebSocketUTF8Data *weakView = nil;
+        @autoreleasepool {
+            PSWebSocketDriver *driver = [self openServerDriver];
+            driver.messageDelivery = delivery.integerValue;
+            NSMutableData *wire = [[self maskedFrameWithHeaderByte:0x81 payload:[ascii dataUsingEncoding:NSUTF8StringEncoding]] mutableCopy];
+            XCTAssertEqual([self executeDriver:driver wire:wire readLength:wire.length], wire.length);
+            if(delivery.integerValue == PSWebSocketMessageDeliveryUTF8Data) {
+                weakView = _driverMessage;
+                string = [_driverMessage string];
+            } else {
+                string = _driverMessage;
+            }
+            _driverMessage = nil;
+            driver = nil;
+        }
+
+        // only the string is left holding the bytes, scribble over freed
+        // memory of the same size before reading it
+        for(NSUInteger i = 0; i < 64; ++i) {
+            NSMutableData *scribble = [NSMutableData dataWithLength:ascii.length];
+            memset(scribble.mutableBytes, 'x', scribble.length);
+        }
+        XCTAssertEqualObjects(string, ascii);
+        if(delivery.integerValue == PSWebSocketMessageDeliveryUTF8Data) {
+            XCTAssertNotNil(weakView);
+            @autoreleasepool {
+                string = nil;
+            }
+            XCTAssertNil(weakView);
+        }
+    }
+}
+- (void)testDriverTextDeliveryThroughput {
+    NSUInteger count = 100000;
+    NSData *payload = [self matrixPayloadWithLength:4096 text:YES];
+    NSData *frame = [self maskedFrameWithHeaderByte:0x81 payload:payload];
+    NSMutableData *wire = [NSMutableData dataWithCapacity:frame.length * count];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [wire appendData:frame];
+    }
+
+    NSArray *names = @[@"string", @"string no copy", @"utf8 data"];
+    for(NSNumber *delivery in @[@(PSWebSocketMessageDeliveryString), @(PSWebSocketMessageDeliveryStringNoCopy), @(PSWebSocketMessageDeliveryUTF8Data)]) {
+        PSWebSocketDriver *driver = [self openServerDriver];
+        driver.messageDelivery = delivery.integerValue;
+        NSMutableData *copy = [wire mutableCopy];
+        _driverEvents = nil;
+        _driverMessageCount = 0;
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        XCTAssertEqual([self executeDriver:driver wire:copy readLength:64 * 1024], copy.length);
+        NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+        XCTAssertEqual(_driverMessageCount, count);
+        NSLog(@"[PSWebSocketBenchmarkTests][4KB text driver, %@]: %.0f msgs/s", names[delivery.integerValue], count / duration);
+    }
+}
+
+#pragma mark - Timers
+
+- (void)testTimingWheelFiresInOrder {
+    dispatch_queue_t queue = dispatch_queue_create(nil, nil);
+    PSWebSocketTimingWheel *wheel = [[PSWebSocketTimingWheel alloc] initWithQueue:queue resolution:0.001];
+    NSMutableArray *fired = [NSMutableArray array];
+    dispatch_semaphore_t semaphore = dispatch_semaphore_create(0);
+
+    // intervals span the first two levels, every third timer is cancelled
+    // and a short one is moved behind a longer one
+    NSArray *intervals = @[@0.2, @0.005, @0.07, @0.03, @0.3, @0.001, @0.12];
+    NSMutableArray *timers = [NSMutableArray array];
+    for(NSNumber *interval in intervals) {
+        PSWebSocketTimer *timer = [PSWebSocketTimer timerWithHandler:^{
+            [fired addObject:interval];
+            if(fired.count == 4) {
+                dispatch_semaphore_signal(semaphore);
+            }
+        }];
+        [timers addObject:timer];
+        [wheel armTimer:timer interval:interval.doubleValue];
+    }
+    XCTAssertEqual(wheel.armedCount, intervals.count);
+    for(NSUInteger i = 0; i < timers.count; i += 3) {
+        [wheel cancelTimer:timers[i]];
+    }
+    [wheel armTimer:timers[1] interval:0.15];
+    XCTAssertEqual(wheel.armedCount, 4);
+
+    XCTAssertEqual(dispatch_semaphore_wait(semaphore, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0);
+    dispatch_sync(queue, ^{
+        XCTAssertEqualObjects(fired, (@[@0.001, @0.07, @0.005, @0.3]));
+    });
+    XCTAssertEqual(wheel.armedCount, 0);
+}
+- (void)testTimingWheelArmCancelThroughput {
+    NSUInteger count = 100000;
+    PSWebSocketTimingWheel *wheel = [[PSWebSocketTimingWheel alloc] initWithQueue:dispatch_queue_create(nil, nil) resolution:0.01];
+    NSMutableArray *timers = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [timers addObject:[PSWebSocketTimer timerWithHandler:^{}]];
+    }
+
+    // deadlines like a deploy closing every socket at once
+    NSTimeInterval duration = [self timeIterations:PSBenchmarkIterations block:^{
+        for(PSWebSocketTimer *timer in timers) {
+            [wheel armTimer:timer interval:30.0];
+        }
+        for(PSWebSocketTimer *timer in timers) {
+            [wheel cancelTimer:timer];
+        }
+    }];
+    XCTAssertEqual(wheel.armedCount, 0);
+    NSLog(@"[PSWebSocketBenchmarkTests][timing wheel arm and cancel]: %.0f ns", duration / (count * PSBenchmarkIterations) * 1e9);
+    [self recordResult:@"timing wheel arm and cancel" metrics:@{@"nanoseconds_per_timer": @(duration / (count * PSBenchmarkIterations) * 1e9)}];
+}
+- (void)testIdleTimeout {
+    PSBenchmarkRecordingTransport *transport = [[PSBenchmarkRecordingTransport alloc] init];
+    PSBenchmarkMessageCounter *counter = [[PSBenchmarkMessageCounter alloc] init];
+    counter.semaphore = dispatch_semaphore_create(0);
+    PSWebSocket *webSocket = [self openWebSocketOverTransport:transport delegate:counter];
+
+    // traffic keeps the websocket alive past its idle timeout
+    webSocket.idleTimeout = 0.1;
+    for(NSUInteger i = 0; i < 5; ++i) {
+        [NSThread sleepForTimeInterval:0.05];
+        [webSocket send:@"ping"];
+    }
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateOpen);
+
+    XCTAssertEqual(dispatch_semaphore_wait(counter.semaphore, dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC)), 0);
+    XCTAssertEqual(webSocket.readyState, PSWebSocketReadyStateClosed);
+    webSocket.delegate = nil;
+}
+
+#pragma mark - Broadcast
+
+- (void)timeFanOutToCount:(NSUInteger)count extensions:(NSString *)extensions message:(NSData *)message {
+    NSMutableArray *drivers = [NSMutableArray arrayWithCapacity:count];
+    for(NSUInteger i = 0; i < count; ++i) {
+        [drivers addObject:[self openServerDriverWithExtensions:extensions]];
+    }
+
+    _discardDriverWrites = YES;
+    NSTimeInterval perSocket = [self timeIterations:1 block:^{
+        for(PSWebSocketDriver *driver in drivers) {
+            [driver sendBinary:message];
+        }
+    }];
+    NSTimeInterval prepared = [self timeIterations:1 block:^{
+        PSWebSocketPreparedMessage *preparedMessage = [PSWebSocketPreparedMessage preparedMessageWithMessage:message];
+        for(PSWebSocketDriver *driver in drivers) {
+            [driver sendPreparedMessage:preparedMessage];
+        }
+    }];
+    _discardDriverWrites = NO;
+
+    NSLog(@"[PSWebSocketBenchmarkTests][fan-out %@ %@]: send %.3f us/subscriber, prepared %.3f us/subscriber",
+          @(count), (extensions) ? @"deflate" : @"plain", perSocket * 1e6 / count, prepared * 1e6 / count);
+}
+- (void)testBroadcastFanOut {
+    NSData *json = [@"{\"id\":1234,\"name\":\"pocketsocket\",\"tags\":[\"a\",\"b\"]}," dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *message = [NSMutableData data];
+    while(message.length < 4096) {
+        [message appendData:json];
+    }
+    for(NSNumber *count in @[@1000, @10000, @50000]) {
+        [self timeFanOutToCount:count.unsignedIntegerValue extensions:nil message:message];
+    }
+    [self timeFanOutToCount:1000 extensions:@"permessage-deflate" message:message];
+}
+- (void)testServerBroadcastSkipsForeignWebSockets {
+    NSUInteger port = 9432;
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    echo.openGroup = dispatch_group_create();
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.eventLoopCount = 2;
+    server.usesSocketTransport = YES;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // opened one at a time so the server's websockets line up with ours
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    NSMutableArray *collectors = [NSMutableArray array];
+    NSMutableArray *webSockets = [NSMutableArray array];
+    for(NSUInteger i = 0; i < 3; ++i) {
+        PSBenchmarkMessageCollector *collector = [[PSBenchmarkMessageCollector alloc] init];
+        collector.semaphore = dispatch_semaphore_create(0);
+        PSWebSocket *webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                            transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+        webSocket.delegate = collector;
+        webSocket.callsDelegateInline = YES;
+        dispatch_group_enter(echo.openGroup);
+        [webSocket open];
+        XCTAssertEqual(dispatch_semaphore_wait(collector.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+        XCTAssertEqual(dispatch_group_wait(echo.openGroup, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+        [collectors addObject:collector];
+        [webSockets addObject:webSocket];
+    }
+    __block NSArray *serverWebSockets = nil;
+    dispatch_sync(server.delegateQueue, ^{
+        serverWebSockets = [echo.webSockets copy];
+    });
+    XCTAssertEqual(serverWebSockets.count, 3);
+
+    // the second client's own websocket is not the server's, were it sent
+    // on it the server would echo the message back to that client
+    PSWebSocket *foreignWebSocket = webSockets[1];
+    [collectors[0] setMessagesExpected:3];
+    [collectors[1] setMessagesExpected:2];
+    [collectors[2] setMessagesExpected:2];
+    [server broadcast:@"everyone"];
+    [server broadcast:@"selected" toWebSockets:@[serverWebSockets[0], foreignWebSocket]];
+    [server broadcast:@"last"];
+    for(PSBenchmarkMessageCollector *collector in collectors) {
+        XCTAssertEqual(dispatch_semaphore_wait(collector.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    }
+    // an echo of anything sent on the foreign websocket has arrived by now
+    [NSThread sleepForTimeInterval:0.1];
+    XCTAssertEqualObjects([collectors[0] messages], (@[@"everyone", @"selected", @"last"]));
+    XCTAssertEqualObjects([collectors[1] messages], (@[@"everyone", @"last"]));
+    XCTAssertEqualObjects([collectors[2] messages], (@[@"everyone", @"last"]));
+
+    for(PSWebSocket *webSocket in webSockets) {
+        webSocket.delegate = nil;
+        [webSocket close];
+    }
+    [server stop];
+}
+- (void)measureServerBroadcastToCount:(NSUInteger)count deflate:(BOOL)deflate message:(NSData *)message port:(NSUInteger)port {
+    NSUInteger broadcastCount = 5;
+    NSUInteger subscribersPerPort = 10000;
+
+    // both ends of every connection live in this process, and each port
+    // takes a share of them so no destination runs out of ephemeral ports
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = MIN(limit.rlim_max, MAX(limit.rlim_cur, (rlim_t)(count * 2 + 256)));
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    PSWebSocketCompressionPolicy *compressionPolicy = [PSWebSocketCompressionPolicy alwaysPolicy];
+    if(!deflate) {
+        compressionPolicy.minimumLength = NSUIntegerMax;
+    }
+    NSUInteger portCount = (count + subscribersPerPort - 1) / subscribersPerPort;
+    NSMutableArray *addresses = [NSMutableArray array];
+    for(NSUInteger i = 0; i < portCount; ++i) {
+        [addresses addObject:[PSWebSocketServer addressWithHost:@"127.0.0.1" port:port + i]];
+    }
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithAddresses:addresses SSLCertificates:nil];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.eventLoopCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    server.usesSocketTransport = YES;
+    server.maximumPendingHandshakes = count;
+    server.compressionPolicy = compressionPolicy;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // open in waves so the listen backlog is not overrun
+    NSMutableArray *subscribers = [NSMutableArray arrayWithCapacity:count];
+    dispatch_group_t openGroup = dispatch_group_create();
+    for(NSUInteger i = 0; i < count; i += 100) {
+        for(NSUInteger j = i; j < MIN(i + 100, count); ++j) {
+            NSUInteger subscriberPort = port + j / subscribersPerPort;
+            NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(subscriberPort)]]];
+            PSBenchmarkSubscriber *subscriber = [[PSBenchmarkSubscriber alloc] init];
+            subscriber.openGroup = openGroup;
+            subscriber.webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                              transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:subscriberPort]];
+            subscriber.webSocket.delegate = subscriber;
+            subscriber.webSocket.callsDelegateInline = YES;
+            subscriber.webSocket.compressionPolicy = compressionPolicy;
+            dispatch_group_enter(openGroup);
+            [subscriber.webSocket open];
+            [subscribers addObject:subscriber];
+        }
+        XCTAssertEqual(dispatch_group_wait(openGroup, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0);
+    }
+    NSUInteger failedCount = 0;
+    for(PSBenchmarkSubscriber *subscriber in subscribers) {
+        failedCount += (subscriber.failed) ? 1 : 0;
+    }
+    XCTAssertEqual(failedCount, 0);
+
+    // each broadcast is timed until the last subscriber has it
+    NSMutableData *durations = [NSMutableData data];
+    for(NSUInteger i = 0; i < broadcastCount; ++i) {
+        dispatch_group_t receiveGroup = dispatch_group_create();
+        for(PSBenchmarkSubscriber *subscriber in subscribers) {
+            if(!subscriber.failed) {
+                dispatch_group_enter(receiveGroup);
+                subscriber.receiveGroup = receiveGroup;
+            }
+        }
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        [server broadcast:message];
+        XCTAssertEqual(dispatch_group_wait(receiveGroup, dispatch_time(DISPATCH_TIME_NOW, 120 * NSEC_PER_SEC)), 0);
+        NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+        [durations appendBytes:&duration length:sizeof(duration)];
+    }
+
+    for(PSBenchmarkSubscriber *subscriber in subscribers) {
+        subscriber.webSocket.delegate = nil;
+        [subscriber.webSocket close];
+    }
+    [server stop];
+
+    int (^compare)(const void *, const void *) = ^int(const void *a, const void *b) {
+        NSTimeInterval x = *(const NSTimeInterval *)a, y = *(const NSTimeInterval *)b;
+        return (x > y) - (x < y);
+    };
+    qsort_b(durations.mutableBytes, broadcastCount, sizeof(NSTimeInterval), compare);
+    NSTimeInterval median = [self percentile:50 ofSortedLatencies:durations];
+    NSUInteger receivedCount = count - failedCount;
+    [self recordResult:@"server broadcast" metrics:@{@"subscribers": @(count),
+                                                     @"failed_subscribers": @(failedCount),
+                                                     @"deflate": @(deflate),
+                                                     @"message_length": @(message.length),
+                                                     @"broadcasts": @(broadcastCount),
+                                                     @"delivery_p50_ms": @(median * 1e3),
+                                                     @"delivery_max_ms": @([self percentile:100 ofSortedLatencies:durations] * 1e3),
+                                                     @"us_per_subscriber": @((receivedCount > 0) ? median * 1e6 / receivedCount : 0.0)}];
+}
+- (void)testServerBroadcast {
+    NSData *json = [@"{\"id\":1234,\"name\":\"pocketsocket\",\"tags\":[\"a\",\"b\"]}," dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *message = [NSMutableData data];
+    while(message.length < 4096) {
+        [message appendData:json];
+    }
+
+    // every run gets its own ports so TIME_WAIT sockets never get in the way
+    NSUInteger port = 9440;
+    for(NSNumber *deflate in @[@NO, @YES]) {
+        for(NSNumber *count in @[@1000, @10000, @50000]) {
+            [self measureServerBroadcastToCount:count.unsignedIntegerValue deflate:deflate.boolValue message:message port:port];
+            port += (count.unsignedIntegerValue + 9999) / 10000;
+        }
+    }
+}
+- (void)testPreparedMessageSharesEncoding {
+    NSString *text = [@"" stringByPaddingToLength:256 withString:@"broadcast " startingAtIndex:0];
+    PSWebSocketPreparedMessage *preparedMessage = [PSWebSocketPreparedMessage preparedMessageWithMessage:text];
+    PSWebSocketDriver *first = [self openServerDriverWithExtensions:@"permessage-deflate"];
+    [first sendPreparedMessage:preparedMessage];
+    NSArray *firstWrites = [_driverWrites copy];
+    PSWebSocketDriver *second = [self openServerDriverWithExtensions:@"permessage-deflate"];
+    [second sendPreparedMessage:preparedMessage];
+
+    XCTAssertEqual(firstWrites.count, 2);
+    XCTAssertEqual(_driverWrites.count, 2);
+    XCTAssertEqual(firstWrites[1], _driverWrites[1], @"Payload bytes should be shared between websockets");
+    XCTAssertEqual(((const uint8_t *)[firstWrites[0] bytes])[0], 0xC1, @"Compressed text frame expected");
+}
+- (void)testPreparedMessageHonoursCompressionPolicy {
+    NSString *text = [@"" stringByPaddingToLength:4096 withString:@"broadcast " startingAtIndex:0];
+    PSWebSocketPreparedMessage *preparedMessage = [PSWebSocketPreparedMessage preparedMessageWithMessage:text];
+    PSWebSocketCompressionPolicy *huffmanOnly = [PSWebSocketCompressionPolicy defaultPolicy];
+    huffmanOnly.strategy = PSWebSocketCompressionStrategyHuffmanOnly;
+    huffmanOnly.level = 1;
+
+    PSWebSocketDriver *standard = [self openServerDriverWithExtensions:@"permessage-deflate" compressionPolicy:nil];
+    [standard sendPreparedMessage:preparedMessage];
+    NSData *standardPayload = _driverWrites.lastObject;
+    PSWebSocketDriver *first = [self openServerDriverWithExtensions:@"permessage-deflate" compressionPolicy:huffmanOnly];
+    [first sendPreparedMessage:preparedMessage];
+    NSData *firstPayload = _driverWrites.lastObject;
+    PSWebSocketDriver *second = [self openServerDriverWithExtensions:@"permessage-deflate" compressionPolicy:huffmanOnly];
+    [second sendPreparedMessage:preparedMessage];
+
+    // huffman coding alone cannot use the repetition a default deflate finds
+    XCTAssertGreaterThan(firstPayload.length, standardPayload.length);
+    XCTAssertEqual(_driverWrites.lastObject, firstPayload, @"Same parameters should share the encoding");
+    NSError *error = nil;
+    NSArray *frames = [preparedMessage framesForDeflateWindowBits:-15 compressionPolicy:huffmanOnly error:&error];
+    XCTAssertNil(error);
+    XCTAssertEqual(frames[1], firstPayload);
+}
+
+#pragma mark - Compression
+
+- (void)testCompressionPolicySkipsShortMessages {
+    PSWebSocketDriver *driver = [self openServerDriverWithExtensions:@"permessage-deflate"];
+    [driver sendText:@"short"];
+    XCTAssertEqual(((const uint8_t *)[_driverWrites[0] bytes])[0], 0x81, @"Uncompressed text frame expected");
+
+    [_driverWrites removeAllObjects];
+    NSString *text = [@"" stringByPaddingToLength:1024 withString:@"compressible " startingAtIndex:0];
+    [driver sendText:text];
+    XCTAssertEqual(((const uint8_t *)[_driverWrites[0] bytes])[0], 0xC1, @"Compressed text frame expected");
+    XCTAssertLessThan([_driverWrites[1] length], 1024);
+}
+- (void)testAdaptiveCompressionPausesOnIncompressiblePayloads {
+    PSWebSocketDriver *driver = [self openServerDriverWithExtensions:@"permessage-deflate"];
+    PSWebSocketCompressionPolicy *policy = [PSWebSocketCompressionPolicy defaultPolicy];
+    policy.adaptive = YES;
+    policy.minimumThroughput = 0;
+    driver.compressionPolicy = policy;
+
+    NSMutableData *noise = [NSMutableData dataWithLength:4096];
+    arc4random_buf(noise.mutableBytes, noise.length);
+    [driver sendBinary:noise];
+    [driver sendBinary:noise];
+    XCTAssertEqual(((const uint8_t *)[_driverWrites[0] bytes])[0], 0xC2, @"First message should be compressed");
+    XCTAssertEqual(((const uint8_t *)[_driverWrites[2] bytes])[0], 0x82, @"Compression should pause after a poor ratio");
+}
+- (void)testDeflaterRoundTrip {
+    NSData *json = [@"{\"id\":1234,\"name\":\"pocketsocket\",\"tags\":[\"a\",\"b\"]}," dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *expected = [NSMutableData data];
+    while(expected.length < 1024 * 1024) {
+        [expected appendData:json];
+        [expected appendBytes:(uint8_t[]){(uint8_t)arc4random()} length:1];
+    }
+
+    PSWebSocketDeflater *deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:-15 memoryLevel:8 level:1 strategy:PSWebSocketCompressionStrategyDefault];
+    NSMutableData *deflated = [NSMutableData data];
+    XCTAssertTrue([deflater begin:deflated error:nil]);
+    XCTAssertTrue([deflater appendBytes:expected.bytes length:expected.length error:nil]);
+    XCTAssertTrue([deflater end:nil]);
+    XCTAssertLessThan(deflated.length, expected.length);
+
+    PSWebSocketInflater *inflater = [[PSWebSocketInflater alloc] initWithWindowBits:-15];
+    NSMutableData *inflated = [NSMutableData data];
+    XCTAssertTrue([inflater begin:inflated error:nil]);
+    XCTAssertTrue([inflater appendBytes:deflated.bytes length:deflated.length error:nil]);
+    XCTAssertTrue([inflater end:nil]);
+    XCTAssertEqualObjects(inflated, expected);
+}
+- (NSData *)maskedDeflatedTextFrame:(NSString *)text {
+    return [self maskedDeflatedFrameWithHeaderByte:0xC1 payload:[text dataUsingEncoding:NSUTF8StringEncoding]];
+}
+- (NSData *)maskedDeflatedFrameWithHeaderByte:(uint8_t)headerByte payload:(NSData *)payload {
+    // a 9 bit window can be inflated whatever window was negotiated
+    PSWebSocketDeflater *deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:-9 memoryLevel:8];
+    NSMutableData *deflated = [NSMutableData data];
+    [deflater begin:deflated error:nil];
+    [deflater appendBytes:payload.bytes length:payload.length error:nil];
+    [deflater end:nil];
+
+    // zero mask key leaves the payload as is
+    NSMutableData *frame = [NSMutableData dataWithLength:14];
+    uint8_t *bytes = frame.mutableBytes;
+    bytes[0] = headerByte;
+    bytes[1] = 0x80 | 127;
+    for(NSUInteger i = 0; i < 8; ++i) {
+        bytes[2 + i] = (uint8_t)((uint64_t)deflated.length >> (56 - i * 8));
+    }
+    [frame appendData:deflated];
+    return frame;
+}
+- (void)testWindowBitsNegotiation {
+    PSWebSocketCompressionPolicy *policy = [PSWebSocketCompressionPolicy defaultPolicy];
+    policy.serverMaxWindowBits = 10;
+    policy.clientMaxWindowBits = 11;
+    [self openServerDriverWithExtensions:@"permessage-deflate; client_max_window_bits; server_max_window_bits=12" compressionPolicy:policy];
+    NSString *response = [[NSString alloc] initWithData:_driverHandshake encoding:NSUTF8StringEncoding];
+    XCTAssertTrue([response containsString:@"server_max_window_bits=10"]);
+    XCTAssertTrue([response containsString:@"client_max_window_bits=11"]);
+
+    [self openServerDriverWithExtensions:@"permessage-deflate" compressionPolicy:policy];
+    response = [[NSString alloc] initWithData:_driverHandshake encoding:NSUTF8StringEncoding];
+    XCTAssertFalse([response containsString:@"client_max_window_bits"], @"Client window bits need an offer");
+
+    [self openServerDriverWithExtensions:@"permessage-deflate; server_max_window_bits=8" compressionPolicy:policy];
+    response = [[NSString alloc] initWithData:_driverHandshake encoding:NSUTF8StringEncoding];
+    XCTAssertFalse([response containsString:@"permessage-deflate"], @"8 bit server windows should be declined");
+}
+- (void)testNoContextTakeoverBorrowsPooledContexts {
+    PSWebSocketCompressionPolicy *policy = [PSWebSocketCompressionPolicy defaultPolicy];
+    policy.serverNoContextTakeover = YES;
+    policy.clientNoContextTakeover = YES;
+    PSWebSocketDriver *driver = [self openServerDriverWithExtensions:@"permessage-deflate" compressionPolicy:policy];
+    NSString *response = [[NSString alloc] initWithData:_driverHandshake encoding:NSUTF8StringEncoding];
+    XCTAssertTrue([response containsString:@"server_no_context_takeover"]);
+    XCTAssertTrue([response containsString:@"client_no_context_takeover"]);
+
+    // without takeover identical messages deflate identically
+    NSString *text = [@"" stringByPaddingToLength:1024 withString:@"compressible " startingAtIndex:0];
+    [driver sendText:text];
+    [driver sendText:text];
+    XCTAssertEqualObjects(_driverWrites[1], _driverWrites[3]);
+
+    NSData *frame = [self maskedDeflatedTextFrame:text];
+    for(NSUInteger i = 0; i < 2; ++i) {
+        NSMutableData *bytes = [frame mutableCopy];
+        XCTAssertEqual([driver execute:bytes.mutableBytes maxLength:bytes.length], bytes.length);
+    }
+    XCTAssertEqualObjects(_driverEvents, (@[@"message", @"message"]));
+    XCTAssertGreaterThan([PSWebSocketZlibPool sharedPool].idleCount, 0);
+}
+- (NSUInteger)bytesPerConnectionWithCompressionPolicy:(PSWebSocketCompressionPolicy *)policy {
+    static const NSUInteger count = 1000;
+    NSString *text = [@"" stringByPaddingToLength:4096 withString:@"compressible " startingAtIndex:0];
+    NSData *frame = [self maskedDeflatedTextFrame:text];
+    NSMutableArray *drivers = [NSMutableArray arrayWithCapacity:count];
+
+    // every connection receives and sends one compressed message
+    [[PSWebSocketZlibPool sharedPool] drain];
+    _discardDriverWrites = YES;
+    malloc_statistics_t before;
+    malloc_zone_statistics(NULL, &before);
+    for(NSUInteger i = 0; i < count; ++i) {
+        PSWebSocketDriver *driver = [self openServerDriverWithExtensions:@"permessage-deflate; client_max_window_bits" compressionPolicy:policy];
+        NSMutableData *bytes = [frame mutableCopy];
+        [driver execute:bytes.mutableBytes maxLength:bytes.length];
+        [driver sendText:text];
+        [drivers addObject:driver];
+    }
+    malloc_statistics_t after;
+    malloc_zone_statistics(NULL, &after);
+    _discardDriverWrites = NO;
+
+    return (after.size_in_use > before.size_in_use) ? (after.size_in_use - before.size_in_use) / count : 0;
+}
+- (void)testCompressionMemoryPerConnection {
+    PSWebSocketCompressionPolicy *small = [PSWebSocketCompressionPolicy defaultPolicy];
+    small.serverMaxWindowBits = 10;
+    small.clientMaxWindowBits = 10;
+    small.memoryLevel = 4;
+    PSWebSocketCompressionPolicy *pooled = [PSWebSocketCompressionPolicy defaultPolicy];
+    pooled.serverNoContextTakeover = YES;
+    pooled.clientNoContextTakeover = YES;
+    PSWebSocketCompressionPolicy *both = [small copy];
+    both.serverNoContextTakeover = YES;
+    both.clientNoContextTakeover = YES;
+
+    NSUInteger defaults = [self bytesPerConnectionWithCompressionPolicy:nil];
+    NSUInteger smallWindows = [self bytesPerConnectionWithCompressionPolicy:small];
+    NSUInteger pooledContexts = [self bytesPerConnectionWithCompressionPolicy:pooled];
+    NSUInteger combined = [self bytesPerConnectionWithCompressionPolicy:both];
+    NSLog(@"[PSWebSocketBenchmarkTests][compression memory]: default %@ B/connection, 10 bit windows %@ B/connection, pooled contexts %@ B/connection, both %@ B/connection",
+          @(defaults), @(smallWindows), @(pooledContexts), @(combined));
+
+    XCTAssertLessThan(smallWindows, defaults);
+    XCTAssertLessThan(pooledContexts, defaults);
+}
+
+#pragma mark - Limits
+
+- (PSWebSocketDriver *)openLimitedServerDriver:(PSWebSocketLimits *)limits {
+    PSWebSocketDriver *driver = [self openServerDriverWithExtensions:@"permessage-deflate"];
+    driver.limits = limits;
+    _driverError = nil;
+    _expectsDriverError = YES;
+    return driver;
+}
+- (void)testLimitsRejectDeclaredFrameLength {
+    PSWebSocketLimits *limits = [PSWebSocketLimits defaultLimits];
+    limits.maximumFrameLength = 1024;
+    PSWebSocketDriver *driver = [self openLimitedServerDriver:limits];
+
+    // only the header of a 1GB frame is needed to fail
+    NSMutableData *header = [[[self maskedBinaryFrameWithLength:0] subdataWithRange:NSMakeRange(0, 14)] mutableCopy];
+    ((uint8_t *)header.mutableBytes)[6] = 0x40;
+    [driver execute:header.mutableBytes maxLength:header.length];
+    XCTAssertEqual(_driverError.code, PSWebSocketStatusCodeMessageTooBig);
+    _expectsDriverError = NO;
+}
+- (void)testLimitsRejectFragmentedMessageLength {
+    PSWebSocketLimits *limits = [PSWebSocketLimits defaultLimits];
+    limits.maximumMessageLength = 6000;
+    PSWebSocketDriver *driver = [self openLimitedServerDriver:limits];
+
+    NSMutableData *first = [[self maskedBinaryFrameWithLength:4000] mutableCopy];
+    ((uint8_t *)first.mutableBytes)[0] = 0x02;
+    NSMutableData *second = [[self maskedBinaryFrameWithLength:4000] mutableCopy];
+    ((uint8_t *)second.mutableBytes)[0] = 0x80;
+    [driver execute:first.mutableBytes maxLength:first.length];
+    XCTAssertNil(_driverError);
+    [driver execute:second.mutableBytes maxLength:14];
+    XCTAssertEqual(_driverError.code, PSWebSocketStatusCodeMessageTooBig);
+    _expectsDriverError = NO;
+}
+- (void)testLimitsStopDeflateBombs {
+    NSMutableData *zeros = [NSMutableData dataWithLength:16 * 1024 * 1024];
+    NSData *bomb = [self maskedDeflatedFrameWithHeaderByte:0xC2 payload:zeros];
+    XCTAssertLessThan(bomb.length, 64 * 1024);
+
+    PSWebSocketLimits *limits = [PSWebSocketLimits defaultLimits];
+    limits.maximumInflatedLength = 1024 * 1024;
+    PSWebSocketDriver *driver = [self openLimitedServerDriver:limits];
+    NSMutableData *bytes = [bomb mutableCopy];
+    [driver execute:bytes.mutableBytes maxLength:bytes.length];
+    XCTAssertEqual(_driverError.code, PSWebSocketStatusCodeMessageTooBig);
+
+    limits = [PSWebSocketLimits defaultLimits];
+    limits.maximumInflateRatio = 100.0;
+    driver = [self openLimitedServerDriver:limits];
+    bytes = [bomb mutableCopy];
+    [driver execute:bytes.mutableBytes maxLength:bytes.length];
+    XCTAssertEqual(_driverError.code, PSWebSocketStatusCodeMessageTooBig);
+
+    // within limits the same message is delivered
+    limits.maximumInflateRatio = 0.0;
+    limits.maximumInflatedLength = zeros.length;
+    driver = [self openLimitedServerDriver:limits];
+    _expectsDriverError = NO;
+    bytes = [bomb mutableCopy];
+    [driver execute:bytes.mutableBytes maxLength:bytes.length];
+    XCTAssertEqualObjects(_driverEvents, @[@"message"]);
+}
+
+#pragma mark - Handshake
+
+- (NSData *)handshakeRequestWithHeaders:(NSString *)headers {
+    NSString *request = [NSString stringWithFormat:@"GET /chat HTTP/1.1\r\n"
+                         @"Host: localhost:9001\r\n"
+                         @"Origin: http://localhost:9001\r\n"
+                         @"%@"
+                         @"Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                         @"Sec-WebSocket-Version: 13\r\n"
+                         @"Sec-WebSocket-Extensions: permessage-deflate; client_max_window_bits\r\n"
+                         @"\r\n", headers];
+    return [request dataUsingEncoding:NSUTF8StringEncoding];
+}
+- (void)testHTTPParserAcceptsUpgradeRequests {
+    NSData *request = [self handshakeRequestWithHeaders:@"upgrade: WebSocket\r\nConnection: keep-alive, Upgrade\r\n"];
+    PSWebSocketHTTPHead head;
+    XCTAssertEqual(PSWebSocketHTTPParseRequest(request.bytes, request.length, &head), PSWebSocketHTTPParseResultComplete);
+    XCTAssertEqual(head.length, request.length);
+    XCTAssertTrue(PSWebSocketHTTPHeadIsUpgradeRequest(&head));
+    XCTAssertTrue(PSWebSocketHTTPSliceEqualsString(head.target, "/chat"));
+    XCTAssertTrue(PSWebSocketHTTPSliceEqualsString(head.host, "localhost:9001"));
+
+    char accept[28];
+    PSWebSocketHTTPAcceptForKey(head.key, accept);
+    XCTAssertEqualObjects([[NSString alloc] initWithBytes:accept length:sizeof(accept) encoding:NSASCIIStringEncoding], @"s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+    XCTAssertEqual(PSWebSocketHTTPParseRequest(request.bytes, request.length - 2, &head), PSWebSocketHTTPParseResultIncomplete);
+    request = [self handshakeRequestWithHeaders:@"Upgrade: websocket\nConnection: Upgrade\r\n"];
+    XCTAssertEqual(PSWebSocketHTTPParseRequest(request.bytes, request.length, &head), PSWebSocketHTTPParseResultInvalid);
+    request = [self handshakeRequestWithHeaders:@"Upgrade: websocket\r\nConnection: Upgrade\r\nContent-Length: 5\r\n"];
+    XCTAssertEqual(PSWebSocketHTTPParseRequest(request.bytes, request.length, &head), PSWebSocketHTTPParseResultComplete);
+    XCTAssertFalse(PSWebSocketHTTPHeadIsUpgradeRequest(&head), @"Upgrade requests must not have a body");
+}
+- (void)testHandshakeThroughput {
+    NSData *request = [self handshakeRequestWithHeaders:@"Upgrade: websocket\r\nConnection: Upgrade\r\n"];
+    NSUInteger count = 20000;
+    _driverWrites = [NSMutableArray array];
+
+    // both paths answer with the same bytes
+    PSWebSocketDriver *driver = [PSWebSocketDriver serverDriverWithHandshake:request];
+    driver.delegate = self;
+    [driver start];
+    driver = [PSWebSocketDriver serverDriverWithRequest:PSWebSocketHTTPRequestWithBytes(request.bytes, request.length)];
+    driver.delegate = self;
+    [driver start];
+    XCTAssertEqual(_driverWrites.count, 2);
+    XCTAssertEqualObjects(_driverWrites.firstObject, _driverWrites.lastObject);
+
+    _discardDriverWrites = YES;
+    NSTimeInterval parsed = [self timeIterations:count block:^{
+        @autoreleasepool {
+            PSWebSocketDriver *driver = [PSWebSocketDriver serverDriverWithHandshake:request];
+            driver.delegate = self;
+            [driver start];
+        }
+    }];
+    NSTimeInterval viaRequest = [self timeIterations:count block:^{
+        @autoreleasepool {
+            NSURLRequest *urlRequest = PSWebSocketHTTPRequestWithBytes(request.bytes, request.length);
+            PSWebSocketDriver *driver = [PSWebSocketDriver serverDriverWithRequest:urlRequest];
+            driver.delegate = self;
+            [driver start];
+        }
+    }];
+    _discardDriverWrites = NO;
+
+    NSLog(@"[PSWebSocketBenchmarkTests][Handshake]: parsed %.0f/s, NSURLRequest %.0f/s", count / parsed, count / viaRequest);
+    XCTAssertLessThan(parsed, viaRequest);
+}
+
+#pragma mark - Driver Matrix
+
+- (void)openDriverPairWithClient:(PSBenchmarkDriverPeer *)client server:(PSBenchmarkDriverPeer *)server deflate:(BOOL)deflate {
+    PSWebSocketCompressionPolicy *compressionPolicy = [PSWebSocketCompressionPolicy defaultPolicy];
+    if(!deflate) {
+        compressionPolicy.minimumLength = NSUIntegerMax;
+    }
+    client.driver = [PSWebSocketDriver clientDriverWithRequest:[NSURLRequest requestWithURL:[NSURL URLWithString:@"ws://localhost/"]]];
+    client.driver.compressionPolicy = compressionPolicy;
+    [client.driver start];
+
+    server.driver = [PSWebSocketDriver serverDriverWithHandshake:client.written];
+    server.driver.compressionPolicy = compressionPolicy;
+    [server.driver start];
+    [client.driver execute:server.written.mutableBytes maxLength:server.written.length];
+    XCTAssertTrue(client.opened && server.opened, @"Driver pair failed to open");
+
+    client.written.length = 0;
+    server.written.length = 0;
+}
+- (NSData *)matrixPayloadWithLength:(NSUInteger)length text:(BOOL)text {
+    NSMutableData *payload = [NSMutableData dataWithLength:length];
+    if(text) {
+        static const char words[] = "the quick brown fox jumps over the lazy dog ";
+        uint8_t *bytes = payload.mutableBytes;
+        for(NSUInteger i = 0; i < length; ++i) {
+            bytes[i] = words[i % (sizeof(words) - 1)];
+        }
+    } else {
+        arc4random_buf(payload.mutableBytes, length);
+    }
+    return payload;
+}
+- (void)timeDriverMatrixWithMasked:(BOOL)masked text:(BOOL)text deflate:(BOOL)deflate length:(NSUInteger)length {
+    // the server receives masked frames from the client and vice versa
+    NSUInteger count = MAX(1, MIN(100000, (16 * 1024 * 1024) / length));
+    NSData *payload = [self matrixPayloadWithLength:length text:text];
+    NSString *string = (text) ? [[NSString alloc] initWithData:payload encoding:NSUTF8StringEncoding] : nil;
+
+    PSBenchmarkDriverPeer *client = [[PSBenchmarkDriverPeer alloc] init];
+    PSBenchmarkDriverPeer *server = [[PSBenchmarkDriverPeer alloc] init];
+    [self openDriverPairWithClient:client server:server deflate:deflate];
+    PSBenchmarkDriverPeer *sender = (masked) ? client : server;
+    for(NSUInteger i = 0; i < count; ++i) {
+        if(text) {
+            [sender.driver sendText:string];
+        } else {
+            [sender.driver sendBinary:payload];
+        }
+    }
+    NSData *wire = [sender.written copy];
+
+    // every pass parses the same wire into a freshly opened receiver
+    NSUInteger (^receive)(void) = ^NSUInteger {
+        PSBenchmarkDriverPeer *pairClient = [[PSBenchmarkDriverPeer alloc] init];
+        PSBenchmarkDriverPeer *pairServer = [[PSBenchmarkDriverPeer alloc] init];
+        [self openDriverPairWithClient:pairClient server:pairServer deflate:deflate];
+        PSBenchmarkDriverPeer *receiver = (masked) ? pairServer : pairClient;
+        NSMutableData *input = [wire mutableCopy];
+        XCTAssertEqual([self executeDriver:receiver.driver wire:input readLength:256 * 1024], wire.length);
+        XCTAssertNil(receiver.error);
+        return receiver.messageCount;
+    };
+
+    __block NSUInteger messageCount = 0;
+    NSTimeInterval duration = [self timeIterations:PSBenchmarkIterations block:^{
+        messageCount = receive();
+    }];
+    XCTAssertEqual(messageCount, count);
+
+    atomic_store(&PSBenchmarkAllocationCount, 0);
+    PSBenchmarkCountAllocations(YES);
+    receive();
+    PSBenchmarkCountAllocations(NO);
+    uint64_t allocations = atomic_load(&PSBenchmarkAllocationCount);
+
+    NSString *name = [NSString stringWithFormat:@"driver %@ %@ %@ %@",
+                      (masked) ? @"masked" : @"unmasked",
+                      (text) ? @"text" : @"binary",
+                      (deflate) ? @"deflate" : @"plain",
+                      @(length)];
+    [self recordResult:name metrics:@{@"receiver": (masked) ? @"server" : @"client",
+                                      @"masked": @(masked),
+                                      @"text": @(text),
+                                      @"deflate": @(deflate),
+                                      @"message_length": @(length),
+                                      @"wire_length": @(wire.length),
+                                      @"bytes_per_second": @((double)length * count * PSBenchmarkIterations / duration),
+                                      @"messages_per_second": @((double)count * PSBenchmarkIterations / duration),
+                                      @"allocations_per_message": @((double)allocations / count)}];
+}
+- (void)testDriverMatrix {
+    NSArray *lengths = @[@16, @256, @(4 * 1024), @(64 * 1024), @(1024 * 1024), @(64 * 1024 * 1024)];
+    for(NSNumber *length in lengths) {
+        for(NSUInteger i = 0; i < 8; ++i) {
+            @autoreleasepool {
+                [self timeDriverMatrixWithMasked:(i & 1) text:(i & 2) deflate:(i & 4) length:length.unsignedIntegerValue];
+            }
+        }
+    }
+}
+
+#pragma mark - Load Generator
+
+- (void)testSocketTransportDeliversMessagesLargerThanReadLength {
+    NSUInteger port = 9407;
+    NSUInteger messageLength = 4 * 1024 * 1024;
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.usesSocketTransport = YES;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // both ends read far less per event than a single burst carries, every
+    // byte after the first read must arrive without another edge
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    PSBenchmarkLoadClient *client = [[PSBenchmarkLoadClient alloc] init];
+    client.openGroup = dispatch_group_create();
+    client.finishGroup = dispatch_group_create();
+    client.messagesRemaining = 1;
+    client.messageLength = messageLength;
+    client.webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                  transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+    client.webSocket.delegate = client;
+    client.webSocket.callsDelegateInline = YES;
+    client.webSocket.maximumReadLength = 4096;
+    dispatch_group_enter(client.openGroup);
+    [client.webSocket open];
+    XCTAssertEqual(dispatch_group_wait(client.openGroup, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertFalse(client.failed);
+
+    dispatch_group_enter(client.finishGroup);
+    [client sendNext];
+    XCTAssertEqual(dispatch_group_wait(client.finishGroup, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0);
+    XCTAssertFalse(client.failed);
+    XCTAssertEqual(client.latencies.length, sizeof(NSTimeInterval));
+
+    client.webSocket.delegate = nil;
+    [client.webSocket close];
+    [server stop];
+}
+- (void)measureLoadWithEventLoopCount:(NSUInteger)eventLoopCount connectionCount:(NSUInteger)connectionCount port:(NSUInteger)port {
+    NSUInteger messageCount = 100;
+    NSUInteger messageLength = 64;
+
+    // both ends of every connection live in this process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = MIN(limit.rlim_max, MAX(limit.rlim_cur, (rlim_t)(connectionCount * 2 + 256)));
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.eventLoopCount = eventLoopCount;
+    server.usesSocketTransport = YES;
+    server.maximumPendingHandshakes = connectionCount;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // open in waves so the listen backlog is not overrun
+    NSMutableArray *clients = [NSMutableArray arrayWithCapacity:connectionCount];
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    dispatch_group_t openGroup = dispatch_group_create();
+    CFAbsoluteTime connectStart = CFAbsoluteTimeGetCurrent();
+    for(NSUInteger i = 0; i < connectionCount; i += 100) {
+        for(NSUInteger j = i; j < MIN(i + 100, connectionCount); ++j) {
+            PSBenchmarkLoadClient *client = [[PSBenchmarkLoadClient alloc] init];
+            client.openGroup = openGroup;
+            client.messagesRemaining = messageCount;
+            client.messageLength = messageLength;
+            client.webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                          transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+            client.webSocket.delegate = client;
+            client.webSocket.callsDelegateInline = YES;
+            client.openStart = CFAbsoluteTimeGetCurrent();
+            dispatch_group_enter(openGroup);
+            [client.webSocket open];
+            [clients addObject:client];
+        }
+        XCTAssertEqual(dispatch_group_wait(openGroup, dispatch_time(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC)), 0);
+    }
+    NSTimeInterval connectDuration = CFAbsoluteTimeGetCurrent() - connectStart;
+
+    dispatch_group_t finishGroup = dispatch_group_create();
+    NSMutableData *connectLatencies = [NSMutableData dataWithCapacity:connectionCount * sizeof(NSTimeInterval)];
+    NSUInteger failedCount = 0;
+    for(PSBenchmarkLoadClient *client in clients) {
+        if(client.failed) {
+            ++failedCount;
+            continue;
+        }
+        NSTimeInterval openLatency = client.openLatency;
+        [connectLatencies appendBytes:&openLatency length:sizeof(openLatency)];
+        dispatch_group_enter(finishGroup);
+        client.finishGroup = finishGroup;
+    }
+    XCTAssertEqual(failedCount, 0);
+
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for(PSBenchmarkLoadClient *client in clients) {
+        if(client.finishGroup) {
+            [client sendNext];
+        }
+    }
+    XCTAssertEqual(dispatch_group_wait(finishGroup, dispatch_time(DISPATCH_TIME_NOW, 120 * NSEC_PER_SEC)), 0);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+    NSMutableData *latencies = [NSMutableData data];
+    for(PSBenchmarkLoadClient *client in clients) {
+        [latencies appendData:client.latencies];
+        client.webSocket.delegate = nil;
+        [client.webSocket close];
+    }
+    [server stop];
+
+    int (^compare)(const void *, const void *) = ^int(const void *a, const void *b) {
+        NSTimeInterval x = *(const NSTimeInterval *)a, y = *(const NSTimeInterval *)b;
+        return (x > y) - (x < y);
+    };
+    qsort_b(latencies.mutableBytes, latencies.length / sizeof(NSTimeInterval), sizeof(NSTimeInterval), compare);
+    qsort_b(connectLatencies.mutableBytes, connectLatencies.length / sizeof(NSTimeInterval), sizeof(NSTimeInterval), compare);
+    NSUInteger roundTrips = latencies.length / sizeof(NSTimeInterval);
+    XCTAssertEqual(roundTrips, (connectionCount - failedCount) * messageCount);
+
+    [self recordResult:@"loopback load" metrics:@{@"event_loops": @(eventLoopCount),
+                                                  @"connections": @(connectionCount),
+                                                  @"failed_connections": @(failedCount),
+                                                  @"messages_per_connection": @(messageCount),
+                                                  @"message_length": @(messageLength),
+                                                  @"connects_per_second": @((double)connectionCount / connectDuration),
+                                                  @"connect_p50_ms": @([self percentile:50 ofSortedLatencies:connectLatencies] * 1e3),
+                                                  @"connect_p99_ms": @([self percentile:99 ofSortedLatencies:connectLatencies] * 1e3),
+                                                  @"messages_per_second": @((double)roundTrips / duration),
+                                                  @"latency_p50_ms": @([self percentile:50 ofSortedLatencies:latencies] * 1e3),
+                                                  @"latency_p90_ms": @([self percentile:90 ofSortedLatencies:latencies] * 1e3),
+                                                  @"latency_p99_ms": @([self percentile:99 ofSortedLatencies:latencies] * 1e3),
+                                                  @"latency_p999_ms": @([self percentile:99.9 ofSortedLatencies:latencies] * 1e3),
+                                                  @"latency_max_ms": @([self percentile:100 ofSortedLatencies:latencies] * 1e3)}];
+}
+- (void)testLoopbackLoadGenerator {
+    NSString *connectionsValue = [[NSProcessInfo processInfo] environment][@"PS_BENCHMARK_CONNECTIONS"];
+    NSUInteger connectionCount = (connectionsValue.integerValue > 0) ? connectionsValue.integerValue : 1000;
+    NSUInteger processorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+
+    // 1, 2, 4 ... loops and always the processor count, each on its own port
+    // so a previous run's TIME_WAIT sockets never get in the way
+    NSMutableOrderedSet *loopCounts = [NSMutableOrderedSet orderedSet];
+    for(NSUInteger loopCount = 1; loopCount < processorCount; loopCount *= 2) {
+        [loopCounts addObject:@(loopCount)];
+    }
+    [loopCounts addObject:@(processorCount)];
+    NSUInteger port = 9410;
+    for(NSNumber *loopCount in loopCounts) {
+        [self measureLoadWithEventLoopCount:loopCount.unsignedIntegerValue connectionCount:connectionCount port:port++];
+    }
+}
+
+#pragma mark - Accepting
+
+- (BOOL)connectToAddress:(NSData *)address {
+    const struct sockaddr *addr = address.bytes;
+    int handle = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if(handle < 0) {
+        return NO;
+    }
+    BOOL connected = (connect(handle, addr, (socklen_t)address.length) == 0);
+    close(handle);
+    return connected;
+}
+- (BOOL)waitForServer:(PSWebSocketServer *)server acceptCount:(uint64_t)acceptCount timeout:(NSTimeInterval)timeout {
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout;
+    while(server.statistics.acceptCount < acceptCount) {
+        if(CFAbsoluteTimeGetCurrent() > deadline) {
+            return NO;
+        }
+        [NSThread sleepForTimeInterval:0.001];
+    }
+    return YES;
+}
+- (void)testListensDualStack {
+    NSUInteger port = 9404;
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"::" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // the IPv6 wildcard also accepts IPv4 as mapped addresses
+    XCTAssertTrue([self connectToAddress:[PSWebSocketServer addressWithHost:@"::1" port:port]]);
+    XCTAssertTrue([self connectToAddress:[PSWebSocketServer addressWithHost:@"127.0.0.1" port:port]]);
+    XCTAssertTrue([self waitForServer:server acceptCount:2 timeout:5.0]);
+    [server stop];
+
+    XCTAssertNil([PSWebSocketServer addressWithHost:@"localhost" port:port]);
+    XCTAssertEqual([PSWebSocketServer addressWithHost:@"[::1]" port:port].length, sizeof(struct sockaddr_in6));
+}
+- (void)testAcceptBacksOffWhenOutOfDescriptors {
+    NSUInteger port = 9408;
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    NSData *address = [PSWebSocketServer addressWithHost:@"127.0.0.1" port:port];
+    int client = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    XCTAssertGreaterThanOrEqual(client, 0);
+
+    // use up every descriptor so accepting fails with EMFILE
+    struct rlimit savedLimit;
+    getrlimit(RLIMIT_NOFILE, &savedLimit);
+    struct rlimit limit = savedLimit;
+    limit.rlim_cur = MIN(limit.rlim_cur, (rlim_t)1024);
+    setrlimit(RLIMIT_NOFILE, &limit);
+    NSMutableData *fillers = [NSMutableData data];
+    for(int filler = dup(client); filler >= 0; filler = dup(client)) {
+        [fillers appendBytes:&filler length:sizeof(filler)];
+    }
+    BOOL connected = (connect(client, address.bytes, (socklen_t)address.length) == 0);
+
+    // the pending connection keeps the listener readable, the acceptor
+    // must not spin on it while nothing can be accepted
+    struct rusage before, after;
+    getrusage(RUSAGE_SELF, &before);
+    [NSThread sleepForTimeInterval:0.5];
+    getrusage(RUSAGE_SELF, &after);
+    for(NSUInteger i = 0; i < fillers.length / sizeof(int); ++i) {
+        close(((const int *)fillers.bytes)[i]);
+    }
+    setrlimit(RLIMIT_NOFILE, &savedLimit);
+    NSTimeInterval cpuTime = (after.ru_utime.tv_sec - before.ru_utime.tv_sec) + (after.ru_utime.tv_usec - before.ru_utime.tv_usec) * 1e-6 +
+                             (after.ru_stime.tv_sec - before.ru_stime.tv_sec) + (after.ru_stime.tv_usec - before.ru_stime.tv_usec) * 1e-6;
+
+    XCTAssertTrue(connected);
+    XCTAssertLessThan(cpuTime, 0.25);
+    XCTAssertEqual(server.statistics.acceptCount, 0);
+
+    // and accepts again once descriptors free up
+    XCTAssertTrue([self waitForServer:server acceptCount:1 timeout:5.0]);
+    close(client);
+    [server stop];
+}
+- (void)measureAcceptRateWithAcceptorCount:(NSUInteger)acceptorCount port:(NSUInteger)port {
+    NSUInteger connectionCount = 20000;
+    NSUInteger threadCount = [[NSProcessInfo processInfo] activeProcessorCount];
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.eventLoopCount = threadCount;
+    server.usesSocketTransport = YES;
+    server.backlog = 4096;
+    server.acceptorCount = acceptorCount;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // connect and hang up from every core as fast as the server takes them
+    NSData *address = [PSWebSocketServer addressWithHost:@"127.0.0.1" port:port];
+    _Atomic uint64_t failedCount = 0;
+    _Atomic uint64_t *failed = &failedCount;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    dispatch_apply(threadCount, dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^(size_t thread) {
+        for(NSUInteger i = thread; i < connectionCount; i += threadCount) {
+            if(![self connectToAddress:address]) {
+                atomic_fetch_add_explicit(failed, 1, memory_order_relaxed);
+            }
+        }
+    });
+    uint64_t connectedCount = connectionCount - atomic_load(&failedCount);
+    XCTAssertTrue([self waitForServer:server acceptCount:connectedCount timeout:60.0]);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+    [server stop];
+
+    [self recordResult:@"accept rate" metrics:@{@"acceptors": @(acceptorCount),
+                                                @"connections": @(connectionCount),
+                                                @"failed_connections": @(connectionCount - connectedCount),
+                                                @"accepts_per_second": @((double)connectedCount / duration)}];
+}
+- (void)testAcceptRate {
+    NSUInteger acceptorCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    [self measureAcceptRateWithAcceptorCount:1 port:9405];
+    [self measureAcceptRateWithAcceptorCount:acceptorCount port:9406];
+}
+
+#pragma mark - Handshake Rate
+
+- (int)openIdleConnectionToAddress:(NSData *)address {
+    const struct sockaddr *addr = address.bytes;
+    int handle = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if(handle < 0) {
+        return -1;
+    }
+    if(connect(handle, addr, (socklen_t)address.length) != 0) {
+        close(handle);
+        return -1;
+    }
+    return handle;
+}
+- (BOOL)waitForHangUpOnHandle:(int)handle timeout:(NSTimeInterval)timeout {
+    struct timeval tv = {.tv_sec = (time_t)timeout, .tv_usec = (suseconds_t)((timeout - floor(timeout)) * 1e6)};
+    setsockopt(handle, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    uint8_t byte;
+    ssize_t length = recv(handle, &byte, sizeof(byte), 0);
+    return (length == 0 || (length < 0 && errno == ECONNRESET));
+}
+- (BOOL)waitForServer:(PSWebSocketServer *)server handshakeFailures:(uint64_t)count reason:(PSWebSocketServerHandshakeFailure)reason timeout:(NSTimeInterval)timeout {
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + timeout;
+    while([server.statistics handshakeFailuresForReason:reason] < count) {
+        if(CFAbsoluteTimeGetCurrent() > deadline) {
+            return NO;
+        }
+        [NSThread sleepForTimeInterval:0.001];
+    }
+    return YES;
+}
+- (void)measureHandshakeRateWithConnectionCount:(NSUInteger)connectionCount port:(NSUInteger)port {
+    // both ends of every connection live in this process
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = MIN(limit.rlim_max, MAX(limit.rlim_cur, (rlim_t)(connectionCount * 2 + 256)));
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.eventLoopCount = [[NSProcessInfo processInfo] activeProcessorCount];
+    server.usesSocketTransport = YES;
+    server.backlog = MAX(connectionCount, 256);
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // every client connects at once, nothing waits for earlier handshakes
+    NSMutableArray *clients = [NSMutableArray arrayWithCapacity:connectionCount];
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    dispatch_group_t openGroup = dispatch_group_create();
+    for(NSUInteger i = 0; i < connectionCount; ++i) {
+        PSBenchmarkLoadClient *client = [[PSBenchmarkLoadClient alloc] init];
+        client.openGroup = openGroup;
+        client.webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                      transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+        client.webSocket.delegate = client;
+        client.webSocket.callsDelegateInline = YES;
+        [clients addObject:client];
+    }
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+    for(PSBenchmarkLoadClient *client in clients) {
+        client.openStart = CFAbsoluteTimeGetCurrent();
+        dispatch_group_enter(openGroup);
+        [client.webSocket open];
+    }
+    XCTAssertEqual(dispatch_group_wait(openGroup, dispatch_time(DISPATCH_TIME_NOW, 120 * NSEC_PER_SEC)), 0);
+    NSTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+
+    NSMutableData *latencies = [NSMutableData dataWithCapacity:connectionCount * sizeof(NSTimeInterval)];
+    NSUInteger failedCount = 0;
+    for(PSBenchmarkLoadClient *client in clients) {
+        if(client.failed) {
+            ++failedCount;
+        } else {
+            NSTimeInterval openLatency = client.openLatency;
+            [latencies appendBytes:&openLatency length:sizeof(openLatency)];
+        }
+        client.webSocket.delegate = nil;
+        [client.webSocket close];
+    }
+    [server stop];
+    XCTAssertEqual(failedCount, 0);
+
+    qsort_b(latencies.mutableBytes, latencies.length / sizeof(NSTimeInterval), sizeof(NSTimeInterval), ^int(const void *a, const void *b) {
+        NSTimeInterval x = *(const NSTimeInterval *)a, y = *(const NSTimeInterval *)b;
+        return (x > y) - (x < y);
+    });
+    [self recordResult:@"handshake rate" metrics:@{@"connections": @(connectionCount),
+                                                   @"failed_connections": @(failedCount),
+                                                   @"handshakes_per_second": @((double)(connectionCount - failedCount) / duration),
+                                                   @"handshake_p50_ms": @([self percentile:50 ofSortedLatencies:latencies] * 1e3),
+                                                   @"handshake_p99_ms": @([self percentile:99 ofSortedLatencies:latencies] * 1e3),
+                                                   @"handshake_max_ms": @([self percentile:100 ofSortedLatencies:latencies] * 1e3)}];
+}
+- (void)testHandshakeRate {
+    [self measureHandshakeRateWithConnectionCount:100 port:9420];
+    [self measureHandshakeRateWithConnectionCount:1000 port:9421];
+    [self measureHandshakeRateWithConnectionCount:10000 port:9422];
+}
+- (void)testHandshakeLimitsShedAndTimeOut {
+    NSUInteger port = 9423;
+    NSUInteger pendingCount = 4;
+    NSUInteger excessCount = 8;
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.usesSocketTransport = YES;
+    server.maximumPendingHandshakes = pendingCount;
+    server.handshakeTimeout = 0.5;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    // connections that never send a request, the first few fill the pending
+    // handshakes and the rest must be turned away straight away
+    NSData *address = [PSWebSocketServer addressWithHost:@"127.0.0.1" port:port];
+    NSMutableArray *handles = [NSMutableArray arrayWithCapacity:pendingCount + excessCount];
+    for(NSUInteger i = 0; i < pendingCount + excessCount; ++i) {
+        int handle = [self openIdleConnectionToAddress:address];
+        XCTAssertGreaterThanOrEqual(handle, 0);
+        [handles addObject:@(handle)];
+        if(i + 1 == pendingCount) {
+            XCTAssertTrue([self waitForServer:server acceptCount:pendingCount timeout:5.0]);
+        }
+    }
+    XCTAssertTrue([self waitForServer:server handshakeFailures:excessCount reason:PSWebSocketServerHandshakeFailureShed timeout:5.0]);
+    XCTAssertEqual([server.statistics handshakeFailuresForReason:PSWebSocketServerHandshakeFailureTimedOut], 0);
+
+    // the idle ones that got in are dropped once handshakeTimeout passes
+    XCTAssertTrue([self waitForServer:server handshakeFailures:pendingCount reason:PSWebSocketServerHandshakeFailureTimedOut timeout:5.0]);
+    XCTAssertEqual([server.statistics handshakeFailuresForReason:PSWebSocketServerHandshakeFailureShed], excessCount);
+    for(NSNumber *handle in handles) {
+        XCTAssertTrue([self waitForHangUpOnHandle:handle.intValue timeout:5.0]);
+        close(handle.intValue);
+    }
+    [server stop];
+}
+
+#pragma mark - Compression Pipeline
+
+- (void)measurePingLatencyWithParallelCompressionLength:(NSUInteger)parallelCompressionLength port:(NSUInteger)port {
+    NSUInteger messageCount = 8;
+    NSUInteger messageLength = 16 * 1024 * 1024;
+    NSUInteger pingCount = 200;
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    echo.discardsMessages = YES;
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.usesSocketTransport = YES;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    PSBenchmarkLoadClient *client = [[PSBenchmarkLoadClient alloc] init];
+    client.openGroup = dispatch_group_create();
+    client.webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                  transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+    client.webSocket.delegate = client;
+    client.webSocket.callsDelegateInline = YES;
+    client.webSocket.compressionPolicy = [PSWebSocketCompressionPolicy alwaysPolicy];
+    client.webSocket.parallelCompressionLength = parallelCompressionLength;
+    dispatch_group_enter(client.openGroup);
+    [client.webSocket open];
+    XCTAssertEqual(dispatch_group_wait(client.openGroup, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+
+    // pings every 5ms while compressible bulk messages are going out
+    NSData *payload = [self matrixPayloadWithLength:messageLength text:YES];
+    for(NSUInteger i = 0; i < messageCount; ++i) {
+        [client.webSocket send:payload];
+    }
+    NSMutableData *latencies = [NSMutableData dataWithLength:pingCount * sizeof(NSTimeInterval)];
+    NSTimeInterval *latencyValues = latencies.mutableBytes;
+    dispatch_group_t pongGroup = dispatch_group_create();
+    for(NSUInteger i = 0; i < pingCount; ++i) {
+        CFAbsoluteTime pingStart = CFAbsoluteTimeGetCurrent();
+        dispatch_group_enter(pongGroup);
+        [client.webSocket ping:[NSData data] handler:^(NSData *pongData) {
+            latencyValues[i] = CFAbsoluteTimeGetCurrent() - pingStart;
+            dispatch_group_leave(pongGroup);
+        }];
+        [NSThread sleepForTimeInterval:0.005];
+    }
+    XCTAssertEqual(dispatch_group_wait(pongGroup, dispatch_time(DISPATCH_TIME_NOW, 120 * NSEC_PER_SEC)), 0);
+
+    client.webSocket.delegate = nil;
+    [client.webSocket close];
+    [server stop];
+
+    int (^compare)(const void *, const void *) = ^int(const void *a, const void *b) {
+        NSTimeInterval x = *(const NSTimeInterval *)a, y = *(const NSTimeInterval *)b;
+        return (x > y) - (x < y);
+    };
+    qsort_b(latencies.mutableBytes, pingCount, sizeof(NSTimeInterval), compare);
+    [self recordResult:@"ping latency during bulk deflate" metrics:@{@"parallel_compression_length": @(parallelCompressionLength),
+                                                                     @"messages": @(messageCount),
+                                                                     @"message_length": @(messageLength),
+                                                                     @"pings": @(pingCount),
+                                                                     @"latency_p50_ms": @([self percentile:50 ofSortedLatencies:latencies] * 1e3),
+                                                                     @"latency_p99_ms": @([self percentile:99 ofSortedLatencies:latencies] * 1e3),
+                                                                     @"latency_max_ms": @([self percentile:100 ofSortedLatencies:latencies] * 1e3)}];
+}
+- (void)testPingLatencyDuringBulkDeflate {
+    [self measurePingLatencyWithParallelCompressionLength:0 port:9402];
+    [self measurePingLatencyWithParallelCompressionLength:1024 * 1024 port:9403];
+}
+- (void)echoInterleavedMessagesWithCompressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy port:(NSUInteger)port {
+    NSUInteger parallelCompressionLength = 64 * 1024;
+
+    PSBenchmarkEchoServer *echo = [[PSBenchmarkEchoServer alloc] init];
+    echo.semaphore = dispatch_semaphore_create(0);
+    PSWebSocketServer *server = [PSWebSocketServer serverWithHost:@"127.0.0.1" port:port];
+    server.delegate = echo;
+    server.delegateQueue = dispatch_queue_create(nil, nil);
+    server.usesSocketTransport = YES;
+    server.compressionPolicy = compressionPolicy;
+    server.parallelCompressionLength = parallelCompressionLength;
+    [server start];
+    XCTAssertEqual(dispatch_semaphore_wait(echo.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+    XCTAssertNil(echo.error);
+
+    NSURLRequest *request = [NSURLRequest requestWithURL:[NSURL URLWithString:[NSString stringWithFormat:@"ws://127.0.0.1:%@/", @(port)]]];
+    PSBenchmarkMessageCollector *collector = [[PSBenchmarkMessageCollector alloc] init];
+    collector.semaphore = dispatch_semaphore_create(0);
+    PSWebSocket *webSocket = [PSWebSocket clientSocketWithRequest:request
+                                                        transport:[PSWebSocketSocketTransport transportWithHost:@"127.0.0.1" port:port]];
+    webSocket.delegate = collector;
+    webSocket.callsDelegateInline = YES;
+    webSocket.compressionPolicy = compressionPolicy;
+    webSocket.parallelCompressionLength = parallelCompressionLength;
+    [webSocket open];
+    XCTAssertEqual(dispatch_semaphore_wait(collector.semaphore, dispatch_time(DISPATCH_TIME_NOW, 10 * NSEC_PER_SEC)), 0);
+
+    // large messages deflate on workers while the small ones queued after
+    // them are ready straight away, each stamped so reordering shows
+    NSData *payload = [self matrixPayloadWithLength:1024 * 1024 text:YES];
+    NSMutableArray *messages = [NSMutableArray array];
+    for(NSUInteger i = 0; i < 64; ++i) {
+        if(i % 4 == 0) {
+            NSMutableData *large = [NSMutableData dataWithData:payload];
+            [large increaseLengthBy:i];
+            memcpy(large.mutableBytes, &i, sizeof(i));
+            [messages addObject:large];
+        } else if(i % 2 == 0) {
+            [messages addObject:[NSString stringWithFormat:@"small text message %@", @(i)]];
+        } else {
+            [messages addObject:[NSData dataWithBytes:&i length:sizeof(i)]];
+        }
+    }
+    collector.messagesExpected = messages.count;
+    for(id message in messages) {
+        [webSocket send:message];
+    }
+    XCTAssertEqual(dispatch_semaphore_wait(collector.semaphore, dispatch_time(DISPATCH_TIME_NOW, 60 * NSEC_PER_SEC)), 0);
+    XCTAssertEqual(collector.messages.count, messages.count);
+    for(NSUInteger i = 0; i < MIN(collector.messages.count, messages.count); ++i) {
+        XCTAssertEqualObjects(collector.messages[i], messages[i], @"message %@ out of order or corrupted", @(i));
+    }
+
+    webSocket.delegate = nil;
+    [webSocket close];
+    [server stop];
+}
+- (void)testParallelCompressionKeepsMessageOrder {
+    PSWebSocketCompressionPolicy *contextTakeover = [PSWebSocketCompressionPolicy alwaysPolicy];
+    [self echoInterleavedMessagesWithCompressionPolicy:contextTakeover port:9430];
+
+    PSWebSocketCompressionPolicy *noContextTakeover = [PSWebSocketCompressionPolicy alwaysPolicy];
+    noContextTakeover.serverNoContextTakeover = YES;
+    noContextTakeover.clientNoContextTakeover = YES;
+    [self echoInterleavedMessagesWithCompressionPolicy:noContextTakeover port:9431];
+}
+
+#pragma mark - PSWebSocketDriverDelegate
+
+- (void)driverDidOpen:(PSWebSocketDriver *)driver {
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceiveMessage:(id)message {
+    ++_driverMessageCount;
+    _driverMessage = message;
+    [_driverEvents addObject:@"message"];
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceivePing:(NSData *)ping {
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceivePong:(NSData *)pong {
+}
+- (void)driver:(PSWebSocketDriver *)driver didFailWithError:(NSError *)error {
+    _driverError = error;
+    if(!_expectsDriverError) {
+        XCTFail(@"Driver failed: %@", error);
+    }
+}
+- (void)driver:(PSWebSocketDriver *)driver didCloseWithCode:(NSInteger)code reason:(NSString *)reason {
+}
+- (void)driver:(PSWebSocketDriver *)driver write:(NSData *)data {
+    if(!_discardDriverWrites) {
+        [_driverWrites addObject:data];
+    }
+}
+- (void)driver:(PSWebSocketDriver *)driver didBeginMessage:(PSWebSocketMessageType)type {
+    XCTAssertEqual(type, PSWebSocketMessageTypeBinary);
+    [_driverEvents addObject:@"begin"];
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceiveMessageChunk:(NSData *)chunk {
+    [_driverEvents addObject:@"chunk"];
+    [_driverChunks appendData:chunk];
+}
+- (void)driverDidFinishMessage:(PSWebSocketDriver *)driver {
+    [_driverEvents addObject:@"finish"];
+}
+
+#pragma mark - PSWebSocketDelegate
+
+- (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
+    if(++_messagesReceived == _messagesExpected) {
+        dispatch_semaphore_signal(_semaphore);
+    }
+}
+- (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
+    XCTFail(@"Loopback websocket failed: %@", error);
+    dispatch_semaphore_signal(_semaphore);
+}
+- (void)webSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+}
+
+#pragma mark - UTF-8
+
+- (void)testUTF8ValidateMatchesDecoder {
+    NSArray *samples = @[@"{\"key\":\"value\"}", @"caf\u00e9 \u20ac \U0001F600", @"\u65e5\u672c\u8a9e\u30c6\u30ad\u30b9\u30c8"];
+    for(NSString *sample in samples) {
+        NSData *data = [sample dataUsingEncoding:NSUTF8StringEncoding];
+        for(NSUInteger split = 0; split <= data.length; ++split) {
+            uint32_t state = PSWebSocketUTF8DecoderAccept;
+            BOOL ascii = YES;
+            PSWebSocketUTF8DecoderValidate(&state, data.bytes, split, &ascii);
+            PSWebSocketUTF8DecoderValidate(&state, (const uint8_t *)data.bytes + split, data.length - split, &ascii);
+            XCTAssertEqual(state, (uint32_t)PSWebSocketUTF8DecoderAccept, @"%@ should validate when split at %@", sample, @(split));
+            XCTAssertEqual(ascii, (BOOL)(data.length == sample.length), @"%@ ASCII flag is wrong", sample);
+        }
+    }
+
+    const uint8_t invalid[][4] = {{0xC0, 0xAF}, {0xED, 0xA0, 0x80}, {0xFF}, {0x80}};
+    const NSUInteger invalidLengths[] = {2, 3, 1, 1};
+    for(NSUInteger i = 0; i < sizeof(invalidLengths) / sizeof(invalidLengths[0]); ++i) {
+        uint32_t state = PSWebSocketUTF8DecoderAccept;
+        XCTAssertEqual(PSWebSocketUTF8DecoderValidate(&state, invalid[i], invalidLengths[i], NULL), (uint32_t)PSWebSocketUTF8DecoderReject);
+    }
+}
+- (void)testUTF8ValidateThroughput {
+    NSData *json = [@"{\"id\":1234,\"name\":\"pocketsocket\",\"tags\":[\"a\",\"b\"]}," dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *data = [NSMutableData dataWithCapacity:PSBenchmarkPayloadLength];
+    while(data.length + json.length <= PSBenchmarkPayloadLength) {
+        [data appendData:json];
+    }
+    const uint8_t *bytes = data.bytes;
+    NSUInteger length = data.length;
+
+    NSTimeInterval dfa = [self timeIterations:PSBenchmarkIterations block:^{
+        uint32_t state = PSWebSocketUTF8DecoderAccept;
+        uint32_t codePoint = 0;
+        for(NSUInteger i = 0; i < length; ++i) {
+            PSWebSocketUTF8DecoderDecode(&state, &codePoint, bytes[i]);
+        }
+    }];
+    NSTimeInterval block = [self timeIterations:PSBenchmarkIterations block:^{
+        uint32_t state = PSWebSocketUTF8DecoderAccept;
+        PSWebSocketUTF8DecoderValidate(&state, bytes, length, NULL);
+    }];
+
+    [self logName:@"utf-8 dfa" bytes:length * PSBenchmarkIterations duration:dfa];
+    [self logName:@"utf-8 block validate" bytes:length * PSBenchmarkIterations duration:block];
+}
+- (void)testUTF8NonASCIIStringThroughput {
+    NSData *text = [@"{\"name\":\"h\u00e9llo w\u00f6rld \u65e5\u672c\u8a9e\",\"emoji\":\"\U0001F600\"}," dataUsingEncoding:NSUTF8StringEncoding];
+    NSMutableData *data = [NSMutableData dataWithCapacity:PSBenchmarkPayloadLength];
+    while(data.length + text.length <= PSBenchmarkPayloadLength) {
+        [data appendData:text];
+    }
+    const uint8_t *bytes = data.bytes;
+    NSUInteger length = data.length;
+
+    uint32_t validated = PSWebSocketUTF8DecoderAccept;
+    BOOL ascii = YES;
+    XCTAssertEqual(PSWebSocketUTF8DecoderValidate(&validated, bytes, length, &ascii), (uint32_t)PSWebSocketUTF8DecoderAccept);
+    XCTAssertFalse(ascii);
+    NSString *expected = [[NSString alloc] initWithData:data encoding:NSUTF8StringEncoding];
+    XCTAssertEqualObjects(PSWebSocketUTF8DecoderString(bytes, length), expected);
+
+    // what the driver used to pay: validate, then let CF validate again
+    NSTimeInterval checked = [self timeIterations:PSBenchmarkIterations block:^{
+        uint32_t state = PSWebSocketUTF8DecoderAccept;
+        PSWebSocketUTF8DecoderValidate(&state, bytes, length, NULL);
+        NSString *string = [[NSString alloc] initWithBytes:bytes length:length encoding:NSUTF8StringEncoding];
+        (void)string;
+    }];
+    NSTimeInterval transcoded = [self timeIterations:PSBenchmarkIterations block:^{
+        uint32_t state = PSWebSocketUTF8DecoderAccept;
+        PSWebSocketUTF8DecoderValidate(&state, bytes, length, NULL);
+        NSString *string = PSWebSocketUTF8DecoderString(bytes, length);
+        (void)string;
+    }];
+
+    [self logName:@"utf-8 non-ascii validate + initWithBytes" bytes:length * PSBenchmarkIterations duration:checked];
+    [self logName:@"utf-8 non-ascii validate + transcode" bytes:length * PSBenchmarkIterations duration:transcoded];
+}
+
+@end
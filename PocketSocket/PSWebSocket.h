@@ -14,6 +14,13 @@
 
 #import <Foundation/Foundation.h>
 #import "PSWebSocketTypes.h"
+#import "PSWebSocketPreparedMessage.h"
+#import "PSWebSocketDataView.h"
+#import "PSWebSocketTransport.h"
+#import "PSWebSocketCompressionPolicy.h"
+#import "PSWebSocketLimits.h"
+#import "PSWebSocketFlushPolicy.h"
+#import "PSWebSocketStatistics.h"
 
 typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
     PSWebSocketReadyStateConnecting = 0,
@@ -22,6 +29,24 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
     PSWebSocketReadyStateClosed
 };
 
+/**
+ *  What happens to sends while output is above the high water mark
+ */
+typedef NS_ENUM(NSInteger, PSWebSocketSlowConsumerPolicy) {
+    // keep queuing, only the water mark delegate methods are called
+    PSWebSocketSlowConsumerPolicyQueue = 0,
+    // sends wait until output drains to the low water mark, except sends made
+    // on the websocket's own queue or event loop which are queued
+    PSWebSocketSlowConsumerPolicyBlock,
+    // messages sent are dropped
+    PSWebSocketSlowConsumerPolicyDropNewest,
+    // queued messages that have not started being written are dropped
+    // oldest first, control frames and fragments never are
+    PSWebSocketSlowConsumerPolicyDropOldest,
+    // the websocket is closed with PSWebSocketStatusCodePolicyViolated
+    PSWebSocketSlowConsumerPolicyDisconnect
+};
+
 @class PSWebSocket;
 
 /**
@@ -37,7 +62,24 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
 @optional
 - (void)webSocketDidFlushInput:(PSWebSocket *)webSocket;
 - (void)webSocketDidFlushOutput:(PSWebSocket *)webSocket;
+
+// called when bufferedAmount reaches highWaterMark and when it then falls
+// back to lowWaterMark
+- (void)webSocketDidReachHighWaterMark:(PSWebSocket *)webSocket;
+- (void)webSocketDidDrainToLowWaterMark:(PSWebSocket *)webSocket;
 - (BOOL)webSocket:(PSWebSocket *)webSocket evaluateServerTrust:(SecTrustRef)trust;
+
+// called with the round trip time of every answered heartbeat and ping
+- (void)webSocket:(PSWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime;
+
+// called instead of webSocket:didReceiveMessage: with every message one read
+// produced, in order and at most maximumMessageBatchCount at a time
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages;
+
+// called instead of webSocket:didReceiveMessage: when streamsMessages is enabled
+- (void)webSocket:(PSWebSocket *)webSocket didBeginMessage:(PSWebSocketMessageType)type;
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessageChunk:(NSData *)chunk;
+- (void)webSocketDidFinishMessage:(PSWebSocket *)webSocket;
 @end
 
 /**
@@ -66,6 +108,134 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
 @property (nonatomic, assign, getter=isInputPaused) BOOL inputPaused;
 @property (nonatomic, assign, getter=isOutputPaused) BOOL outputPaused;
 
+/**
+ *  Upper bound on the number of bytes read from the input stream per stream
+ *  event. Reads start small and grow toward this while the stream keeps
+ *  returning full reads. Defaults to 256KB.
+ */
+@property (nonatomic, assign) NSUInteger maximumReadLength;
+
+/**
+ *  Deliver text and binary messages in chunks as they arrive through the
+ *  optional didBeginMessage:, didReceiveMessageChunk: and
+ *  webSocketDidFinishMessage: delegate methods instead of buffering the
+ *  whole message for webSocket:didReceiveMessage:. Text chunks are raw
+ *  validated UTF-8 and may split a multi byte sequence. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL streamsMessages;
+
+/**
+ *  What webSocket:didReceiveMessage: is given. PSWebSocketMessageDeliveryString
+ *  decodes text into a new NSString and hands binary over as an NSMutableData.
+ *  The other modes hand the received bytes over without copying them:
+ *  binary as an immutable NSData view, and text either as an NSString view
+ *  over pure ASCII or as validated UTF-8 PSWebSocketUTF8Data. Defaults to
+ *  PSWebSocketMessageDeliveryString.
+ */
+@property (nonatomic, assign) PSWebSocketMessageDelivery messageDelivery;
+
+/**
+ *  Most messages handed to webSocket:didReceiveMessages: at once when the
+ *  delegate implements it. Defaults to 256.
+ */
+@property (nonatomic, assign) NSUInteger maximumMessageBatchCount;
+
+/**
+ *  Call delegate methods directly on the websocket's internal queue instead
+ *  of dispatching them to delegateQueue. Saves a queue hop per callback at
+ *  high message rates, the delegate must then be thread safe and return
+ *  quickly as input and output wait on it. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL callsDelegateInline;
+
+/**
+ *  Which outgoing messages are deflated when permessage-deflate is
+ *  negotiated, see PSWebSocketCompressionPolicy. Set before opening.
+ */
+@property (nonatomic, copy) PSWebSocketCompressionPolicy *compressionPolicy;
+
+/**
+ *  Bounds on incoming frames and messages, see PSWebSocketLimits. Peers that
+ *  exceed them are closed with PSWebSocketStatusCodeMessageTooBig.
+ */
+@property (nonatomic, copy) PSWebSocketLimits *limits;
+
+/**
+ *  Payload length of each frame when sending an input stream, a file or a
+ *  message deflated in parallel. Defaults to 64KB.
+ */
+@property (nonatomic, assign) NSUInteger fragmentLength;
+
+/**
+ *  Text and binary messages at least this long, in characters for text, are
+ *  deflated on a background queue while earlier messages keep going out,
+ *  then sent in order split into fragmentLength frames so pings and pongs
+ *  are not stuck behind them. Only applies once permessage-deflate has been
+ *  negotiated, 0 deflates every message on the socket's queue. Defaults
+ *  to 0.
+ */
+@property (nonatomic, assign) NSUInteger parallelCompressionLength;
+
+/**
+ *  Number of bytes queued for output that have not been written yet
+ */
+@property (nonatomic, assign, readonly) NSUInteger bufferedAmount;
+
+/**
+ *  bufferedAmount at which output is considered backed up and the
+ *  slowConsumerPolicy applies, 0 disables it. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger highWaterMark;
+
+/**
+ *  bufferedAmount at or below which backed up output is considered drained
+ *  again. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger lowWaterMark;
+
+/**
+ *  What happens to sends while output is backed up. Blocking never blocks
+ *  calls made on the websocket's own queue, such as from an inline delegate,
+ *  or on the server event loop it belongs to; those sends are queued as with
+ *  PSWebSocketSlowConsumerPolicyQueue. Defaults to
+ *  PSWebSocketSlowConsumerPolicyQueue.
+ */
+@property (nonatomic, assign) PSWebSocketSlowConsumerPolicy slowConsumerPolicy;
+
+/**
+ *  How long outgoing frames may be held back to coalesce them into fewer
+ *  writes, see PSWebSocketFlushPolicy. Defaults to
+ *  +[PSWebSocketFlushPolicy defaultPolicy] which never holds frames unless
+ *  corked.
+ */
+@property (nonatomic, copy) PSWebSocketFlushPolicy *flushPolicy;
+
+/**
+ *  Disable Nagle's algorithm on the TCP connection so small writes are sent
+ *  without waiting for outstanding acknowledgements. Transports that do not
+ *  expose a TCP socket ignore it. Defaults to YES.
+ */
+@property (nonatomic, assign) BOOL noDelay;
+
+/**
+ *  Interval at which pings are sent while open to measure round trip times
+ *  and detect dead peers, 0 disables them. Defaults to 0.
+ */
+@property (nonatomic, assign) NSTimeInterval heartbeatInterval;
+
+/**
+ *  Heartbeats in a row that may go unanswered before the websocket fails
+ *  with PSWebSocketErrorCodeTimedOut. Defaults to 2.
+ */
+@property (nonatomic, assign) NSUInteger maximumMissedHeartbeats;
+
+/**
+ *  Time the websocket may stay open without reading or writing a byte
+ *  before it fails with PSWebSocketErrorCodeTimedOut, 0 disables it.
+ *  Heartbeats count as traffic. Defaults to 0.
+ */
+@property (nonatomic, assign) NSTimeInterval idleTimeout;
+
 #pragma mark - Initialization
 
 /**
@@ -90,6 +260,44 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
                             inputStream:(NSInputStream *)inputStream
                            outputStream:(NSOutputStream *)outputStream;
 
+/**
+ *  Initialize a PSWebSocket instance in client mode over the given
+ *  transport, e.g. a PSWebSocketSocketTransport connecting to the request's
+ *  host. Secure requests require the default stream transport.
+ *
+ *  @param request   request that is to be used to initiate the handshake
+ *  @param transport unopened transport to be taken over by the websocket
+ *
+ *  @return an initialized instance of PSWebSocket in client mode
+ */
++ (instancetype)clientSocketWithRequest:(NSURLRequest *)request
+                              transport:(id <PSWebSocketTransport>)transport;
+
+/**
+ *  Initialize a PSWebSocket instance in server mode over the given
+ *  transport
+ *
+ *  @param request   request that is to be used to initiate the handshake response
+ *  @param transport connected transport to be taken over by the websocket
+ *
+ *  @return an initialized instance of PSWebSocket in server mode
+ */
++ (instancetype)serverSocketWithRequest:(NSURLRequest *)request
+                              transport:(id <PSWebSocketTransport>)transport;
+
+/**
+ *  Initialize a PSWebSocket instance in server mode from the raw bytes of
+ *  the handshake request, which are parsed in place without building an
+ *  NSURLRequest. The request property builds one the first time it is read.
+ *
+ *  @param handshake complete HTTP request head, nothing after it
+ *  @param transport connected transport to be taken over by the websocket
+ *
+ *  @return an initialized instance of PSWebSocket in server mode
+ */
++ (instancetype)serverSocketWithHandshake:(NSData *)handshake
+                                transport:(id <PSWebSocketTransport>)transport;
+
 #pragma mark - Actions
 
 /**
@@ -107,6 +315,65 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
  */
 - (void)send:(id)message;
 
+/**
+ *  Send several messages back to back, their frames are queued together and
+ *  written in as few writes as possible
+ *
+ *  @param messages instances of NSData or NSString to send in order
+ */
+- (void)sendMessages:(NSArray *)messages;
+
+/**
+ *  Send a message that was framed ahead of time, see
+ *  PSWebSocketPreparedMessage
+ *
+ *  @param message prepared message to send
+ */
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message;
+
+/**
+ *  Send the contents of an input stream as a single fragmented message.
+ *  The stream is opened if needed and read on the websocket's queue one
+ *  fragment at a time as earlier fragments are written, so it should not
+ *  block for long. Messages sent afterwards wait until it has been sent.
+ *
+ *  @param inputStream stream to read the message from until its end
+ *  @param type        whether the message is text or binary
+ */
+- (void)sendInputStream:(NSInputStream *)inputStream type:(PSWebSocketMessageType)type;
+
+/**
+ *  Send the contents of a file as a single fragmented message. The file is
+ *  memory mapped and sent one fragment at a time as earlier fragments are
+ *  written.
+ *
+ *  @param path     path of the file to send
+ *  @param type     whether the message is text or binary
+ *  @param outError set if the file could not be mapped
+ *
+ *  @return whether the file was queued for sending
+ */
+- (BOOL)sendFileAtPath:(NSString *)path type:(PSWebSocketMessageType)type error:(NSError **)outError;
+
+/**
+ *  Hold outgoing frames until a matching uncork so a burst of sends leaves
+ *  in as few writes as possible. Calls nest, output is written once every
+ *  cork has been balanced or a bound of the flushPolicy is reached. Control
+ *  frames queued while corked are held too.
+ */
+- (void)cork;
+
+/**
+ *  Balance an earlier cork, writing held frames once the last one is
+ *  balanced. Raises if the websocket is not corked.
+ */
+- (void)uncork;
+
+/**
+ *  Write held frames now without changing the cork count.
+ */
+- (void)flush;
+
 /**
  *  Send a ping over the websocket
  *
@@ -115,6 +382,12 @@ typedef NS_ENUM(NSInteger, PSWebSocketReadyState) {
  */
 - (void)ping:(NSData *)pingData handler:(void (^)(NSData *pongData))handler;
 
+/**
+ *  Snapshot of the websocket's traffic, buffers and round trip times. Never
+ *  waits on the websocket so it is cheap to poll from any thread.
+ */
+- (PSWebSocketStatistics *)statistics;
+
 
 /**
  *  Close the websocket will default to code 1000 and nil reason
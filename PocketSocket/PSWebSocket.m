@@ -16,19 +16,162 @@
 #import "PSWebSocketInternal.h"
 #import "PSWebSocketDriver.h"
 #import "PSWebSocketBuffer.h"
+#import "PSWebSocketOutputQueue.h"
+#import "PSWebSocketStreamTransport.h"
+#import "PSWebSocketHTTPParser.h"
+#import "PSWebSocketCounters.h"
+#import "PSWebSocketTimingWheel.h"
 #import <sys/socket.h>
 #import <arpa/inet.h>
 
+static const NSUInteger PSWebSocketMinimumReadLength = 4096;
+static const NSUInteger PSWebSocketDefaultMaximumReadLength = 256 * 1024;
+static const NSUInteger PSWebSocketDefaultFragmentLength = 64 * 1024;
+static const NSUInteger PSWebSocketDefaultMaximumMessageBatchCount = 256;
+static const NSUInteger PSWebSocketDefaultMaximumMissedHeartbeats = 2;
+static const NSTimeInterval PSWebSocketCloseTimeout = 30.0;
 
-@interface PSWebSocket() <NSStreamDelegate, PSWebSocketDriverDelegate> {
+// heartbeat ping payload, our token followed by the time it was sent
+typedef struct {
+    uint32_t token;
+    CFAbsoluteTime time;
+} __attribute__((packed)) PSWebSocketHeartbeat;
+
+static void *PSWebSocketWorkQueueKey = &PSWebSocketWorkQueueKey;
+
+/**
+ *  Text or binary message sent from an input stream or mapped file one
+ *  fragment at a time. Streams are read one fragment ahead so the final
+ *  fragment can be flagged without sending an empty frame.
+ */
+@interface PSWebSocketStreamedMessage : NSObject {
+    NSInputStream *_inputStream;
+    NSData *_data;
+    NSUInteger _offset;
+    NSData *_nextFragment;
+}
+
+@property (nonatomic, assign, readonly) PSWebSocketMessageType type;
+@property (nonatomic, assign, readonly) BOOL started;
+
+- (instancetype)initWithInputStream:(NSInputStream *)inputStream type:(PSWebSocketMessageType)type;
+- (instancetype)initWithData:(NSData *)data type:(PSWebSocketMessageType)type;
+- (NSData *)nextFragmentWithLength:(NSUInteger)length final:(BOOL *)final error:(NSError *__autoreleasing *)outError;
+- (void)close;
+
+@end
+@implementation PSWebSocketStreamedMessage
+
+- (instancetype)initWithInputStream:(NSInputStream *)inputStream type:(PSWebSocketMessageType)type {
+    if((self = [super init])) {
+        _inputStream = inputStream;
+        _type = type;
+    }
+    return self;
+}
+- (instancetype)initWithData:(NSData *)data type:(PSWebSocketMessageType)type {
+    if((self = [super init])) {
+        _data = data;
+        _type = type;
+    }
+    return self;
+}
+- (NSData *)nextFragmentWithLength:(NSUInteger)length final:(BOOL *)final error:(NSError *__autoreleasing *)outError {
+    NSData *fragment = nil;
+    if(_data) {
+        NSUInteger fragmentLength = MIN(length, _data.length - _offset);
+        fragment = [_data subdataWithRange:NSMakeRange(_offset, fragmentLength)];
+        _offset += fragmentLength;
+        *final = (_offset == _data.length);
+    } else {
+        if(!_started) {
+            if(_inputStream.streamStatus == NSStreamStatusNotOpen) {
+                [_inputStream open];
+            }
+            _nextFragment = [self readLength:length error:outError];
+        }
+        fragment = _nextFragment;
+        _nextFragment = (fragment) ? [self readLength:length error:outError] : nil;
+        if(!_nextFragment) {
+            return nil;
+        }
+        *final = (_nextFragment.length == 0);
+    }
+    _started = YES;
+    if(*final) {
+        [self close];
+    }
+    return fragment;
+}
+- (NSData *)readLength:(NSUInteger)length error:(NSError *__autoreleasing *)outError {
+    NSMutableData *data = [NSMutableData dataWithLength:length];
+    NSUInteger totalLength = 0;
+    while(totalLength < length) {
+        NSInteger readLength = [_inputStream read:(uint8_t *)data.mutableBytes + totalLength maxLength:length - totalLength];
+        if(readLength < 0) {
+            if(outError) {
+                *outError = _inputStream.streamError ?: [PSWebSocketDriver errorWithCode:PSWebSocketErrorCodeUnknown reason:@"Failed to read from message stream"];
+            }
+            return nil;
+        } else if(readLength == 0) {
+            break;
+        }
+        totalLength += readLength;
+    }
+    data.length = totalLength;
+    return data;
+}
+- (void)close {
+    [_inputStream close];
+    _inputStream = nil;
+    _data = nil;
+    _nextFragment = nil;
+}
+
+@end
+
+/**
+ *  Text or binary message being deflated on a background queue, it keeps
+ *  its place among the outgoing messages until it is finished.
+ */
+@interface PSWebSocketDeflatingMessage : NSObject
+
+@property (nonatomic, strong, readonly) PSWebSocketPreparedMessage *preparedMessage;
+@property (nonatomic, assign, readonly) NSUInteger length;
+@property (nonatomic, assign, readonly) NSInteger windowBits;
+@property (nonatomic, assign) BOOL finished;
+
+/**
+ *  @param message    an instance of NSData or NSString to send
+ *  @param windowBits deflate window bits decided when it was queued, 0
+ *                    sends it uncompressed and it is finished straight away
+ */
+- (instancetype)initWithMessage:(id)message windowBits:(NSInteger)windowBits;
+
+@end
+@implementation PSWebSocketDeflatingMessage
+
+- (instancetype)initWithMessage:(id)message windowBits:(NSInteger)windowBits {
+    if((self = [super init])) {
+        _preparedMessage = [PSWebSocketPreparedMessage preparedMessageWithMessage:message];
+        _length = ([message isKindOfClass:[NSString class]]) ? [message lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : [message length];
+        _windowBits = windowBits;
+        _finished = (windowBits == 0);
+    }
+    return self;
+}
+
+@end
+
+@interface PSWebSocket() <PSWebSocketTransportDelegate, PSWebSocketDriverDelegate> {
     PSWebSocketMode _mode;
     NSMutableURLRequest *_request;
+    NSData *_handshake;
     dispatch_queue_t _workQueue;
     PSWebSocketDriver *_driver;
     PSWebSocketBuffer *_inputBuffer;
-    PSWebSocketBuffer *_outputBuffer;
-    NSInputStream *_inputStream;
-    NSOutputStream *_outputStream;
+    PSWebSocketOutputQueue *_outputQueue;
+    id <PSWebSocketTransport> _transport;
     PSWebSocketReadyState _readyState;
     BOOL _secure;
     BOOL _negotiatedSSL;
@@ -40,9 +183,48 @@
     BOOL _pumpingOutput;
     BOOL _inputPaused;
     BOOL _outputPaused;
+    NSUInteger _readLength;
+    NSUInteger _maximumReadLength;
+    NSUInteger _fragmentLength;
+    NSMutableArray *_outgoingMessages;
+    BOOL _pumpingOutgoingMessages;
+    NSUInteger _parallelCompressionLength;
+    uint64_t _framePayloadRemaining;
+    NSMutableData *_controlFrame;
+    PSWebSocketFlushPolicy *_flushPolicy;
+    NSUInteger _corkCount;
+    BOOL _outputReleased;
+    BOOL _outputFlushScheduled;
+    BOOL _writingMessage;
+    BOOL _noDelay;
+    NSMutableArray *_pendingMessages;
+    NSUInteger _maximumMessageBatchCount;
+    BOOL _callsDelegateInline;
+    NSUInteger _highWaterMark;
+    NSUInteger _lowWaterMark;
+    PSWebSocketSlowConsumerPolicy _slowConsumerPolicy;
+    BOOL _aboveHighWaterMark;
+    NSCondition *_outputCondition;
+    BOOL _sendsBlocked;
+    NSUInteger _messageTag;
+    NSUInteger _writingTag;
     NSInteger _closeCode;
     NSString *_closeReason;
     NSMutableArray *_pingHandlers;
+    NSMutableArray *_pingTimes;
+    PSWebSocketCounters *_counters;
+    NSTimeInterval _heartbeatInterval;
+    NSUInteger _maximumMissedHeartbeats;
+    PSWebSocketTimer *_heartbeatTimer;
+    uint32_t _heartbeatToken;
+    BOOL _heartbeatPending;
+    NSUInteger _missedHeartbeatCount;
+    PSWebSocketTimingWheel *_timingWheel;
+    PSWebSocketTimer *_deadlineTimer;
+    PSWebSocketTimer *_idleTimer;
+    PSWebSocketTimer *_flushTimer;
+    NSTimeInterval _idleTimeout;
+    CFAbsoluteTime _lastActivityTime;
 }
 @end
 @implementation PSWebSocket
@@ -55,6 +237,17 @@
 
 #pragma mark - Properties
 
+- (NSURLRequest *)request {
+    __block NSURLRequest *value = nil;
+    [self executeWorkAndWait:^{
+        // sockets accepted from a raw handshake only build the request on demand
+        if(!_request && _handshake) {
+            _request = [PSWebSocketHTTPRequestWithBytes(_handshake.bytes, _handshake.length) mutableCopy];
+        }
+        value = _request;
+    }];
+    return value;
+}
 - (PSWebSocketReadyState)readyState {
     __block PSWebSocketReadyState value = 0;
     [self executeWorkAndWait:^{
@@ -64,11 +257,11 @@
 }
 
 - (NSData* )remoteAddress {
-    return PSPeerAddressOfInputStream(_inputStream);
+    return _transport.remoteAddress;
 }
 
 - (NSString* )remoteHost {
-    return PSPeerHostOfInputStream(_inputStream);
+    return PSPeerHostOfAddress(_transport.remoteAddress);
 }
 
 @synthesize inputPaused = _inputPaused, outputPaused = _outputPaused;
@@ -109,17 +302,274 @@
     }];
 }
 
+- (NSUInteger)maximumReadLength {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _maximumReadLength;
+    }];
+    return result;
+}
+- (void)setMaximumReadLength:(NSUInteger)maximumReadLength {
+    [self executeWorkAndWait:^{
+        _maximumReadLength = MAX(maximumReadLength, PSWebSocketMinimumReadLength);
+        _readLength = MIN(_readLength, _maximumReadLength);
+    }];
+}
+
+- (NSUInteger)fragmentLength {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _fragmentLength;
+    }];
+    return result;
+}
+- (void)setFragmentLength:(NSUInteger)fragmentLength {
+    NSParameterAssert(fragmentLength > 0);
+    [self executeWorkAndWait:^{
+        _fragmentLength = fragmentLength;
+    }];
+}
+- (NSUInteger)parallelCompressionLength {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _parallelCompressionLength;
+    }];
+    return result;
+}
+- (void)setParallelCompressionLength:(NSUInteger)parallelCompressionLength {
+    [self executeWorkAndWait:^{
+        _parallelCompressionLength = parallelCompressionLength;
+    }];
+}
+- (BOOL)streamsMessages {
+    __block BOOL result;
+    [self executeWorkAndWait:^{
+        result = _driver.streamsMessages;
+    }];
+    return result;
+}
+- (void)setStreamsMessages:(BOOL)streamsMessages {
+    [self executeWorkAndWait:^{
+        _driver.streamsMessages = streamsMessages;
+    }];
+}
+- (PSWebSocketMessageDelivery)messageDelivery {
+    __block PSWebSocketMessageDelivery result;
+    [self executeWorkAndWait:^{
+        result = _driver.messageDelivery;
+    }];
+    return result;
+}
+- (void)setMessageDelivery:(PSWebSocketMessageDelivery)messageDelivery {
+    [self executeWorkAndWait:^{
+        _driver.messageDelivery = messageDelivery;
+    }];
+}
+- (PSWebSocketCompressionPolicy *)compressionPolicy {
+    __block PSWebSocketCompressionPolicy *result;
+    [self executeWorkAndWait:^{
+        result = [_driver.compressionPolicy copy];
+    }];
+    return result;
+}
+- (void)setCompressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy {
+    [self executeWorkAndWait:^{
+        _driver.compressionPolicy = compressionPolicy;
+    }];
+}
+- (PSWebSocketLimits *)limits {
+    __block PSWebSocketLimits *result;
+    [self executeWorkAndWait:^{
+        result = [_driver.limits copy];
+    }];
+    return result;
+}
+- (void)setLimits:(PSWebSocketLimits *)limits {
+    [self executeWorkAndWait:^{
+        _driver.limits = limits;
+    }];
+}
+- (NSUInteger)maximumMessageBatchCount {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _maximumMessageBatchCount;
+    }];
+    return result;
+}
+- (void)setMaximumMessageBatchCount:(NSUInteger)maximumMessageBatchCount {
+    NSParameterAssert(maximumMessageBatchCount > 0);
+    [self executeWorkAndWait:^{
+        _maximumMessageBatchCount = maximumMessageBatchCount;
+    }];
+}
+- (BOOL)callsDelegateInline {
+    __block BOOL result;
+    [self executeWorkAndWait:^{
+        result = _callsDelegateInline;
+    }];
+    return result;
+}
+- (void)setCallsDelegateInline:(BOOL)callsDelegateInline {
+    [self executeWorkAndWait:^{
+        _callsDelegateInline = callsDelegateInline;
+    }];
+}
+- (NSUInteger)bufferedAmount {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _outputQueue.bytesAvailable;
+    }];
+    return result;
+}
+- (NSUInteger)highWaterMark {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _highWaterMark;
+    }];
+    return result;
+}
+- (void)setHighWaterMark:(NSUInteger)highWaterMark {
+    [self executeWorkAndWait:^{
+        _highWaterMark = highWaterMark;
+        [self updateWaterMarks];
+    }];
+}
+- (NSUInteger)lowWaterMark {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _lowWaterMark;
+    }];
+    return result;
+}
+- (void)setLowWaterMark:(NSUInteger)lowWaterMark {
+    [self executeWorkAndWait:^{
+        _lowWaterMark = lowWaterMark;
+        [self updateWaterMarks];
+    }];
+}
+- (PSWebSocketSlowConsumerPolicy)slowConsumerPolicy {
+    __block PSWebSocketSlowConsumerPolicy result;
+    [self executeWorkAndWait:^{
+        result = _slowConsumerPolicy;
+    }];
+    return result;
+}
+- (void)setSlowConsumerPolicy:(PSWebSocketSlowConsumerPolicy)slowConsumerPolicy {
+    [self executeWorkAndWait:^{
+        _slowConsumerPolicy = slowConsumerPolicy;
+        [self setSendsBlocked:(_aboveHighWaterMark && _slowConsumerPolicy == PSWebSocketSlowConsumerPolicyBlock)];
+    }];
+}
+- (NSTimeInterval)heartbeatInterval {
+    __block NSTimeInterval result;
+    [self executeWorkAndWait:^{
+        result = _heartbeatInterval;
+    }];
+    return result;
+}
+- (void)setHeartbeatInterval:(NSTimeInterval)heartbeatInterval {
+    [self executeWorkAndWait:^{
+        _heartbeatInterval = heartbeatInterval;
+        if(_readyState == PSWebSocketReadyStateOpen) {
+            [self startHeartbeat];
+        }
+    }];
+}
+- (NSUInteger)maximumMissedHeartbeats {
+    __block NSUInteger result;
+    [self executeWorkAndWait:^{
+        result = _maximumMissedHeartbeats;
+    }];
+    return result;
+}
+- (void)setMaximumMissedHeartbeats:(NSUInteger)maximumMissedHeartbeats {
+    NSParameterAssert(maximumMissedHeartbeats > 0);
+    [self executeWorkAndWait:^{
+        _maximumMissedHeartbeats = maximumMissedHeartbeats;
+    }];
+}
+- (NSTimeInterval)idleTimeout {
+    __block NSTimeInterval result;
+    [self executeWorkAndWait:^{
+        result = _idleTimeout;
+    }];
+    return result;
+}
+- (void)setIdleTimeout:(NSTimeInterval)idleTimeout {
+    [self executeWorkAndWait:^{
+        _idleTimeout = idleTimeout;
+        if(_readyState == PSWebSocketReadyStateOpen) {
+            [self startIdleTimer];
+        }
+    }];
+}
+- (PSWebSocketTimingWheel *)timingWheel {
+    __block PSWebSocketTimingWheel *result;
+    [self executeWorkAndWait:^{
+        result = _timingWheel;
+    }];
+    return result;
+}
+- (void)setTimingWheel:(PSWebSocketTimingWheel *)timingWheel {
+    [self executeWorkAndWait:^{
+        if(_opened) {
+            [NSException raise:@"Invalid State" format:@"The timing wheel can only be changed before opening"];
+            return;
+        }
+        _timingWheel = timingWheel ?: [PSWebSocketTimingWheel sharedWheel];
+    }];
+}
+- (PSWebSocketStatistics *)statistics {
+    // counters are atomic so the snapshot never waits on the work queue
+    return [[PSWebSocketStatistics alloc] initWithCounters:_counters];
+}
+- (PSWebSocketFlushPolicy *)flushPolicy {
+    __block PSWebSocketFlushPolicy *result;
+    [self executeWorkAndWait:^{
+        result = [_flushPolicy copy];
+    }];
+    return result;
+}
+- (void)setFlushPolicy:(PSWebSocketFlushPolicy *)flushPolicy {
+    NSParameterAssert(flushPolicy);
+    flushPolicy = [flushPolicy copy];
+    [self executeWorkAndWait:^{
+        _flushPolicy = flushPolicy;
+        [self pumpOutput];
+    }];
+}
+- (BOOL)noDelay {
+    __block BOOL result;
+    [self executeWorkAndWait:^{
+        result = _noDelay;
+    }];
+    return result;
+}
+- (void)setNoDelay:(BOOL)noDelay {
+    [self executeWorkAndWait:^{
+        _noDelay = noDelay;
+        [self applyNoDelay];
+    }];
+}
+
 #pragma mark - Initialization
 
 - (instancetype)initWithMode:(PSWebSocketMode)mode request:(NSURLRequest *)request {
+    return [self initWithMode:mode request:request handshake:nil];
+}
+- (instancetype)initWithMode:(PSWebSocketMode)mode request:(NSURLRequest *)request handshake:(NSData *)handshake {
     if((self = [super init])) {
         _mode = mode;
         _request = [request mutableCopy];
+        _handshake = [handshake copy];
         _readyState = PSWebSocketReadyStateConnecting;
-        NSString* name = [NSString stringWithFormat: @"PSWebSocket <%@>", request.URL];
+        NSString* name = [NSString stringWithFormat: @"PSWebSocket <%@>", (request) ? request.URL : @"handshake"];
         _workQueue = dispatch_queue_create(name.UTF8String, nil);
+        dispatch_queue_set_specific(_workQueue, PSWebSocketWorkQueueKey, (__bridge void *)self, NULL);
         if(_mode == PSWebSocketModeClient) {
             _driver = [PSWebSocketDriver clientDriverWithRequest:_request];
+        } else if(_handshake) {
+            _driver = [PSWebSocketDriver serverDriverWithHandshake:_handshake];
         } else {
             _driver = [PSWebSocketDriver serverDriverWithRequest:_request];
         }
@@ -132,11 +582,71 @@
         _failed = NO;
         _pumpingInput = NO;
         _pumpingOutput = NO;
+        _readLength = PSWebSocketMinimumReadLength;
+        _maximumReadLength = PSWebSocketDefaultMaximumReadLength;
+        _fragmentLength = PSWebSocketDefaultFragmentLength;
+        _outgoingMessages = [NSMutableArray array];
+        _parallelCompressionLength = 0;
+        _framePayloadRemaining = 0;
+        _flushPolicy = [PSWebSocketFlushPolicy defaultPolicy];
+        _corkCount = 0;
+        _outputReleased = NO;
+        _outputFlushScheduled = NO;
+        _writingMessage = NO;
+        _noDelay = YES;
+        _pendingMessages = [NSMutableArray array];
+        _maximumMessageBatchCount = PSWebSocketDefaultMaximumMessageBatchCount;
+        _callsDelegateInline = NO;
+        _highWaterMark = 0;
+        _lowWaterMark = 0;
+        _slowConsumerPolicy = PSWebSocketSlowConsumerPolicyQueue;
+        _aboveHighWaterMark = NO;
+        _outputCondition = [[NSCondition alloc] init];
+        _sendsBlocked = NO;
+        _messageTag = 0;
+        _writingTag = 0;
         _closeCode = 0;
         _closeReason = nil;
         _pingHandlers = [NSMutableArray array];
+        _pingTimes = [NSMutableArray array];
+        _counters = _driver.counters;
+        _heartbeatInterval = 0.0;
+        _maximumMissedHeartbeats = PSWebSocketDefaultMaximumMissedHeartbeats;
+        _heartbeatToken = arc4random();
+        _heartbeatPending = NO;
+        _missedHeartbeatCount = 0;
+        _timingWheel = [PSWebSocketTimingWheel sharedWheel];
+        _idleTimeout = 0.0;
+        _lastActivityTime = 0.0;
+        
+        // timers fire on the wheel's queue and hop onto the work queue
+        __weak typeof(self)weakSelf = self;
+        _heartbeatTimer = [PSWebSocketTimer timerWithHandler:^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            [strongSelf executeWork:^{
+                [strongSelf sendHeartbeat];
+            }];
+        }];
+        _deadlineTimer = [PSWebSocketTimer timerWithHandler:^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            [strongSelf executeWork:^{
+                [strongSelf deadlineExpired];
+            }];
+        }];
+        _idleTimer = [PSWebSocketTimer timerWithHandler:^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            [strongSelf executeWork:^{
+                [strongSelf idleTimerExpired];
+            }];
+        }];
+        _flushTimer = [PSWebSocketTimer timerWithHandler:^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            [strongSelf executeWork:^{
+                [strongSelf flushTimerExpired];
+            }];
+        }];
         _inputBuffer = [[PSWebSocketBuffer alloc] init];
-        _outputBuffer = [[PSWebSocketBuffer alloc] init];
+        _outputQueue = [[PSWebSocketOutputQueue alloc] init];
         if(_request.HTTPBody.length > 0) {
             [_inputBuffer appendData:_request.HTTPBody];
             _request.HTTPBody = nil;
@@ -188,24 +698,49 @@
             break;
         }
         
-        _inputStream = CFBridgingRelease(readStream);
-        _outputStream = CFBridgingRelease(writeStream);
+        NSInputStream *inputStream = CFBridgingRelease(readStream);
+        NSOutputStream *outputStream = CFBridgingRelease(writeStream);
         
         if (networkServiceType != nil) {
-            [_inputStream setProperty:networkServiceType forKey:NSStreamNetworkServiceType];
-            [_outputStream setProperty:networkServiceType forKey:NSStreamNetworkServiceType];
+            [inputStream setProperty:networkServiceType forKey:NSStreamNetworkServiceType];
+            [outputStream setProperty:networkServiceType forKey:NSStreamNetworkServiceType];
         }
+        
+        _transport = [PSWebSocketStreamTransport transportWithInputStream:inputStream outputStream:outputStream];
     }
     return self;
 }
 
++ (instancetype)clientSocketWithRequest:(NSURLRequest *)request transport:(id <PSWebSocketTransport>)transport {
+    return [[self alloc] initWithMode:PSWebSocketModeClient request:request transport:transport];
+}
+
 + (instancetype)serverSocketWithRequest:(NSURLRequest *)request inputStream:(NSInputStream *)inputStream outputStream:(NSOutputStream *)outputStream {
     return [[self alloc] initServerWithRequest:request inputStream:inputStream outputStream:outputStream];
 }
 - (instancetype)initServerWithRequest:(NSURLRequest *)request inputStream:(NSInputStream *)inputStream outputStream:(NSOutputStream *)outputStream {
-    if((self = [self initWithMode:PSWebSocketModeServer request:request])) {
-        _inputStream = inputStream;
-        _outputStream = outputStream;
+    id <PSWebSocketTransport> transport = [PSWebSocketStreamTransport transportWithInputStream:inputStream outputStream:outputStream];
+    return [self initWithMode:PSWebSocketModeServer request:request transport:transport];
+}
+
++ (instancetype)serverSocketWithRequest:(NSURLRequest *)request transport:(id <PSWebSocketTransport>)transport {
+    return [[self alloc] initWithMode:PSWebSocketModeServer request:request transport:transport];
+}
++ (instancetype)serverSocketWithHandshake:(NSData *)handshake transport:(id <PSWebSocketTransport>)transport {
+    return [[self alloc] initServerWithHandshake:handshake transport:transport];
+}
+- (instancetype)initServerWithHandshake:(NSData *)handshake transport:(id <PSWebSocketTransport>)transport {
+    NSParameterAssert(handshake);
+    NSParameterAssert(transport);
+    if((self = [self initWithMode:PSWebSocketModeServer request:nil handshake:handshake])) {
+        _transport = transport;
+    }
+    return self;
+}
+- (instancetype)initWithMode:(PSWebSocketMode)mode request:(NSURLRequest *)request transport:(id <PSWebSocketTransport>)transport {
+    NSParameterAssert(transport);
+    if((self = [self initWithMode:mode request:request])) {
+        _transport = transport;
     }
     return self;
 }
@@ -227,25 +762,81 @@
 }
 - (void)send:(id)message {
     NSParameterAssert(message);
+    // queued output references the message bytes, immutable messages are not copied
+    message = [message copy];
+    [self waitUntilSendsUnblocked];
     [self executeWork:^{
-        if(!_opened || _readyState == PSWebSocketReadyStateConnecting) {
-            [NSException raise:@"Invalid State" format:@"You cannot send a PSWebSocket messages before it is finished opening."];
+        [self enqueueMessage:message];
+    }];
+}
+- (void)sendMessages:(NSArray *)messages {
+    NSParameterAssert(messages);
+    NSMutableArray *copiedMessages = [NSMutableArray arrayWithCapacity:messages.count];
+    for(id message in messages) {
+        [copiedMessages addObject:[message copy]];
+    }
+    [self waitUntilSendsUnblocked];
+    [self executeWork:^{
+        ++_corkCount;
+        for(id message in copiedMessages) {
+            [self enqueueMessage:message];
+        }
+        --_corkCount;
+        if(_corkCount == 0) {
+            [self flushOutput];
+        }
+    }];
+}
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message {
+    NSParameterAssert(message);
+    [self waitUntilSendsUnblocked];
+    [self executeWork:^{
+        [self enqueueMessage:message];
+    }];
+}
+- (void)sendInputStream:(NSInputStream *)inputStream type:(PSWebSocketMessageType)type {
+    NSParameterAssert(inputStream);
+    PSWebSocketStreamedMessage *message = [[PSWebSocketStreamedMessage alloc] initWithInputStream:inputStream type:type];
+    [self sendStreamedMessage:message];
+}
+- (BOOL)sendFileAtPath:(NSString *)path type:(PSWebSocketMessageType)type error:(NSError *__autoreleasing *)outError {
+    NSParameterAssert(path);
+    NSData *data = [NSData dataWithContentsOfFile:path options:NSDataReadingMappedAlways error:outError];
+    if(!data) {
+        return NO;
+    }
+    PSWebSocketStreamedMessage *message = [[PSWebSocketStreamedMessage alloc] initWithData:data type:type];
+    [self sendStreamedMessage:message];
+    return YES;
+}
+- (void)cork {
+    [self executeWork:^{
+        ++_corkCount;
+    }];
+}
+- (void)uncork {
+    [self executeWork:^{
+        if(_corkCount == 0) {
+            [NSException raise:@"Invalid State" format:@"You cannot uncork a PSWebSocket that is not corked."];
             return;
         }
-        
-        if([message isKindOfClass:[NSString class]]) {
-            [_driver sendText:message];
-        } else if([message isKindOfClass:[NSData class]]) {
-            [_driver sendBinary:message];
-        } else {
-            [NSException raise:@"Invalid Message" format:@"Messages must be instances of NSString or NSData"];
+        --_corkCount;
+        if(_corkCount == 0) {
+            [self flushOutput];
         }
     }];
 }
+- (void)flush {
+    [self executeWork:^{
+        [self flushOutput];
+    }];
+}
 - (void)ping:(NSData *)pingData handler:(void (^)(NSData *pongData))handler {
+    pingData = [pingData copy];
     [self executeWork:^{
         if(handler) {
             [_pingHandlers addObject:handler];
+            [_pingTimes addObject:@(CFAbsoluteTimeGetCurrent())];
         }
         [_driver sendPing:pingData];
     }];
@@ -255,36 +846,7 @@
 }
 - (void)closeWithCode:(NSInteger)code reason:(NSString *)reason {
     [self executeWork:^{
-        // already closing so lets exit
-        if(_readyState >= PSWebSocketReadyStateClosing) {
-            return;
-        }
-        
-        BOOL connecting = (_readyState == PSWebSocketReadyStateConnecting);
-        _readyState = PSWebSocketReadyStateClosing;
-        
-        // send close code if we're not connecting
-        if(!connecting) {
-            _closeCode = code;
-            [_driver sendCloseCode:code reason:reason];
-        }
-        
-        // disconnect gracefully
-        [self disconnectGracefully];
-        
-        // disconnect hard in 30 seconds
-        __weak typeof(self)weakSelf = self;
-        dispatch_after(dispatch_walltime(DISPATCH_TIME_NOW, 30 * NSEC_PER_SEC), dispatch_get_main_queue(), ^{
-            __strong typeof(weakSelf)strongSelf = weakSelf;
-            if(!strongSelf) return;
-            
-            [strongSelf executeWork:^{
-                if(strongSelf->_readyState >= PSWebSocketReadyStateClosed) {
-                    return;
-                }
-                [strongSelf disconnect];
-            }];
-        });
+        [self beginClosingWithCode:code reason:reason];
     }];
 }
 
@@ -293,7 +855,12 @@
 - (CFTypeRef)copyStreamPropertyForKey:(NSString *)key {
     __block CFTypeRef result;
     [self executeWorkAndWait:^{
-        result = CFWriteStreamCopyProperty((__bridge CFWriteStreamRef)_outputStream, (__bridge CFStringRef)key);
+        if([_transport isKindOfClass:[PSWebSocketStreamTransport class]]) {
+            NSOutputStream *outputStream = [(PSWebSocketStreamTransport *)_transport outputStream];
+            result = CFWriteStreamCopyProperty((__bridge CFWriteStreamRef)outputStream, (__bridge CFStringRef)key);
+        } else {
+            result = NULL;
+        }
     }];
     return result;
 }
@@ -303,7 +870,12 @@
             [NSException raise:@"Invalid State" format:@"You cannot set stream properties on a PSWebSocket once it is opened."];
             return;
         }
-        CFWriteStreamSetProperty((__bridge CFWriteStreamRef)_outputStream, (__bridge CFStringRef)key, (CFTypeRef)property);
+        if(![_transport isKindOfClass:[PSWebSocketStreamTransport class]]) {
+            [NSException raise:@"Invalid State" format:@"You cannot set stream properties on a PSWebSocket that is not backed by streams."];
+            return;
+        }
+        NSOutputStream *outputStream = [(PSWebSocketStreamTransport *)_transport outputStream];
+        CFWriteStreamSetProperty((__bridge CFWriteStreamRef)outputStream, (__bridge CFStringRef)key, (CFTypeRef)property);
     }];
 }
 
@@ -311,6 +883,10 @@
 
 - (void)connect {
     if(_secure && _mode == PSWebSocketModeClient) {
+        if(![_transport isKindOfClass:[PSWebSocketStreamTransport class]]) {
+            [NSException raise:@"Invalid State" format:@"Secure PSWebSocket connections require a stream backed transport."];
+            return;
+        }
         
         __block BOOL customTrustEvaluation = NO;
         [self executeDelegateAndWait:^{
@@ -323,27 +899,21 @@
         ssl[(__bridge id)kCFStreamSSLIsServer] = @NO;
         
         _negotiatedSSL = !customTrustEvaluation;
-        [_inputStream setProperty:ssl forKey:(__bridge id)kCFStreamPropertySSLSettings];
+        [[(PSWebSocketStreamTransport *)_transport inputStream] setProperty:ssl forKey:(__bridge id)kCFStreamPropertySSLSettings];
     }
 
     // delegate
-    _inputStream.delegate = self;
-    _outputStream.delegate = self;
+    _transport.delegate = self;
     
     // driver
     [_driver start];
     
-    // schedule streams
-    CFReadStreamSetDispatchQueue((__bridge CFReadStreamRef)_inputStream, _workQueue);
-    CFWriteStreamSetDispatchQueue((__bridge CFWriteStreamRef)_outputStream, _workQueue);
+    // schedule transport
+    [_transport scheduleOnQueue:_workQueue];
 
-    // open streams
-    if(_inputStream.streamStatus == NSStreamStatusNotOpen) {
-        [_inputStream open];
-    }
-    if(_outputStream.streamStatus == NSStreamStatusNotOpen) {
-        [_outputStream open];
-    }
+    // open transport
+    [_transport open];
+    [self applyNoDelay];
     
     // pump
     [self pumpInput];
@@ -351,41 +921,151 @@
     
     // prepare timeout
     if(_request.timeoutInterval > 0.0) {
-        __weak typeof(self)weakSelf = self;
-        dispatch_after(dispatch_time(DISPATCH_TIME_NOW, (int64_t)(_request.timeoutInterval * NSEC_PER_SEC)), dispatch_get_main_queue(), ^{
-            __strong typeof(weakSelf)strongSelf = weakSelf;
-            if(strongSelf) {
-                [strongSelf executeWork:^{
-                    if(strongSelf->_readyState == PSWebSocketReadyStateConnecting) {
-                        [strongSelf failWithCode:PSWebSocketErrorCodeTimedOut reason:@"Timed out."];
-                    }
-                }];
-            }
-        });
+        [_timingWheel armTimer:_deadlineTimer interval:_request.timeoutInterval];
     }
 }
+- (void)beginClosingWithCode:(NSInteger)code reason:(NSString *)reason {
+    // already closing so lets exit
+    if(_readyState >= PSWebSocketReadyStateClosing) {
+        return;
+    }
+    
+    BOOL connecting = (_readyState == PSWebSocketReadyStateConnecting);
+    _readyState = PSWebSocketReadyStateClosing;
+    
+    // send close code if we're not connecting
+    if(!connecting) {
+        _closeCode = code;
+        [_driver sendCloseCode:code reason:reason];
+    }
+    
+    // disconnect hard in 30 seconds, replacing any connect timeout
+    [_timingWheel armTimer:_deadlineTimer interval:PSWebSocketCloseTimeout];
+    
+    // disconnect gracefully
+    [self disconnectGracefully];
+}
 - (void)disconnectGracefully {
     _closeWhenFinishedOutput = YES;
+    [self cancelOutgoingMessages];
     [self pumpOutput];
 }
 - (void)disconnect {
-    _inputStream.delegate = nil;
-    _outputStream.delegate = nil;
+    [self cancelOutgoingMessages];
+    [self setSendsBlocked:NO];
+    [self stopHeartbeat];
+    [_timingWheel cancelTimer:_deadlineTimer];
+    [_timingWheel cancelTimer:_idleTimer];
+    [_timingWheel cancelTimer:_flushTimer];
+    _outputFlushScheduled = NO;
     
-    [_inputStream close];
-    [_outputStream close];
+    _transport.delegate = nil;
+    [_transport scheduleOnQueue:NULL];
+    [_transport close];
+    _transport = nil;
+}
+- (void)applyNoDelay {
+    if([_transport respondsToSelector:@selector(setNoDelay:)]) {
+        [_transport setNoDelay:_noDelay];
+    }
+}
+
+#pragma mark - Heartbeat
+
+- (void)startHeartbeat {
+    [self stopHeartbeat];
+    if(_heartbeatInterval <= 0.0) {
+        return;
+    }
+    _heartbeatPending = NO;
+    _missedHeartbeatCount = 0;
+    [_timingWheel armTimer:_heartbeatTimer interval:_heartbeatInterval];
+}
+- (void)stopHeartbeat {
+    [_timingWheel cancelTimer:_heartbeatTimer];
+}
+- (void)sendHeartbeat {
+    if(_readyState != PSWebSocketReadyStateOpen || _heartbeatInterval <= 0.0) {
+        [self stopHeartbeat];
+        return;
+    }
     
-    _inputStream = nil;
-    _outputStream = nil;
+    // peers may answer only the latest of several pings, so a heartbeat is
+    // missed when it is still unanswered as the next one is due
+    if(_heartbeatPending) {
+        ++_missedHeartbeatCount;
+        PSWebSocketCounterAdd(&_counters->missedHeartbeats, 1);
+        if(_missedHeartbeatCount >= _maximumMissedHeartbeats) {
+            [self stopHeartbeat];
+            [self failWithCode:PSWebSocketErrorCodeTimedOut reason:@"Heartbeat timed out."];
+            return;
+        }
+    }
+    
+    PSWebSocketHeartbeat heartbeat = {_heartbeatToken, CFAbsoluteTimeGetCurrent()};
+    _heartbeatPending = YES;
+    [_driver sendPing:[NSData dataWithBytes:&heartbeat length:sizeof(heartbeat)]];
+    [_timingWheel armTimer:_heartbeatTimer interval:_heartbeatInterval];
+}
+- (BOOL)receiveHeartbeat:(NSData *)pong {
+    PSWebSocketHeartbeat heartbeat;
+    if(pong.length != sizeof(heartbeat)) {
+        return NO;
+    }
+    memcpy(&heartbeat, pong.bytes, sizeof(heartbeat));
+    if(heartbeat.token != _heartbeatToken) {
+        return NO;
+    }
+    _heartbeatPending = NO;
+    _missedHeartbeatCount = 0;
+    [self recordRoundTripTime:CFAbsoluteTimeGetCurrent() - heartbeat.time];
+    return YES;
+}
+- (void)recordRoundTripTime:(NSTimeInterval)roundTripTime {
+    PSWebSocketHistogramRecord(&_counters->roundTripTimes, roundTripTime);
+    [self notifyDelegateDidMeasureRoundTripTime:roundTripTime];
+}
+
+#pragma mark - Timers
+
+- (void)deadlineExpired {
+    // the same timer is the connect timeout and later the close deadline
+    if(_readyState == PSWebSocketReadyStateConnecting) {
+        [self failWithCode:PSWebSocketErrorCodeTimedOut reason:@"Timed out."];
+    } else if(_readyState == PSWebSocketReadyStateClosing) {
+        [self disconnect];
+    }
+}
+- (void)startIdleTimer {
+    [_timingWheel cancelTimer:_idleTimer];
+    if(_idleTimeout <= 0.0) {
+        return;
+    }
+    _lastActivityTime = CFAbsoluteTimeGetCurrent();
+    [_timingWheel armTimer:_idleTimer interval:_idleTimeout];
+}
+- (void)idleTimerExpired {
+    if(_readyState != PSWebSocketReadyStateOpen || _idleTimeout <= 0.0) {
+        return;
+    }
+    
+    // traffic only stamps the time, the timer is moved lazily when it fires
+    NSTimeInterval remaining = _idleTimeout - (CFAbsoluteTimeGetCurrent() - _lastActivityTime);
+    if(remaining > 0.0) {
+        [_timingWheel armTimer:_idleTimer interval:remaining];
+        return;
+    }
+    [self failWithCode:PSWebSocketErrorCodeTimedOut reason:@"Idle timed out."];
 }
 
 #pragma mark - SSL
 
-- (void)negotiateSSL:(NSStream *)stream {
+- (void)negotiateSSL {
     if (_negotiatedSSL) {
         return;
     }
     
+    NSInputStream *stream = [(PSWebSocketStreamTransport *)_transport inputStream];
     SecTrustRef trust = (__bridge SecTrustRef)[stream propertyForKey:(__bridge id)kCFStreamPropertySSLPeerTrust];
     BOOL accept = [self askDelegateToEvaluateServerTrust:trust];
     if(accept) {
@@ -407,58 +1087,91 @@
     if(_readyState >= PSWebSocketReadyStateClosing ||
        _pumpingInput ||
        _inputPaused ||
-       !_inputStream.hasBytesAvailable) {
+       !_transport.hasBytesAvailable) {
         return;
     }
 
     _pumpingInput = YES;
+    BOOL filledReadLength = NO;
     @autoreleasepool {
-        uint8_t chunkBuffer[4096];
-        NSInteger readLength = [_inputStream read:chunkBuffer maxLength:sizeof(chunkBuffer)];
-        if(readLength > 0) {
-            if(!_inputBuffer.hasBytesAvailable) {
-                NSInteger consumedLength = [_driver execute:chunkBuffer maxLength:readLength];
-                if(consumedLength < readLength) {
-                    NSInteger offset = MAX(0, consumedLength);
-                    NSInteger remaining = readLength - offset;
-                    [_inputBuffer appendBytes:chunkBuffer + offset length:remaining];
-                }
-            } else {
-                [_inputBuffer appendBytes:chunkBuffer length:readLength];
+        // read straight into the input buffer, growing the amount read per
+        // event while the transport keeps filling it and shrinking when it doesn't
+        NSUInteger totalLength = 0;
+        while(totalLength < _readLength) {
+            NSUInteger reservedLength = 0;
+            uint8_t *bytes = [_inputBuffer reserveBytes:&reservedLength];
+            reservedLength = MIN(reservedLength, _readLength - totalLength);
+            NSInteger readLength = [_transport read:bytes maxLength:reservedLength];
+            [_inputBuffer commitLength:MAX(readLength, 0)];
+            if(readLength < 0) {
+                [self failWithError:_transport.error];
+                break;
+            }
+            totalLength += readLength;
+            PSWebSocketCounterAdd(&_counters->bytesReceived, readLength);
+            if((NSUInteger)readLength < reservedLength || !_transport.hasBytesAvailable) {
+                break;
             }
-        } else if(readLength < 0) {
-            [self failWithError:_inputStream.streamError];
+        }
+        if(totalLength > 0) {
+            _lastActivityTime = CFAbsoluteTimeGetCurrent();
+        }
+        filledReadLength = (totalLength >= _readLength);
+        if(filledReadLength) {
+            _readLength = MIN(_readLength * 2, _maximumReadLength);
+        } else if(totalLength < _readLength / 4) {
+            _readLength = MAX(_readLength / 2, PSWebSocketMinimumReadLength);
         }
 
         while(_inputBuffer.hasBytesAvailable) {
-            NSInteger readLength = [_driver execute:_inputBuffer.mutableBytes maxLength:_inputBuffer.bytesAvailable];
-            if(readLength <= 0) {
+            NSUInteger contiguousLength = _inputBuffer.contiguousBytesAvailable;
+            NSInteger readLength = [_driver execute:_inputBuffer.mutableBytes maxLength:contiguousLength];
+            if(readLength > 0) {
+                [_inputBuffer consumeLength:readLength];
+                continue;
+            }
+            if(readLength < 0 || contiguousLength == _inputBuffer.bytesAvailable) {
                 break;
             }
-            _inputBuffer.offset += readLength;
+            
+            // driver needs bytes that straddle a segment boundary
+            [_inputBuffer makeContiguous:contiguousLength * 2];
         }
-
-        [_inputBuffer compact];
+        PSWebSocketCounterSet(&_counters->inputBufferLength, _inputBuffer.bytesAvailable);
+        
+        // hand everything this read produced to the delegate at once
+        [self deliverPendingMessages];
         
         if(_readyState == PSWebSocketReadyStateOpen &&
-           !_inputStream.hasBytesAvailable &&
+           !_transport.hasBytesAvailable &&
            !_inputBuffer.hasBytesAvailable) {
             [self notifyDelegateDidFlushInput];
         }
     }
     _pumpingInput = NO;
+    
+    // stopping at _readLength leaves bytes in the socket that an edge
+    // triggered transport will not signal again, come back for them once
+    // whatever else is queued has run
+    if(filledReadLength && _transport.hasBytesAvailable) {
+        __weak typeof(self)weakSelf = self;
+        [self executeWork:^{
+            [weakSelf pumpInput];
+        }];
+    }
 }
 
 - (void)pumpOutput {
     if(_pumpingInput ||
-       _outputPaused) {
+       _outputPaused ||
+       [self holdsOutput]) {
         return;
     }
     
     _pumpingOutput = YES;
     do {
-        while(_outputStream.hasSpaceAvailable && _outputBuffer.hasBytesAvailable) {
-            NSInteger writeLength = [_outputStream write:_outputBuffer.bytes maxLength:_outputBuffer.bytesAvailable];
+        while(_transport.hasSpaceAvailable && _outputQueue.hasBytesAvailable) {
+            NSInteger writeLength = [_outputQueue writeToTransport:_transport];
             if(writeLength <= -1) {
                 _failed = YES;
                 [self disconnect];
@@ -467,12 +1180,24 @@
                 [self notifyDelegateDidFailWithError:error];
                 return;
             }
-            _outputBuffer.offset += writeLength;
+            PSWebSocketCounterAdd(&_counters->bytesSent, writeLength);
+            if(writeLength > 0) {
+                _lastActivityTime = CFAbsoluteTimeGetCurrent();
+            }
         }
+        
+        // refill from queued messages once everything before them is written
+        if(_transport.hasSpaceAvailable &&
+           !_outputQueue.hasBytesAvailable &&
+           [self hasOutgoingMessageReady]) {
+            [self pumpOutgoingMessages];
+            continue;
+        }
+        
         if(_closeWhenFinishedOutput &&
-           !_outputBuffer.hasBytesAvailable &&
-           (_inputStream.streamStatus != NSStreamStatusNotOpen &&
-            _inputStream.streamStatus != NSStreamStatusClosed) &&
+           !_outputQueue.hasBytesAvailable &&
+           (_transport.status != NSStreamStatusNotOpen &&
+            _transport.status != NSStreamStatusClosed) &&
            !_sentClose) {
             _sentClose = YES;
             
@@ -482,17 +1207,257 @@
                 [self notifyDelegateDidCloseWithCode:_closeCode reason:_closeReason wasClean:YES];
             }
         }
-        
-        [_outputBuffer compact];
 
         if(_readyState == PSWebSocketReadyStateOpen &&
-           _outputStream.hasSpaceAvailable &&
-           !_outputBuffer.hasBytesAvailable) {
+           _transport.hasSpaceAvailable &&
+           !_outputQueue.hasBytesAvailable &&
+           _outgoingMessages.count == 0) {
             [self notifyDelegateDidFlushOutput];
         }
         
-    } while (_outputStream.hasSpaceAvailable && _outputBuffer.hasBytesAvailable);
+    } while (_transport.hasSpaceAvailable &&
+             (_outputQueue.hasBytesAvailable || [self hasOutgoingMessageReady]));
     _pumpingOutput = NO;
+    
+    // frames queued from now on are held again
+    if(!_outputQueue.hasBytesAvailable) {
+        _outputReleased = NO;
+    }
+    
+    [self updateWaterMarks];
+}
+
+#pragma mark - Backpressure
+
+- (void)updateWaterMarks {
+    PSWebSocketCounterSet(&_counters->outputBufferLength, _outputQueue.bytesAvailable);
+    if(_highWaterMark == 0) {
+        if(_aboveHighWaterMark) {
+            _aboveHighWaterMark = NO;
+            [self setSendsBlocked:NO];
+        }
+        return;
+    }
+    
+    // dropping the oldest messages keeps output below the mark instead
+    if(_slowConsumerPolicy == PSWebSocketSlowConsumerPolicyDropOldest) {
+        while(_outputQueue.bytesAvailable >= _highWaterMark && [_outputQueue dropOldestTaggedData] > 0);
+    }
+    
+    NSUInteger bufferedAmount = _outputQueue.bytesAvailable;
+    if(!_aboveHighWaterMark && bufferedAmount >= _highWaterMark) {
+        _aboveHighWaterMark = YES;
+        [self notifyDelegateDidReachHighWaterMark];
+        if(_slowConsumerPolicy == PSWebSocketSlowConsumerPolicyBlock) {
+            [self setSendsBlocked:YES];
+        } else if(_slowConsumerPolicy == PSWebSocketSlowConsumerPolicyDisconnect) {
+            [self disconnectSlowConsumer];
+        }
+    } else if(_aboveHighWaterMark && bufferedAmount <= _lowWaterMark) {
+        _aboveHighWaterMark = NO;
+        [self setSendsBlocked:NO];
+        [self notifyDelegateDidDrainToLowWaterMark];
+    }
+}
+- (void)disconnectSlowConsumer {
+    if(_readyState != PSWebSocketReadyStateOpen) {
+        return;
+    }
+    // the close frame should not wait behind messages the peer is not reading
+    while([_outputQueue dropOldestTaggedData] > 0);
+    [self beginClosingWithCode:PSWebSocketStatusCodePolicyViolated reason:@"Slow consumer"];
+}
+- (void)setSendsBlocked:(BOOL)sendsBlocked {
+    [_outputCondition lock];
+    _sendsBlocked = sendsBlocked;
+    if(!sendsBlocked) {
+        [_outputCondition broadcast];
+    }
+    [_outputCondition unlock];
+}
+- (void)waitUntilSendsUnblocked {
+    // the work queue unblocks sends so it must never wait itself, nor must
+    // the event loop whose wheel drives our timeouts; a server broadcasting
+    // on it would hold up every other connection on the loop
+    if(dispatch_get_specific(PSWebSocketWorkQueueKey) == (__bridge void *)self ||
+       _timingWheel.isCurrentQueue) {
+        return;
+    }
+    [_outputCondition lock];
+    while(_sendsBlocked) {
+        [_outputCondition wait];
+    }
+    [_outputCondition unlock];
+}
+
+#pragma mark - Flushing
+
+- (BOOL)holdsOutput {
+    // the handshake and closing frames are never held
+    return ((_corkCount > 0 || _flushPolicy.maximumDelay > 0.0) &&
+            !_outputReleased &&
+            !_closeWhenFinishedOutput &&
+            _readyState == PSWebSocketReadyStateOpen);
+}
+- (void)flushOutput {
+    _outputReleased = YES;
+    [self pumpOutput];
+}
+- (void)scheduleOutputFlush {
+    if(_outputFlushScheduled || _flushPolicy.maximumDelay <= 0.0) {
+        return;
+    }
+    _outputFlushScheduled = YES;
+    [_timingWheel armTimer:_flushTimer interval:_flushPolicy.maximumDelay];
+}
+- (void)flushTimerExpired {
+    _outputFlushScheduled = NO;
+    if(_outputQueue.hasBytesAvailable) {
+        [self flushOutput];
+    }
+}
+
+#pragma mark - Outgoing Messages
+
+- (void)enqueueMessage:(id)message {
+    if(!_opened || _readyState == PSWebSocketReadyStateConnecting) {
+        [NSException raise:@"Invalid State" format:@"You cannot send a PSWebSocket messages before it is finished opening."];
+        return;
+    }
+    
+    if(![message isKindOfClass:[NSString class]] &&
+       ![message isKindOfClass:[NSData class]] &&
+       ![message isKindOfClass:[PSWebSocketPreparedMessage class]]) {
+        [NSException raise:@"Invalid Message" format:@"Messages must be instances of NSString or NSData"];
+        return;
+    }
+    
+    // backed up output refuses new messages
+    if(_aboveHighWaterMark && _slowConsumerPolicy == PSWebSocketSlowConsumerPolicyDropNewest) {
+        return;
+    }
+    
+    // large messages are deflated off the queue and keep their place
+    if(_parallelCompressionLength > 0 &&
+       _driver.deflateWindowBits != 0 &&
+       ![message isKindOfClass:[PSWebSocketPreparedMessage class]] &&
+       [message length] >= _parallelCompressionLength) {
+        [self deflateMessageInParallel:message];
+        return;
+    }
+    
+    // wait behind any streamed or deflating message still being sent
+    if(_outgoingMessages.count > 0) {
+        [_outgoingMessages addObject:message];
+        return;
+    }
+    [self sendMessage:message];
+}
+- (void)deflateMessageInParallel:(id)message {
+    // decided now, in send order, so the adaptive policy sees every message
+    // exactly once; a skipped message keeps its place uncompressed
+    NSUInteger length = ([message isKindOfClass:[NSString class]]) ? [message lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : [message length];
+    NSInteger windowBits = [_driver deflateWindowBitsForLength:length];
+    PSWebSocketDeflatingMessage *deflatingMessage = [[PSWebSocketDeflatingMessage alloc] initWithMessage:message windowBits:windowBits];
+    [_outgoingMessages addObject:deflatingMessage];
+    if(deflatingMessage.finished) {
+        [self pumpOutput];
+        return;
+    }
+    
+    // deflated with a fresh context, independent of anything sent before it
+    PSWebSocketCompressionPolicy *compressionPolicy = _driver.compressionPolicy;
+    dispatch_queue_t workQueue = _workQueue;
+    __weak typeof(self)weakSelf = self;
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        // failures are reported when the message is sent and deflates again
+        CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
+        NSArray *frames = [deflatingMessage.preparedMessage framesForDeflateWindowBits:windowBits compressionPolicy:compressionPolicy error:nil];
+        CFTimeInterval duration = CFAbsoluteTimeGetCurrent() - start;
+        dispatch_async(workQueue, ^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            deflatingMessage.finished = YES;
+            if(!strongSelf) {
+                return;
+            }
+            if(frames) {
+                [strongSelf->_driver recordDeflateOfLength:deflatingMessage.length toLength:[frames[1] length] duration:duration];
+            }
+            [strongSelf pumpOutput];
+        });
+    });
+}
+- (void)sendMessage:(id)message {
+    // the frame header and payload are written together once both are queued
+    _writingMessage = YES;
+    _writingTag = (_driver.framesAreIndependent) ? ++_messageTag : 0;
+    if([message isKindOfClass:[PSWebSocketDeflatingMessage class]]) {
+        [_driver sendPreparedMessage:[message preparedMessage] deflateWindowBits:[message windowBits] fragmentLength:_fragmentLength];
+    } else if([message isKindOfClass:[PSWebSocketPreparedMessage class]]) {
+        [_driver sendPreparedMessage:message];
+    } else if([message isKindOfClass:[NSString class]]) {
+        [_driver sendText:message];
+    } else {
+        [_driver sendBinary:message];
+    }
+    _writingTag = 0;
+    _writingMessage = NO;
+    [self updateWaterMarks];
+    [self pumpOutput];
+}
+- (void)sendStreamedMessage:(PSWebSocketStreamedMessage *)message {
+    [self executeWork:^{
+        if(!_opened || _readyState == PSWebSocketReadyStateConnecting) {
+            [NSException raise:@"Invalid State" format:@"You cannot send a PSWebSocket messages before it is finished opening."];
+            return;
+        }
+        if(_readyState >= PSWebSocketReadyStateClosing) {
+            [message close];
+            return;
+        }
+        [_outgoingMessages addObject:message];
+        [self pumpOutput];
+    }];
+}
+- (BOOL)hasOutgoingMessageReady {
+    if(_outgoingMessages.count == 0 || _pumpingOutgoingMessages) {
+        return NO;
+    }
+    id message = _outgoingMessages.firstObject;
+    return (![message isKindOfClass:[PSWebSocketDeflatingMessage class]] || [message finished]);
+}
+- (void)pumpOutgoingMessages {
+    _pumpingOutgoingMessages = YES;
+    id message = _outgoingMessages.firstObject;
+    if([message isKindOfClass:[PSWebSocketStreamedMessage class]]) {
+        PSWebSocketStreamedMessage *streamedMessage = message;
+        BOOL first = !streamedMessage.started;
+        BOOL final = NO;
+        NSError *error = nil;
+        NSData *fragment = [streamedMessage nextFragmentWithLength:_fragmentLength final:&final error:&error];
+        if(!fragment) {
+            _pumpingOutgoingMessages = NO;
+            [self cancelOutgoingMessages];
+            [self failWithError:error];
+            return;
+        }
+        if(final) {
+            [_outgoingMessages removeObjectAtIndex:0];
+        }
+        [_driver sendFragment:fragment type:streamedMessage.type first:first final:final];
+    } else {
+        [_outgoingMessages removeObjectAtIndex:0];
+        [self sendMessage:message];
+    }
+    _pumpingOutgoingMessages = NO;
+}
+- (void)cancelOutgoingMessages {
+    for(id message in _outgoingMessages) {
+        if([message isKindOfClass:[PSWebSocketStreamedMessage class]]) {
+            [message close];
+        }
+    }
+    [_outgoingMessages removeAllObjects];
 }
 
 #pragma mark - Failing
@@ -501,7 +1466,8 @@
     [self failWithError:[PSWebSocketDriver errorWithCode:code reason:reason]];
 }
 - (void)failWithError:(NSError *)error {
-    if(error.code == PSWebSocketStatusCodeProtocolError && [error.domain isEqualToString:PSWebSocketErrorDomain]) {
+    if((error.code == PSWebSocketStatusCodeProtocolError || error.code == PSWebSocketStatusCodeMessageTooBig) &&
+       [error.domain isEqualToString:PSWebSocketErrorDomain]) {
         [self executeDelegate:^{
             _closeCode = error.code;
             _closeReason = error.localizedDescription;
@@ -531,6 +1497,8 @@
     }
     _readyState = PSWebSocketReadyStateOpen;
     [self notifyDelegateDidOpen];
+    [self startHeartbeat];
+    [self startIdleTimer];
     [self pumpInput];
     [self pumpOutput];
 }
@@ -548,7 +1516,36 @@
     }];
 }
 - (void)driver:(PSWebSocketDriver *)driver didReceiveMessage:(id)message {
-    [self notifyDelegateDidReceiveMessage:message];
+    if(![_delegate respondsToSelector:@selector(webSocket:didReceiveMessages:)]) {
+        [self deliverPendingMessages];
+        [self notifyDelegateDidReceiveMessage:message];
+        return;
+    }
+    [_pendingMessages addObject:message];
+    if(!_pumpingInput || _pendingMessages.count >= _maximumMessageBatchCount) {
+        [self deliverPendingMessages];
+    }
+}
+- (void)deliverPendingMessages {
+    if(_pendingMessages.count == 0) {
+        return;
+    }
+    NSArray *messages = _pendingMessages;
+    _pendingMessages = [NSMutableArray array];
+    [self notifyDelegateDidReceiveMessages:messages];
+}
+- (void)driver:(PSWebSocketDriver *)driver didBeginMessage:(PSWebSocketMessageType)type {
+    // batched messages read earlier in this pump go first
+    [self deliverPendingMessages];
+    [self notifyDelegateDidBeginMessage:type];
+}
+- (void)driver:(PSWebSocketDriver *)driver didReceiveMessageChunk:(NSData *)chunk {
+    [self deliverPendingMessages];
+    [self notifyDelegateDidReceiveMessageChunk:chunk];
+}
+- (void)driverDidFinishMessage:(PSWebSocketDriver *)driver {
+    [self deliverPendingMessages];
+    [self notifyDelegateDidFinishMessage];
 }
 - (void)driver:(PSWebSocketDriver *)driver didReceivePing:(NSData *)ping {
     [self executeDelegate:^{
@@ -558,54 +1555,110 @@
     }];
 }
 - (void)driver:(PSWebSocketDriver *)driver didReceivePong:(NSData *)pong {
+    if([self receiveHeartbeat:pong]) {
+        return;
+    }
     void (^handler)(NSData *pong) = [_pingHandlers firstObject];
     if(handler) {
+        [self recordRoundTripTime:CFAbsoluteTimeGetCurrent() - [_pingTimes[0] doubleValue]];
+        [self deliverPendingMessages];
         [self executeDelegate:^{
             handler(pong);
         }];
         [_pingHandlers removeObjectAtIndex:0];
+        [_pingTimes removeObjectAtIndex:0];
     }
 }
 - (void)driver:(PSWebSocketDriver *)driver write:(NSData *)data {
-    if(_closeWhenFinishedOutput) {
+    if(_closeWhenFinishedOutput || data.length == 0) {
         return;
     }
-    [_outputBuffer appendData:data];
-    [self pumpOutput];
+    
+    // pings and pongs go ahead of queued data frames, everything else in order
+    if(_readyState == PSWebSocketReadyStateConnecting) {
+        [_outputQueue appendData:data tag:_writingTag];
+    } else if(_controlFrame) {
+        [_controlFrame appendData:data];
+        _framePayloadRemaining -= MIN(_framePayloadRemaining, (uint64_t)data.length);
+        if(_framePayloadRemaining == 0) {
+            [_outputQueue insertControlFrame:_controlFrame];
+            _controlFrame = nil;
+        }
+    } else if(_framePayloadRemaining > 0) {
+        [_outputQueue appendData:data tag:_writingTag];
+        _framePayloadRemaining -= MIN(_framePayloadRemaining, (uint64_t)data.length);
+    } else {
+        PSWebSocketOpCode opcode = (PSWebSocketOpCode)(((const uint8_t *)data.bytes)[0] & PSWebSocketOpCodeMask);
+        _framePayloadRemaining = [self payloadLengthOfFrameHeader:data];
+        if(opcode == PSWebSocketOpCodePing || opcode == PSWebSocketOpCodePong) {
+            if(_framePayloadRemaining > 0) {
+                _controlFrame = [data mutableCopy];
+            } else {
+                [_outputQueue insertControlFrame:data];
+            }
+        } else {
+            [_outputQueue appendData:data tag:_writingTag frameStart:YES];
+        }
+    }
+    
+    if(!_writingMessage) {
+        [self updateWaterMarks];
+    }
+    if(_flushPolicy.maximumLength > 0 && _outputQueue.bytesAvailable >= _flushPolicy.maximumLength) {
+        _outputReleased = YES;
+    }
+    if([self holdsOutput]) {
+        [self scheduleOutputFlush];
+        return;
+    }
+    if(!_writingMessage) {
+        [self pumpOutput];
+    }
+}
+- (uint64_t)payloadLengthOfFrameHeader:(NSData *)header {
+    const uint8_t *bytes = header.bytes;
+    uint64_t length = (header.length > 1) ? (bytes[1] & PSWebSocketPayloadLenMask) : 0;
+    if(length == 126 && header.length >= 4) {
+        length = ((uint64_t)bytes[2] << 8) | bytes[3];
+    } else if(length == 127 && header.length >= 10) {
+        length = 0;
+        for(NSUInteger i = 2; i < 10; ++i) {
+            length = (length << 8) | bytes[i];
+        }
+    }
+    return length;
 }
 
-#pragma mark - NSStreamDelegate
+#pragma mark - PSWebSocketTransportDelegate
 
-- (void)stream:(NSStream *)stream handleEvent:(NSStreamEvent)event {
+- (void)transport:(id <PSWebSocketTransport>)transport handleEvent:(NSStreamEvent)event {
     // This is invoked on the work queue.
     switch(event) {
         case NSStreamEventOpenCompleted: {
-            if(_mode != PSWebSocketModeClient) {
-                [NSException raise:@"Invalid State" format:@"Server mode should have already opened streams."];
-                return;
-            }
+            // server mode transports may finish opening after being taken over
             if(_readyState >= PSWebSocketReadyStateClosing) {
                 return;
             }
+            [self applyNoDelay];
             [self pumpOutput];
             [self pumpInput];
             break;
         }
         case NSStreamEventErrorOccurred: {
-            [self failWithError:stream.streamError];
+            [self failWithError:transport.error];
             [_inputBuffer reset];
             break;
         }
         case NSStreamEventEndEncountered: {
             [self pumpInput];
-            if(stream.streamError) {
-                [self failWithError:stream.streamError];
+            if(transport.error) {
+                [self failWithError:transport.error];
             } else {
                 _readyState = PSWebSocketReadyStateClosed;
                 if(!_sentClose && !_failed) {
                     _failed = YES;
                     [self disconnect];
-                    NSString *reason = [NSString stringWithFormat:@"%@ stream end encountered", (stream == _inputStream) ? @"Input" : @"Output"];
+                    NSString *reason = @"Transport end encountered";
                     NSError *error = [PSWebSocketDriver errorWithCode:PSWebSocketErrorCodeConnectionFailed reason:reason];
                     [self notifyDelegateDidFailWithError:error];
                 }
@@ -614,7 +1667,7 @@
         }
         case NSStreamEventHasBytesAvailable: {
             if (!_negotiatedSSL) {
-                [self negotiateSSL:stream];
+                [self negotiateSSL];
             } else {
                 [self pumpInput];
             }
@@ -622,7 +1675,7 @@
         }
         case NSStreamEventHasSpaceAvailable: {
             if (!_negotiatedSSL) {
-                [self negotiateSSL:stream];
+                [self negotiateSSL];
             } else {
                 [self pumpOutput];
             }
@@ -645,12 +1698,46 @@
         [_delegate webSocket:self didReceiveMessage:message];
     }];
 }
+- (void)notifyDelegateDidReceiveMessages:(NSArray *)messages {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocket:didReceiveMessages:)]) {
+            [_delegate webSocket:self didReceiveMessages:messages];
+        } else {
+            for(id message in messages) {
+                [_delegate webSocket:self didReceiveMessage:message];
+            }
+        }
+    }];
+}
+- (void)notifyDelegateDidBeginMessage:(PSWebSocketMessageType)type {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocket:didBeginMessage:)]) {
+            [_delegate webSocket:self didBeginMessage:type];
+        }
+    }];
+}
+- (void)notifyDelegateDidReceiveMessageChunk:(NSData *)chunk {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocket:didReceiveMessageChunk:)]) {
+            [_delegate webSocket:self didReceiveMessageChunk:chunk];
+        }
+    }];
+}
+- (void)notifyDelegateDidFinishMessage {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocketDidFinishMessage:)]) {
+            [_delegate webSocketDidFinishMessage:self];
+        }
+    }];
+}
 - (void)notifyDelegateDidFailWithError:(NSError *)error {
+    [self deliverPendingMessages];
     [self executeDelegate:^{
         [_delegate webSocket:self didFailWithError:error];
     }];
 }
 - (void)notifyDelegateDidCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
+    [self deliverPendingMessages];
     [self executeDelegate:^{
         [_delegate webSocket:self didCloseWithCode:code reason:reason wasClean:wasClean];
     }];
@@ -662,6 +1749,27 @@
         }
     }];
 }
+- (void)notifyDelegateDidReachHighWaterMark {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocketDidReachHighWaterMark:)]) {
+            [_delegate webSocketDidReachHighWaterMark:self];
+        }
+    }];
+}
+- (void)notifyDelegateDidDrainToLowWaterMark {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocketDidDrainToLowWaterMark:)]) {
+            [_delegate webSocketDidDrainToLowWaterMark:self];
+        }
+    }];
+}
+- (void)notifyDelegateDidMeasureRoundTripTime:(NSTimeInterval)roundTripTime {
+    [self executeDelegate:^{
+        if ([_delegate respondsToSelector:@selector(webSocket:didMeasureRoundTripTime:)]) {
+            [_delegate webSocket:self didMeasureRoundTripTime:roundTripTime];
+        }
+    }];
+}
 - (void)notifyDelegateDidFlushOutput {
     [self executeDelegate:^{
         if ([_delegate respondsToSelector:@selector(webSocketDidFlushOutput:)]) {
@@ -687,14 +1795,27 @@
 }
 - (void)executeWorkAndWait:(void (^)(void))work {
     NSParameterAssert(work);
+    // delegates called inline may use synchronous accessors
+    if(dispatch_get_specific(PSWebSocketWorkQueueKey) == (__bridge void *)self) {
+        work();
+        return;
+    }
     dispatch_sync(_workQueue, work);
 }
 - (void)executeDelegate:(void (^)(void))work {
     NSParameterAssert(work);
+    if(_callsDelegateInline) {
+        work();
+        return;
+    }
     dispatch_async((_delegateQueue) ? _delegateQueue : dispatch_get_main_queue(), work);
 }
 - (void)executeDelegateAndWait:(void (^)(void))work {
     NSParameterAssert(work);
+    if(_callsDelegateInline) {
+        work();
+        return;
+    }
     dispatch_sync((_delegateQueue) ? _delegateQueue : dispatch_get_main_queue(), work);
 }
 
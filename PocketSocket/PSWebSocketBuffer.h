@@ -14,24 +14,55 @@
 
 #import <Foundation/Foundation.h>
 
-
+/**
+ *  Byte buffer built from fixed size segments that are taken from a process
+ *  wide pool as bytes are appended and handed back as soon as they have been
+ *  consumed, an empty buffer holds no memory.
+ */
 @interface PSWebSocketBuffer : NSObject
 
-#pragma mark - Properties
+#pragma mark - Pool
+
+/**
+ *  Size of each pooled segment
+ */
++ (NSUInteger)segmentLength;
+
+/**
+ *  Maximum number of bytes of idle segments the pool keeps for reuse,
+ *  segments released beyond this are freed. Defaults to 4MB.
+ */
++ (NSUInteger)poolCapacity;
++ (void)setPoolCapacity:(NSUInteger)poolCapacity;
 
-@property (nonatomic, assign) NSInteger offset;
-@property (nonatomic, assign) NSUInteger compactionLength;
+/**
+ *  Bytes currently held by idle segments in the pool
+ */
++ (NSUInteger)pooledMemoryUsage;
+
+/**
+ *  Bytes currently held by segments in use by buffers
+ */
++ (NSUInteger)allocatedMemoryUsage;
 
 #pragma mark - Actions
 
 - (BOOL)hasBytesAvailable;
 - (NSUInteger)bytesAvailable;
+- (NSUInteger)contiguousBytesAvailable;
 - (void)appendData:(NSData *)data;
 - (void)appendBytes:(const void *)bytes length:(NSUInteger)length;
-- (void)compact;
+- (void)consumeLength:(NSUInteger)length;
+- (void)makeContiguous:(NSUInteger)length;
+
+/**
+ *  Free space at the end of the buffer that bytes can be written into
+ *  directly, followed by commitLength: with the number of bytes written.
+ */
+- (void *)reserveBytes:(NSUInteger *)length;
+- (void)commitLength:(NSUInteger)length;
 - (void)reset;
 - (const void *)bytes;
 - (void *)mutableBytes;
-- (NSData *)data;
 
 @end
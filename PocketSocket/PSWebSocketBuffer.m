@@ -13,21 +13,122 @@
 //  limitations under the License.
 
 #import "PSWebSocketBuffer.h"
+#import <pthread.h>
 
-@interface PSWebSocketBuffer() {
-    NSMutableData *_data;
+typedef struct PSWebSocketBufferSegment {
+    struct PSWebSocketBufferSegment *next;
+    NSUInteger capacity;
+    NSUInteger start;
+    NSUInteger end;
+    uint8_t bytes[];
+} PSWebSocketBufferSegment;
+
+static const NSUInteger PSWebSocketBufferSegmentLength = 16384;
+
+static pthread_mutex_t PSWebSocketBufferPoolLock = PTHREAD_MUTEX_INITIALIZER;
+static PSWebSocketBufferSegment *PSWebSocketBufferPoolHead = NULL;
+static NSUInteger PSWebSocketBufferPoolLength = 0;
+static NSUInteger PSWebSocketBufferPoolCapacity = 4 * 1024 * 1024;
+static NSUInteger PSWebSocketBufferAllocatedLength = 0;
+
+static PSWebSocketBufferSegment *PSWebSocketBufferSegmentCreate(NSUInteger capacity) {
+    PSWebSocketBufferSegment *segment = NULL;
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    if(capacity == PSWebSocketBufferSegmentLength && PSWebSocketBufferPoolHead) {
+        segment = PSWebSocketBufferPoolHead;
+        PSWebSocketBufferPoolHead = segment->next;
+        PSWebSocketBufferPoolLength -= capacity;
+    }
+    PSWebSocketBufferAllocatedLength += capacity;
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    
+    if(!segment) {
+        segment = malloc(sizeof(PSWebSocketBufferSegment) + capacity);
+        NSCAssert(segment, @"Failed to allocate buffer segment");
+        segment->capacity = capacity;
+    }
+    segment->next = NULL;
+    segment->start = 0;
+    segment->end = 0;
+    return segment;
+}
+static void PSWebSocketBufferSegmentRelease(PSWebSocketBufferSegment *segment) {
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    PSWebSocketBufferAllocatedLength -= segment->capacity;
+    if(segment->capacity == PSWebSocketBufferSegmentLength &&
+       PSWebSocketBufferPoolLength + segment->capacity <= PSWebSocketBufferPoolCapacity) {
+        segment->next = PSWebSocketBufferPoolHead;
+        PSWebSocketBufferPoolHead = segment;
+        PSWebSocketBufferPoolLength += segment->capacity;
+        segment = NULL;
+    }
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    
+    if(segment) {
+        free(segment);
+    }
 }
 
+@interface PSWebSocketBuffer() {
+    PSWebSocketBufferSegment *_head;
+    PSWebSocketBufferSegment *_tail;
+    PSWebSocketBufferSegment *_reserve;
+    NSUInteger _bytesAvailable;
+}
 @end
 @implementation PSWebSocketBuffer
 
+#pragma mark - Pool
+
++ (NSUInteger)segmentLength {
+    return PSWebSocketBufferSegmentLength;
+}
++ (NSUInteger)poolCapacity {
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    NSUInteger value = PSWebSocketBufferPoolCapacity;
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    return value;
+}
++ (void)setPoolCapacity:(NSUInteger)poolCapacity {
+    PSWebSocketBufferSegment *trimmed = NULL;
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    PSWebSocketBufferPoolCapacity = poolCapacity;
+    while(PSWebSocketBufferPoolHead && PSWebSocketBufferPoolLength > PSWebSocketBufferPoolCapacity) {
+        PSWebSocketBufferSegment *segment = PSWebSocketBufferPoolHead;
+        PSWebSocketBufferPoolHead = segment->next;
+        PSWebSocketBufferPoolLength -= segment->capacity;
+        segment->next = trimmed;
+        trimmed = segment;
+    }
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    
+    while(trimmed) {
+        PSWebSocketBufferSegment *next = trimmed->next;
+        free(trimmed);
+        trimmed = next;
+    }
+}
++ (NSUInteger)pooledMemoryUsage {
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    NSUInteger value = PSWebSocketBufferPoolLength;
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    return value;
+}
++ (NSUInteger)allocatedMemoryUsage {
+    pthread_mutex_lock(&PSWebSocketBufferPoolLock);
+    NSUInteger value = PSWebSocketBufferAllocatedLength;
+    pthread_mutex_unlock(&PSWebSocketBufferPoolLock);
+    return value;
+}
+
 #pragma mark - Initialization
 
 - (instancetype)init {
     if((self = [super init])) {
-        _data = [NSMutableData data];
-        _offset = 0;
-        _compactionLength = 4096;
+        _head = NULL;
+        _tail = NULL;
+        _reserve = NULL;
+        _bytesAvailable = 0;
     }
     return self;
 }
@@ -35,40 +136,137 @@
 #pragma mark - Actions
 
 - (BOOL)hasBytesAvailable {
-    return _data.length > _offset;
+    return _bytesAvailable > 0;
 }
 - (NSUInteger)bytesAvailable {
-    if(_data.length > _offset) {
-        return _data.length - _offset;
-    }
-    return 0;
+    return _bytesAvailable;
+}
+- (NSUInteger)contiguousBytesAvailable {
+    return (_head) ? _head->end - _head->start : 0;
 }
 - (void)appendData:(NSData *)data {
-    [_data appendData:data];
+    [self appendBytes:data.bytes length:data.length];
 }
 - (void)appendBytes:(const void *)bytes length:(NSUInteger)length {
-    [_data appendBytes:bytes length:length];
+    while(length > 0) {
+        if(!_tail || _tail->end == _tail->capacity) {
+            PSWebSocketBufferSegment *segment = PSWebSocketBufferSegmentCreate(PSWebSocketBufferSegmentLength);
+            if(_tail) {
+                _tail->next = segment;
+            } else {
+                _head = segment;
+            }
+            _tail = segment;
+        }
+        NSUInteger copyLength = MIN(length, _tail->capacity - _tail->end);
+        memcpy(_tail->bytes + _tail->end, bytes, copyLength);
+        _tail->end += copyLength;
+        _bytesAvailable += copyLength;
+        bytes = (const uint8_t *)bytes + copyLength;
+        length -= copyLength;
+    }
+}
+- (void)consumeLength:(NSUInteger)length {
+    NSAssert(length <= _bytesAvailable, @"Cannot consume more bytes than are available");
+    _bytesAvailable -= length;
+    while(length > 0) {
+        NSUInteger consumeLength = MIN(length, _head->end - _head->start);
+        _head->start += consumeLength;
+        length -= consumeLength;
+        if(_head->start == _head->end) {
+            [self releaseHead];
+        }
+    }
+}
+- (void)makeContiguous:(NSUInteger)length {
+    length = MIN(length, _bytesAvailable);
+    if(length <= self.contiguousBytesAvailable) {
+        return;
+    }
+    
+    // move the first length bytes into one segment large enough to hold them
+    PSWebSocketBufferSegment *segment = PSWebSocketBufferSegmentCreate(MAX(length, PSWebSocketBufferSegmentLength));
+    while(segment->end < length) {
+        NSUInteger copyLength = MIN(length - segment->end, _head->end - _head->start);
+        memcpy(segment->bytes + segment->end, _head->bytes + _head->start, copyLength);
+        segment->end += copyLength;
+        _head->start += copyLength;
+        if(_head->start == _head->end) {
+            [self releaseHead];
+        }
+    }
+    segment->next = _head;
+    _head = segment;
+    if(!_tail) {
+        _tail = segment;
+    }
+}
+- (void *)reserveBytes:(NSUInteger *)length {
+    if(_tail && _tail->end < _tail->capacity) {
+        *length = _tail->capacity - _tail->end;
+        return _tail->bytes + _tail->end;
+    }
+    if(!_reserve) {
+        _reserve = PSWebSocketBufferSegmentCreate(PSWebSocketBufferSegmentLength);
+    }
+    *length = _reserve->capacity;
+    return _reserve->bytes;
 }
-- (void)compact {
-    if(_offset > _compactionLength && _offset > (_data.length >> 1)) {
-        _data = [NSMutableData dataWithBytes:(char *)_data.bytes + _offset
-                                      length:_data.length - _offset];
-        _offset = 0;
+- (void)commitLength:(NSUInteger)length {
+    if(_reserve) {
+        // only keep the reserved segment around if something was written to it
+        if(length == 0) {
+            PSWebSocketBufferSegmentRelease(_reserve);
+            _reserve = NULL;
+            return;
+        }
+        if(_tail) {
+            _tail->next = _reserve;
+        } else {
+            _head = _reserve;
+        }
+        _tail = _reserve;
+        _reserve = NULL;
+    }
+    if(length == 0) {
+        return;
     }
+    NSAssert(_tail && _tail->end + length <= _tail->capacity, @"Cannot commit more bytes than were reserved");
+    _tail->end += length;
+    _bytesAvailable += length;
 }
 - (void)reset {
-    _offset = 0;
-    _data.length = 0;
+    while(_head) {
+        [self releaseHead];
+    }
+    if(_reserve) {
+        PSWebSocketBufferSegmentRelease(_reserve);
+        _reserve = NULL;
+    }
+    _bytesAvailable = 0;
 }
 - (const void *)bytes {
-    return _data.bytes + _offset;
+    return (_head) ? _head->bytes + _head->start : NULL;
 }
 - (void *)mutableBytes {
-    return _data.mutableBytes + _offset;
+    return (_head) ? _head->bytes + _head->start : NULL;
 }
-- (NSData *)data {
-    return [_data copy];
+
+#pragma mark - Private
+
+- (void)releaseHead {
+    PSWebSocketBufferSegment *segment = _head;
+    _head = segment->next;
+    if(!_head) {
+        _tail = NULL;
+    }
+    PSWebSocketBufferSegmentRelease(segment);
 }
 
+#pragma mark - Dealloc
+
+- (void)dealloc {
+    [self reset];
+}
 
 @end
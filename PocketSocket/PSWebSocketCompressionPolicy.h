@@ -0,0 +1,112 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+typedef NS_ENUM(NSInteger, PSWebSocketCompressionStrategy) {
+    PSWebSocketCompressionStrategyDefault = 0,
+    PSWebSocketCompressionStrategyFiltered,
+    PSWebSocketCompressionStrategyHuffmanOnly,
+    PSWebSocketCompressionStrategyRLE,
+    PSWebSocketCompressionStrategyFixed
+};
+
+/**
+ *  Decides which outgoing messages are deflated once permessage-deflate has
+ *  been negotiated and how hard to try. Messages that are not deflated are
+ *  sent as is with RSV1 clear. Also carries the permessage-deflate
+ *  parameters offered or accepted during the handshake.
+ */
+@interface PSWebSocketCompressionPolicy : NSObject <NSCopying>
+
+#pragma mark - Properties
+
+/**
+ *  Messages shorter than this are never deflated, below a few dozen bytes
+ *  the deflate block overhead usually makes them larger. Defaults to 64.
+ */
+@property (nonatomic, assign) NSUInteger minimumLength;
+
+/**
+ *  zlib compression level from 0 to 9, -1 for zlib's default. Defaults to -1.
+ */
+@property (nonatomic, assign) NSInteger level;
+
+/**
+ *  zlib compression strategy. Defaults to PSWebSocketCompressionStrategyFixed.
+ */
+@property (nonatomic, assign) PSWebSocketCompressionStrategy strategy;
+
+/**
+ *  Stop deflating for a while when recent messages compressed poorly or
+ *  slowly, then try again. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL adaptive;
+
+/**
+ *  In adaptive mode, the running ratio of compressed to original length
+ *  above which compression is paused. Defaults to 0.9.
+ */
+@property (nonatomic, assign) double maximumRatio;
+
+/**
+ *  In adaptive mode, the running input bytes deflated per second below which
+ *  compression is paused, 0 ignores cost. Defaults to 10MB/s.
+ */
+@property (nonatomic, assign) double minimumThroughput;
+
+/**
+ *  Largest LZ77 window, from 9 to 15 bits, the server may use when
+ *  compressing. Servers never exceed it and clients ask for it during the
+ *  handshake, smaller windows use less memory per connection on both ends.
+ *  Defaults to 15.
+ */
+@property (nonatomic, assign) NSUInteger serverMaxWindowBits;
+
+/**
+ *  Largest LZ77 window, from 9 to 15 bits, the client may use when
+ *  compressing. Servers can only enforce it on clients that offer
+ *  client_max_window_bits, clients never exceed it. Defaults to 15.
+ */
+@property (nonatomic, assign) NSUInteger clientMaxWindowBits;
+
+/**
+ *  zlib memory level from 1 to 9 used by the local deflater, lower levels
+ *  use less memory at some cost in ratio and speed. Defaults to 8.
+ */
+@property (nonatomic, assign) NSUInteger memoryLevel;
+
+/**
+ *  Request that the server compresses every message independently. Its
+ *  zlib contexts are then borrowed from a shared pool per message instead
+ *  of being held by each connection. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL serverNoContextTakeover;
+
+/**
+ *  Request that the client compresses every message independently, see
+ *  serverNoContextTakeover. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL clientNoContextTakeover;
+
+#pragma mark - Initialization
+
++ (instancetype)defaultPolicy;
+
+/**
+ *  Policy that deflates every non empty message as earlier versions did.
+ */
++ (instancetype)alwaysPolicy;
+
+@end
@@ -0,0 +1,64 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketCompressionPolicy.h"
+
+@implementation PSWebSocketCompressionPolicy
+
+#pragma mark - Initialization
+
++ (instancetype)defaultPolicy {
+    return [[self alloc] init];
+}
++ (instancetype)alwaysPolicy {
+    PSWebSocketCompressionPolicy *policy = [[self alloc] init];
+    policy.minimumLength = 0;
+    return policy;
+}
+- (instancetype)init {
+    if((self = [super init])) {
+        _minimumLength = 64;
+        _level = -1;
+        _strategy = PSWebSocketCompressionStrategyFixed;
+        _adaptive = NO;
+        _maximumRatio = 0.9;
+        _minimumThroughput = 10 * 1024 * 1024;
+        _serverMaxWindowBits = 15;
+        _clientMaxWindowBits = 15;
+        _memoryLevel = 8;
+        _serverNoContextTakeover = NO;
+        _clientNoContextTakeover = NO;
+    }
+    return self;
+}
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+    PSWebSocketCompressionPolicy *policy = [[[self class] allocWithZone:zone] init];
+    policy.minimumLength = _minimumLength;
+    policy.level = _level;
+    policy.strategy = _strategy;
+    policy.adaptive = _adaptive;
+    policy.maximumRatio = _maximumRatio;
+    policy.minimumThroughput = _minimumThroughput;
+    policy.serverMaxWindowBits = _serverMaxWindowBits;
+    policy.clientMaxWindowBits = _clientMaxWindowBits;
+    policy.memoryLevel = _memoryLevel;
+    policy.serverNoContextTakeover = _serverNoContextTakeover;
+    policy.clientNoContextTakeover = _clientNoContextTakeover;
+    return policy;
+}
+
+@end
@@ -0,0 +1,100 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+#import <stdatomic.h>
+#import "PSWebSocketStatistics.h"
+#import "PSWebSocketDriver.h"
+
+// latencies are bucketed by powers of two microseconds, bucket i counts those
+// from 2^(i-1) up to 2^i and the last one everything longer
+#define PSWebSocketHistogramBucketCount 32
+
+typedef struct {
+    _Atomic uint64_t buckets[PSWebSocketHistogramBucketCount];
+    _Atomic uint64_t count;
+    _Atomic uint64_t totalMicroseconds;
+    _Atomic uint64_t maximumMicroseconds;
+} PSWebSocketHistogramCounters;
+
+// every field is written by the websocket's work queue and read from anywhere
+typedef struct {
+    _Atomic uint64_t bytesReceived;
+    _Atomic uint64_t bytesSent;
+    _Atomic uint64_t framesReceived;
+    _Atomic uint64_t framesSent;
+    _Atomic uint64_t messagesReceived;
+    _Atomic uint64_t messagesSent;
+    _Atomic uint64_t uncompressedBytesSent;
+    _Atomic uint64_t compressedBytesSent;
+    _Atomic uint64_t compressedBytesReceived;
+    _Atomic uint64_t uncompressedBytesReceived;
+    _Atomic uint64_t inputBufferLength;
+    _Atomic uint64_t outputBufferLength;
+    _Atomic uint64_t driverNanoseconds;
+    _Atomic uint64_t deflateNanoseconds;
+    _Atomic uint64_t missedHeartbeats;
+    PSWebSocketHistogramCounters roundTripTimes;
+} PSWebSocketCounters;
+
+static inline void PSWebSocketCounterAdd(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+static inline void PSWebSocketCounterSet(_Atomic uint64_t *counter, uint64_t value) {
+    atomic_store_explicit(counter, value, memory_order_relaxed);
+}
+static inline uint64_t PSWebSocketCounterGet(_Atomic uint64_t *counter) {
+    return atomic_load_explicit(counter, memory_order_relaxed);
+}
+static inline uint64_t PSWebSocketNanosecondsSince(CFAbsoluteTime start) {
+    CFAbsoluteTime duration = CFAbsoluteTimeGetCurrent() - start;
+    return (duration > 0.0) ? (uint64_t)(duration * NSEC_PER_SEC) : 0;
+}
+static inline void PSWebSocketHistogramRecord(PSWebSocketHistogramCounters *histogram, NSTimeInterval duration) {
+    uint64_t microseconds = (duration > 0.0) ? (uint64_t)(duration * USEC_PER_SEC) : 0;
+    NSUInteger bucket = (microseconds > 0) ? MIN(64 - __builtin_clzll(microseconds), PSWebSocketHistogramBucketCount - 1) : 0;
+    PSWebSocketCounterAdd(&histogram->buckets[bucket], 1);
+    PSWebSocketCounterAdd(&histogram->count, 1);
+    PSWebSocketCounterAdd(&histogram->totalMicroseconds, microseconds);
+    uint64_t maximum = PSWebSocketCounterGet(&histogram->maximumMicroseconds);
+    while(microseconds > maximum &&
+          !atomic_compare_exchange_weak_explicit(&histogram->maximumMicroseconds, &maximum, microseconds,
+                                                 memory_order_relaxed, memory_order_relaxed));
+}
+
+@interface PSWebSocketHistogram ()
+
+/**
+ *  Snapshot of the given counters, which may keep changing while it is taken.
+ */
+- (instancetype)initWithCounters:(PSWebSocketHistogramCounters *)counters;
+
+@end
+
+@interface PSWebSocketStatistics ()
+
+- (instancetype)initWithCounters:(PSWebSocketCounters *)counters;
+
+@end
+
+@interface PSWebSocketDriver ()
+
+/**
+ *  Counters the driver records into, owned by the driver. Its delegate adds
+ *  what only the transport side knows.
+ */
+@property (nonatomic, assign, readonly) PSWebSocketCounters *counters;
+
+@end
@@ -0,0 +1,61 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Immutable view over the buffer a received message was collected into.
+ *  The driver hands the buffer off and never writes to it again, so the
+ *  view shares its bytes instead of copying them.
+ */
+@interface PSWebSocketDataView : NSData
+
+#pragma mark - Initialization
+
+/**
+ *  @param data buffer nothing else writes to from now on
+ *
+ *  @return a view sharing the buffer's bytes
+ */
+- (instancetype)initWithMutableData:(NSMutableData *)data;
+
+@end
+
+/**
+ *  Text message delivered as its UTF-8 bytes, already validated by the
+ *  driver so it can be handed to parsers that consume UTF-8 without being
+ *  decoded into an NSString first.
+ */
+@interface PSWebSocketUTF8Data : PSWebSocketDataView
+
+#pragma mark - Properties
+
+/**
+ *  Whether every byte is ASCII.
+ */
+@property (nonatomic, assign, readonly) BOOL ascii;
+
+#pragma mark - Initialization
+
+- (instancetype)initWithMutableData:(NSMutableData *)data ascii:(BOOL)ascii;
+
+#pragma mark - Actions
+
+/**
+ *  The text as an NSString. Pure ASCII text is viewed in place and keeps
+ *  the bytes alive for as long as the string, other text is transcoded.
+ */
+- (NSString *)string;
+
+@end
@@ -0,0 +1,83 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketDataView.h"
+#import "PSWebSocketUTF8Decoder.h"
+
+static void PSWebSocketUTF8DataReleaseOwner(void *ptr, void *info) {
+    CFRelease(info);
+}
+
+@interface PSWebSocketDataView() {
+    NSMutableData *_data;
+}
+@end
+@implementation PSWebSocketDataView
+
+#pragma mark - Initialization
+
+- (instancetype)initWithMutableData:(NSMutableData *)data {
+    if((self = [super init])) {
+        _data = data ?: [NSMutableData data];
+    }
+    return self;
+}
+
+#pragma mark - NSData
+
+- (const void *)bytes {
+    return _data.bytes;
+}
+- (NSUInteger)length {
+    return _data.length;
+}
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+    return self;
+}
+
+@end
+
+@implementation PSWebSocketUTF8Data
+
+#pragma mark - Initialization
+
+- (instancetype)initWithMutableData:(NSMutableData *)data ascii:(BOOL)ascii {
+    if((self = [super initWithMutableData:data])) {
+        _ascii = ascii;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (NSString *)string {
+    if(!_ascii) {
+        return PSWebSocketUTF8DecoderString(self.bytes, self.length);
+    }
+    
+    // the string owns a reference to us through its contents deallocator,
+    // CF calls it straight away if it copies short strings instead
+    CFAllocatorContext context = {0};
+    context.info = (__bridge_retained void *)self;
+    context.deallocate = PSWebSocketUTF8DataReleaseOwner;
+    CFAllocatorRef owner = CFAllocatorCreate(kCFAllocatorDefault, &context);
+    NSString *string = CFBridgingRelease(CFStringCreateWithBytesNoCopy(kCFAllocatorDefault, self.bytes, self.length, kCFStringEncodingASCII, false, owner));
+    CFRelease(owner);
+    return string;
+}
+
+@end
@@ -13,12 +13,17 @@
 //  limitations under the License.
 
 #import <Foundation/Foundation.h>
+#import "PSWebSocketCompressionPolicy.h"
 
 @interface PSWebSocketDeflater : NSObject
 
 #pragma mark - Initialization
 
 - (instancetype)initWithWindowBits:(NSInteger)windowBits memoryLevel:(NSUInteger)memoryLevel;
+- (instancetype)initWithWindowBits:(NSInteger)windowBits
+                       memoryLevel:(NSUInteger)memoryLevel
+                             level:(NSInteger)level
+                          strategy:(PSWebSocketCompressionStrategy)strategy;
 
 #pragma mark - Actions
 
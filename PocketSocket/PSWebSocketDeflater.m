@@ -12,17 +12,17 @@
 //  See the License for the specific language governing permissions and
 //  limitations under the License.
 
-#import "PSWebSocketDeflater.h"
 #import "PSWebSocketDeflater.h"
 #import "PSWebSocketInternal.h"
+#import "PSWebSocketZlibPool.h"
 #import <zlib.h>
 
 @interface PSWebSocketDeflater() {
     NSInteger _windowBits;
     NSUInteger _memoryLevel;
-    uint8_t _chunkBuffer[16384];
-    z_stream _stream;
-    BOOL _ready;
+    int _level;
+    int _strategy;
+    z_stream *_stream;
     
     NSMutableData *_buffer;
 }
@@ -32,14 +32,27 @@
 #pragma mark - Initialization
 
 - (instancetype)initWithWindowBits:(NSInteger)windowBits memoryLevel:(NSUInteger)memoryLevel {
+    return [self initWithWindowBits:windowBits memoryLevel:memoryLevel level:Z_DEFAULT_COMPRESSION strategy:PSWebSocketCompressionStrategyFixed];
+}
+- (instancetype)initWithWindowBits:(NSInteger)windowBits
+                       memoryLevel:(NSUInteger)memoryLevel
+                             level:(NSInteger)level
+                          strategy:(PSWebSocketCompressionStrategy)strategy {
     if((self = [super init])) {
-        _windowBits = windowBits;
+        // zlib raises 8 bit raw windows to 9 itself, pool them as such
+        _windowBits = MIN(windowBits, -9);
         _memoryLevel = memoryLevel;
+        _level = (int)level;
+        switch(strategy) {
+            case PSWebSocketCompressionStrategyFiltered: _strategy = Z_FILTERED; break;
+            case PSWebSocketCompressionStrategyHuffmanOnly: _strategy = Z_HUFFMAN_ONLY; break;
+            case PSWebSocketCompressionStrategyRLE: _strategy = Z_RLE; break;
+            case PSWebSocketCompressionStrategyFixed: _strategy = Z_FIXED; break;
+            default: _strategy = Z_DEFAULT_STRATEGY; break;
+        }
         NSAssert(_windowBits >= -15 && _windowBits <= -1, @"windowBits must be between -15 and -1");
         NSAssert(_memoryLevel >= 1 && _memoryLevel <= 9, @"memory level must be between 1 and 9");
-        bzero(&_stream, sizeof(_stream));
-        bzero(_chunkBuffer, sizeof(_chunkBuffer));
-        _ready = NO;
+        NSAssert(_level >= -1 && _level <= 9, @"level must be between -1 and 9");
     }
     return self;
 }
@@ -58,23 +71,25 @@
     NSParameterAssert(length);
     
     // set input properties
-    _stream.avail_in = (uInt)length;
-    _stream.next_in = (Bytef *)bytes;
+    _stream->avail_in = (uInt)length;
+    _stream->next_in = (Bytef *)bytes;
     
-    // inflate loop
+    // deflate loop, straight into the buffer sized for the worst case plus
+    // the sync flush marker so one pass is almost always enough
     do {
+        NSUInteger offset = _buffer.length;
+        uLong bound = deflateBound(_stream, _stream->avail_in) + 16;
+        _buffer.length = offset + bound;
+        
         // set output properties
-        _stream.avail_out = (uInt)sizeof(_chunkBuffer);
-        _stream.next_out = (Bytef *)_chunkBuffer;
+        _stream->avail_out = (uInt)bound;
+        _stream->next_out = (Bytef *)_buffer.mutableBytes + offset;
         
-        deflate(&_stream, Z_SYNC_FLUSH);
+        deflate(_stream, Z_SYNC_FLUSH);
         
-        // determine number of bytes inflated
-        uInt gotBack = sizeof(_chunkBuffer) - _stream.avail_out;
-        if(gotBack > 0) {
-            [_buffer appendBytes:_chunkBuffer length:gotBack];
-        }
-    } while(_stream.avail_out == 0);
+        // trim to the number of bytes deflated
+        _buffer.length = offset + (bound - _stream->avail_out);
+    } while(_stream->avail_out == 0);
     
     return YES;
 }
@@ -88,24 +103,29 @@
     return YES;
 }
 - (void)reset {
-    if(_ready) {
-        _buffer = nil;
-        deflateEnd(&_stream);
-        bzero(&_stream, sizeof(_stream));
-        bzero(_chunkBuffer, sizeof(_chunkBuffer));
-        _ready = NO;
+    _buffer = nil;
+    if(_stream) {
+        [[PSWebSocketZlibPool sharedPool] relinquishDeflateStream:_stream
+                                                       windowBits:(int)_windowBits
+                                                      memoryLevel:(int)_memoryLevel
+                                                            level:_level
+                                                         strategy:_strategy];
+        _stream = NULL;
     }
 }
 
 #pragma mark - Private
 
 - (BOOL)ensureReady:(NSError *__autoreleasing *)outError {
-    if(!_ready) {
-        if(deflateInit2(&_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, _windowBits, _memoryLevel, Z_FIXED) != Z_OK) {
+    if(!_stream) {
+        _stream = [[PSWebSocketZlibPool sharedPool] deflateStreamWithWindowBits:(int)_windowBits
+                                                                    memoryLevel:(int)_memoryLevel
+                                                                          level:_level
+                                                                       strategy:_strategy];
+        if(!_stream) {
             PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Failed to initialize deflate stream");
             return NO;
         }
-        _ready = YES;
     }
     return YES;
 }
@@ -14,6 +14,10 @@
 
 #import <Foundation/Foundation.h>
 #import "PSWebSocketTypes.h"
+#import "PSWebSocketPreparedMessage.h"
+#import "PSWebSocketCompressionPolicy.h"
+#import "PSWebSocketLimits.h"
+#import "PSWebSocketStatistics.h"
 
 @class PSWebSocketDriver;
 
@@ -29,6 +33,13 @@
 - (void)driver:(PSWebSocketDriver *)driver didCloseWithCode:(NSInteger)code reason:(NSString *)reason;
 - (void)driver:(PSWebSocketDriver *)driver write:(NSData *)data;
 
+@optional
+
+// required when streamsMessages is enabled
+- (void)driver:(PSWebSocketDriver *)driver didBeginMessage:(PSWebSocketMessageType)type;
+- (void)driver:(PSWebSocketDriver *)driver didReceiveMessageChunk:(NSData *)chunk;
+- (void)driverDidFinishMessage:(PSWebSocketDriver *)driver;
+
 @end
 @interface PSWebSocketDriver : NSObject
 
@@ -44,20 +55,122 @@
 
 @property (nonatomic, strong) NSString *protocol;
 
+/**
+ *  Deliver text and binary messages through the didBeginMessage:,
+ *  didReceiveMessageChunk: and driverDidFinishMessage: delegate methods as
+ *  their payload is unmasked and inflated instead of collecting them into a
+ *  single didReceiveMessage: call. Text chunks are validated UTF-8 but may
+ *  split a multi byte sequence. Applies from the next message on.
+ */
+@property (nonatomic, assign) BOOL streamsMessages;
+
+/**
+ *  What didReceiveMessage: is given for text and binary messages. Every mode
+ *  but PSWebSocketMessageDeliveryString hands the message buffer off as an
+ *  immutable view without copying it. Applies from the next message on.
+ */
+@property (nonatomic, assign) PSWebSocketMessageDelivery messageDelivery;
+
+/**
+ *  Which outgoing messages are deflated when permessage-deflate is
+ *  negotiated. Window bits, context takeover, memory level, level and
+ *  strategy are used during the handshake so set it before starting.
+ *  Defaults to
+ *  +[PSWebSocketCompressionPolicy defaultPolicy].
+ */
+@property (nonatomic, copy) PSWebSocketCompressionPolicy *compressionPolicy;
+
+/**
+ *  Bounds on incoming frames and messages, see PSWebSocketLimits. Defaults to
+ *  +[PSWebSocketLimits defaultLimits].
+ */
+@property (nonatomic, copy) PSWebSocketLimits *limits;
+
+/**
+ *  Whether the frames of an outgoing message can be discarded before being
+ *  written without corrupting later messages, which is not the case once
+ *  the peer inflates with its context kept between messages.
+ */
+@property (nonatomic, assign, readonly) BOOL framesAreIndependent;
+
+/**
+ *  Negative window bits, as zlib takes them for raw deflate, the local
+ *  deflater was negotiated with or 0 when permessage-deflate is off.
+ */
+@property (nonatomic, assign, readonly) NSInteger deflateWindowBits;
+
 #pragma mark - Initialization
 
 + (instancetype)clientDriverWithRequest:(NSURLRequest *)request;
 + (instancetype)serverDriverWithRequest:(NSURLRequest *)request;
 
+/**
+ *  Server driver for the raw bytes of a request head, which are parsed in
+ *  place when the driver starts without building an NSURLRequest.
+ */
++ (instancetype)serverDriverWithHandshake:(NSData *)handshake;
+
 #pragma mark - Actions
 
 - (void)start;
 - (void)sendText:(NSString *)text;
 - (void)sendBinary:(NSData *)binary;
+
+/**
+ *  Send one fragment of a text or binary message. The first fragment carries
+ *  the message type and the final one completes it, no other text or binary
+ *  message may be sent in between although control frames may.
+ */
+- (void)sendFragment:(NSData *)fragment type:(PSWebSocketMessageType)type first:(BOOL)first final:(BOOL)final;
+
+/**
+ *  Send a message framed ahead of time. Server mode drivers write the shared
+ *  encoding matching their negotiated compression, client mode drivers mask
+ *  every frame and so frame it like sendText: or sendBinary:.
+ */
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message;
+
+/**
+ *  Send a message framed ahead of time in either mode, split into frames
+ *  of at most fragmentLength payload bytes so control frames can be sent
+ *  in between. Its deflated encoding was built with a fresh context which
+ *  any peer can inflate, the local context is reset after it.
+ */
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message fragmentLength:(NSUInteger)fragmentLength;
+
+/**
+ *  Like sendPreparedMessage:fragmentLength: with the compression decision
+ *  already taken by deflateWindowBitsForLength:, the encoding for non zero
+ *  window bits is deflated with the compression policy's parameters.
+ */
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message
+          deflateWindowBits:(NSInteger)windowBits
+             fragmentLength:(NSUInteger)fragmentLength;
+
+/**
+ *  Decide whether an outgoing message of the given length is deflated, as
+ *  every send does, counting toward the adaptive policy's skip window. Call
+ *  once per message in send order.
+ *
+ *  @return deflateWindowBits or 0 when the message goes out uncompressed
+ */
+- (NSInteger)deflateWindowBitsForLength:(NSUInteger)length;
+
+/**
+ *  Account for a message deflated off the driver's queue so the adaptive
+ *  compression policy and statistics see it.
+ */
+- (void)recordDeflateOfLength:(NSUInteger)length toLength:(NSUInteger)deflatedLength duration:(CFTimeInterval)duration;
 - (void)sendCloseCode:(NSInteger)code reason:(NSString *)reason;
 - (void)sendPing:(NSData *)data;
 - (void)sendPong:(NSData *)data;
 
 - (NSUInteger)execute:(void *)bytes maxLength:(NSUInteger)maxLength;
 
+/**
+ *  Snapshot of the frames, messages and compression the driver has seen.
+ *  Safe to call from any thread.
+ */
+- (PSWebSocketStatistics *)statistics;
+
 @end
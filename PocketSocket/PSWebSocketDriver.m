@@ -18,62 +18,120 @@
 #import "PSWebSocketDeflater.h"
 #import "PSWebSocketBuffer.h"
 #import "PSWebSocketUTF8Decoder.h"
+#import "PSWebSocketMask.h"
 #import "PSWebSocketInternal.h"
+#import "PSWebSocketHTTPParser.h"
+#import "PSWebSocketCounters.h"
+#import "PSWebSocketDataView.h"
 #if TARGET_OS_IPHONE
 #import <Endian.h>
 #endif
 #import <CommonCrypto/CommonCrypto.h>
 
-@interface PSWebSocketFrame : NSObject {
-@public
-    BOOL fin;
-    BOOL rsv1;
-    BOOL rsv2;
-    BOOL rsv3;
+// frame whose payload is being read
+typedef struct {
     PSWebSocketOpCode opcode;
+    BOOL fin;
     BOOL masked;
-    NSUInteger payloadLength;
-    BOOL control;
-    NSUInteger headerExtraLength;
     uint8_t maskKey[4];
     uint32_t maskOffset;
-    NSMutableData *buffer;
+    NSUInteger payloadLength;
     NSUInteger payloadRemainingLength;
+} PSWebSocketDriverFrame;
+
+// text or binary message in progress, control frames may arrive between its frames
+typedef struct {
+    PSWebSocketDriverFrame frame;
+    BOOL active;
+    PSWebSocketOpCode opcode;
     BOOL pmd;
-}
-@end
-@implementation PSWebSocketFrame
+    BOOL streamed;
+} PSWebSocketDriverMessage;
 
-@end
+// control frame in progress, its payload is never longer than 125 bytes
+typedef struct {
+    PSWebSocketDriverFrame frame;
+    uint8_t payload[125];
+    NSUInteger length;
+} PSWebSocketDriverControl;
 
 typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     PSWebSocketDriverStateHandshakeRequest = 0,
     PSWebSocketDriverStateHandshakeResponse,
     PSWebSocketDriverStateFrameHeader,
-    PSWebSocketDriverStateFrameHeaderExtra,
     PSWebSocketDriverStateFramePayload
 };
 
+// messages sent uncompressed once adaptive compression decides to pause
+static const NSUInteger PSWebSocketDriverAdaptiveSkipCount = 32;
+
+// inflated length below which messages are never held to the inflate ratio limit
+static const NSUInteger PSWebSocketDriverInflateRatioFloor = 64 * 1024;
+
+// window bits we can deflate with, zlib does not support 8 bit raw windows
+static inline NSUInteger PSWebSocketDriverWindowBits(NSUInteger windowBits) {
+    return MAX(9, MIN(15, windowBits));
+}
+
+// window bits parameter value, 0 when none was given and -1 when out of range
+static inline NSInteger PSWebSocketDriverParseWindowBits(PSWebSocketHTTPSlice value) {
+    if(!value.bytes) {
+        return 0;
+    }
+    NSInteger windowBits = 0;
+    for(NSUInteger i = 0; i < value.length; ++i) {
+        if(value.bytes[i] < '0' || value.bytes[i] > '9' || windowBits > 15) {
+            return -1;
+        }
+        windowBits = windowBits * 10 + (value.bytes[i] - '0');
+    }
+    return (windowBits >= 8 && windowBits <= 15) ? windowBits : -1;
+}
+
+static void PSWebSocketDriverAppendFormat(char *buffer, NSUInteger capacity, NSUInteger *length, const char *format, ...) {
+    if(*length >= capacity) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int written = vsnprintf(buffer + *length, capacity - *length, format, args);
+    va_end(args);
+    *length = (written < 0) ? capacity : MIN(capacity, *length + (NSUInteger)written);
+}
+
 @interface PSWebSocketDriver() {
     NSURLRequest *_request;
+    NSData *_handshake;
     PSWebSocketDriverState _state;
     
     BOOL _failed;
     
     NSString *_handshakeSecKey;
     
-    NSMutableArray *_frames;
+    PSWebSocketDriverMessage _message;
+    PSWebSocketDriverControl _control;
+    PSWebSocketDriverFrame *_frame;
+    NSMutableData *_messageBuffer;
     
     BOOL _pmdEnabled;
     NSInteger _pmdClientWindowBits;
     BOOL _pmdClientNoContextTakeover;
     NSInteger _pmdServerWindowBits;
     BOOL _pmdServerNoContextTakeover;
+    BOOL _pmdClientWindowBitsOffered;
     PSWebSocketInflater *_inflater;
     PSWebSocketDeflater *_deflater;
+    BOOL _pmdWritingDeflated;
+    double _pmdRatio;
+    double _pmdThroughput;
+    NSUInteger _pmdSkipCount;
     
     uint32_t _utf8DecoderState;
-    uint32_t _utf8DecoderCodePoint;
+    BOOL _utf8DecoderASCII;
+    
+    NSUInteger _messageLength;
+    NSUInteger _messageDeflatedLength;
+    NSUInteger _messageInflatedLength;
 }
 @end
 @implementation PSWebSocketDriver
@@ -98,26 +156,67 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     return NO;
 }
 
+#pragma mark - Properties
+
+- (void)setCompressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy {
+    _compressionPolicy = [compressionPolicy copy] ?: [PSWebSocketCompressionPolicy defaultPolicy];
+    _pmdSkipCount = 0;
+}
+- (void)setLimits:(PSWebSocketLimits *)limits {
+    _limits = [limits copy] ?: [PSWebSocketLimits defaultLimits];
+}
+- (BOOL)framesAreIndependent {
+    if(!_pmdEnabled) {
+        return YES;
+    }
+    return (_mode == PSWebSocketModeClient) ? _pmdClientNoContextTakeover : _pmdServerNoContextTakeover;
+}
+
+- (NSInteger)deflateWindowBits {
+    if(!_pmdEnabled) {
+        return 0;
+    }
+    return (_mode == PSWebSocketModeClient) ? _pmdClientWindowBits : _pmdServerWindowBits;
+}
+
 #pragma mark - Initialization
 
 + (instancetype)clientDriverWithRequest:(NSURLRequest *)request {
     return [[self alloc] initWithMode:PSWebSocketModeClient request:request];
 }
 + (instancetype)serverDriverWithRequest:(NSURLRequest *)request {
-    return [[self alloc] initWithMode:PSWebSocketModeServer request:request];
+    return [[self alloc] initWithMode:PSWebSocketModeServer request:request handshake:nil];
+}
++ (instancetype)serverDriverWithHandshake:(NSData *)handshake {
+    return [[self alloc] initWithMode:PSWebSocketModeServer request:nil handshake:handshake];
 }
 - (instancetype)initWithMode:(PSWebSocketMode)mode request:(NSURLRequest *)request {
-    NSParameterAssert(request);
+    return [self initWithMode:mode request:request handshake:nil];
+}
+- (instancetype)initWithMode:(PSWebSocketMode)mode request:(NSURLRequest *)request handshake:(NSData *)handshake {
+    NSParameterAssert(request || (handshake && mode == PSWebSocketModeServer));
     if((self = [super init])) {
         _mode = mode;
         _state = (_mode == PSWebSocketModeClient) ? PSWebSocketDriverStateHandshakeRequest : PSWebSocketDriverStateHandshakeResponse;
         _request = [request mutableCopy];
-        _frames = [NSMutableArray array];
+        _handshake = [handshake copy];
+        _frame = NULL;
         _utf8DecoderState = 0;
-        _utf8DecoderCodePoint = 0;
+        _utf8DecoderASCII = YES;
         _pmdEnabled = YES;
-        _pmdClientWindowBits = -11;
-        _pmdServerWindowBits = -11;
+        _pmdClientWindowBits = -15;
+        _pmdServerWindowBits = -15;
+        _pmdClientWindowBitsOffered = NO;
+        _pmdRatio = 0.0;
+        _pmdThroughput = 0.0;
+        _pmdSkipCount = 0;
+        _compressionPolicy = [PSWebSocketCompressionPolicy defaultPolicy];
+        _limits = [PSWebSocketLimits defaultLimits];
+        _messageLength = 0;
+        _messageDeflatedLength = 0;
+        _messageInflatedLength = 0;
+        _messageDelivery = PSWebSocketMessageDeliveryString;
+        _counters = calloc(1, sizeof(PSWebSocketCounters));
     }
     return self;
 }
@@ -145,6 +244,7 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     NSError *error = nil;
     NSInteger bytesRead = 0;
     NSUInteger totalBytesRead = 0;
+    CFAbsoluteTime start = CFAbsoluteTimeGetCurrent();
     while(totalBytesRead < maxLength) {
         bytesRead = [self readBytes:bytes maxLength:maxLength - totalBytesRead error:&error];
         if(bytesRead < 0) {
@@ -160,8 +260,12 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
         totalBytesRead += bytesRead;
         bytes += bytesRead;
     }
+    PSWebSocketCounterAdd(&_counters->driverNanoseconds, PSWebSocketNanosecondsSince(start));
     return totalBytesRead;
 }
+- (PSWebSocketStatistics *)statistics {
+    return [[PSWebSocketStatistics alloc] initWithCounters:_counters];
+}
 - (void)sendText:(NSString *)text {
     NSData *data = [text dataUsingEncoding:NSUTF8StringEncoding];
     [self writeMessageWithOpCode:PSWebSocketOpCodeText data:data];
@@ -169,6 +273,78 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
 - (void)sendBinary:(NSData *)binary {
     [self writeMessageWithOpCode:PSWebSocketOpCodeBinary data:binary];
 }
+- (void)sendFragment:(NSData *)fragment type:(PSWebSocketMessageType)type first:(BOOL)first final:(BOOL)final {
+    PSWebSocketOpCode opcode = (type == PSWebSocketMessageTypeText) ? PSWebSocketOpCodeText : PSWebSocketOpCodeBinary;
+    [self writeFrameWithOpCode:opcode data:fragment first:first final:final];
+}
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message {
+    if(_mode == PSWebSocketModeClient) {
+        if([message.message isKindOfClass:[NSString class]]) {
+            [self sendText:message.message];
+        } else {
+            [self sendBinary:message.message];
+        }
+        return;
+    }
+    
+    [self sendPreparedMessage:message fragmentLength:NSUIntegerMax];
+}
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message fragmentLength:(NSUInteger)fragmentLength {
+    NSUInteger length = ([message.message isKindOfClass:[NSString class]]) ? [message.message lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : [message.message length];
+    NSInteger windowBits = [self deflateWindowBitsForLength:length];
+    if(windowBits != 0) {
+        // encodings are cached, only the first connection pays for the deflate
+        CFAbsoluteTime deflateStart = CFAbsoluteTimeGetCurrent();
+        NSArray *frames = [message framesForDeflateWindowBits:windowBits compressionPolicy:_compressionPolicy error:nil];
+        if(frames) {
+            [self recordDeflateOfLength:length toLength:[frames[1] length] duration:CFAbsoluteTimeGetCurrent() - deflateStart];
+        }
+    }
+    [self sendPreparedMessage:message deflateWindowBits:windowBits fragmentLength:fragmentLength];
+}
+- (void)sendPreparedMessage:(PSWebSocketPreparedMessage *)message
+          deflateWindowBits:(NSInteger)windowBits
+             fragmentLength:(NSUInteger)fragmentLength
+{
+    NSUInteger length = ([message.message isKindOfClass:[NSString class]]) ? [message.message lengthOfBytesUsingEncoding:NSUTF8StringEncoding] : [message.message length];
+    NSError *error = nil;
+    NSArray *frames = [message framesForDeflateWindowBits:windowBits compressionPolicy:_compressionPolicy error:&error];
+    if(!frames) {
+        [self failWithError:error];
+        return;
+    }
+    
+    // the shared encoding did not use our context but the peer's window now
+    // holds it, start over so later messages never reference stale offsets
+    if(windowBits != 0) {
+        [_deflater reset];
+        PSWebSocketCounterAdd(&_counters->uncompressedBytesSent, length);
+        PSWebSocketCounterAdd(&_counters->compressedBytesSent, [frames[1] length]);
+    }
+    PSWebSocketCounterAdd(&_counters->messagesSent, 1);
+    
+    // unmasked frames that fit are shared as is
+    NSData *payload = frames[1];
+    fragmentLength = MAX(fragmentLength, (NSUInteger)1);
+    if(_mode == PSWebSocketModeServer && payload.length <= fragmentLength) {
+        PSWebSocketCounterAdd(&_counters->framesSent, 1);
+        [_delegate driver:self write:frames[0]];
+        [_delegate driver:self write:payload];
+        return;
+    }
+    
+    // the first fragment keeps the opcode and rsv1, the rest continue it
+    uint8_t headerByte = (uint8_t)(((const uint8_t *)[frames[0] bytes])[0] & ~PSWebSocketFinMask);
+    NSUInteger offset = 0;
+    do {
+        NSUInteger fragment = MIN(payload.length - offset, fragmentLength);
+        BOOL final = (offset + fragment == payload.length);
+        NSData *data = (offset == 0 && final) ? payload : [payload subdataWithRange:NSMakeRange(offset, fragment)];
+        [self writeFrameWithHeaderByte:(uint8_t)((final) ? headerByte | PSWebSocketFinMask : headerByte) payload:data];
+        headerByte = PSWebSocketOpCodeContinuation;
+        offset += fragment;
+    } while(offset < payload.length);
+}
 - (void)sendCloseCode:(NSInteger)code reason:(NSString *)reason {
     NSUInteger reasonMaxLength = [reason maximumLengthOfBytesUsingEncoding:NSUTF8StringEncoding];
     NSMutableData *data = [NSMutableData dataWithLength:sizeof(uint16_t) + reasonMaxLength];
@@ -230,10 +406,10 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     }];
     
     // extensions
-    NSMutableArray *extensionComponents = [NSMutableArray array];
-    [extensionComponents addObjectsFromArray:[self pmdExtensionsHeaderComponents]];
-    if(extensionComponents.count > 0) {
-        NSString *value = [extensionComponents componentsJoinedByString:@"; "];
+    char extensions[256];
+    NSUInteger extensionsLength = [self pmdWriteExtensions:extensions capacity:sizeof(extensions)];
+    if(extensionsLength > 0) {
+        NSString *value = [[NSString alloc] initWithBytes:extensions length:extensionsLength encoding:NSASCIIStringEncoding];
         CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Sec-WebSocket-Extensions"), (__bridge CFStringRef)value);
     }
     
@@ -252,49 +428,47 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
 - (void)writeHandshakeResponse {
     NSAssert(_state == PSWebSocketDriverStateHandshakeResponse, @"Cannot start a driver more than once");
     
-    // get headers
-    NSDictionary *headers = _request.allHTTPHeaderFields;
+    // parse the raw handshake in place, drivers created from an
+    // NSURLRequest point the slices at its header values instead
+    PSWebSocketHTTPHead head;
+    BOOL valid = NO;
+    if(_handshake) {
+        valid = (PSWebSocketHTTPParseRequest(_handshake.bytes, _handshake.length, &head) == PSWebSocketHTTPParseResultComplete &&
+                 PSWebSocketHTTPHeadIsUpgradeRequest(&head));
+    } else {
+        NSDictionary *headers = _request.allHTTPHeaderFields;
+        memset(&head, 0, sizeof(head));
+        head.key = PSWebSocketHTTPSliceWithString(headers[@"Sec-WebSocket-Key"]);
+        head.extensions = PSWebSocketHTTPSliceWithString(headers[@"Sec-WebSocket-Extensions"]);
+        valid = [[self class] isWebSocketRequest:_request];
+    }
     
     // validate is websocket
-    if(![[self class] isWebSocketRequest:_request]) {
+    if(!valid) {
         [self failWithErrorCode:-1 reason:@"Invalid websocket request"];
         return;
     }
     
     // validate extensions
-    NSOrderedSet *extensionComponents = PSHTTPHeaderFieldValues([headers[@"Sec-WebSocket-Extensions"] lowercaseString]);
-    if(![self pmdConfigureWithExtensionsHeaderComponents:extensionComponents]) {
+    if(![self pmdConfigureWithExtensions:head.extensions]) {
         [self failWithErrorCode:PSWebSocketErrorCodeHandshakeFailed reason:@"invalid permessage-deflate extension parameters"];
         return;
     }
     
-    // set key
-    _handshakeSecKey = headers[@"Sec-WebSocket-Key"];
-    
-    // create response
-    CFHTTPMessageRef msg = CFHTTPMessageCreateResponse(kCFAllocatorDefault, 101, CFSTR("Switching Protocols"), kCFHTTPVersion1_1);
-    CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Connection"), CFSTR("Upgrade"));
-    CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Upgrade"), CFSTR("websocket"));
-    CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Sec-WebSocket-Accept"), (__bridge CFStringRef)[self acceptHeaderForKey:_handshakeSecKey]);
-    if (_protocol) {
-        CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Sec-WebSocket-Protocol"), (__bridge CFStringRef)_protocol);
-    }
-    
-    NSMutableArray *negotiatedExtensionComponents = [NSMutableArray array];
-    [negotiatedExtensionComponents addObjectsFromArray:[self pmdExtensionsHeaderComponents]];
-    if(negotiatedExtensionComponents.count > 0) {
-        NSString *value = [negotiatedExtensionComponents componentsJoinedByString:@"; "];
-        CFHTTPMessageSetHeaderFieldValue(msg, CFSTR("Sec-WebSocket-Extensions"), (__bridge CFStringRef)value);
+    // write response
+    char extensions[256];
+    NSUInteger extensionsLength = [self pmdWriteExtensions:extensions capacity:sizeof(extensions)];
+    char response[1024];
+    NSUInteger responseLength = PSWebSocketHTTPWriteUpgradeResponse(response,
+                                                                    sizeof(response),
+                                                                    head.key,
+                                                                    PSWebSocketHTTPSliceWithString(_protocol),
+                                                                    (PSWebSocketHTTPSlice){extensions, extensionsLength});
+    if(responseLength == 0) {
+        [self failWithErrorCode:PSWebSocketErrorCodeHandshakeFailed reason:@"Handshake response too large"];
+        return;
     }
-    
-    // serialize
-    NSData *handshakeData = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg));
-    
-    // write handshake
-    [_delegate driver:self write:handshakeData];
-    
-    // clean up
-    CFRelease(msg);
+    [_delegate driver:self write:[NSData dataWithBytes:response length:responseLength]];
     
     // transition state
     _state = PSWebSocketDriverStateFrameHeader;
@@ -302,29 +476,71 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     // open
     [_delegate driverDidOpen:self];
 }
+- (NSInteger)deflateWindowBitsForLength:(NSUInteger)length {
+    return (_pmdEnabled && [self shouldDeflateLength:length]) ? self.deflateWindowBits : 0;
+}
+- (BOOL)shouldDeflateLength:(NSUInteger)length {
+    if(length == 0 || length < _compressionPolicy.minimumLength) {
+        return NO;
+    }
+    if(_compressionPolicy.adaptive && _pmdSkipCount > 0) {
+        --_pmdSkipCount;
+        return NO;
+    }
+    return YES;
+}
+- (void)recordDeflateOfLength:(NSUInteger)length toLength:(NSUInteger)deflatedLength duration:(CFTimeInterval)duration {
+    PSWebSocketCounterAdd(&_counters->deflateNanoseconds, (uint64_t)(MAX(duration, 0.0) * NSEC_PER_SEC));
+    if(!_compressionPolicy.adaptive || length == 0) {
+        return;
+    }
+    
+    // running averages weighted 1/8 toward the latest message
+    double ratio = (double)deflatedLength / (double)length;
+    double throughput = (double)length / MAX(duration, 1e-9);
+    _pmdRatio = (_pmdRatio > 0.0) ? _pmdRatio + (ratio - _pmdRatio) / 8.0 : ratio;
+    _pmdThroughput = (_pmdThroughput > 0.0) ? _pmdThroughput + (throughput - _pmdThroughput) / 8.0 : throughput;
+    
+    // pause for a while then measure afresh
+    if(_pmdRatio > _compressionPolicy.maximumRatio ||
+       (_compressionPolicy.minimumThroughput > 0.0 && _pmdThroughput < _compressionPolicy.minimumThroughput)) {
+        _pmdSkipCount = PSWebSocketDriverAdaptiveSkipCount;
+        _pmdRatio = 0.0;
+        _pmdThroughput = 0.0;
+    }
+}
 - (void)writeMessageWithOpCode:(PSWebSocketOpCode)opcode data:(NSData *)data {
-    // create header
-    NSMutableData *header = [NSMutableData dataWithLength:2];
-    uint8_t *headerBytes = header.mutableBytes;
+    [self writeFrameWithOpCode:opcode data:data first:YES final:YES];
+}
+- (void)writeFrameWithOpCode:(PSWebSocketOpCode)opcode data:(NSData *)data first:(BOOL)first final:(BOOL)final {
+    BOOL control = PSWebSocketOpCodeIsControl(opcode);
     
-    headerBytes[0] |= PSWebSocketFinMask;
-    //  headerBytes[0] |= (PSWebSocketRsv2Mask);
-    //  headerBytes[0] |= (PSWebSocketRsv3Mask);
-    headerBytes[0] |= (PSWebSocketOpCodeMask & opcode);
+    // first header byte
+    uint8_t headerByte = 0;
+    if(final) {
+        headerByte |= PSWebSocketFinMask;
+    }
+    //  headerByte |= (PSWebSocketRsv2Mask);
+    //  headerByte |= (PSWebSocketRsv3Mask);
+    headerByte |= (PSWebSocketOpCodeMask & ((first) ? opcode : PSWebSocketOpCodeContinuation));
     
     // determine payload payload
     id payload = data;
     
-    // deflate payload
-    if(_pmdEnabled && !PSWebSocketOpCodeIsControl(opcode) && [payload length] > 0) {
-        // reset deflater if needed
-        if((_pmdClientNoContextTakeover && _mode == PSWebSocketModeClient) ||
-           (_pmdServerNoContextTakeover && _mode == PSWebSocketModeServer)) {
-            [_deflater reset];
+    // a message is compressed if its first fragment is, every fragment after follows
+    BOOL deflate = NO;
+    if(_pmdEnabled && !control) {
+        if(first) {
+            _pmdWritingDeflated = [self shouldDeflateLength:[payload length]];
         }
-        
-        // create deflate buffer
-        NSMutableData *deflated = [NSMutableData dataWithCapacity:[payload length]/4];
+        deflate = (_pmdWritingDeflated && [payload length] > 0);
+    }
+    
+    // deflate payload
+    if(deflate) {
+        // create deflate buffer, the deflater sizes it with deflateBound
+        NSMutableData *deflated = [NSMutableData data];
+        CFAbsoluteTime deflateStart = CFAbsoluteTimeGetCurrent();
         
         // error
         NSError *error = nil;
@@ -345,39 +561,47 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             return;
         }
         
-        // end deflater
-        if(![_deflater end:&error]) {
+        // end deflater, the trailing 00 00 ff ff is only stripped from the final fragment
+        if(final && ![_deflater end:&error]) {
             NSAssert(NO, error.localizedDescription);
             [self failWithError:error];
             [_deflater reset];
             return;
         }
         
+        CFTimeInterval deflateDuration = CFAbsoluteTimeGetCurrent() - deflateStart;
+        [self recordDeflateOfLength:[payload length] toLength:deflated.length duration:deflateDuration];
+        PSWebSocketCounterAdd(&_counters->uncompressedBytesSent, [payload length]);
+        PSWebSocketCounterAdd(&_counters->compressedBytesSent, deflated.length);
+        
         // reassign data
         payload = deflated;
-        
-        // set rsv1 mask
-        headerBytes[0] |= PSWebSocketRsv1Mask;
     }
     
-    // set payload length data
-    if([payload length] < 126) {
-        headerBytes[1] |= [payload length];
-    } else if([payload length] <= UINT16_MAX) {
-        headerBytes[1] |= 126;
-        uint16_t len = EndianU16_BtoN((uint16_t)[payload length]);
-        [header appendBytes:&len length:sizeof(len)];
-    } else {
-        headerBytes[1] |= 127;
-        uint64_t len = EndianU64_BtoN((uint64_t)[payload length]);
-        [header appendBytes:&len length:sizeof(len)];
+    // without context takeover the zlib context goes back to the pool between messages
+    if(final && _pmdEnabled && !control &&
+       ((_pmdClientNoContextTakeover && _mode == PSWebSocketModeClient) ||
+        (_pmdServerNoContextTakeover && _mode == PSWebSocketModeServer))) {
+        [_deflater reset];
     }
     
+    // set rsv1 mask on the first frame of compressed messages only
+    if(first && _pmdEnabled && !control && _pmdWritingDeflated) {
+        headerByte |= PSWebSocketRsv1Mask;
+    }
+    
+    if(final && !control) {
+        PSWebSocketCounterAdd(&_counters->messagesSent, 1);
+    }
+    [self writeFrameWithHeaderByte:headerByte payload:payload];
+}
+- (void)writeFrameWithHeaderByte:(uint8_t)headerByte payload:(id)payload {
+    // create header with payload length data
+    NSMutableData *header = [NSMutableData dataWithBytes:&headerByte length:sizeof(headerByte)];
+    PSWebSocketAppendFramePayloadLength(header, [payload length], (_mode == PSWebSocketModeClient));
+    
     // set masking data
     if(_mode == PSWebSocketModeClient) {
-        headerBytes = header.mutableBytes; // because -appendBytes may have realloced header
-        headerBytes[1] |= PSWebSocketMaskMask;
-        
         uint8_t maskKey[4];
         int result = SecRandomCopyBytes(kSecRandomDefault, sizeof(maskKey), maskKey);
         if (result != 0) {
@@ -391,12 +615,11 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
         }
         
         // mask payload inplace
-        uint8_t *payloadBytes = (uint8_t *)[payload mutableBytes];
-        for(NSUInteger i = 0; i < [payload length]; ++i) {
-            payloadBytes[i] = payloadBytes[i] ^ maskKey[i % sizeof(maskKey)];
-        }
+        PSWebSocketMaskBytes((uint8_t *)[payload mutableBytes], [payload length], maskKey, 0);
     }
     
+    PSWebSocketCounterAdd(&_counters->framesSent, 1);
+    
     // write data to delegate
     [_delegate driver:self write:header];
     [_delegate driver:self write:payload];
@@ -414,8 +637,9 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             NSAssert(maxLength > 0, @"Must have 1 or more bytes");
             NSAssert(_state == PSWebSocketDriverStateHandshakeResponse, @"Invalid state for reading handshake response");
             
-            void* boundary = memmem(bytes, maxLength, "\r\n\r\n", 4);
-            if (boundary == NULL) {
+            PSWebSocketHTTPHead head;
+            PSWebSocketHTTPParseResult result = PSWebSocketHTTPParseResponse(bytes, maxLength, &head);
+            if(result == PSWebSocketHTTPParseResultIncomplete) {
                 // do not allow too much data for headers
                 if(maxLength >= 16384) {
                     PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"HTTP headers did not finish after reading 16384 bytes");
@@ -423,31 +647,20 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
                 }
                 return 0;
             }
-            NSUInteger preBoundaryLength = boundary + 4 - bytes;
-            
-            // create handshake
-            CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(NULL, NO);
-            if (!CFHTTPMessageAppendBytes(msg, (const UInt8 *)bytes, preBoundaryLength)) {
+            if(result == PSWebSocketHTTPParseResultInvalid) {
                 PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"Not a valid HTTP response");
-                CFRelease(msg);
                 return -1;
             }
             
-            // validate complete
-            if(!CFHTTPMessageIsHeaderComplete(msg)) {
-                PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"HTTP headers found CRLFCRLF but not complete");
-                CFRelease(msg);
-                return -1;
-            }
-            
-            // get values
-            NSInteger statusCode = CFHTTPMessageGetResponseStatusCode(msg);
-            NSDictionary *headers = [CFBridgingRelease(CFHTTPMessageCopyAllHeaderFields(msg)) copy];
-            CFAutorelease(msg);
-            
             // validate status
+            NSInteger statusCode = head.statusCode;
             if(statusCode != 101) {
                 if(outError) {
+                    // the message is only built to hand the response to the error
+                    CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(NULL, NO);
+                    CFHTTPMessageAppendBytes(msg, (const UInt8 *)bytes, head.length);
+                    CFAutorelease(msg);
+                    
                     NSString* message = CFBridgingRelease(CFHTTPMessageCopyResponseStatusLine(msg));
                     if (!message)
                         message = [NSHTTPURLResponse localizedStringForStatusCode:statusCode];
@@ -466,19 +679,21 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             }
             
             // validate accept
-            if(![headers[@"Sec-WebSocket-Accept"] isEqualToString:[self acceptHeaderForKey:_handshakeSecKey]]) {
+            char accept[28];
+            PSWebSocketHTTPAcceptForKey(PSWebSocketHTTPSliceWithString(_handshakeSecKey), accept);
+            if(head.accept.length != sizeof(accept) || memcmp(head.accept.bytes, accept, sizeof(accept)) != 0) {
                 PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"Invalid Sec-WebSocket-Accept");
                 return -1;
             }
             
             // validate version
-            if(headers[@"Sec-WebSocket-Version"] && ![headers[@"Sec-WebSocket-Version"] isEqualToString:@"13"]) {
+            if(head.version.bytes && !PSWebSocketHTTPSliceEqualsString(head.version, "13")) {
                 PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"Invalid Sec-WebSocket-Version");
                 return -1;
             }
             
             // validate protocol
-            _protocol = headers[@"Sec-WebSocket-Protocol"];
+            _protocol = (head.protocol.bytes) ? [[NSString alloc] initWithBytes:head.protocol.bytes length:head.protocol.length encoding:NSUTF8StringEncoding] : nil;
             NSString* protocolRequest = _request.allHTTPHeaderFields[@"Sec-WebSocket-Protocol"];
             if (protocolRequest) {
                 NSArray *protocolComponents = [protocolRequest componentsSeparatedByString:@" "];
@@ -488,12 +703,9 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
                     return -1;
                 }
             }
-
-            // extensions
-            NSOrderedSet *extensionComponents = PSHTTPHeaderFieldValues([headers[@"Sec-WebSocket-Extensions"] lowercaseString]);
             
             // per-message deflate
-            if(![self pmdConfigureWithExtensionsHeaderComponents:extensionComponents]) {
+            if(![self pmdConfigureWithExtensions:head.extensions]) {
                 PSWebSocketSetOutError(outError, PSWebSocketErrorCodeHandshakeFailed, @"permessage-deflate could not negotiate parameters");
                 return -1;
             }
@@ -503,20 +715,34 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             
             [_delegate driverDidOpen:self];
             
-            return preBoundaryLength;
+            return head.length;
         }
         //
-        // FRAME HEADER
+        // FRAMES
         //
-        case PSWebSocketDriverStateFrameHeader: {
-            NSAssert(maxLength > 0, @"Must have 1 or more bytes");
-            
-            if(maxLength < 2) {
-                return 0;
+        case PSWebSocketDriverStateFrameHeader:
+        case PSWebSocketDriverStateFramePayload:
+            return [self readFrames:bytes maxLength:maxLength error:outError];
+        default:
+            return 0;
+    }
+    return 0;
+}
+- (NSInteger)readFrames:(uint8_t *)bytes maxLength:(NSUInteger)maxLength error:(NSError *__autoreleasing *)outError {
+    // parse as many frames as there are bytes for, only stopping early when a
+    // header is incomplete so the caller can provide it contiguously
+    NSUInteger offset = 0;
+    while(offset < maxLength) {
+        //
+        // HEADER
+        //
+        if(_state == PSWebSocketDriverStateFrameHeader) {
+            const uint8_t *header = bytes + offset;
+            NSUInteger available = maxLength - offset;
+            if(available < 2) {
+                break;
             }
             
-            const uint8_t *header = (const uint8_t *)bytes;
-            
             BOOL fin = !!(header[0] & PSWebSocketFinMask);
             BOOL rsv1 = !!(header[0] & PSWebSocketRsv1Mask);
             BOOL rsv2 = !!(header[0] & PSWebSocketRsv2Mask);
@@ -524,11 +750,16 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             PSWebSocketOpCode opcode = (header[0] & PSWebSocketOpCodeMask);
             BOOL masked = !!(header[1] & PSWebSocketMaskMask);
             uint64_t payloadLength = (header[1] & PSWebSocketPayloadLenMask);
-            uint32_t headerExtraLength = (masked) ? sizeof(uint32_t) : 0;
+            NSUInteger headerLength = 2 + ((masked) ? sizeof(uint32_t) : 0);
             if(payloadLength == 126) {
-                headerExtraLength += sizeof(uint16_t);
+                headerLength += sizeof(uint16_t);
             } else if(payloadLength == 127) {
-                headerExtraLength += sizeof(uint64_t);
+                headerLength += sizeof(uint64_t);
+            }
+            
+            // wait for the whole header
+            if(available < headerLength) {
+                break;
             }
             
             // validate opcode
@@ -561,12 +792,12 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
             // validate data frame
             else {
                 // data continuation frames must follow an initial data frame
-                if(opcode == PSWebSocketOpCodeContinuation && _frames.count == 0) {
+                if(opcode == PSWebSocketOpCodeContinuation && !_message.active) {
                     PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Data continuation frames must follow an initial data frame");
                     return -1;
                 }
                 // non data continuation frames must not follow an initial data frame
-                if(opcode != PSWebSocketOpCodeContinuation && _frames.count > 0) {
+                if(opcode != PSWebSocketOpCodeContinuation && _message.active) {
                     PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Data frames must not follow an initial data frame unless continuations");
                     return -1;
                 }
@@ -593,229 +824,265 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
                 return -1;
             }
             
-            // create frame
-            PSWebSocketFrame *frame = [[PSWebSocketFrame alloc] init];
-            frame->fin = fin;
-            frame->rsv1 = rsv1;
-            frame->rsv2 = rsv2;
-            frame->rsv3 = rsv3;
-            frame->opcode = opcode;
-            frame->masked = masked;
-            frame->payloadLength = (NSUInteger)payloadLength;
-            frame->payloadRemainingLength = (NSUInteger)payloadLength;
-            frame->headerExtraLength = headerExtraLength;
-            frame->control = control;
-            frame->pmd = (_pmdEnabled && !control && rsv1);
-            
-            if(!frame->control && _frames.count > 0) {
-                PSWebSocketFrame *lastFrame = [_frames lastObject];
-                frame->pmd = (_pmdEnabled && (rsv1 || lastFrame->pmd));
-                frame->opcode = lastFrame->opcode;
-                frame->buffer = lastFrame->buffer;
-            } else {
-                frame->buffer = [NSMutableData data];
-            }
-            [_frames addObject:frame];
-            
-            if(headerExtraLength > 0) {
-                _state = PSWebSocketDriverStateFrameHeaderExtra;
-            } else if(payloadLength > 0) {
-                _state = PSWebSocketDriverStateFramePayload;
-            } else {
-                _state = PSWebSocketDriverStateFrameHeader;
-                if(![self processFramesAndDelegate:outError]) {
-                    return -1;
-                }
+            // extended payload length
+            if(payloadLength == 126) {
+                uint16_t extendedLength = 0;
+                memcpy(&extendedLength, header + 2, sizeof(extendedLength));
+                payloadLength = EndianU16_BtoN(extendedLength);
+            } else if(payloadLength == 127) {
+                uint64_t extendedLength = 0;
+                memcpy(&extendedLength, header + 2, sizeof(extendedLength));
+                payloadLength = EndianU64_BtoN(extendedLength);
             }
-            return 2;
-        }
-        //
-        // FRAME HEADER EXTRA
-        //
-        case PSWebSocketDriverStateFrameHeaderExtra: {
-            NSAssert(maxLength > 0, @"Must have 1 or more bytes");
-            
-            // get current frame
-            PSWebSocketFrame *frame = [_frames lastObject];
             
-            // we need at least current frames header extra length
-            if(maxLength < frame->headerExtraLength) {
-                return 0;
+            // enforce limits before any of the payload is buffered
+            if(!control && ![self acceptPayloadLength:payloadLength control:NO error:outError]) {
+                return -1;
             }
             
-            uint64_t payloadLength = frame->payloadLength;
-            if(payloadLength == 126) {
-                payloadLength = EndianU16_BtoN(*(uint16_t *)bytes);
-            } else if(payloadLength == 127) {
-                payloadLength = EndianU64_BtoN(*(uint64_t *)bytes);
+            // fill in the frame
+            PSWebSocketDriverFrame *frame = (control) ? &_control.frame : &_message.frame;
+            frame->opcode = opcode;
+            frame->fin = fin;
+            frame->masked = masked;
+            if(masked) {
+                memcpy(frame->maskKey, header + headerLength - sizeof(uint32_t), sizeof(uint32_t));
             }
+            frame->maskOffset = 0;
             frame->payloadLength = (NSUInteger)payloadLength;
             frame->payloadRemainingLength = (NSUInteger)payloadLength;
             
-            if(frame->masked) {
-                memcpy(frame->maskKey, (uint8_t *)bytes + (frame->headerExtraLength - sizeof(uint32_t)), sizeof(uint32_t));
-                frame->maskOffset = 0;
+            if(control) {
+                _control.length = 0;
+            } else if(_message.active) {
+                _message.pmd = (_pmdEnabled && (rsv1 || _message.pmd));
+            } else {
+                _message.active = YES;
+                _message.opcode = opcode;
+                _message.pmd = (_pmdEnabled && rsv1);
+                _message.streamed = _streamsMessages;
+                if(_message.streamed) {
+                    [_delegate driver:self didBeginMessage:(opcode == PSWebSocketOpCodeText) ? PSWebSocketMessageTypeText : PSWebSocketMessageTypeBinary];
+                } else {
+                    _messageBuffer = [NSMutableData data];
+                }
             }
+            _frame = frame;
+            offset += headerLength;
+            PSWebSocketCounterAdd(&_counters->framesReceived, 1);
             
-            if(frame->payloadLength > 0) {
+            if(payloadLength > 0) {
                 _state = PSWebSocketDriverStateFramePayload;
-            } else {
-                _state = PSWebSocketDriverStateFrameHeader;
-                if(![self processFramesAndDelegate:outError]) {
-                    return -1;
-                }
+            } else if(![self processFrameAndDelegate:outError]) {
+                return -1;
             }
-            return frame->headerExtraLength;
+            continue;
         }
+        
         //
-        // FRAME PAYLOAD
+        // PAYLOAD
         //
-        case PSWebSocketDriverStateFramePayload: {
-            NSAssert(maxLength > 0, @"Must have 1 or more bytes");
-            
-            // get current frame
-            PSWebSocketFrame *frame = [_frames lastObject];
-            
-            NSUInteger consumeLength = MIN(frame->payloadRemainingLength, maxLength);
-            NSUInteger offset = frame->buffer.length;
-            
-            // unmask bytes if client -> server
-            if(_mode == PSWebSocketModeServer) {
-                uint8_t *unmaskedBytes = (uint8_t *)bytes;
-                uint8_t *maskKey = frame->maskKey;
-                for(NSInteger i = 0; i < consumeLength; ++i) {
-                    unmaskedBytes[i] = unmaskedBytes[i] ^ maskKey[frame->maskOffset++ % sizeof(uint32_t)];
-                }
-            }
-            
-            // inflate if necessary
-            if(frame->pmd) {
-                // reset inflater if we need to
-                if((_pmdClientNoContextTakeover && _mode == PSWebSocketModeServer) ||
-                   (_pmdServerNoContextTakeover && _mode == PSWebSocketModeClient)) {
-                    [_inflater reset];
-                }
-                
-                // begin the inflater
-                if(frame->payloadLength == frame->payloadRemainingLength) {
-                    if(![_inflater begin:frame->buffer error:outError]) {
-                        return -1;
-                    }
-                }
-                
-                // inflate bytes
-                if(![_inflater appendBytes:bytes length:consumeLength error:outError]) {
-                    return -1;
-                }
-                
-                // end inflater
-                if(frame->fin && frame->payloadRemainingLength == consumeLength) {
-                    if(![_inflater end:outError]) {
-                        return -1;
-                    }
-                }
-            }
-            // otherwise append
-            else {
-                [frame->buffer appendBytes:bytes length:consumeLength];
-            }
-            
-            // validate utf-8 if necessary
-            if(frame->opcode == PSWebSocketOpCodeText) {
-                uint8_t *bytes = (uint8_t *)(frame->buffer.bytes + offset);
-                for(NSUInteger i = 0; i < frame->buffer.length - offset; ++i) {
-                    // get validation result
-                    PSWebSocketUTF8DecoderDecode(&_utf8DecoderState, &_utf8DecoderCodePoint, *(bytes + i));
-                    
-                    // read bad code point
-                    if(_utf8DecoderState == PSWebSocketUTF8DecoderReject) {
-                        PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
-                        return -1;
-                    }
-                }
-                
-                // need more bytes & no data will be left
-                if(_utf8DecoderState > 1 && frame->fin && frame->payloadRemainingLength - consumeLength == 0) {
-                    PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
-                    return -1;
-                }
-            }
-            
-            // remove consumed length from remaining payload length
-            frame->payloadRemainingLength -= consumeLength;
-            
-            if(frame->payloadRemainingLength == 0) {
-                _state = PSWebSocketDriverStateFrameHeader;
-                if(![self processFramesAndDelegate:outError]) {
-                    return -1;
-                }
+        PSWebSocketDriverFrame *frame = _frame;
+        uint8_t *payload = bytes + offset;
+        NSUInteger consumeLength = MIN(frame->payloadRemainingLength, maxLength - offset);
+        
+        // unmask bytes if client -> server
+        if(frame->masked) {
+            PSWebSocketMaskBytes(payload, consumeLength, frame->maskKey, frame->maskOffset);
+            frame->maskOffset += consumeLength;
+        }
+        
+        // control payloads are copied aside, message payloads appended
+        if(frame == &_control.frame) {
+            memcpy(_control.payload + _control.length, payload, consumeLength);
+            _control.length += consumeLength;
+        } else if(![self appendMessagePayload:payload length:consumeLength error:outError]) {
+            return -1;
+        }
+        
+        // remove consumed length from remaining payload length
+        frame->payloadRemainingLength -= consumeLength;
+        offset += consumeLength;
+        
+        if(frame->payloadRemainingLength == 0) {
+            _state = PSWebSocketDriverStateFrameHeader;
+            if(![self processFrameAndDelegate:outError]) {
+                return -1;
             }
-            return consumeLength;
         }
-        default:
-            return 0;
     }
-    return 0;
+    return offset;
 }
-
-- (BOOL)processFramesAndDelegate:(NSError *__autoreleasing *)outError {
-    // get current frame
-    PSWebSocketFrame *frame = [_frames lastObject];
+- (BOOL)appendMessagePayload:(const void *)bytes length:(NSUInteger)length error:(NSError *__autoreleasing *)outError {
+    // streamed messages get a fresh buffer per chunk that is handed off below
+    NSMutableData *buffer = (_message.streamed) ? [NSMutableData data] : _messageBuffer;
+    NSUInteger offset = buffer.length;
+    
+    // inflate if necessary, NULL bytes flush the end of the message
+    if(_message.pmd) {
+        if(![_inflater begin:buffer error:outError] ||
+           ![self inflateBytes:bytes length:length buffer:buffer error:outError]) {
+            return NO;
+        }
+    }
+    // otherwise append
+    else if(bytes) {
+        [buffer appendBytes:bytes length:length];
+    }
+    
+    // validate utf-8 if necessary
+    if(_message.opcode == PSWebSocketOpCodeText && buffer.length > offset) {
+        const uint8_t *bytes = (const uint8_t *)buffer.bytes + offset;
+        if(PSWebSocketUTF8DecoderValidate(&_utf8DecoderState, bytes, buffer.length - offset, &_utf8DecoderASCII) == PSWebSocketUTF8DecoderReject) {
+            PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
+            return NO;
+        }
+    }
+    
+    // hand off streamed chunk
+    if(_message.streamed && buffer.length > 0) {
+        [_delegate driver:self didReceiveMessageChunk:buffer];
+    }
+    return YES;
+}
+- (BOOL)acceptPayloadLength:(uint64_t)payloadLength control:(BOOL)control error:(NSError *__autoreleasing *)outError {
+    // control frames are always short
+    if(control) {
+        return YES;
+    }
+    if(payloadLength > NSUIntegerMax - _messageLength ||
+       (_limits.maximumFrameLength > 0 && payloadLength > _limits.maximumFrameLength)) {
+        PSWebSocketSetOutError(outError, PSWebSocketStatusCodeMessageTooBig, @"Frame exceeds maximum length");
+        return NO;
+    }
+    _messageLength += (NSUInteger)payloadLength;
+    if(_limits.maximumMessageLength > 0 && _messageLength > _limits.maximumMessageLength) {
+        PSWebSocketSetOutError(outError, PSWebSocketStatusCodeMessageTooBig, @"Message exceeds maximum length");
+        return NO;
+    }
+    return YES;
+}
+- (BOOL)inflateBytes:(const void *)bytes length:(NSUInteger)length buffer:(NSMutableData *)buffer error:(NSError *__autoreleasing *)outError {
+    _messageDeflatedLength += length;
+    
+    // the inflater may only produce what is left under the inflated limits
+    NSUInteger maximumLength = NSUIntegerMax;
+    if(_limits.maximumInflatedLength > 0) {
+        maximumLength = (_limits.maximumInflatedLength > _messageInflatedLength) ? _limits.maximumInflatedLength - _messageInflatedLength : 0;
+    }
+    if(_limits.maximumInflateRatio > 0.0) {
+        double ratioLength = MAX(_limits.maximumInflateRatio * _messageDeflatedLength, (double)PSWebSocketDriverInflateRatioFloor);
+        if(ratioLength < (double)NSUIntegerMax) {
+            NSUInteger ratioMaximumLength = ((NSUInteger)ratioLength > _messageInflatedLength) ? (NSUInteger)ratioLength - _messageInflatedLength : 0;
+            maximumLength = MIN(maximumLength, ratioMaximumLength);
+        }
+    }
+    _inflater.maximumLength = maximumLength;
+    
+    NSUInteger offset = buffer.length;
+    BOOL success = (bytes) ? [_inflater appendBytes:bytes length:length error:outError] : [_inflater end:outError];
+    _messageInflatedLength += buffer.length - offset;
+    PSWebSocketCounterAdd(&_counters->compressedBytesReceived, length);
+    PSWebSocketCounterAdd(&_counters->uncompressedBytesReceived, buffer.length - offset);
+    return success;
+}
+- (BOOL)processFrameAndDelegate:(NSError *__autoreleasing *)outError {
+    // control frames are handled on their own, even in the middle of a message
+    if(_frame == &_control.frame) {
+        return [self processControlFrameAndDelegate:outError];
+    }
     
     // skip if not final
-    if(!frame->fin) {
+    if(!_message.frame.fin) {
         return YES;
     }
     
-    // close off pmd for zero-length frames that have a buffer otherwise they are orphaned
-    if (frame->pmd && frame->payloadLength == 0 && frame->buffer.length > 0) {
-        if (![_inflater end:outError]) {
-            return -1;
+    // flush the inflater, possibly after an empty final frame
+    if(_message.pmd && ![self appendMessagePayload:NULL length:0 error:outError]) {
+        return NO;
+    }
+    
+    // need more bytes & no data will be left
+    if(_message.opcode == PSWebSocketOpCodeText && _utf8DecoderState > 1) {
+        PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
+        return NO;
+    }
+    
+    // without context takeover the zlib context goes back to the pool between messages
+    if(_message.pmd &&
+       ((_pmdClientNoContextTakeover && _mode == PSWebSocketModeServer) ||
+        (_pmdServerNoContextTakeover && _mode == PSWebSocketModeClient))) {
+        [_inflater reset];
+    }
+    
+    // text payloads were already validated as they arrived
+    BOOL ascii = _utf8DecoderASCII;
+    NSMutableData *buffer = _messageBuffer;
+    
+    // reset message
+    _message.active = NO;
+    _messageBuffer = nil;
+    _utf8DecoderState = 0;
+    _utf8DecoderASCII = YES;
+    _messageLength = 0;
+    _messageDeflatedLength = 0;
+    _messageInflatedLength = 0;
+    PSWebSocketCounterAdd(&_counters->messagesReceived, 1);
+    
+    // streamed messages were already handed off chunk by chunk
+    if(_message.streamed) {
+        [_delegate driverDidFinishMessage:self];
+        return YES;
+    }
+    
+    // views share the buffer, nothing writes to it once the message is done
+    if(_messageDelivery != PSWebSocketMessageDeliveryString) {
+        if(_message.opcode == PSWebSocketOpCodeText) {
+            PSWebSocketUTF8Data *utf8 = [[PSWebSocketUTF8Data alloc] initWithMutableData:buffer ascii:ascii];
+            [_delegate driver:self didReceiveMessage:(_messageDelivery == PSWebSocketMessageDeliveryUTF8Data) ? utf8 : [utf8 string]];
+        } else {
+            [_delegate driver:self didReceiveMessage:[[PSWebSocketDataView alloc] initWithMutableData:buffer]];
         }
+        return YES;
     }
     
-    // remove frames
-    if(frame->control) {
-        [_frames removeLastObject];
+    if(_message.opcode == PSWebSocketOpCodeText) {
+        // the frames were validated as they arrived, so pure ASCII is a straight
+        // byte copy and anything else is transcoded without checking it again
+        NSString *utf8 = (ascii) ? [[NSString alloc] initWithData:buffer encoding:NSASCIIStringEncoding] : PSWebSocketUTF8DecoderString(buffer.bytes, buffer.length);
+        if(!utf8) {
+            PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
+            return NO;
+        }
+        [_delegate driver:self didReceiveMessage:utf8];
     } else {
-        [_frames removeAllObjects];
-        _utf8DecoderState = 0;
-        _utf8DecoderCodePoint = 0;
+        [_delegate driver:self didReceiveMessage:buffer];
     }
-    
-    switch(frame->opcode) {
-        case PSWebSocketOpCodeBinary:
-            [_delegate driver:self didReceiveMessage:frame->buffer];
-            break;
+    return YES;
+}
+- (BOOL)processControlFrameAndDelegate:(NSError *__autoreleasing *)outError {
+    const uint8_t *payload = _control.payload;
+    NSUInteger length = _control.length;
+    switch(_control.frame.opcode) {
         case PSWebSocketOpCodePong:
-            [_delegate driver:self didReceivePong:frame->buffer];
-            break;
-        case PSWebSocketOpCodePing: {
-            [_delegate driver:self didReceivePing:frame->buffer];
+            [_delegate driver:self didReceivePong:[NSData dataWithBytes:payload length:length]];
             break;
-        }
-        case PSWebSocketOpCodeText: {
-            NSString *utf8 = [[NSString alloc] initWithData:frame->buffer encoding:NSUTF8StringEncoding];
-            if(!utf8) {
-                PSWebSocketSetOutError(outError, PSWebSocketStatusCodeInvalidUTF8, @"Invalid UTF-8");
-                return NO;
-            }
-            [_delegate driver:self didReceiveMessage:utf8];
+        case PSWebSocketOpCodePing:
+            [_delegate driver:self didReceivePing:[NSData dataWithBytes:payload length:length]];
             break;
-        }
         case PSWebSocketOpCodeClose:
-            if(frame->buffer.length >= 2) {
+            if(length >= 2) {
                 uint16_t closeCode = 0;
-                [frame->buffer getBytes:&closeCode length:sizeof(closeCode)];
+                memcpy(&closeCode, payload, sizeof(closeCode));
                 closeCode = EndianU16_BtoN(closeCode);
                 if(!PSWebSocketCloseCodeIsValid(closeCode)) {
                     PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Invalid close code");
                     return NO;
                 }
                 NSString *reason = nil;
-                if(frame->buffer.length > 2) {
-                    reason = [[NSString alloc] initWithBytes:frame->buffer.mutableBytes + sizeof(uint16_t)
-                                                      length:frame->buffer.length - sizeof(uint16_t)
+                if(length > 2) {
+                    reason = [[NSString alloc] initWithBytes:payload + sizeof(uint16_t)
+                                                      length:length - sizeof(uint16_t)
                                                     encoding:NSUTF8StringEncoding];
                     if(!reason) {
                         PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Invalid close reason; must be UTF-8");
@@ -823,17 +1090,16 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
                     }
                 }
                 [_delegate driver:self didCloseWithCode:closeCode reason:reason];
-            } else if(frame->buffer.length >= 1) {
+            } else if(length >= 1) {
                 PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Invalid close payload");
                 return NO;
             } else {
                 [_delegate driver:self didCloseWithCode:PSWebSocketStatusCodeNoStatusReceived reason:nil];
             }
             break;
-        case PSWebSocketOpCodeContinuation:
-            return YES;
+        default:
+            break;
     }
-    
     return YES;
 }
 
@@ -871,66 +1137,153 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
 
 #pragma mark - permessage-deflate
 
-- (NSArray *)pmdExtensionsHeaderComponents {
-    if(_pmdEnabled) {
-        NSMutableArray *components = [NSMutableArray arrayWithObject:@"permessage-deflate"];
+- (NSUInteger)pmdWriteExtensions:(char *)buffer capacity:(NSUInteger)capacity {
+    if(!_pmdEnabled) {
+        return 0;
+    }
+    NSUInteger length = 0;
+    PSWebSocketDriverAppendFormat(buffer, capacity, &length, "permessage-deflate");
+    
+    // client mode
+    if(_mode == PSWebSocketModeClient) {
+        // offer to limit our own window and ask the server to limit its
+        NSUInteger clientWindowBits = PSWebSocketDriverWindowBits(_compressionPolicy.clientMaxWindowBits);
+        NSUInteger serverWindowBits = PSWebSocketDriverWindowBits(_compressionPolicy.serverMaxWindowBits);
+        if(clientWindowBits < 15) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; client_max_window_bits=%d", (int)clientWindowBits);
+        } else {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; client_max_window_bits");
+        }
+        if(serverWindowBits < 15) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; server_max_window_bits=%d", (int)serverWindowBits);
+        }
+        if(_compressionPolicy.serverNoContextTakeover) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; server_no_context_takeover");
+        }
+        if(_compressionPolicy.clientNoContextTakeover) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; client_no_context_takeover");
+        }
+    }
+    // server mode
+    else if(_mode == PSWebSocketModeServer) {
+        // set the window bits the server will use
+        PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; server_max_window_bits=%d", (int)-_pmdServerWindowBits);
         
-        // client mode
-        if(_mode == PSWebSocketModeClient) {
-            // say we'll take whatever window bits the server gives us
-            [components addObject:@"client_max_window_bits"];
-        }
-        // server mode
-        else if(_mode == PSWebSocketModeServer) {
-            // set the window bits the client must use
-            [components addObject:[NSString stringWithFormat:@"client_max_window_bits=%@", @(-_pmdClientWindowBits)]];
-            
-            // set the window bits the server will use
-            [components addObject:[NSString stringWithFormat:@"server_max_window_bits=%@", @(-_pmdServerWindowBits)]];
+        // set the window bits the client must use, only allowed if it offered to limit them
+        if(_pmdClientWindowBitsOffered) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; client_max_window_bits=%d", (int)-_pmdClientWindowBits);
+        }
+        if(_pmdServerNoContextTakeover) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; server_no_context_takeover");
+        }
+        if(_pmdClientNoContextTakeover) {
+            PSWebSocketDriverAppendFormat(buffer, capacity, &length, "; client_no_context_takeover");
         }
-        return components;
     }
-    return @[];
+    NSAssert(length < capacity, @"permessage-deflate parameters do not fit");
+    return length;
 }
-- (BOOL)pmdConfigureWithExtensionsHeaderComponents:(NSOrderedSet *)components {
+- (BOOL)pmdConfigureWithExtensions:(PSWebSocketHTTPSlice)extensions {
     _pmdEnabled = NO;
     _pmdClientWindowBits = -15;
     _pmdClientNoContextTakeover = NO;
+    _pmdClientWindowBitsOffered = NO;
     _pmdServerWindowBits = -15;
     _pmdServerNoContextTakeover = NO;
     
-    for(NSString *component in components) {
-        // split to key & value
-        NSArray *subcomponents = [component componentsSeparatedByString:@"="];
-        
-        if([subcomponents[0] isEqualToString:@"permessage-deflate"]) {
-            _pmdEnabled = YES;
-        } else if([subcomponents[0] isEqualToString:@"client_max_window_bits"] && subcomponents.count > 1) {
-            _pmdClientWindowBits = -[subcomponents[1] integerValue];
-        } else if([subcomponents[0] isEqualToString:@"server_max_window_bits"] && subcomponents.count > 1) {
-            _pmdServerWindowBits = -[subcomponents[1] integerValue];
-        } else if([subcomponents[0] isEqualToString:@"client_no_context_takeover"] && _mode == PSWebSocketModeClient) {
-            _pmdClientNoContextTakeover = YES;
-        } else if([subcomponents[0] isEqualToString:@"server_no_context_takeover"] && _mode == PSWebSocketModeClient) {
-            _pmdServerNoContextTakeover = YES;
+    // parameters as sent by the peer, 0 window bits when no value was given
+    NSInteger clientWindowBits = 0;
+    NSInteger serverWindowBits = 0;
+    BOOL clientNoContextTakeover = NO;
+    BOOL serverNoContextTakeover = NO;
+    
+    // only the first permessage-deflate offer is considered, other
+    // extensions and their parameters are skipped
+    PSWebSocketHTTPSlice remaining = extensions;
+    PSWebSocketHTTPSlice name;
+    PSWebSocketHTTPSlice value;
+    char separator = '\0';
+    BOOL extensionStart = YES;
+    while(PSWebSocketHTTPNextParameter(&remaining, &name, &value, &separator)) {
+        if(extensionStart) {
+            if(_pmdEnabled) {
+                break;
+            }
+            _pmdEnabled = PSWebSocketHTTPSliceEqualsString(name, "permessage-deflate");
+        } else if(_pmdEnabled) {
+            if(PSWebSocketHTTPSliceEqualsString(name, "client_max_window_bits")) {
+                _pmdClientWindowBitsOffered = YES;
+                clientWindowBits = PSWebSocketDriverParseWindowBits(value);
+                if(clientWindowBits < 0) {
+                    return NO;
+                }
+            } else if(PSWebSocketHTTPSliceEqualsString(name, "server_max_window_bits") && value.bytes) {
+                serverWindowBits = PSWebSocketDriverParseWindowBits(value);
+                if(serverWindowBits < 0) {
+                    return NO;
+                }
+            } else if(PSWebSocketHTTPSliceEqualsString(name, "client_no_context_takeover")) {
+                clientNoContextTakeover = YES;
+            } else if(PSWebSocketHTTPSliceEqualsString(name, "server_no_context_takeover")) {
+                serverNoContextTakeover = YES;
+            }
         }
+        extensionStart = (separator == ',');
     }
     
-    if(_pmdClientWindowBits > -8 || _pmdClientWindowBits < -15) {
-        return NO;
-    }
-    if(_pmdServerWindowBits > -8 || _pmdServerWindowBits < -15) {
-        return NO;
+    if(!_pmdEnabled) {
+        return YES;
     }
     
-    if (_pmdEnabled) {
-        if(_mode == PSWebSocketModeClient) {
-            _inflater = [[PSWebSocketInflater alloc] initWithWindowBits:_pmdServerWindowBits];
-            _deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:_pmdClientWindowBits memoryLevel:8];
-        } else {
-            _inflater = [[PSWebSocketInflater alloc] initWithWindowBits:_pmdClientWindowBits];
-            _deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:_pmdServerWindowBits memoryLevel:8];
+    NSUInteger localClientWindowBits = PSWebSocketDriverWindowBits(_compressionPolicy.clientMaxWindowBits);
+    NSUInteger localServerWindowBits = PSWebSocketDriverWindowBits(_compressionPolicy.serverMaxWindowBits);
+    
+    if(_mode == PSWebSocketModeServer) {
+        // zlib cannot deflate with an 8 bit window, decline rather than break the limit
+        if(serverWindowBits == 8) {
+            _pmdEnabled = NO;
+            return YES;
+        }
+        
+        // use the smaller of the client's request and our own limit
+        _pmdServerWindowBits = -(NSInteger)MIN(localServerWindowBits, (NSUInteger)(serverWindowBits ?: 15));
+        
+        // the client's window can only be limited if it offered to be
+        if(_pmdClientWindowBitsOffered) {
+            _pmdClientWindowBits = -(NSInteger)MIN(localClientWindowBits, (NSUInteger)(clientWindowBits ?: 15));
         }
+        
+        // context takeover is dropped for a direction if either side asks
+        _pmdServerNoContextTakeover = (serverNoContextTakeover || _compressionPolicy.serverNoContextTakeover);
+        _pmdClientNoContextTakeover = (clientNoContextTakeover || _compressionPolicy.clientNoContextTakeover);
+    } else {
+        // zlib cannot deflate with an 8 bit window so we cannot honour it
+        if(clientWindowBits == 8) {
+            return NO;
+        }
+        
+        // the server's window as answered, we may always use less than allowed ourselves
+        _pmdServerWindowBits = -(serverWindowBits ?: 15);
+        _pmdClientWindowBits = -(NSInteger)MIN(localClientWindowBits, (NSUInteger)(clientWindowBits ?: 15));
+        
+        // a client may drop context takeover on its own, the server must agree to
+        _pmdServerNoContextTakeover = serverNoContextTakeover;
+        _pmdClientNoContextTakeover = (clientNoContextTakeover || _compressionPolicy.clientNoContextTakeover);
+    }
+    
+    NSUInteger memoryLevel = MAX(1, MIN(9, _compressionPolicy.memoryLevel));
+    if(_mode == PSWebSocketModeClient) {
+        _inflater = [[PSWebSocketInflater alloc] initWithWindowBits:_pmdServerWindowBits];
+        _deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:_pmdClientWindowBits
+                                                        memoryLevel:memoryLevel
+                                                              level:_compressionPolicy.level
+                                                           strategy:_compressionPolicy.strategy];
+    } else {
+        _inflater = [[PSWebSocketInflater alloc] initWithWindowBits:_pmdClientWindowBits];
+        _deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:_pmdServerWindowBits
+                                                        memoryLevel:memoryLevel
+                                                              level:_compressionPolicy.level
+                                                           strategy:_compressionPolicy.strategy];
     }
     
     return YES;
@@ -938,15 +1291,6 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
 
 #pragma mark - Utilities
 
-- (NSString *)acceptHeaderForKey:(NSString *)key {
-    NSParameterAssert(key);
-    NSString *combined = [key stringByAppendingString:PSWebSocketGUID];
-    NSData *data = [combined dataUsingEncoding:NSUTF8StringEncoding];
-    unsigned char sha1[CC_SHA1_DIGEST_LENGTH];
-    CC_SHA1(data.bytes, (CC_LONG)data.length, sha1);
-    data = [NSData dataWithBytes:sha1 length:CC_SHA1_DIGEST_LENGTH];
-    return [self base64EncodedData:data];
-}
 - (NSString *)base64EncodedData:(NSData *)data {
     // if we're targeting deployment before OS X 10.9 or IOS 7 the public methods for base 64 encoding didn't exist
     // however, a more basic private API ( which is now also public but deprecated ) did exist so we'll use it instead
@@ -961,4 +1305,10 @@ typedef NS_ENUM(NSInteger, PSWebSocketDriverState) {
     return [data base64EncodedStringWithOptions:0];
 }
 
+#pragma mark - Dealloc
+
+- (void)dealloc {
+    free(_counters);
+}
+
 @end
@@ -0,0 +1,47 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Decides how long outgoing frames may be held back so bursts of small
+ *  messages leave in as few writes as possible. Frames held by -[PSWebSocket
+ *  cork] are bounded by it too. 0 disables a bound.
+ */
+@interface PSWebSocketFlushPolicy : NSObject <NSCopying>
+
+#pragma mark - Properties
+
+/**
+ *  Longest time an outgoing frame is held before being written. When above
+ *  0 every send is held this long so later sends join the same write, even
+ *  without corking. Rounded up to the resolution of the socket's timing
+ *  wheel. Defaults to 0.
+ */
+@property (nonatomic, assign) NSTimeInterval maximumDelay;
+
+/**
+ *  Number of held bytes that triggers a write regardless of corking or
+ *  delay. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger maximumLength;
+
+#pragma mark - Initialization
+
+/**
+ *  Policy that writes every frame as soon as possible unless corked.
+ */
++ (instancetype)defaultPolicy;
+
+@end
@@ -0,0 +1,41 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketFlushPolicy.h"
+
+@implementation PSWebSocketFlushPolicy
+
+#pragma mark - Initialization
+
++ (instancetype)defaultPolicy {
+    return [[self alloc] init];
+}
+- (instancetype)init {
+    if((self = [super init])) {
+        _maximumDelay = 0.0;
+        _maximumLength = 0;
+    }
+    return self;
+}
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+    PSWebSocketFlushPolicy *policy = [[[self class] allocWithZone:zone] init];
+    policy.maximumDelay = _maximumDelay;
+    policy.maximumLength = _maximumLength;
+    return policy;
+}
+
+@end
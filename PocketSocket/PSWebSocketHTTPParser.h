@@ -0,0 +1,114 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Range of bytes inside a parsed buffer, not NUL terminated.
+ */
+typedef struct {
+    const char *bytes;
+    NSUInteger length;
+} PSWebSocketHTTPSlice;
+
+typedef NS_ENUM(NSInteger, PSWebSocketHTTPParseResult) {
+    PSWebSocketHTTPParseResultIncomplete = 0,
+    PSWebSocketHTTPParseResultComplete,
+    PSWebSocketHTTPParseResultInvalid
+};
+
+/**
+ *  HTTP/1.1 request or response head parsed in place. Only the fields a
+ *  websocket handshake needs are kept and every slice points into the parsed
+ *  bytes, so nothing is allocated and the head is only valid while they are.
+ */
+typedef struct {
+    // bytes up to and including the blank line ending the head
+    NSUInteger length;
+    
+    // request line
+    PSWebSocketHTTPSlice method;
+    PSWebSocketHTTPSlice target;
+    
+    // status line
+    NSInteger statusCode;
+    PSWebSocketHTTPSlice reason;
+    
+    // header values with surrounding whitespace removed
+    PSWebSocketHTTPSlice host;
+    PSWebSocketHTTPSlice origin;
+    PSWebSocketHTTPSlice key;
+    PSWebSocketHTTPSlice accept;
+    PSWebSocketHTTPSlice version;
+    PSWebSocketHTTPSlice protocol;
+    PSWebSocketHTTPSlice extensions;
+    
+    // Upgrade lists websocket, Connection lists upgrade, a body was declared
+    BOOL upgradeWebSocket;
+    BOOL connectionUpgrade;
+    BOOL hasBody;
+} PSWebSocketHTTPHead;
+
+/**
+ *  Parse a request or response head in a single pass over bytes. Incomplete
+ *  is returned until the blank line ending the head has been seen.
+ */
+PSWebSocketHTTPParseResult PSWebSocketHTTPParseRequest(const void *bytes, NSUInteger length, PSWebSocketHTTPHead *head);
+PSWebSocketHTTPParseResult PSWebSocketHTTPParseResponse(const void *bytes, NSUInteger length, PSWebSocketHTTPHead *head);
+
+/**
+ *  Whether a parsed request is a version 13 websocket upgrade, the same
+ *  checks as +[PSWebSocketDriver isWebSocketRequest:].
+ */
+BOOL PSWebSocketHTTPHeadIsUpgradeRequest(const PSWebSocketHTTPHead *head);
+
+/**
+ *  Case insensitive comparison of a slice with a C string.
+ */
+BOOL PSWebSocketHTTPSliceEqualsString(PSWebSocketHTTPSlice slice, const char *string);
+
+/**
+ *  Slice over the UTF-8 bytes of a string, valid as long as the string is.
+ */
+PSWebSocketHTTPSlice PSWebSocketHTTPSliceWithString(NSString *string);
+
+/**
+ *  Split the next element off a header value listing parameters such as
+ *  Sec-WebSocket-Extensions. Elements end at ';' or ',', which is returned
+ *  through separator or '\0' for the last one. Name and value are trimmed,
+ *  value has its quotes removed and a NULL bytes pointer when there was no
+ *  '='.
+ *
+ *  @return NO once remaining is exhausted
+ */
+BOOL PSWebSocketHTTPNextParameter(PSWebSocketHTTPSlice *remaining, PSWebSocketHTTPSlice *name, PSWebSocketHTTPSlice *value, char *separator);
+
+/**
+ *  Write the 28 character Sec-WebSocket-Accept value for a key.
+ */
+void PSWebSocketHTTPAcceptForKey(PSWebSocketHTTPSlice key, char accept[28]);
+
+/**
+ *  Write a 101 Switching Protocols response accepting key. Empty protocol
+ *  and extensions slices leave out their headers.
+ *
+ *  @return bytes written or 0 if the response did not fit
+ */
+NSUInteger PSWebSocketHTTPWriteUpgradeResponse(char *buffer, NSUInteger capacity, PSWebSocketHTTPSlice key, PSWebSocketHTTPSlice protocol, PSWebSocketHTTPSlice extensions);
+
+/**
+ *  Build the NSURLRequest view of a request head, only needed when
+ *  something asks for it.
+ */
+NSURLRequest* PSWebSocketHTTPRequestWithBytes(const void *bytes, NSUInteger length);
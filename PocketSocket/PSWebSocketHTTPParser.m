@@ -0,0 +1,330 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketHTTPParser.h"
+#import <CommonCrypto/CommonCrypto.h>
+
+static const char PSWebSocketHTTPGUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+static const char PSWebSocketHTTPBase64Table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+#pragma mark - Slices
+
+static inline char PSWebSocketHTTPLower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+static inline PSWebSocketHTTPSlice PSWebSocketHTTPSliceTrim(const char *start, const char *end) {
+    while(start < end && (*start == ' ' || *start == '\t')) {
+        ++start;
+    }
+    while(end > start && (end[-1] == ' ' || end[-1] == '\t')) {
+        --end;
+    }
+    return (PSWebSocketHTTPSlice){start, (NSUInteger)(end - start)};
+}
+BOOL PSWebSocketHTTPSliceEqualsString(PSWebSocketHTTPSlice slice, const char *string) {
+    NSUInteger i = 0;
+    for(; i < slice.length; ++i) {
+        if(string[i] == '\0' || PSWebSocketHTTPLower(slice.bytes[i]) != PSWebSocketHTTPLower(string[i])) {
+            return NO;
+        }
+    }
+    return (string[i] == '\0');
+}
+static BOOL PSWebSocketHTTPSliceContainsToken(PSWebSocketHTTPSlice slice, const char *token) {
+    const char *start = slice.bytes;
+    const char *end = slice.bytes + slice.length;
+    while(YES) {
+        const char *comma = memchr(start, ',', end - start);
+        if(PSWebSocketHTTPSliceEqualsString(PSWebSocketHTTPSliceTrim(start, (comma) ? comma : end), token)) {
+            return YES;
+        }
+        if(!comma) {
+            return NO;
+        }
+        start = comma + 1;
+    }
+}
+PSWebSocketHTTPSlice PSWebSocketHTTPSliceWithString(NSString *string) {
+    const char *bytes = string.UTF8String;
+    return (PSWebSocketHTTPSlice){bytes, (bytes) ? strlen(bytes) : 0};
+}
+
+#pragma mark - Parsing
+
+static inline BOOL PSWebSocketHTTPIsVersion(const char *start, const char *end) {
+    return (end - start == 8 && memcmp(start, "HTTP/1.", 7) == 0 && (start[7] == '0' || start[7] == '1'));
+}
+static BOOL PSWebSocketHTTPParseRequestLine(const char *start, const char *end, PSWebSocketHTTPHead *head) {
+    // METHOD SP target SP HTTP/1.x
+    const char *space = memchr(start, ' ', end - start);
+    if(!space || space == start) {
+        return NO;
+    }
+    head->method = (PSWebSocketHTTPSlice){start, (NSUInteger)(space - start)};
+    
+    const char *target = space + 1;
+    space = memchr(target, ' ', end - target);
+    if(!space || space == target) {
+        return NO;
+    }
+    head->target = (PSWebSocketHTTPSlice){target, (NSUInteger)(space - target)};
+    
+    return PSWebSocketHTTPIsVersion(space + 1, end);
+}
+static BOOL PSWebSocketHTTPParseStatusLine(const char *start, const char *end, PSWebSocketHTTPHead *head) {
+    // HTTP/1.x SP 3DIGIT [SP reason]
+    if(end - start < 12 || !PSWebSocketHTTPIsVersion(start, start + 8) || start[8] != ' ') {
+        return NO;
+    }
+    NSInteger statusCode = 0;
+    for(NSUInteger i = 9; i < 12; ++i) {
+        if(start[i] < '0' || start[i] > '9') {
+            return NO;
+        }
+        statusCode = statusCode * 10 + (start[i] - '0');
+    }
+    head->statusCode = statusCode;
+    
+    if(end - start > 12) {
+        if(start[12] != ' ') {
+            return NO;
+        }
+        head->reason = (PSWebSocketHTTPSlice){start + 13, (NSUInteger)(end - start - 13)};
+    }
+    return YES;
+}
+static BOOL PSWebSocketHTTPParseHeaderLine(const char *start, const char *end, PSWebSocketHTTPHead *head) {
+    // obsolete line folding is not accepted
+    if(*start == ' ' || *start == '\t') {
+        return NO;
+    }
+    const char *colon = memchr(start, ':', end - start);
+    if(!colon || colon == start || colon[-1] == ' ' || colon[-1] == '\t') {
+        return NO;
+    }
+    PSWebSocketHTTPSlice name = {start, (NSUInteger)(colon - start)};
+    PSWebSocketHTTPSlice value = PSWebSocketHTTPSliceTrim(colon + 1, end);
+    
+    // only compare names of the length of a header we care about, repeated
+    // headers keep their first value except for token lists
+    PSWebSocketHTTPSlice *field = NULL;
+    switch(name.length) {
+        case 4:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Host") ? &head->host : NULL;
+            break;
+        case 6:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Origin") ? &head->origin : NULL;
+            break;
+        case 7:
+            if(PSWebSocketHTTPSliceEqualsString(name, "Upgrade")) {
+                head->upgradeWebSocket = head->upgradeWebSocket || PSWebSocketHTTPSliceContainsToken(value, "websocket");
+            }
+            break;
+        case 10:
+            if(PSWebSocketHTTPSliceEqualsString(name, "Connection")) {
+                head->connectionUpgrade = head->connectionUpgrade || PSWebSocketHTTPSliceContainsToken(value, "upgrade");
+            }
+            break;
+        case 14:
+            if(PSWebSocketHTTPSliceEqualsString(name, "Content-Length")) {
+                for(NSUInteger i = 0; i < value.length; ++i) {
+                    head->hasBody = head->hasBody || (value.bytes[i] != '0');
+                }
+            }
+            break;
+        case 17:
+            if(PSWebSocketHTTPSliceEqualsString(name, "Sec-WebSocket-Key")) {
+                field = &head->key;
+            } else if(PSWebSocketHTTPSliceEqualsString(name, "Transfer-Encoding")) {
+                head->hasBody = YES;
+            }
+            break;
+        case 20:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Sec-WebSocket-Accept") ? &head->accept : NULL;
+            break;
+        case 21:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Sec-WebSocket-Version") ? &head->version : NULL;
+            break;
+        case 22:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Sec-WebSocket-Protocol") ? &head->protocol : NULL;
+            break;
+        case 24:
+            field = PSWebSocketHTTPSliceEqualsString(name, "Sec-WebSocket-Extensions") ? &head->extensions : NULL;
+            break;
+    }
+    if(field && !field->bytes) {
+        *field = value;
+    }
+    return YES;
+}
+static PSWebSocketHTTPParseResult PSWebSocketHTTPParseHead(const char *bytes, NSUInteger length, BOOL request, PSWebSocketHTTPHead *head) {
+    memset(head, 0, sizeof(*head));
+    
+    const char *end = bytes + length;
+    const char *line = bytes;
+    BOOL first = YES;
+    while(YES) {
+        // every line must end with CRLF
+        const char *newline = memchr(line, '\n', end - line);
+        if(!newline) {
+            return PSWebSocketHTTPParseResultIncomplete;
+        }
+        if(newline == line || newline[-1] != '\r') {
+            return PSWebSocketHTTPParseResultInvalid;
+        }
+        const char *lineEnd = newline - 1;
+        
+        if(first) {
+            BOOL valid = (request) ? PSWebSocketHTTPParseRequestLine(line, lineEnd, head) : PSWebSocketHTTPParseStatusLine(line, lineEnd, head);
+            if(!valid) {
+                return PSWebSocketHTTPParseResultInvalid;
+            }
+            first = NO;
+        } else if(lineEnd == line) {
+            head->length = (NSUInteger)(newline + 1 - bytes);
+            return PSWebSocketHTTPParseResultComplete;
+        } else if(!PSWebSocketHTTPParseHeaderLine(line, lineEnd, head)) {
+            return PSWebSocketHTTPParseResultInvalid;
+        }
+        line = newline + 1;
+    }
+}
+PSWebSocketHTTPParseResult PSWebSocketHTTPParseRequest(const void *bytes, NSUInteger length, PSWebSocketHTTPHead *head) {
+    return PSWebSocketHTTPParseHead((const char *)bytes, length, YES, head);
+}
+PSWebSocketHTTPParseResult PSWebSocketHTTPParseResponse(const void *bytes, NSUInteger length, PSWebSocketHTTPHead *head) {
+    return PSWebSocketHTTPParseHead((const char *)bytes, length, NO, head);
+}
+BOOL PSWebSocketHTTPHeadIsUpgradeRequest(const PSWebSocketHTTPHead *head) {
+    return (PSWebSocketHTTPSliceEqualsString(head->method, "GET") &&
+            head->key.length > 0 &&
+            PSWebSocketHTTPSliceEqualsString(head->version, "13") &&
+            head->upgradeWebSocket &&
+            head->connectionUpgrade &&
+            !head->hasBody);
+}
+
+BOOL PSWebSocketHTTPNextParameter(PSWebSocketHTTPSlice *remaining, PSWebSocketHTTPSlice *name, PSWebSocketHTTPSlice *value, char *separator) {
+    const char *cursor = remaining->bytes;
+    const char *end = cursor + remaining->length;
+    if(cursor >= end) {
+        return NO;
+    }
+    
+    // find the separator ending this element, quoted strings may contain one
+    const char *stop = cursor;
+    BOOL quoted = NO;
+    while(stop < end && (quoted || (*stop != ';' && *stop != ','))) {
+        if(*stop == '"') {
+            quoted = !quoted;
+        }
+        ++stop;
+    }
+    *separator = (stop < end) ? *stop : '\0';
+    remaining->bytes = (stop < end) ? stop + 1 : end;
+    remaining->length = (NSUInteger)(end - remaining->bytes);
+    
+    const char *equals = memchr(cursor, '=', stop - cursor);
+    if(equals) {
+        *name = PSWebSocketHTTPSliceTrim(cursor, equals);
+        *value = PSWebSocketHTTPSliceTrim(equals + 1, stop);
+        if(value->length >= 2 && value->bytes[0] == '"' && value->bytes[value->length - 1] == '"') {
+            value->bytes += 1;
+            value->length -= 2;
+        }
+    } else {
+        *name = PSWebSocketHTTPSliceTrim(cursor, stop);
+        *value = (PSWebSocketHTTPSlice){NULL, 0};
+    }
+    return YES;
+}
+
+#pragma mark - Writing
+
+void PSWebSocketHTTPAcceptForKey(PSWebSocketHTTPSlice key, char accept[28]) {
+    unsigned char sha1[CC_SHA1_DIGEST_LENGTH];
+    CC_SHA1_CTX context;
+    CC_SHA1_Init(&context);
+    CC_SHA1_Update(&context, key.bytes, (CC_LONG)key.length);
+    CC_SHA1_Update(&context, PSWebSocketHTTPGUID, (CC_LONG)(sizeof(PSWebSocketHTTPGUID) - 1));
+    CC_SHA1_Final(sha1, &context);
+    
+    // base64 of 20 bytes is 6 full groups and one padded group of 2 bytes
+    NSUInteger offset = 0;
+    for(NSUInteger i = 0; i < 18; i += 3) {
+        uint32_t group = ((uint32_t)sha1[i] << 16) | ((uint32_t)sha1[i + 1] << 8) | sha1[i + 2];
+        accept[offset++] = PSWebSocketHTTPBase64Table[(group >> 18) & 0x3f];
+        accept[offset++] = PSWebSocketHTTPBase64Table[(group >> 12) & 0x3f];
+        accept[offset++] = PSWebSocketHTTPBase64Table[(group >> 6) & 0x3f];
+        accept[offset++] = PSWebSocketHTTPBase64Table[group & 0x3f];
+    }
+    uint32_t group = ((uint32_t)sha1[18] << 16) | ((uint32_t)sha1[19] << 8);
+    accept[24] = PSWebSocketHTTPBase64Table[(group >> 18) & 0x3f];
+    accept[25] = PSWebSocketHTTPBase64Table[(group >> 12) & 0x3f];
+    accept[26] = PSWebSocketHTTPBase64Table[(group >> 6) & 0x3f];
+    accept[27] = '=';
+}
+static inline BOOL PSWebSocketHTTPAppend(char *buffer, NSUInteger capacity, NSUInteger *length, const char *bytes, NSUInteger bytesLength) {
+    if(capacity - *length < bytesLength) {
+        return NO;
+    }
+    memcpy(buffer + *length, bytes, bytesLength);
+    *length += bytesLength;
+    return YES;
+}
+static inline BOOL PSWebSocketHTTPAppendHeader(char *buffer, NSUInteger capacity, NSUInteger *length, const char *name, PSWebSocketHTTPSlice value) {
+    return (PSWebSocketHTTPAppend(buffer, capacity, length, name, strlen(name)) &&
+            PSWebSocketHTTPAppend(buffer, capacity, length, ": ", 2) &&
+            PSWebSocketHTTPAppend(buffer, capacity, length, value.bytes, value.length) &&
+            PSWebSocketHTTPAppend(buffer, capacity, length, "\r\n", 2));
+}
+NSUInteger PSWebSocketHTTPWriteUpgradeResponse(char *buffer, NSUInteger capacity, PSWebSocketHTTPSlice key, PSWebSocketHTTPSlice protocol, PSWebSocketHTTPSlice extensions) {
+    static const char statusLine[] = "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n";
+    char accept[28];
+    PSWebSocketHTTPAcceptForKey(key, accept);
+    
+    NSUInteger length = 0;
+    BOOL fits = (PSWebSocketHTTPAppend(buffer, capacity, &length, statusLine, sizeof(statusLine) - 1) &&
+                 PSWebSocketHTTPAppendHeader(buffer, capacity, &length, "Sec-WebSocket-Accept", (PSWebSocketHTTPSlice){accept, sizeof(accept)}));
+    if(fits && protocol.length > 0) {
+        fits = PSWebSocketHTTPAppendHeader(buffer, capacity, &length, "Sec-WebSocket-Protocol", protocol);
+    }
+    if(fits && extensions.length > 0) {
+        fits = PSWebSocketHTTPAppendHeader(buffer, capacity, &length, "Sec-WebSocket-Extensions", extensions);
+    }
+    fits = fits && PSWebSocketHTTPAppend(buffer, capacity, &length, "\r\n", 2);
+    return (fits) ? length : 0;
+}
+
+#pragma mark - Foundation
+
+NSURLRequest* PSWebSocketHTTPRequestWithBytes(const void *bytes, NSUInteger length) {
+    CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, YES);
+    CFHTTPMessageAppendBytes(msg, bytes, length);
+    if(!CFHTTPMessageIsHeaderComplete(msg)) {
+        CFRelease(msg);
+        return nil;
+    }
+    
+    NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:CFBridgingRelease(CFHTTPMessageCopyRequestURL(msg))];
+    request.HTTPMethod = CFBridgingRelease(CFHTTPMessageCopyRequestMethod(msg));
+    
+    NSDictionary *headers = CFBridgingRelease(CFHTTPMessageCopyAllHeaderFields(msg));
+    [headers enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
+        [request setValue:obj forHTTPHeaderField:key];
+    }];
+    
+    CFRelease(msg);
+    return request;
+}
@@ -16,6 +16,15 @@
 
 @interface PSWebSocketInflater : NSObject
 
+#pragma mark - Properties
+
+/**
+ *  Most bytes the next append or end may inflate. Exceeding it fails with
+ *  PSWebSocketStatusCodeMessageTooBig without buffering more than one byte
+ *  past it. Defaults to NSUIntegerMax.
+ */
+@property (nonatomic, assign) NSUInteger maximumLength;
+
 #pragma mark - Initialization
 
 - (instancetype)initWithWindowBits:(NSInteger)windowBits;
@@ -14,13 +14,15 @@
 
 #import "PSWebSocketInflater.h"
 #import "PSWebSocketInternal.h"
+#import "PSWebSocketZlibPool.h"
 #import <zlib.h>
 
+// smallest amount the output buffer grows by per inflate pass
+static const NSUInteger PSWebSocketInflaterMinimumGrowth = 4096;
+
 @interface PSWebSocketInflater() {
     NSInteger _windowBits;
-    uint8_t _chunkBuffer[16384];
-    z_stream _stream;
-    BOOL _ready;
+    z_stream *_stream;
 
     NSMutableData *_buffer;
 }
@@ -31,8 +33,11 @@
 
 - (instancetype)initWithWindowBits:(NSInteger)windowBits {
     if((self = [super init])) {
-        _windowBits = windowBits;
-        [self reset];
+        // zlib never deflates raw streams with 8 bit windows so peers that
+        // negotiated one still send data using 9 bits
+        _windowBits = MIN(windowBits, -9);
+        NSAssert(_windowBits >= -15, @"windowBits must be between -15 and -8");
+        _maximumLength = NSUIntegerMax;
     }
     return self;
 }
@@ -51,29 +56,41 @@
     NSParameterAssert(length);
     
     // set input properties
-    _stream.avail_in = (uInt)length;
-    _stream.next_in = (Bytef *)bytes;
+    _stream->avail_in = (uInt)length;
+    _stream->next_in = (Bytef *)bytes;
     
-    // inflate loop
+    // inflate loop, straight into the buffer which grows with the input but
+    // never more than one byte past the maximum length
     int ret;
+    NSUInteger inflatedLength = 0;
     do {
+        NSUInteger offset = _buffer.length;
+        NSUInteger growth = MAX((NSUInteger)_stream->avail_in * 2, PSWebSocketInflaterMinimumGrowth);
+        if(_maximumLength != NSUIntegerMax) {
+            growth = MIN(growth, _maximumLength - inflatedLength + 1);
+        }
+        _buffer.length = offset + growth;
+        
         // set output properties
-        _stream.avail_out = (uInt)sizeof(_chunkBuffer);
-        _stream.next_out = (Bytef *)_chunkBuffer;
+        _stream->avail_out = (uInt)growth;
+        _stream->next_out = (Bytef *)_buffer.mutableBytes + offset;
         
         // inflate and check status
-        ret = inflate(&_stream, Z_SYNC_FLUSH);
+        ret = inflate(_stream, Z_SYNC_FLUSH);
+        
+        // trim to the number of bytes inflated
+        _buffer.length = offset + (growth - _stream->avail_out);
+        inflatedLength += growth - _stream->avail_out;
+        
+        if(inflatedLength > _maximumLength) {
+            PSWebSocketSetOutError(outError, PSWebSocketStatusCodeMessageTooBig, @"Inflated message exceeds maximum length");
+            return NO;
+        }
         if(ret == Z_NEED_DICT || ret == Z_DATA_ERROR || ret == Z_MEM_ERROR) {
             PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Failed to inflate bytes");
             return NO;
         }
-        
-        // determine number of bytes inflated
-        uInt gotBack = sizeof(_chunkBuffer) - _stream.avail_out;
-        if(gotBack > 0) {
-            [_buffer appendBytes:_chunkBuffer length:gotBack];
-        }
-    } while(_stream.avail_out == 0);
+    } while(_stream->avail_out == 0);
     
     return YES;
 }
@@ -82,24 +99,22 @@
     return [self appendBytes:finish length:sizeof(finish) error:outError];
 }
 - (void)reset {
-    if(_ready) {
-        _buffer = nil;
-        inflateEnd(&_stream);
-        bzero(&_stream, sizeof(_stream));
-        bzero(_chunkBuffer, sizeof(_chunkBuffer));
-        _ready = NO;
+    _buffer = nil;
+    if(_stream) {
+        [[PSWebSocketZlibPool sharedPool] relinquishInflateStream:_stream windowBits:(int)_windowBits];
+        _stream = NULL;
     }
 }
 
 #pragma mark - Private
 
 - (BOOL)ensureReady:(NSError *__autoreleasing *)outError {
-    if(!_ready) {
-        if(inflateInit2(&_stream, -MAX_WBITS) != Z_OK) {
+    if(!_stream) {
+        _stream = [[PSWebSocketZlibPool sharedPool] inflateStreamWithWindowBits:(int)_windowBits];
+        if(!_stream) {
             PSWebSocketSetOutError(outError, PSWebSocketStatusCodeProtocolError, @"Failed to initialize inflate stream");
             return NO;
         }
-        _ready = YES;
     }
     return YES;
 }
@@ -39,6 +39,24 @@ static const uint8_t PSWebSocketRsv3Mask = 0x10;
 static const uint8_t PSWebSocketMaskMask = 0x80;
 static const uint8_t PSWebSocketPayloadLenMask = 0x7F;
 
+static inline void PSWebSocketAppendFramePayloadLength(NSMutableData *header, NSUInteger payloadLength, BOOL masked) {
+    uint8_t lengthByte = (masked) ? PSWebSocketMaskMask : 0;
+    if(payloadLength < 126) {
+        lengthByte |= payloadLength;
+        [header appendBytes:&lengthByte length:sizeof(lengthByte)];
+    } else if(payloadLength <= UINT16_MAX) {
+        lengthByte |= 126;
+        uint16_t len = CFSwapInt16HostToBig((uint16_t)payloadLength);
+        [header appendBytes:&lengthByte length:sizeof(lengthByte)];
+        [header appendBytes:&len length:sizeof(len)];
+    } else {
+        lengthByte |= 127;
+        uint64_t len = CFSwapInt64HostToBig((uint64_t)payloadLength);
+        [header appendBytes:&lengthByte length:sizeof(lengthByte)];
+        [header appendBytes:&len length:sizeof(len)];
+    }
+}
+
 #define PSWebSocketSetOutError(e, c, d) if(e){ *e = [PSWebSocketDriver errorWithCode:c reason:d]; }
 
 static inline void _PSWebSocketLog(id self, NSString *format, ...) {
@@ -123,8 +141,7 @@ static inline NSData* PSPeerAddressOfInputStream(NSInputStream *stream) {
     return [NSData dataWithBytes: &addr length: addr.sin_len];
 }
 
-static inline NSString* PSPeerHostOfInputStream(NSInputStream *stream) {
-    NSData *peerAddress = PSPeerAddressOfInputStream(stream);
+static inline NSString* PSPeerHostOfAddress(NSData *peerAddress) {
     if(!peerAddress) {
         return nil;
     }
@@ -134,4 +151,8 @@ static inline NSString* PSPeerHostOfInputStream(NSInputStream *stream) {
         return nil;
     }
     return [NSString stringWithFormat: @"%s:%hu", nameBuf, ntohs(addr->sin_port)];
+}
+
+static inline NSString* PSPeerHostOfInputStream(NSInputStream *stream) {
+    return PSPeerHostOfAddress(PSPeerAddressOfInputStream(stream));
 }
\ No newline at end of file
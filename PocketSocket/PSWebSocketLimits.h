@@ -0,0 +1,56 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Bounds on what a peer may send. Lengths are checked as soon as a frame
+ *  header is parsed and inflated lengths after every inflate step, a
+ *  violation fails the connection with PSWebSocketStatusCodeMessageTooBig
+ *  before the memory is allocated. 0 disables a limit.
+ */
+@interface PSWebSocketLimits : NSObject <NSCopying>
+
+#pragma mark - Properties
+
+/**
+ *  Largest payload length a single frame may declare. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger maximumFrameLength;
+
+/**
+ *  Largest payload length of a message across all of its frames, as sent on
+ *  the wire. Applies to streamed messages too. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger maximumMessageLength;
+
+/**
+ *  Largest length a compressed message may inflate to. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger maximumInflatedLength;
+
+/**
+ *  Largest ratio of inflated to compressed length of a message. Messages
+ *  inflating to less than 64KB are never held to it. Defaults to 0.
+ */
+@property (nonatomic, assign) double maximumInflateRatio;
+
+#pragma mark - Initialization
+
+/**
+ *  Limits with every check disabled.
+ */
++ (instancetype)defaultLimits;
+
+@end
@@ -0,0 +1,45 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketLimits.h"
+
+@implementation PSWebSocketLimits
+
+#pragma mark - Initialization
+
++ (instancetype)defaultLimits {
+    return [[self alloc] init];
+}
+- (instancetype)init {
+    if((self = [super init])) {
+        _maximumFrameLength = 0;
+        _maximumMessageLength = 0;
+        _maximumInflatedLength = 0;
+        _maximumInflateRatio = 0.0;
+    }
+    return self;
+}
+
+#pragma mark - NSCopying
+
+- (id)copyWithZone:(NSZone *)zone {
+    PSWebSocketLimits *limits = [[[self class] allocWithZone:zone] init];
+    limits.maximumFrameLength = _maximumFrameLength;
+    limits.maximumMessageLength = _maximumMessageLength;
+    limits.maximumInflatedLength = _maximumInflatedLength;
+    limits.maximumInflateRatio = _maximumInflateRatio;
+    return limits;
+}
+
+@end
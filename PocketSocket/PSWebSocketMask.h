@@ -0,0 +1,22 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  XOR length bytes in place with the 4 byte mask key. maskOffset is the
+ *  number of payload bytes already masked with this key so that a payload
+ *  split across several calls stays in phase with the key.
+ */
+void PSWebSocketMaskBytes(uint8_t *bytes, NSUInteger length, const uint8_t maskKey[4], NSUInteger maskOffset);
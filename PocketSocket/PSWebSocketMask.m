@@ -0,0 +1,75 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketMask.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#import <immintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#import <arm_neon.h>
+#endif
+
+void PSWebSocketMaskBytes(uint8_t *bytes, NSUInteger length, const uint8_t maskKey[4], NSUInteger maskOffset) {
+    NSUInteger i = 0;
+
+    // head; byte at a time until the pointer is 16 byte aligned
+    while(i < length && ((uintptr_t)(bytes + i) & 15) != 0) {
+        bytes[i] ^= maskKey[(maskOffset + i) & 3];
+        ++i;
+    }
+    if(i == length) {
+        return;
+    }
+
+    // key repeated and rotated so pattern[0] lines up with bytes[i], every
+    // step below is a multiple of 4 bytes so the phase never changes
+    uint8_t pattern[32];
+    for(NSUInteger j = 0; j < sizeof(pattern); ++j) {
+        pattern[j] = maskKey[(maskOffset + i + j) & 3];
+    }
+
+#if defined(__AVX2__)
+    __m256i key256 = _mm256_loadu_si256((const __m256i *)pattern);
+    for(; i + 32 <= length; i += 32) {
+        __m256i value = _mm256_loadu_si256((const __m256i *)(bytes + i));
+        _mm256_storeu_si256((__m256i *)(bytes + i), _mm256_xor_si256(value, key256));
+    }
+#endif
+#if defined(__SSE2__)
+    __m128i key128 = _mm_loadu_si128((const __m128i *)pattern);
+    for(; i + 16 <= length; i += 16) {
+        __m128i value = _mm_load_si128((const __m128i *)(bytes + i));
+        _mm_store_si128((__m128i *)(bytes + i), _mm_xor_si128(value, key128));
+    }
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint8x16_t key128 = vld1q_u8(pattern);
+    for(; i + 16 <= length; i += 16) {
+        vst1q_u8(bytes + i, veorq_u8(vld1q_u8(bytes + i), key128));
+    }
+#endif
+
+    // scalar fallback and remaining words
+    uint64_t key64;
+    memcpy(&key64, pattern, sizeof(key64));
+    for(; i + 8 <= length; i += 8) {
+        uint64_t value;
+        memcpy(&value, bytes + i, sizeof(value));
+        value ^= key64;
+        memcpy(bytes + i, &value, sizeof(value));
+    }
+
+    // tail
+    for(NSUInteger j = 0; i < length; ++i, ++j) {
+        bytes[i] ^= pattern[j];
+    }
+}
@@ -0,0 +1,60 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import <sys/uio.h>
+#import "PSWebSocketTransport.h"
+
+/**
+ *  Queue of references to outgoing data. Appended data is retained, not
+ *  copied, so it must not be mutated once appended.
+ */
+@interface PSWebSocketOutputQueue : NSObject
+
+#pragma mark - Actions
+
+- (BOOL)hasBytesAvailable;
+- (NSUInteger)bytesAvailable;
+- (void)appendData:(NSData *)data;
+
+/**
+ *  Append data belonging to a message that may be dropped before any of it
+ *  is written. Consecutive data with the same non zero tag form one message.
+ */
+- (void)appendData:(NSData *)data tag:(NSUInteger)tag;
+
+/**
+ *  Append data as above, flagging whether it begins a frame. Control frames
+ *  are only let ahead of data at the start of a frame.
+ */
+- (void)appendData:(NSData *)data tag:(NSUInteger)tag frameStart:(BOOL)frameStart;
+
+/**
+ *  Queue a whole control frame ahead of every data frame that has not
+ *  started going out, behind control frames queued before it.
+ */
+- (void)insertControlFrame:(NSData *)frame;
+
+/**
+ *  Remove the oldest tagged message none of which has been written.
+ *
+ *  @return number of bytes removed, 0 if no message could be dropped
+ */
+- (NSUInteger)dropOldestTaggedData;
+- (NSUInteger)getChunks:(struct iovec *)chunks maxCount:(NSUInteger)maxCount;
+- (void)consumeLength:(NSUInteger)length;
+- (NSInteger)writeToTransport:(id <PSWebSocketTransport>)transport;
+- (void)reset;
+
+@end
@@ -0,0 +1,176 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketOutputQueue.h"
+
+// enough for a corked burst of small frames, header and payload each, to
+// leave in a single vectored write
+static const NSUInteger PSWebSocketOutputQueueGatherCount = 64;
+
+typedef NS_OPTIONS(uint8_t, PSWebSocketOutputQueueChunkFlags) {
+    PSWebSocketOutputQueueChunkFrameStart = 1 << 0,
+    PSWebSocketOutputQueueChunkControl = 1 << 1
+};
+
+@interface PSWebSocketOutputQueue() {
+    NSMutableArray *_chunks;
+    NSMutableArray *_chunkTags;
+    NSMutableArray *_chunkFlags;
+    NSUInteger _writtenTag;
+    NSUInteger _headOffset;
+    NSUInteger _bytesAvailable;
+}
+@end
+@implementation PSWebSocketOutputQueue
+
+#pragma mark - Initialization
+
+- (instancetype)init {
+    if((self = [super init])) {
+        _chunks = [NSMutableArray array];
+        _chunkTags = [NSMutableArray array];
+        _chunkFlags = [NSMutableArray array];
+        _writtenTag = 0;
+        _headOffset = 0;
+        _bytesAvailable = 0;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (BOOL)hasBytesAvailable {
+    return _bytesAvailable > 0;
+}
+- (NSUInteger)bytesAvailable {
+    return _bytesAvailable;
+}
+- (void)appendData:(NSData *)data {
+    [self appendData:data tag:0];
+}
+- (void)appendData:(NSData *)data tag:(NSUInteger)tag {
+    [self appendData:data tag:tag frameStart:NO];
+}
+- (void)appendData:(NSData *)data tag:(NSUInteger)tag frameStart:(BOOL)frameStart {
+    if(data.length == 0) {
+        return;
+    }
+    [_chunks addObject:data];
+    [_chunkTags addObject:@(tag)];
+    [_chunkFlags addObject:@((frameStart) ? PSWebSocketOutputQueueChunkFrameStart : 0)];
+    _bytesAvailable += data.length;
+}
+- (void)insertControlFrame:(NSData *)frame {
+    if(frame.length == 0) {
+        return;
+    }
+    
+    // never split the frame going out, then skip control frames already ahead
+    NSUInteger count = _chunks.count;
+    NSUInteger index = (_headOffset > 0) ? 1 : 0;
+    while(index < count &&
+          [_chunkFlags[index] unsignedCharValue] != PSWebSocketOutputQueueChunkFrameStart) {
+        ++index;
+    }
+    [_chunks insertObject:frame atIndex:index];
+    [_chunkTags insertObject:@0 atIndex:index];
+    [_chunkFlags insertObject:@(PSWebSocketOutputQueueChunkFrameStart | PSWebSocketOutputQueueChunkControl) atIndex:index];
+    _bytesAvailable += frame.length;
+}
+- (NSUInteger)dropOldestTaggedData {
+    NSUInteger count = _chunks.count;
+    for(NSUInteger i = 0; i < count; ++i) {
+        NSUInteger tag = [_chunkTags[i] unsignedIntegerValue];
+        // a message that has started going out must be finished
+        if(tag == 0 || tag == _writtenTag) {
+            continue;
+        }
+        // control frames let in between the message's frames stay queued
+        NSMutableIndexSet *indexes = [NSMutableIndexSet indexSet];
+        NSUInteger length = 0;
+        for(NSUInteger end = i; end < count; ++end) {
+            if([_chunkFlags[end] unsignedCharValue] & PSWebSocketOutputQueueChunkControl) {
+                continue;
+            }
+            if([_chunkTags[end] unsignedIntegerValue] != tag) {
+                break;
+            }
+            [indexes addIndex:end];
+            length += [_chunks[end] length];
+        }
+        [_chunks removeObjectsAtIndexes:indexes];
+        [_chunkTags removeObjectsAtIndexes:indexes];
+        [_chunkFlags removeObjectsAtIndexes:indexes];
+        _bytesAvailable -= length;
+        return length;
+    }
+    return 0;
+}
+- (NSUInteger)getChunks:(struct iovec *)chunks maxCount:(NSUInteger)maxCount {
+    NSUInteger count = 0;
+    NSUInteger offset = _headOffset;
+    for(NSData *data in _chunks) {
+        if(count >= maxCount) {
+            break;
+        }
+        chunks[count].iov_base = (uint8_t *)data.bytes + offset;
+        chunks[count].iov_len = data.length - offset;
+        offset = 0;
+        ++count;
+    }
+    return count;
+}
+- (void)consumeLength:(NSUInteger)length {
+    NSAssert(length <= _bytesAvailable, @"Cannot consume more bytes than are queued");
+    _bytesAvailable -= length;
+    while(length > 0) {
+        NSData *head = _chunks[0];
+        NSUInteger remaining = head.length - _headOffset;
+        // control frames let ahead do not finish the message they interrupt
+        if(!([_chunkFlags[0] unsignedCharValue] & PSWebSocketOutputQueueChunkControl)) {
+            _writtenTag = [_chunkTags[0] unsignedIntegerValue];
+        }
+        if(length < remaining) {
+            _headOffset += length;
+            return;
+        }
+        length -= remaining;
+        _headOffset = 0;
+        [_chunks removeObjectAtIndex:0];
+        [_chunkTags removeObjectAtIndex:0];
+        [_chunkFlags removeObjectAtIndex:0];
+    }
+}
+- (NSInteger)writeToTransport:(id <PSWebSocketTransport>)transport {
+    struct iovec chunks[PSWebSocketOutputQueueGatherCount];
+    NSUInteger count = [self getChunks:chunks maxCount:PSWebSocketOutputQueueGatherCount];
+    if(count == 0) {
+        return 0;
+    }
+    NSInteger writeLength = [transport writeChunks:chunks count:count];
+    if(writeLength > 0) {
+        [self consumeLength:writeLength];
+    }
+    return writeLength;
+}
+- (void)reset {
+    [_chunks removeAllObjects];
+    [_chunkTags removeAllObjects];
+    [_chunkFlags removeAllObjects];
+    _writtenTag = 0;
+    _headOffset = 0;
+    _bytesAvailable = 0;
+}
+
+@end
@@ -0,0 +1,61 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import "PSWebSocketCompressionPolicy.h"
+
+/**
+ *  A text or binary message that is framed once and sent to many server
+ *  mode websockets. Each distinct set of permessage-deflate window size,
+ *  level, strategy and memory level is compressed once with a fresh context
+ *  the first time a websocket using it needs it, after which every websocket
+ *  shares the same header and payload bytes. Safe to use from multiple
+ *  queues.
+ */
+@interface PSWebSocketPreparedMessage : NSObject
+
+#pragma mark - Properties
+
+/**
+ *  The NSString or NSData the message was prepared from
+ */
+@property (nonatomic, strong, readonly) id message;
+
+#pragma mark - Initialization
+
+/**
+ *  @param message an instance of NSData or NSString to send
+ *
+ *  @return a prepared message
+ */
++ (instancetype)preparedMessageWithMessage:(id)message;
+
+#pragma mark - Framing
+
+/**
+ *  Unmasked header and payload for the given deflate window bits, negative
+ *  as zlib takes them for raw deflate or 0 when uncompressed, deflated with
+ *  the level, strategy and memory level of the compression policy.
+ *
+ *  @param windowBits        deflate window bits or 0
+ *  @param compressionPolicy policy whose zlib parameters are used
+ *  @param outError          set if compression failed
+ *
+ *  @return array of the header and payload NSData or nil on failure
+ */
+- (NSArray *)framesForDeflateWindowBits:(NSInteger)windowBits
+                      compressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy
+                                  error:(NSError *__autoreleasing *)outError;
+
+@end
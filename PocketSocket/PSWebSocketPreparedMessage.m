@@ -0,0 +1,96 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketPreparedMessage.h"
+#import "PSWebSocketDeflater.h"
+#import "PSWebSocketInternal.h"
+
+@interface PSWebSocketPreparedMessage() {
+    PSWebSocketOpCode _opcode;
+    NSData *_data;
+    NSMutableDictionary *_frames;
+}
+@end
+@implementation PSWebSocketPreparedMessage
+
+#pragma mark - Initialization
+
++ (instancetype)preparedMessageWithMessage:(id)message {
+    return [[self alloc] initWithMessage:message];
+}
+- (instancetype)initWithMessage:(id)message {
+    NSParameterAssert(message);
+    if((self = [super init])) {
+        _message = [message copy];
+        if([_message isKindOfClass:[NSString class]]) {
+            _opcode = PSWebSocketOpCodeText;
+            _data = [_message dataUsingEncoding:NSUTF8StringEncoding];
+        } else if([_message isKindOfClass:[NSData class]]) {
+            _opcode = PSWebSocketOpCodeBinary;
+            _data = _message;
+        } else {
+            [NSException raise:@"Invalid Message" format:@"Messages must be instances of NSString or NSData"];
+            return nil;
+        }
+        _frames = [NSMutableDictionary dictionary];
+    }
+    return self;
+}
+
+#pragma mark - Framing
+
+- (NSArray *)framesForDeflateWindowBits:(NSInteger)windowBits
+                      compressionPolicy:(PSWebSocketCompressionPolicy *)compressionPolicy
+                                  error:(NSError *__autoreleasing *)outError
+{
+    compressionPolicy = compressionPolicy ?: [PSWebSocketCompressionPolicy defaultPolicy];
+    NSUInteger memoryLevel = MAX(1, MIN(9, compressionPolicy.memoryLevel));
+    
+    // one encoding per set of parameters that changes the deflated bytes
+    NSArray *key = (windowBits != 0) ? @[@(windowBits), @(compressionPolicy.level), @(compressionPolicy.strategy), @(memoryLevel)] : @[@0];
+    @synchronized(self) {
+        NSArray *frames = _frames[key];
+        if(frames) {
+            return frames;
+        }
+        
+        uint8_t headerByte = PSWebSocketFinMask | _opcode;
+        NSData *payload = _data;
+        
+        // deflate with a fresh context so any connection can inflate it
+        if(windowBits != 0 && _data.length > 0) {
+            PSWebSocketDeflater *deflater = [[PSWebSocketDeflater alloc] initWithWindowBits:windowBits
+                                                                                memoryLevel:memoryLevel
+                                                                                      level:compressionPolicy.level
+                                                                                   strategy:compressionPolicy.strategy];
+            NSMutableData *deflated = [NSMutableData dataWithCapacity:_data.length/4];
+            if(![deflater begin:deflated error:outError] ||
+               ![deflater appendBytes:_data.bytes length:_data.length error:outError] ||
+               ![deflater end:outError]) {
+                return nil;
+            }
+            payload = deflated;
+            headerByte |= PSWebSocketRsv1Mask;
+        }
+        
+        NSMutableData *header = [NSMutableData dataWithBytes:&headerByte length:sizeof(headerByte)];
+        PSWebSocketAppendFramePayloadLength(header, payload.length, NO);
+        
+        frames = @[[header copy], [payload copy]];
+        _frames[key] = frames;
+        return frames;
+    }
+}
+
+@end
@@ -15,6 +15,47 @@
 #import <Foundation/Foundation.h>
 #import "PSWebSocket.h"
 
+/**
+ *  Why a connection was dropped before becoming a websocket
+ */
+typedef NS_ENUM(NSInteger, PSWebSocketServerHandshakeFailure) {
+    // closed on accept beyond maximumPendingHandshakes
+    PSWebSocketServerHandshakeFailureShed = 0,
+    // handshakeTimeout passed
+    PSWebSocketServerHandshakeFailureTimedOut,
+    // malformed or oversized request head
+    PSWebSocketServerHandshakeFailureInvalidRequest,
+    // a request that is not a websocket upgrade
+    PSWebSocketServerHandshakeFailureNotWebSocket,
+    // the delegate rejected the request
+    PSWebSocketServerHandshakeFailureRejected,
+    // the connection errored or was closed by the peer
+    PSWebSocketServerHandshakeFailureConnectionFailed
+};
+
+/**
+ *  Snapshot of a server's counters, see PSWebSocketStatistics.
+ */
+@interface PSWebSocketServerStatistics : NSObject
+
+@property (nonatomic, assign, readonly) uint64_t acceptCount;
+@property (nonatomic, assign, readonly) NSUInteger openWebSocketCount;
+
+/**
+ *  Round trip times measured by every accepted websocket, see PSWebSocket
+ *  heartbeatInterval.
+ */
+@property (nonatomic, strong, readonly) PSWebSocketHistogram *roundTripTimes;
+
+/**
+ *  Time from accepting a connection to accepting its upgrade request.
+ */
+@property (nonatomic, strong, readonly) PSWebSocketHistogram *handshakeTimes;
+
+- (uint64_t)handshakeFailuresForReason:(PSWebSocketServerHandshakeFailure)reason;
+
+@end
+
 @class PSWebSocketServer;
 
 @protocol PSWebSocketServerDelegate <NSObject>
@@ -33,8 +74,20 @@
 @optional
 - (void)server:(PSWebSocketServer *)server webSocketDidFlushInput:(PSWebSocket *)webSocket;
 - (void)server:(PSWebSocketServer *)server webSocketDidFlushOutput:(PSWebSocket *)webSocket;
+- (void)server:(PSWebSocketServer *)server webSocketDidReachHighWaterMark:(PSWebSocket *)webSocket;
+- (void)server:(PSWebSocketServer *)server webSocketDidDrainToLowWaterMark:(PSWebSocket *)webSocket;
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime;
+
+// called instead of server:webSocket:didReceiveMessage: with every message one
+// read produced, see PSWebSocket maximumMessageBatchCount
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages;
 - (BOOL)server:(PSWebSocketServer *)server acceptWebSocketWithRequest:(NSURLRequest *)request;
 - (BOOL)server:(PSWebSocketServer *)server acceptWebSocketWithRequest:(NSURLRequest *)request address:(NSData *)address trust:(SecTrustRef)trust response:(NSHTTPURLResponse **)response;
+
+// called instead of server:webSocket:didReceiveMessage: when streamsMessages is enabled
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didBeginMessage:(PSWebSocketMessageType)type;
+- (void)server:(PSWebSocketServer *)server webSocket:(PSWebSocket *)webSocket didReceiveMessageChunk:(NSData *)chunk;
+- (void)server:(PSWebSocketServer *)server webSocketDidFinishMessage:(PSWebSocket *)webSocket;
 @end
 
 @interface PSWebSocketServer : NSObject
@@ -44,14 +97,211 @@
 @property (nonatomic, weak) id <PSWebSocketServerDelegate> delegate;
 @property (nonatomic, strong) dispatch_queue_t delegateQueue;
 
+/**
+ *  Socket addresses, sockaddr_in or sockaddr_in6 NSData, the server listens
+ *  on.
+ */
+@property (nonatomic, copy, readonly) NSArray *addresses;
+
+/**
+ *  Length of each listening socket's queue of connections not yet accepted,
+ *  the kernel may cap it further. Set before starting the server. Defaults
+ *  to 256.
+ */
+@property (nonatomic, assign) NSUInteger backlog;
+
+/**
+ *  Number of listening sockets opened on every address, sharing its port
+ *  through SO_REUSEPORT when more than one. Each accepts on its own queue,
+ *  kernels that spread connections across such sockets, as Linux does, then
+ *  accept bursts in parallel. Set before starting the server. Defaults to 1.
+ */
+@property (nonatomic, assign) NSUInteger acceptorCount;
+
+/**
+ *  Keep IPv6 listeners from also accepting IPv4 connections as IPv4 mapped
+ *  addresses. Leave it off to serve both from "::" alone, turn it on to list
+ *  the IPv4 and IPv6 wildcards as separate addresses. Set before starting
+ *  the server. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL IPv6Only;
+
+/**
+ *  Accepted websockets deliver messages in chunks, see PSWebSocket
+ *  streamsMessages. Set before starting the server. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL streamsMessages;
+
+/**
+ *  What accepted websockets hand to the delegate, see PSWebSocket
+ *  messageDelivery. Set before starting the server. Defaults to
+ *  PSWebSocketMessageDeliveryString.
+ */
+@property (nonatomic, assign) PSWebSocketMessageDelivery messageDelivery;
+
+/**
+ *  Compression policy given to accepted websockets, see
+ *  PSWebSocketCompressionPolicy. Window bits and context takeover are
+ *  negotiated from it with every client. Set before starting the server.
+ *  Defaults to +[PSWebSocketCompressionPolicy defaultPolicy].
+ */
+@property (nonatomic, copy) PSWebSocketCompressionPolicy *compressionPolicy;
+
+/**
+ *  Bounds on incoming frames and messages given to accepted websockets, see
+ *  PSWebSocketLimits. Set before starting the server. Defaults to
+ *  +[PSWebSocketLimits defaultLimits].
+ */
+@property (nonatomic, copy) PSWebSocketLimits *limits;
+
+/**
+ *  Flush policy given to accepted websockets, see PSWebSocketFlushPolicy.
+ *  Set before starting the server. Defaults to
+ *  +[PSWebSocketFlushPolicy defaultPolicy].
+ */
+@property (nonatomic, copy) PSWebSocketFlushPolicy *flushPolicy;
+
+/**
+ *  Whether accepted websockets disable Nagle's algorithm, see PSWebSocket
+ *  noDelay. Set before starting the server. Defaults to YES.
+ */
+@property (nonatomic, assign) BOOL noDelay;
+
+/**
+ *  Most messages given to accepted websockets' delegate at once, see
+ *  PSWebSocket maximumMessageBatchCount. Set before starting the server.
+ *  Defaults to 256.
+ */
+@property (nonatomic, assign) NSUInteger maximumMessageBatchCount;
+
+/**
+ *  Call websocket delegate methods directly on the websocket's event loop
+ *  instead of dispatching them to delegateQueue, as is always done with more
+ *  than one event loop. The delegate must then be thread safe. Set before
+ *  starting the server. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL callsDelegateInline;
+
+/**
+ *  Output water marks given to accepted websockets, see PSWebSocket
+ *  highWaterMark and lowWaterMark. Set before starting the server. Both
+ *  default to 0, which leaves output unbounded.
+ */
+@property (nonatomic, assign) NSUInteger highWaterMark;
+@property (nonatomic, assign) NSUInteger lowWaterMark;
+
+/**
+ *  What accepted websockets do with sends while their output is above the
+ *  high water mark, see PSWebSocketSlowConsumerPolicy. Blocking never holds
+ *  up an event loop: broadcasts, and sends from delegate methods called on a
+ *  loop, are queued past the high water mark instead, so only sends from
+ *  other queues wait. Dropping or disconnecting also bounds the memory a slow
+ *  client can hold. Set before starting the server. Defaults to
+ *  PSWebSocketSlowConsumerPolicyQueue.
+ */
+@property (nonatomic, assign) PSWebSocketSlowConsumerPolicy slowConsumerPolicy;
+
+/**
+ *  Heartbeat given to accepted websockets, see PSWebSocket
+ *  heartbeatInterval and maximumMissedHeartbeats. Set before starting the
+ *  server. They default to 0 and 2.
+ */
+@property (nonatomic, assign) NSTimeInterval heartbeatInterval;
+@property (nonatomic, assign) NSUInteger maximumMissedHeartbeats;
+
+/**
+ *  Idle timeout given to accepted websockets, see PSWebSocket idleTimeout.
+ *  Set before starting the server. Defaults to 0.
+ */
+@property (nonatomic, assign) NSTimeInterval idleTimeout;
+
+/**
+ *  Length from which accepted websockets deflate messages in parallel, see
+ *  PSWebSocket parallelCompressionLength. Set before starting the server.
+ *  Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger parallelCompressionLength;
+
+/**
+ *  Number of serial event loops connections are spread across, each accepted
+ *  connection is assigned to the next loop in turn and stays there. With more
+ *  than one loop, websocket delegate methods are called on the websocket's
+ *  loop rather than delegateQueue so loops run in parallel; the delegate must
+ *  then be thread safe. Set before starting the server. Defaults to 1.
+ */
+@property (nonatomic, assign) NSUInteger eventLoopCount;
+
+/**
+ *  Seconds a connection may take to complete its opening handshake before it
+ *  is dropped, 0 disables the deadline. Defaults to 10.
+ */
+@property (nonatomic, assign) NSTimeInterval handshakeTimeout;
+
+/**
+ *  Maximum number of connections mid handshake, divided evenly between event
+ *  loops. Connections accepted beyond it are closed straight away so a
+ *  reconnect storm cannot starve the handshakes already in flight. 0 means no
+ *  limit. Defaults to 0.
+ */
+@property (nonatomic, assign) NSUInteger maximumPendingHandshakes;
+
+/**
+ *  Serve plain connections over PSWebSocketSocketTransport, nonblocking
+ *  sockets polled with kqueue or epoll, instead of a CFStream pair each. SSL
+ *  servers always use streams. Set before starting the server. Defaults to NO.
+ */
+@property (nonatomic, assign) BOOL usesSocketTransport;
+
 #pragma mark - Initialization
 
 + (instancetype)serverWithHost:(NSString *)host port:(NSUInteger)port;
 + (instancetype)serverWithHost:(NSString *)host port:(NSUInteger)port SSLCertificates:(NSArray *)SSLCertificates;
 
+/**
+ *  Server listening on every given address.
+ *
+ *  @param addresses       sockaddr_in or sockaddr_in6 NSData, see addressWithHost:port:
+ *  @param SSLCertificates optional certificates to serve SSL with
+ *
+ *  @return a server that is not started yet
+ */
++ (instancetype)serverWithAddresses:(NSArray *)addresses SSLCertificates:(NSArray *)SSLCertificates;
+
+/**
+ *  Socket address for an IPv4 or IPv6 literal such as "127.0.0.1", "::1"
+ *  or "::", nil and "0.0.0.0" being every IPv4 interface.
+ *
+ *  @return a sockaddr_in or sockaddr_in6 NSData or nil if host is not a literal
+ */
++ (NSData *)addressWithHost:(NSString *)host port:(NSUInteger)port;
+
 #pragma mark - Actions
 
 - (void)start;
 - (void)stop;
 
+/**
+ *  Send a message to every open websocket. The message is framed and, per
+ *  negotiated compression window, deflated once and the resulting bytes are
+ *  shared by every websocket's output.
+ *
+ *  @param message an instance of NSData or NSString to send
+ */
+- (void)broadcast:(id)message;
+
+/**
+ *  Send a message to the given websockets, any that are not open websockets
+ *  of this server are skipped. See broadcast:.
+ *
+ *  @param message    an instance of NSData or NSString to send
+ *  @param webSockets websockets to send the message to
+ */
+- (void)broadcast:(id)message toWebSockets:(NSArray *)webSockets;
+
+/**
+ *  Snapshot of accepts, handshake failures, open websockets and latencies
+ *  across every event loop. Safe to call from any thread.
+ */
+- (PSWebSocketServerStatistics *)statistics;
+
 @end
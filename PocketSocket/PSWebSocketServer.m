@@ -17,7 +17,11 @@
 #import "PSWebSocketDriver.h"
 #import "PSWebSocketInternal.h"
 #import "PSWebSocketBuffer.h"
-#import "PSWebSocketNetworkThread.h"
+#import "PSWebSocketHTTPParser.h"
+#import "PSWebSocketStreamTransport.h"
+#import "PSWebSocketSocketTransport.h"
+#import "PSWebSocketCounters.h"
+#import "PSWebSocketTimingWheel.h"
 #import <CFNetwork/CFNetwork.h>
 #import <net/if.h>
 #import <net/if_dl.h>
@@ -25,8 +29,16 @@
 #import <ifaddrs.h>
 #import <netdb.h>
 #import <arpa/inet.h>
+#import <unistd.h>
+#import <fcntl.h>
 #import <Security/SecureTransport.h>
 
+static inline void PSWebSocketServerSetPOSIXError(NSError *__autoreleasing *outError) {
+    if(outError) {
+        *outError = [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil];
+    }
+}
+
 typedef NS_ENUM(NSInteger, PSWebSocketServerConnectionReadyState) {
     PSWebSocketServerConnectionReadyStateConnecting = 0,
     PSWebSocketServerConnectionReadyStateOpen,
@@ -34,16 +46,52 @@ typedef NS_ENUM(NSInteger, PSWebSocketServerConnectionReadyState) {
     PSWebSocketServerConnectionReadyStateClosed
 };
 
+static const NSUInteger PSWebSocketServerHandshakeFailureCount = PSWebSocketServerHandshakeFailureConnectionFailed + 1;
+
+// written from every event loop and read from anywhere
+typedef struct {
+    _Atomic uint64_t accepts;
+    _Atomic uint64_t handshakeFailures[PSWebSocketServerHandshakeFailureCount];
+    _Atomic uint64_t openWebSockets;
+    PSWebSocketHistogramCounters roundTripTimes;
+    PSWebSocketHistogramCounters handshakeTimes;
+} PSWebSocketServerCounters;
+
+@implementation PSWebSocketServerStatistics {
+    uint64_t _handshakeFailures[PSWebSocketServerHandshakeFailureCount];
+}
+
+- (instancetype)initWithCounters:(PSWebSocketServerCounters *)counters {
+    if((self = [super init])) {
+        _acceptCount = PSWebSocketCounterGet(&counters->accepts);
+        for(NSUInteger i = 0; i < PSWebSocketServerHandshakeFailureCount; ++i) {
+            _handshakeFailures[i] = PSWebSocketCounterGet(&counters->handshakeFailures[i]);
+        }
+        _openWebSocketCount = (NSUInteger)PSWebSocketCounterGet(&counters->openWebSockets);
+        _roundTripTimes = [[PSWebSocketHistogram alloc] initWithCounters:&counters->roundTripTimes];
+        _handshakeTimes = [[PSWebSocketHistogram alloc] initWithCounters:&counters->handshakeTimes];
+    }
+    return self;
+}
+- (uint64_t)handshakeFailuresForReason:(PSWebSocketServerHandshakeFailure)reason {
+    NSParameterAssert(reason >= 0 && reason < PSWebSocketServerHandshakeFailureCount);
+    return _handshakeFailures[reason];
+}
+
+@end
+
+@class PSWebSocketServerLoop;
+
 @interface PSWebSocketServerConnection : NSObject
 
 @property (nonatomic, strong, readonly) NSString *identifier;
+@property (nonatomic, weak) PSWebSocketServerLoop *loop;
 @property (nonatomic, assign) PSWebSocketServerConnectionReadyState readyState;
-@property (nonatomic, strong) NSInputStream *inputStream;
-@property (nonatomic, strong) NSOutputStream *outputStream;
-@property (nonatomic, assign) BOOL inputStreamOpenCompleted;
-@property (nonatomic, assign) BOOL outputStreamOpenCompleted;
+@property (nonatomic, assign) CFAbsoluteTime acceptTime;
+@property (nonatomic, strong) id <PSWebSocketTransport> transport;
 @property (nonatomic, strong) PSWebSocketBuffer *inputBuffer;
 @property (nonatomic, strong) PSWebSocketBuffer *outputBuffer;
+@property (nonatomic, strong) PSWebSocketTimer *deadlineTimer;
 
 @end
 @implementation PSWebSocketServerConnection
@@ -60,36 +108,150 @@ typedef NS_ENUM(NSInteger, PSWebSocketServerConnectionReadyState) {
 
 @end
 
+/**
+ *  A serial event loop owning a share of the server's connections. A
+ *  connection is pinned to one loop from accept until close, its handshake,
+ *  bookkeeping and delegation all run on the loop's queue so loops share no
+ *  state and never contend with one another.
+ */
+@interface PSWebSocketServerLoop : NSObject
+
+@property (nonatomic, strong, readonly) dispatch_queue_t queue;
+@property (nonatomic, strong, readonly) NSMutableSet *connections;
+@property (nonatomic, strong, readonly) NSMapTable *connectionsByTransports;
+@property (nonatomic, strong, readonly) NSMutableSet *webSockets;
+@property (nonatomic, strong, readonly) NSMutableSet *openWebSockets;
+@property (nonatomic, strong, readonly) PSWebSocketTimingWheel *timingWheel;
+
++ (instancetype)currentLoop;
+
+@end
+
+static void *PSWebSocketServerLoopKey = &PSWebSocketServerLoopKey;
+static const NSTimeInterval PSWebSocketServerLoopTimerResolution = 0.01;
+static const NSTimeInterval PSWebSocketServerGracefulDisconnectTimeout = 5.0;
+static const NSTimeInterval PSWebSocketServerAcceptBackOffInterval = 0.1;
+
+@implementation PSWebSocketServerLoop
+
++ (instancetype)currentLoop {
+    return (__bridge PSWebSocketServerLoop *)dispatch_get_specific(PSWebSocketServerLoopKey);
+}
+- (instancetype)initWithName:(NSString *)name {
+    if((self = [super init])) {
+        _queue = dispatch_queue_create(name.UTF8String, nil);
+        dispatch_queue_set_specific(_queue, PSWebSocketServerLoopKey, (__bridge void *)self, NULL);
+        _connections = [NSMutableSet set];
+        _connectionsByTransports = [NSMapTable weakToWeakObjectsMapTable];
+        _webSockets = [NSMutableSet set];
+        _openWebSockets = [NSMutableSet set];
+        _timingWheel = [[PSWebSocketTimingWheel alloc] initWithQueue:_queue resolution:PSWebSocketServerLoopTimerResolution];
+    }
+    return self;
+}
+
+@end
+
+/**
+ *  One listening socket and the dispatch source accepting on it, on its own
+ *  serial queue. Accepting can be paused for a while when the process runs
+ *  out of descriptors or buffers, the listener stays readable meanwhile.
+ */
+@interface PSWebSocketServerAcceptor : NSObject
+
+@property (nonatomic, assign, readonly) int handle;
+@property (nonatomic, strong, readonly) dispatch_queue_t queue;
+
+- (instancetype)initWithHandle:(int)handle name:(NSString *)name handler:(void (^)(PSWebSocketServerAcceptor *acceptor))handler;
+
+- (void)backOff;
+- (void)cancel;
+
+@end
+
+@interface PSWebSocketServerAcceptor() {
+    dispatch_source_t _source;
+    PSWebSocketTimer *_backOffTimer;
+    BOOL _suspended;
+}
+@end
+@implementation PSWebSocketServerAcceptor
 
-void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info);
+- (instancetype)initWithHandle:(int)handle name:(NSString *)name handler:(void (^)(PSWebSocketServerAcceptor *acceptor))handler {
+    NSParameterAssert(handler);
+    if((self = [super init])) {
+        _handle = handle;
+        _queue = dispatch_queue_create(name.UTF8String, DISPATCH_QUEUE_SERIAL);
+        _source = dispatch_source_create(DISPATCH_SOURCE_TYPE_READ, handle, 0, _queue);
+        __weak typeof(self)weakSelf = self;
+        dispatch_source_set_event_handler(_source, ^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            if(strongSelf) {
+                handler(strongSelf);
+            }
+        });
+        dispatch_source_set_cancel_handler(_source, ^{
+            close(handle);
+        });
+        _backOffTimer = [PSWebSocketTimer timerWithHandler:^{
+            __strong typeof(weakSelf)strongSelf = weakSelf;
+            if(strongSelf) {
+                dispatch_async(strongSelf->_queue, ^{
+                    [strongSelf resumeAccepting];
+                });
+            }
+        }];
+        dispatch_resume(_source);
+    }
+    return self;
+}
+- (void)backOff {
+    // called on the queue; stop polling the listener until the timer fires
+    // instead of spinning on the same failed accept
+    if(_suspended || dispatch_source_testcancel(_source)) {
+        return;
+    }
+    _suspended = YES;
+    dispatch_suspend(_source);
+    [[PSWebSocketTimingWheel sharedWheel] armTimer:_backOffTimer interval:PSWebSocketServerAcceptBackOffInterval];
+}
+- (void)resumeAccepting {
+    if(!_suspended) {
+        return;
+    }
+    _suspended = NO;
+    dispatch_resume(_source);
+}
+- (void)cancel {
+    dispatch_source_cancel(_source);
+    
+    // a suspended source never runs its cancel handler, which closes the listener
+    dispatch_async(_queue, ^{
+        [[PSWebSocketTimingWheel sharedWheel] cancelTimer:_backOffTimer];
+        [self resumeAccepting];
+    });
+}
 
-@interface PSWebSocketServer() <NSStreamDelegate, PSWebSocketDelegate> {
+@end
+
+
+@interface PSWebSocketServer() <PSWebSocketTransportDelegate, PSWebSocketDelegate> {
     dispatch_queue_t _workQueue;
     
     NSArray *_SSLCertificates;
     BOOL _secure;
     
-    NSData *_addrData;
-    CFSocketContext _socketContext;
-    
     BOOL _running;
-    CFSocketRef _socket;
-    CFRunLoopSourceRef _socketRunLoopSource;
+    NSMutableArray *_acceptors;
     
-    NSMutableSet *_connections;
-    NSMapTable *_connectionsByStreams;
+    NSArray *_loops;
+    _Atomic NSUInteger _nextLoopIndex;
     
-    NSMutableSet *_webSockets;
+    PSWebSocketServerCounters *_counters;
 }
 @end
 @implementation PSWebSocketServer
 
-#pragma mark - Properties
-
-- (NSRunLoop *)runLoop {
-    return [[PSWebSocketNetworkThread sharedNetworkThread] runLoop];
-}
-
 #pragma mark - Initialization
 
 + (instancetype)serverWithHost:(NSString *)host port:(NSUInteger)port {
@@ -98,8 +260,48 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
 + (instancetype)serverWithHost:(NSString *)host port:(NSUInteger)port SSLCertificates:(NSArray *)SSLCertificates {
     return [[self alloc] initWithHost:host port:port SSLCertificates:SSLCertificates];
 }
++ (instancetype)serverWithAddresses:(NSArray *)addresses SSLCertificates:(NSArray *)SSLCertificates {
+    return [[self alloc] initWithAddresses:addresses SSLCertificates:SSLCertificates];
+}
++ (NSData *)addressWithHost:(NSString *)host port:(NSUInteger)port {
+    NSParameterAssert(port <= UINT16_MAX);
+    
+    // no host or the IPv4 wildcard listens on every IPv4 interface
+    if(!host || [host isEqualToString:@"0.0.0.0"]) {
+        host = @"0.0.0.0";
+    }
+    host = [host stringByTrimmingCharactersInSet:[NSCharacterSet characterSetWithCharactersInString:@"[]"]];
+    
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_len = sizeof(addr);
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if(inet_pton(AF_INET, host.UTF8String, &addr.sin_addr) == 1) {
+        return [NSData dataWithBytes:&addr length:sizeof(addr)];
+    }
+    
+    struct sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    addr6.sin6_len = sizeof(addr6);
+    addr6.sin6_family = AF_INET6;
+    addr6.sin6_port = htons(port);
+    if(inet_pton(AF_INET6, host.UTF8String, &addr6.sin6_addr) == 1) {
+        return [NSData dataWithBytes:&addr6 length:sizeof(addr6)];
+    }
+    return nil;
+}
 - (instancetype)initWithHost:(NSString *)host port:(NSUInteger)port SSLCertificates:(NSArray *)SSLCertificates {
     NSParameterAssert(port);
+    NSData *address = [[self class] addressWithHost:host port:port];
+    if(!address) {
+        [NSException raise:@"Invalid host" format:@"Could not formulate internet address from host: %@", host];
+        return nil;
+    }
+    return [self initWithAddresses:@[address] SSLCertificates:SSLCertificates];
+}
+- (instancetype)initWithAddresses:(NSArray *)addresses SSLCertificates:(NSArray *)SSLCertificates {
+    NSParameterAssert(addresses.count > 0);
     if((self = [super init])) {
         _workQueue = dispatch_queue_create(nil, nil);
         
@@ -107,31 +309,37 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
         _SSLCertificates = [SSLCertificates copy];
         _secure = (_SSLCertificates != nil);
         
-        // create addr data
-        struct sockaddr_in addr;
-        memset(&addr, 0, sizeof(addr));
-        addr.sin_len = sizeof(addr);
-        addr.sin_family = AF_INET;
-        if(host && ![host isEqualToString:@"0.0.0.0"]) {
-            addr.sin_addr.s_addr = inet_addr(host.UTF8String);
-            if(!addr.sin_addr.s_addr) {
-                [NSException raise:@"Invalid host" format:@"Could not formulate internet address from host: %@", host];
+        // only IPv4 and IPv6 socket addresses can be listened on
+        for(NSData *address in addresses) {
+            const struct sockaddr *addr = address.bytes;
+            if(address.length < sizeof(struct sockaddr) ||
+               (addr->sa_family != AF_INET && addr->sa_family != AF_INET6)) {
+                [NSException raise:@"Invalid address" format:@"Listen addresses must be sockaddr_in or sockaddr_in6: %@", address];
                 return nil;
             }
-        } else {
-            addr.sin_addr.s_addr = htonl(INADDR_ANY);
         }
-        addr.sin_port = htons(port);
-        _addrData = [NSData dataWithBytes:&addr length:sizeof(addr)];
-        
-        // create socket context
-        _socketContext = (CFSocketContext){0, (__bridge void *)self, NULL, NULL, NULL};
-        
-        _connections = [NSMutableSet set];
-        _connectionsByStreams = [NSMapTable weakToWeakObjectsMapTable];
-        
-        _webSockets = [NSMutableSet set];
+        _addresses = [addresses copy];
         
+        _backlog = 256;
+        _acceptorCount = 1;
+        _IPv6Only = NO;
+        _eventLoopCount = 1;
+        _compressionPolicy = [PSWebSocketCompressionPolicy defaultPolicy];
+        _limits = [PSWebSocketLimits defaultLimits];
+        _flushPolicy = [PSWebSocketFlushPolicy defaultPolicy];
+        _noDelay = YES;
+        _maximumMessageBatchCount = 256;
+        _callsDelegateInline = NO;
+        _highWaterMark = 0;
+        _lowWaterMark = 0;
+        _slowConsumerPolicy = PSWebSocketSlowConsumerPolicyQueue;
+        _heartbeatInterval = 0.0;
+        _maximumMissedHeartbeats = 2;
+        _idleTimeout = 0.0;
+        _messageDelivery = PSWebSocketMessageDeliveryString;
+        _parallelCompressionLength = 0;
+        _handshakeTimeout = 10.0;
+        _counters = calloc(1, sizeof(PSWebSocketServerCounters));
     }
     return self;
 }
@@ -148,6 +356,28 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
         [self disconnectGracefully:NO];
     }];
 }
+- (PSWebSocketServerStatistics *)statistics {
+    return [[PSWebSocketServerStatistics alloc] initWithCounters:_counters];
+}
+- (void)broadcast:(id)message {
+    [self broadcast:message toWebSockets:nil];
+}
+- (void)broadcast:(id)message toWebSockets:(NSArray *)webSockets {
+    PSWebSocketPreparedMessage *preparedMessage = [PSWebSocketPreparedMessage preparedMessageWithMessage:message];
+    webSockets = [webSockets copy];
+    [self executeWork:^{
+        for(PSWebSocketServerLoop *loop in _loops) {
+            dispatch_async(loop.queue, ^{
+                for(PSWebSocket *webSocket in (webSockets) ?: loop.openWebSockets) {
+                    if(webSockets && ![loop.openWebSockets containsObject:webSocket]) {
+                        continue;
+                    }
+                    [webSocket sendPreparedMessage:preparedMessage];
+                }
+            });
+        }
+    }];
+}
 
 #pragma mark - Connection
 
@@ -156,37 +386,39 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
         return;
     }
     
-    // create socket
-    _socket = CFSocketCreate(kCFAllocatorDefault,
-                             PF_INET,
-                             SOCK_STREAM,
-                             IPPROTO_TCP,
-                             kCFSocketAcceptCallBack,
-                             PSWebSocketServerAcceptCallback,
-                             &_socketContext);
-    // configure socket
-    int yes = 1;
-    setsockopt(CFSocketGetNative(_socket), SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
-    
-    // bind
-    CFSocketError err = CFSocketSetAddress(_socket, (__bridge CFDataRef)_addrData);
-    if(err == kCFSocketError) {
-        if(!silent) {
-            [self notifyDelegateFailedToStart:[NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:nil]];
+    // create event loops
+    if(!_loops) {
+        NSMutableArray *loops = [NSMutableArray array];
+        for(NSUInteger i = 0; i < MAX(_eventLoopCount, 1); ++i) {
+            NSString *name = [NSString stringWithFormat:@"PSWebSocketServer loop %@", @(i)];
+            [loops addObject:[[PSWebSocketServerLoop alloc] initWithName:name]];
         }
-        return;
-    } else if(err == kCFSocketTimeout) {
-        if(!silent) {
-            [self notifyDelegateFailedToStart:[NSError errorWithDomain:NSPOSIXErrorDomain code:ETIME userInfo:nil]];
-        }
-        return;
+        _loops = loops;
     }
     
-    // schedule
-    _socketRunLoopSource = CFSocketCreateRunLoopSource(kCFAllocatorDefault, _socket, 0);
-    
-    CFRunLoopRef runLoop = [[self runLoop] getCFRunLoop];
-    CFRunLoopAddSource(runLoop, _socketRunLoopSource, kCFRunLoopCommonModes);
+    // every address gets acceptorCount listeners sharing its port, each
+    // accepting on its own queue so the kernel can spread connections
+    NSUInteger acceptorCount = MAX(_acceptorCount, 1);
+    _acceptors = [NSMutableArray array];
+    for(NSData *address in _addresses) {
+        for(NSUInteger i = 0; i < acceptorCount; ++i) {
+            NSError *error = nil;
+            int handle = [self listenOnAddress:address reusePort:(acceptorCount > 1) error:&error];
+            if(handle < 0) {
+                [self disconnect:YES];
+                if(!silent) {
+                    [self notifyDelegateFailedToStart:error];
+                }
+                return;
+            }
+            
+            NSString *name = [NSString stringWithFormat:@"PSWebSocketServer acceptor %@", @(_acceptors.count)];
+            __weak typeof(self)weakSelf = self;
+            [_acceptors addObject:[[PSWebSocketServerAcceptor alloc] initWithHandle:handle name:name handler:^(PSWebSocketServerAcceptor *acceptor) {
+                [weakSelf acceptOnAcceptor:acceptor];
+            }]];
+        }
+    }
     
     _running = YES;
     
@@ -199,15 +431,17 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
         return;
     }
     
-    for(PSWebSocketServerConnection *connection in _connections.allObjects) {
-        [self disconnectConnectionGracefully:connection statusCode:500 description:@"Service Going Away" headers: nil];
-    }
-    for(PSWebSocket *webSocket in _webSockets.allObjects) {
-        [webSocket close];
+    for(PSWebSocketServerLoop *loop in _loops) {
+        dispatch_async(loop.queue, ^{
+            for(PSWebSocketServerConnection *connection in loop.connections.allObjects) {
+                [self disconnectConnectionGracefully:connection statusCode:500 description:@"Service Going Away" headers: nil];
+            }
+            for(PSWebSocket *webSocket in loop.webSockets.allObjects) {
+                [webSocket close];
+            }
+        });
     }
     
-    [self pumpOutput];
-    
     // disconnect
     [self executeWork:^{
         [self disconnect:silent];
@@ -216,20 +450,11 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     _running = NO;
 }
 - (void)disconnect:(BOOL)silent {
-    if(_socketRunLoopSource) {
-        CFRunLoopRef runLoop = [[self runLoop] getCFRunLoop];
-        CFRunLoopRemoveSource(runLoop, _socketRunLoopSource, kCFRunLoopCommonModes);
-        CFRelease(_socketRunLoopSource);
-        _socketRunLoopSource = nil;
-    }
-    
-    if(_socket) {
-        if(CFSocketIsValid(_socket)) {
-            CFSocketInvalidate(_socket);
-        }
-        CFRelease(_socket);
-        _socket = nil;
+    // listening sockets are closed once their acceptor is done with them
+    for(PSWebSocketServerAcceptor *acceptor in _acceptors) {
+        [acceptor cancel];
     }
+    _acceptors = nil;
     
     _running = NO;
     
@@ -238,81 +463,191 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     }
 }
 
+- (int)listenOnAddress:(NSData *)address reusePort:(BOOL)reusePort error:(NSError *__autoreleasing *)outError {
+    const struct sockaddr *addr = address.bytes;
+    int handle = socket(addr->sa_family, SOCK_STREAM, IPPROTO_TCP);
+    if(handle < 0) {
+        PSWebSocketServerSetPOSIXError(outError);
+        return -1;
+    }
+    
+    // configure socket
+    int yes = 1;
+    int v6only = (_IPv6Only) ? 1 : 0;
+    setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (void *)&yes, sizeof(yes));
+    if((reusePort && setsockopt(handle, SOL_SOCKET, SO_REUSEPORT, (void *)&yes, sizeof(yes)) != 0) ||
+       (addr->sa_family == AF_INET6 && setsockopt(handle, IPPROTO_IPV6, IPV6_V6ONLY, (void *)&v6only, sizeof(v6only)) != 0)) {
+        PSWebSocketServerSetPOSIXError(outError);
+        close(handle);
+        return -1;
+    }
+    fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(handle, F_SETFD, FD_CLOEXEC);
+    
+    // bind & listen
+    if(bind(handle, addr, (socklen_t)address.length) != 0 ||
+       listen(handle, (int)MIN(MAX(_backlog, (NSUInteger)1), (NSUInteger)INT_MAX)) != 0) {
+        PSWebSocketServerSetPOSIXError(outError);
+        close(handle);
+        return -1;
+    }
+    return handle;
+}
+
 #pragma mark - Accepting
 
-- (void)accept:(CFSocketNativeHandle)handle {
-    [self executeWork:^{
-        // create streams
-        CFReadStreamRef readStream = nil;
-        CFWriteStreamRef writeStream = nil;
-        CFStreamCreatePairWithSocket(kCFAllocatorDefault, handle, &readStream, &writeStream);
+- (void)acceptOnAcceptor:(PSWebSocketServerAcceptor *)acceptor {
+    // take every connection that is ready, one readiness event may cover many
+    while(YES) {
+        int handle = accept(acceptor.handle, NULL, NULL);
+        if(handle < 0) {
+            if(errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if(errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM) {
+                // the connection stays queued so the listener stays readable,
+                // retrying straight away would spin until resources free up
+                [acceptor backOff];
+            }
+            return;
+        }
         
-        // fail if we couldn't get streams
-        if(!readStream || !writeStream) {
+        // accepted sockets inherit nonblocking from the listener on BSD, hand
+        // them over blocking as a CFSocket listener did
+        fcntl(handle, F_SETFL, fcntl(handle, F_GETFL, 0) & ~O_NONBLOCK);
+        [self accept:handle];
+    }
+}
+- (void)accept:(CFSocketNativeHandle)handle {
+    // pin the connection to the next loop in turn, acceptors race for it
+    NSUInteger loopIndex = atomic_fetch_add_explicit(&_nextLoopIndex, 1, memory_order_relaxed);
+    PSWebSocketServerLoop *loop = _loops[loopIndex % _loops.count];
+    CFAbsoluteTime acceptTime = CFAbsoluteTimeGetCurrent();
+    PSWebSocketCounterAdd(&_counters->accepts, 1);
+    dispatch_async(loop.queue, ^{
+        // shed connections beyond the loop's share of pending handshakes
+        if(_maximumPendingHandshakes > 0 &&
+           loop.connections.count >= MAX(_maximumPendingHandshakes / _loops.count, 1)) {
+            [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureShed];
+            close(handle);
             return;
         }
         
-        // configure streams
-        CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
-        CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+        // create transport
+        id <PSWebSocketTransport> transport = nil;
+        if(_usesSocketTransport && !_secure) {
+            transport = [PSWebSocketSocketTransport transportWithNativeHandle:handle];
+        } else {
+            transport = [self streamTransportWithNativeHandle:handle];
+        }
         
-        // enable SSL
-        if(_secure) {
-            NSMutableDictionary *opts = [NSMutableDictionary dictionary];
-            
-            opts[(__bridge id)kCFStreamSSLIsServer] = @YES;
-            opts[(__bridge id)kCFStreamSSLCertificates] = _SSLCertificates;
-            opts[(__bridge id)kCFStreamSSLValidatesCertificateChain] = @NO; // i.e. client certs
-            
-            CFReadStreamSetProperty(readStream, kCFStreamPropertySSLSettings, (__bridge CFDictionaryRef)opts);
-            CFWriteStreamSetProperty(writeStream, kCFStreamPropertySSLSettings, (__bridge CFDictionaryRef)opts);
-
-            SSLContextRef context = (SSLContextRef)CFWriteStreamCopyProperty(writeStream, kCFStreamPropertySSLContext);
-            SSLSetClientSideAuthenticate(context, kTryAuthenticate);
-            CFRelease(context);
+        // fail if we couldn't get a transport
+        if(!transport) {
+            [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureConnectionFailed];
+            return;
         }
         
         // create connection
         PSWebSocketServerConnection *connection = [[PSWebSocketServerConnection alloc] init];
-        connection.inputStream = CFBridgingRelease(readStream);
-        connection.outputStream = CFBridgingRelease(writeStream);
+        connection.loop = loop;
+        connection.transport = transport;
+        connection.acceptTime = acceptTime;
         
         // attach connection
         [self attachConnection:connection];
         
-        // open
-        [connection.inputStream open];
-        [connection.outputStream open];
+        // open, transports over connected sockets may open synchronously
+        [connection.transport open];
+        if(connection.transport.status == NSStreamStatusOpen) {
+            connection.readyState = PSWebSocketServerConnectionReadyStateOpen;
+        }
         
-    }];
+    });
+}
+
+- (id <PSWebSocketTransport>)streamTransportWithNativeHandle:(CFSocketNativeHandle)handle {
+    // create streams
+    CFReadStreamRef readStream = nil;
+    CFWriteStreamRef writeStream = nil;
+    CFStreamCreatePairWithSocket(kCFAllocatorDefault, handle, &readStream, &writeStream);
+    
+    // fail if we couldn't get streams
+    if(!readStream || !writeStream) {
+        return nil;
+    }
+    
+    // configure streams
+    CFReadStreamSetProperty(readStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    CFWriteStreamSetProperty(writeStream, kCFStreamPropertyShouldCloseNativeSocket, kCFBooleanTrue);
+    
+    // enable SSL
+    if(_secure) {
+        NSMutableDictionary *opts = [NSMutableDictionary dictionary];
+        
+        opts[(__bridge id)kCFStreamSSLIsServer] = @YES;
+        opts[(__bridge id)kCFStreamSSLCertificates] = _SSLCertificates;
+        opts[(__bridge id)kCFStreamSSLValidatesCertificateChain] = @NO; // i.e. client certs
+        
+        CFReadStreamSetProperty(readStream, kCFStreamPropertySSLSettings, (__bridge CFDictionaryRef)opts);
+        CFWriteStreamSetProperty(writeStream, kCFStreamPropertySSLSettings, (__bridge CFDictionaryRef)opts);
+
+        SSLContextRef context = (SSLContextRef)CFWriteStreamCopyProperty(writeStream, kCFStreamPropertySSLContext);
+        SSLSetClientSideAuthenticate(context, kTryAuthenticate);
+        CFRelease(context);
+    }
+    
+    return [PSWebSocketStreamTransport transportWithInputStream:CFBridgingRelease(readStream)
+                                                   outputStream:CFBridgingRelease(writeStream)];
 }
 
 #pragma mark - WebSockets
 
-- (void)attachWebSocket:(PSWebSocket *)webSocket {
-    if([_webSockets containsObject:webSocket]) {
+- (void)attachWebSocket:(PSWebSocket *)webSocket loop:(PSWebSocketServerLoop *)loop {
+    if([loop.webSockets containsObject:webSocket]) {
         return;
     }
-    [_webSockets addObject:webSocket];
+    [loop.webSockets addObject:webSocket];
     webSocket.delegate = self;
-    webSocket.delegateQueue = _workQueue;
+    webSocket.delegateQueue = loop.queue;
 }
 - (void)detachWebSocket:(PSWebSocket *)webSocket {
-    if(![_webSockets containsObject:webSocket]) {
+    PSWebSocketServerLoop *loop = [PSWebSocketServerLoop currentLoop];
+    if(![loop.webSockets containsObject:webSocket]) {
         return;
     }
-    [_webSockets removeObject:webSocket];
+    [loop.webSockets removeObject:webSocket];
+    if([loop.openWebSockets containsObject:webSocket]) {
+        [loop.openWebSockets removeObject:webSocket];
+        atomic_fetch_sub_explicit(&_counters->openWebSockets, 1, memory_order_relaxed);
+    }
     webSocket.delegate = nil;
 }
 
 #pragma mark - PSWebSocketDelegate
 
 - (void)webSocketDidOpen:(PSWebSocket *)webSocket {
+    PSWebSocketServerLoop *loop = [PSWebSocketServerLoop currentLoop];
+    if([loop.webSockets containsObject:webSocket]) {
+        [loop.openWebSockets addObject:webSocket];
+        PSWebSocketCounterAdd(&_counters->openWebSockets, 1);
+    }
     [self notifyDelegateWebSocketDidOpen:webSocket];
 }
 - (void)webSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
     [self notifyDelegateWebSocket:webSocket didReceiveMessage:message];
 }
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages {
+    [self notifyDelegateWebSocket:webSocket didReceiveMessages:messages];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didBeginMessage:(PSWebSocketMessageType)type {
+    [self notifyDelegateWebSocket:webSocket didBeginMessage:type];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didReceiveMessageChunk:(NSData *)chunk {
+    [self notifyDelegateWebSocket:webSocket didReceiveMessageChunk:chunk];
+}
+- (void)webSocketDidFinishMessage:(PSWebSocket *)webSocket {
+    [self notifyDelegateWebSocketDidFinishMessage:webSocket];
+}
 - (void)webSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
     [self detachWebSocket:webSocket];
     [self notifyDelegateWebSocket:webSocket didFailWithError:error];
@@ -327,32 +662,52 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
 - (void)webSocketDidFlushOutput:(PSWebSocket *)webSocket {
     [self notifyDelegateWebSocketDidFlushOutput:webSocket];
 }
+- (void)webSocketDidReachHighWaterMark:(PSWebSocket *)webSocket {
+    [self notifyDelegateWebSocketDidReachHighWaterMark:webSocket];
+}
+- (void)webSocketDidDrainToLowWaterMark:(PSWebSocket *)webSocket {
+    [self notifyDelegateWebSocketDidDrainToLowWaterMark:webSocket];
+}
+- (void)webSocket:(PSWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime {
+    PSWebSocketHistogramRecord(&_counters->roundTripTimes, roundTripTime);
+    [self notifyDelegateWebSocket:webSocket didMeasureRoundTripTime:roundTripTime];
+}
 
 #pragma mark - Connections
 
 - (void)attachConnection:(PSWebSocketServerConnection *)connection {
-    if([_connections containsObject:connection]) {
+    PSWebSocketServerLoop *loop = connection.loop;
+    if([loop.connections containsObject:connection]) {
         return;
     }
-    [_connections addObject:connection];
-    [_connectionsByStreams setObject:connection forKey:connection.inputStream];
-    [_connectionsByStreams setObject:connection forKey:connection.outputStream];
-    connection.inputStream.delegate = self;
-    connection.outputStream.delegate = self;
-    [connection.inputStream scheduleInRunLoop:[self runLoop] forMode:NSRunLoopCommonModes];
-    [connection.outputStream scheduleInRunLoop:[self runLoop] forMode:NSRunLoopCommonModes];
+    [loop.connections addObject:connection];
+    [loop.connectionsByTransports setObject:connection forKey:connection.transport];
+    connection.transport.delegate = self;
+    [connection.transport scheduleOnQueue:loop.queue];
+    
+    // handshake deadline, later moved to the graceful disconnect deadline
+    __weak typeof(self)weakSelf = self;
+    __weak typeof(connection)weakConnection = connection;
+    connection.deadlineTimer = [PSWebSocketTimer timerWithHandler:^{
+        __strong typeof(weakConnection)strongConnection = weakConnection;
+        if(strongConnection) {
+            [weakSelf connectionDeadlineExpired:strongConnection];
+        }
+    }];
+    if(_handshakeTimeout > 0) {
+        [loop.timingWheel armTimer:connection.deadlineTimer interval:_handshakeTimeout];
+    }
 }
 - (void)detatchConnection:(PSWebSocketServerConnection *)connection {
-    if(![_connections containsObject:connection]) {
+    PSWebSocketServerLoop *loop = connection.loop;
+    if(![loop.connections containsObject:connection]) {
         return;
     }
-    [_connections removeObject:connection];
-    [_connectionsByStreams removeObjectForKey:connection.inputStream];
-    [_connectionsByStreams removeObjectForKey:connection.outputStream];
-    [connection.inputStream removeFromRunLoop:[self runLoop] forMode:NSRunLoopCommonModes];
-    [connection.outputStream removeFromRunLoop:[self runLoop] forMode:NSRunLoopCommonModes];
-    connection.inputStream.delegate = nil;
-    connection.outputStream.delegate = nil;
+    [loop.connections removeObject:connection];
+    [loop.connectionsByTransports removeObjectForKey:connection.transport];
+    [loop.timingWheel cancelTimer:connection.deadlineTimer];
+    [connection.transport scheduleOnQueue:NULL];
+    connection.transport.delegate = nil;
 }
 - (void)disconnectConnectionGracefully:(PSWebSocketServerConnection *)connection
                             statusCode:(NSInteger)statusCode
@@ -375,14 +730,10 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     NSData *data = CFBridgingRelease(CFHTTPMessageCopySerializedMessage(msg));
     CFRelease(msg);
     [connection.outputBuffer appendData:data];
-    [self pumpOutput];
-    __weak typeof(self)weakSelf = self;
-    dispatch_after(dispatch_time(DISPATCH_TIME_NOW, 5 * NSEC_PER_SEC), _workQueue, ^{
-        __strong typeof(weakSelf)strongSelf = weakSelf;
-        if(strongSelf) {
-            [strongSelf disconnectConnection:connection];
-        }
-    });
+    [self pumpOutputForConnection:connection];
+    if(connection.readyState == PSWebSocketServerConnectionReadyStateClosing) {
+        [connection.loop.timingWheel armTimer:connection.deadlineTimer interval:PSWebSocketServerGracefulDisconnectTimeout];
+    }
 }
 - (void)disconnectConnection:(PSWebSocketServerConnection *)connection {
     if(connection.readyState == PSWebSocketServerConnectionReadyStateClosed) {
@@ -390,191 +741,189 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     }
     connection.readyState = PSWebSocketServerConnectionReadyStateClosed;
     [self detatchConnection:connection];
-    [connection.inputStream close];
-    [connection.outputStream close];
+    [connection.transport close];
+}
+- (void)connectionDeadlineExpired:(PSWebSocketServerConnection *)connection {
+    if(connection.readyState == PSWebSocketServerConnectionReadyStateClosing) {
+        [self disconnectConnection:connection];
+    } else if([connection.loop.connections containsObject:connection]) {
+        [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureTimedOut];
+        [self disconnectConnection:connection];
+    }
+}
+- (void)recordHandshakeFailure:(PSWebSocketServerHandshakeFailure)reason {
+    PSWebSocketCounterAdd(&_counters->handshakeFailures[reason], 1);
 }
 
 #pragma mark - Pumping
 
-- (void)pumpInput {
+- (void)pumpInputForConnection:(PSWebSocketServerConnection *)connection {
     uint8_t chunkBuffer[4096];
-    for(PSWebSocketServerConnection *connection in _connections.allObjects) {
-        if(connection.readyState != PSWebSocketServerConnectionReadyStateOpen ||
-           !connection.inputStream.hasBytesAvailable) {
-            continue;
+    PSWebSocketServerLoop *loop = connection.loop;
+    if(connection.readyState != PSWebSocketServerConnectionReadyStateOpen ||
+       !connection.transport.hasBytesAvailable) {
+        return;
+    }
+    
+    while(connection.transport.hasBytesAvailable) {
+        NSInteger readLength = [connection.transport read:chunkBuffer maxLength:sizeof(chunkBuffer)];
+        if(readLength > 0) {
+            [connection.inputBuffer appendBytes:chunkBuffer length:readLength];
+        } else if(readLength < 0) {
+            [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureConnectionFailed];
+            [self disconnectConnection:connection];
+            return;
         }
+        if(readLength < sizeof(chunkBuffer)) {
+            break;
+        }
+    }
+    
+    if(connection.inputBuffer.bytesAvailable > 4) {
+        [connection.inputBuffer makeContiguous:connection.inputBuffer.bytesAvailable];
         
-        while(connection.inputStream.hasBytesAvailable) {
-            NSInteger readLength = [connection.inputStream read:chunkBuffer maxLength:sizeof(chunkBuffer)];
-            if(readLength > 0) {
-                [connection.inputBuffer appendBytes:chunkBuffer length:readLength];
-            } else if(readLength < 0) {
+        // parse the head in place
+        PSWebSocketHTTPHead head;
+        PSWebSocketHTTPParseResult result = PSWebSocketHTTPParseRequest(connection.inputBuffer.bytes,
+                                                                        connection.inputBuffer.bytesAvailable,
+                                                                        &head);
+        if(result == PSWebSocketHTTPParseResultIncomplete) {
+            // Haven't reached end of HTTP headers yet
+            if(connection.inputBuffer.bytesAvailable >= 16384) {
+                [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureInvalidRequest];
                 [self disconnectConnection:connection];
             }
-            if(readLength < sizeof(chunkBuffer)) {
-                break;
-            }
+            return;
+        }
+        if(result == PSWebSocketHTTPParseResultInvalid ||
+           connection.inputBuffer.bytesAvailable > head.length) {
+            [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureInvalidRequest];
+            [self disconnectConnection:connection];
+            return;
         }
         
-        if(connection.inputBuffer.bytesAvailable > 4) {
-            void* boundary = memmem(connection.inputBuffer.bytes,
-                                    connection.inputBuffer.bytesAvailable,
-                                    "\r\n\r\n", 4);
-            if (boundary == NULL) {
-                // Haven't reached end of HTTP headers yet
-                if(connection.inputBuffer.bytesAvailable >= 16384) {
-                    [self disconnectConnection:connection];
-                }
-                continue;
-            }
-            NSUInteger boundaryOffset = boundary + 4 - connection.inputBuffer.bytes;
-            
-            CFHTTPMessageRef msg = CFHTTPMessageCreateEmpty(kCFAllocatorDefault, YES);
-            CFHTTPMessageAppendBytes(msg, connection.inputBuffer.bytes, connection.inputBuffer.bytesAvailable);
-            if(!CFHTTPMessageIsHeaderComplete(msg)) {
-                [self disconnectConnection:connection];
-                CFRelease(msg);
-                continue;
-            }
-            
-            // move input buffer
-            connection.inputBuffer.offset += boundaryOffset;
-            if(connection.inputBuffer.hasBytesAvailable) {
-                [self disconnectConnection:connection];
-                CFRelease(msg);
-                continue;
-            }
-            
-            NSMutableURLRequest *request = [NSMutableURLRequest requestWithURL:CFBridgingRelease(CFHTTPMessageCopyRequestURL(msg))];
-            request.HTTPMethod = CFBridgingRelease(CFHTTPMessageCopyRequestMethod(msg));
-            
-            NSDictionary *headers = CFBridgingRelease(CFHTTPMessageCopyAllHeaderFields(msg));
-            [headers enumerateKeysAndObjectsUsingBlock:^(id key, id obj, BOOL *stop) {
-                [request setValue:obj forHTTPHeaderField:key];
-            }];
-            
-            if(![PSWebSocket isWebSocketRequest:request]) {
+        if(!PSWebSocketHTTPHeadIsUpgradeRequest(&head)) {
+            [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureNotWebSocket];
+            [self disconnectConnectionGracefully:connection
+                                      statusCode:501 description:@"WebSockets only, please"
+                                         headers:nil];
+            return;
+        }
+        
+        // the request is only built for delegates that look at it
+        NSString* protocol = nil;
+        if([_delegate respondsToSelector:@selector(server:acceptWebSocketWithRequest:address:trust:response:)] ||
+           [_delegate respondsToSelector:@selector(server:acceptWebSocketWithRequest:)]) {
+            NSURLRequest *request = PSWebSocketHTTPRequestWithBytes(connection.inputBuffer.bytes, head.length);
+            NSHTTPURLResponse* response = nil;
+            if (!request || ![self askDelegateShouldAcceptConnection:connection
+                                                             request:request
+                                                            response:&response]) {
+                [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureRejected];
                 [self disconnectConnectionGracefully:connection
-                                          statusCode:501 description:@"WebSockets only, please"
-                                             headers:nil];
-                CFRelease(msg);
-                continue;
+                                          statusCode:(response.statusCode ?: 403)
+                                         description:nil
+                                             headers:response.allHeaderFields];
+                return;
             }
-
-            NSString* protocol = nil;
-            if(_delegate) {
-                NSHTTPURLResponse* response = nil;
-                if (![self askDelegateShouldAcceptConnection:connection
-                                                     request:request
-                                                    response:&response]) {
-                    [self disconnectConnectionGracefully:connection
-                                              statusCode:(response.statusCode ?: 403)
-                                             description:nil
-                                                 headers:response.allHeaderFields];
-                    CFRelease(msg);
-                    continue;
-                }
-                protocol = response.allHeaderFields[@"Sec-WebSocket-Protocol"];
-            }
-            
-            // detach connection
-            [self detatchConnection:connection];
-
-            // create webSocket
-            PSWebSocket *webSocket = [PSWebSocket serverSocketWithRequest:request inputStream:connection.inputStream outputStream:connection.outputStream];
-            webSocket.delegateQueue = _workQueue;
-            
-            // attach webSocket
-            [self attachWebSocket:webSocket];
-            
-            // open webSocket
-            [webSocket open];
-            
-            // clean up
-            CFRelease(msg);
+            protocol = response.allHeaderFields[@"Sec-WebSocket-Protocol"];
         }
+        
+        PSWebSocketHistogramRecord(&_counters->handshakeTimes, CFAbsoluteTimeGetCurrent() - connection.acceptTime);
+        
+        // move input buffer
+        NSData *handshake = [NSData dataWithBytes:connection.inputBuffer.bytes length:head.length];
+        [connection.inputBuffer consumeLength:head.length];
+        
+        // detach connection
+        [self detatchConnection:connection];
+
+        // create webSocket
+        PSWebSocket *webSocket = [PSWebSocket serverSocketWithHandshake:handshake transport:connection.transport];
+        webSocket.streamsMessages = _streamsMessages;
+        webSocket.messageDelivery = _messageDelivery;
+        webSocket.compressionPolicy = _compressionPolicy;
+        webSocket.limits = _limits;
+        webSocket.flushPolicy = _flushPolicy;
+        webSocket.noDelay = _noDelay;
+        webSocket.maximumMessageBatchCount = _maximumMessageBatchCount;
+        webSocket.highWaterMark = _highWaterMark;
+        webSocket.lowWaterMark = _lowWaterMark;
+        webSocket.slowConsumerPolicy = _slowConsumerPolicy;
+        webSocket.heartbeatInterval = _heartbeatInterval;
+        webSocket.maximumMissedHeartbeats = _maximumMissedHeartbeats;
+        webSocket.idleTimeout = _idleTimeout;
+        webSocket.parallelCompressionLength = _parallelCompressionLength;
+        webSocket.timingWheel = loop.timingWheel;
+        
+        // attach webSocket
+        [self attachWebSocket:webSocket loop:loop];
+        
+        // open webSocket
+        [webSocket open];
     }
 }
-- (void)pumpOutput {
-    for(PSWebSocketServerConnection *connection in _connections.allObjects) {
-        if(connection.readyState != PSWebSocketServerConnectionReadyStateOpen &&
-           connection.readyState != PSWebSocketServerConnectionReadyStateClosing) {
-            continue;
-        }
-        
-        while(connection.outputStream.hasSpaceAvailable && connection.outputBuffer.hasBytesAvailable) {
-            NSInteger writeLength = [connection.outputStream write:connection.outputBuffer.bytes maxLength:connection.outputBuffer.bytesAvailable];
-            if(writeLength > 0) {
-                connection.outputBuffer.offset += writeLength;
-            } else if(writeLength < 0) {
-                [self disconnectConnection:connection];
-                break;
-            }
-            
-            if(writeLength == 0) {
-                break;
-            }
+- (void)pumpOutputForConnection:(PSWebSocketServerConnection *)connection {
+    if(connection.readyState != PSWebSocketServerConnectionReadyStateOpen &&
+       connection.readyState != PSWebSocketServerConnectionReadyStateClosing) {
+        return;
+    }
+    
+    while(connection.transport.hasSpaceAvailable && connection.outputBuffer.hasBytesAvailable) {
+        struct iovec chunk = {(void *)connection.outputBuffer.bytes, connection.outputBuffer.contiguousBytesAvailable};
+        NSInteger writeLength = [connection.transport writeChunks:&chunk count:1];
+        if(writeLength > 0) {
+            [connection.outputBuffer consumeLength:writeLength];
+        } else if(writeLength < 0) {
+            [self disconnectConnection:connection];
+            break;
         }
         
-        if(connection.readyState == PSWebSocketServerConnectionReadyStateClosing &&
-           !connection.outputBuffer.hasBytesAvailable) {
-            [self disconnectConnection:connection];
+        if(writeLength == 0) {
+            break;
         }
     }
+    
+    if(connection.readyState == PSWebSocketServerConnectionReadyStateClosing &&
+       !connection.outputBuffer.hasBytesAvailable) {
+        [self disconnectConnection:connection];
+    }
 }
 
-#pragma mark - NSStreamDelegate
+#pragma mark - PSWebSocketTransportDelegate
 
-- (void)stream:(NSStream *)stream handleEvent:(NSStreamEvent)event {
-    [self executeWork:^{
-        if(stream.delegate != self) {
-            [stream.delegate stream:stream handleEvent:event];
-            return;
+- (void)transport:(id <PSWebSocketTransport>)transport handleEvent:(NSStreamEvent)event {
+    PSWebSocketServerConnection *connection = [[PSWebSocketServerLoop currentLoop].connectionsByTransports objectForKey:transport];
+    NSAssert(connection, @"Connection should not be nil");
+    
+    switch(event) {
+        case NSStreamEventOpenCompleted: {
+            if(connection.readyState == PSWebSocketServerConnectionReadyStateConnecting) {
+                connection.readyState = PSWebSocketServerConnectionReadyStateOpen;
+            }
+            [self pumpInputForConnection:connection];
+            [self pumpOutputForConnection:connection];
+            break;
         }
-        
-        PSWebSocketServerConnection *connection = [_connectionsByStreams objectForKey:stream];
-        NSAssert(connection, @"Connection should not be nil");
-        
-        if(event == NSStreamEventOpenCompleted) {
-            if(stream == connection.inputStream) {
-                connection.inputStreamOpenCompleted = YES;
-            } else if(stream == connection.outputStream) {
-                connection.outputStreamOpenCompleted = YES;
+        case NSStreamEventErrorOccurred:
+        case NSStreamEventEndEncountered: {
+            if(connection.readyState < PSWebSocketServerConnectionReadyStateClosing) {
+                [self recordHandshakeFailure:PSWebSocketServerHandshakeFailureConnectionFailed];
             }
+            [self disconnectConnection:connection];
+            break;
         }
-        if(!connection.inputStreamOpenCompleted || !connection.outputStreamOpenCompleted) {
-            return;
+        case NSStreamEventHasBytesAvailable: {
+            [self pumpInputForConnection:connection];
+            break;
         }
-        
-        switch(event) {
-            case NSStreamEventOpenCompleted: {
-                if(connection.readyState == PSWebSocketServerConnectionReadyStateConnecting) {
-                    connection.readyState = PSWebSocketServerConnectionReadyStateOpen;
-                }
-                [self pumpInput];
-                [self pumpOutput];
-                break;
-            }
-            case NSStreamEventErrorOccurred: {
-                [self disconnectConnection:connection];
-                break;
-            }
-            case NSStreamEventEndEncountered: {
-                [self disconnectConnection:connection];
-                break;
-            }
-            case NSStreamEventHasBytesAvailable: {
-                [self pumpInput];
-                break;
-            }
-            case NSStreamEventHasSpaceAvailable: {
-                [self pumpOutput];
-                break;
-            }
-            default:
-                break;
+        case NSStreamEventHasSpaceAvailable: {
+            [self pumpOutputForConnection:connection];
+            break;
         }
-    }];
+        default:
+            break;
+    }
 }
 
 #pragma mark - Delegation
@@ -596,51 +945,107 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
 }
 
 - (void)notifyDelegateWebSocketDidOpen:(PSWebSocket *)webSocket {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         [_delegate server:self webSocketDidOpen:webSocket];
     }];
 }
 - (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didReceiveMessage:(id)message {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         [_delegate server:self webSocket:webSocket didReceiveMessage:message];
     }];
 }
+- (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didReceiveMessages:(NSArray *)messages {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocket:didReceiveMessages:)]) {
+            [_delegate server:self webSocket:webSocket didReceiveMessages:messages];
+        } else {
+            for(id message in messages) {
+                [_delegate server:self webSocket:webSocket didReceiveMessage:message];
+            }
+        }
+    }];
+}
+- (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didBeginMessage:(PSWebSocketMessageType)type {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocket:didBeginMessage:)]) {
+            [_delegate server:self webSocket:webSocket didBeginMessage:type];
+        }
+    }];
+}
+- (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didReceiveMessageChunk:(NSData *)chunk {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocket:didReceiveMessageChunk:)]) {
+            [_delegate server:self webSocket:webSocket didReceiveMessageChunk:chunk];
+        }
+    }];
+}
+- (void)notifyDelegateWebSocketDidFinishMessage:(PSWebSocket *)webSocket {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocketDidFinishMessage:)]) {
+            [_delegate server:self webSocketDidFinishMessage:webSocket];
+        }
+    }];
+}
 
 - (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didFailWithError:(NSError *)error {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         [_delegate server:self webSocket:webSocket didFailWithError:error];
     }];
 }
 - (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didCloseWithCode:(NSInteger)code reason:(NSString *)reason wasClean:(BOOL)wasClean {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         [_delegate server:self webSocket:webSocket didCloseWithCode:code reason:reason wasClean:wasClean];
     }];
 }
 - (void)notifyDelegateWebSocketDidFlushInput:(PSWebSocket *)webSocket {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         if ([_delegate respondsToSelector: @selector(server:webSocketDidFlushInput:)]) {
             [_delegate server:self webSocketDidFlushInput:webSocket];
         };
     }];
 }
 - (void)notifyDelegateWebSocketDidFlushOutput:(PSWebSocket *)webSocket {
-    [self executeDelegate:^{
+    [self executeWebSocketDelegate:^{
         if ([_delegate respondsToSelector: @selector(server:webSocketDidFlushOutput:)]) {
             [_delegate server:self webSocketDidFlushOutput:webSocket];
         }
     }];
 }
+- (void)notifyDelegateWebSocketDidReachHighWaterMark:(PSWebSocket *)webSocket {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocketDidReachHighWaterMark:)]) {
+            [_delegate server:self webSocketDidReachHighWaterMark:webSocket];
+        }
+    }];
+}
+- (void)notifyDelegateWebSocketDidDrainToLowWaterMark:(PSWebSocket *)webSocket {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocketDidDrainToLowWaterMark:)]) {
+            [_delegate server:self webSocketDidDrainToLowWaterMark:webSocket];
+        }
+    }];
+}
+- (void)notifyDelegateWebSocket:(PSWebSocket *)webSocket didMeasureRoundTripTime:(NSTimeInterval)roundTripTime {
+    [self executeWebSocketDelegate:^{
+        if ([_delegate respondsToSelector: @selector(server:webSocket:didMeasureRoundTripTime:)]) {
+            [_delegate server:self webSocket:webSocket didMeasureRoundTripTime:roundTripTime];
+        }
+    }];
+}
 - (BOOL)askDelegateShouldAcceptConnection:(PSWebSocketServerConnection *)connection
                                   request: (NSURLRequest *)request
                                  response:(NSHTTPURLResponse **)outResponse {
     __block BOOL accept;
     __block NSHTTPURLResponse* response = nil;
-    [self executeDelegateAndWait:^{
+    [self executeWebSocketDelegateAndWait:^{
         if([_delegate respondsToSelector:@selector(server:acceptWebSocketWithRequest:address:trust:response:)]) {
-            NSData* address = PSPeerAddressOfInputStream(connection.inputStream);
-            SecTrustRef trust = (SecTrustRef)CFReadStreamCopyProperty(
-                                                  (__bridge CFReadStreamRef)connection.inputStream,
-                                                  kCFStreamPropertySSLPeerTrust);
+            NSData* address = connection.transport.remoteAddress;
+            SecTrustRef trust = NULL;
+            if([connection.transport isKindOfClass:[PSWebSocketStreamTransport class]]) {
+                NSInputStream *inputStream = [(PSWebSocketStreamTransport *)connection.transport inputStream];
+                trust = (SecTrustRef)CFReadStreamCopyProperty((__bridge CFReadStreamRef)inputStream,
+                                                              kCFStreamPropertySSLPeerTrust);
+            }
             accept = [_delegate server:self
             acceptWebSocketWithRequest:request
                                address:address
@@ -677,6 +1082,22 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     NSParameterAssert(work);
     dispatch_sync((_delegateQueue) ? _delegateQueue : dispatch_get_main_queue(), work);
 }
+- (void)executeWebSocketDelegate:(void (^)(void))work {
+    // with several loops delegation stays on the websocket's loop, funnelling
+    // every loop through one delegate queue would serialize them again
+    if((_loops.count > 1 || _callsDelegateInline) && [PSWebSocketServerLoop currentLoop]) {
+        work();
+    } else {
+        [self executeDelegate:work];
+    }
+}
+- (void)executeWebSocketDelegateAndWait:(void (^)(void))work {
+    if((_loops.count > 1 || _callsDelegateInline) && [PSWebSocketServerLoop currentLoop]) {
+        work();
+    } else {
+        [self executeDelegateAndWait:work];
+    }
+}
 
 #pragma mark - Dealloc
 
@@ -684,10 +1105,7 @@ void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, C
     [self executeWorkAndWait:^{
         [self disconnect:YES];
     }];
+    free(_counters);
 }
 
 @end
-
-void PSWebSocketServerAcceptCallback(CFSocketRef s, CFSocketCallBackType type, CFDataRef address, const void *data, void *info) {
-    [(__bridge PSWebSocketServer *)info accept:*(CFSocketNativeHandle *)data];
-}
@@ -0,0 +1,52 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import "PSWebSocketTransport.h"
+
+/**
+ *  Transport over a nonblocking BSD socket. Readiness comes from a single
+ *  shared poller thread using kqueue, or epoll on Linux, instead of a
+ *  CFStream pair per connection. TLS is not supported, use the default
+ *  stream transport for wss.
+ */
+@interface PSWebSocketSocketTransport : NSObject <PSWebSocketTransport>
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readonly) int nativeHandle;
+
+#pragma mark - Initialization
+
+/**
+ *  Take ownership of an already connected socket.
+ *
+ *  @param handle connected socket, closed when the transport is closed
+ *
+ *  @return an initialized transport
+ */
++ (instancetype)transportWithNativeHandle:(int)handle;
+
+/**
+ *  Transport that resolves and connects to the host when opened, open
+ *  completed is sent once connected.
+ *
+ *  @param host host name or address to connect to
+ *  @param port port to connect to
+ *
+ *  @return an initialized transport
+ */
++ (instancetype)transportWithHost:(NSString *)host port:(NSUInteger)port;
+
+@end
@@ -0,0 +1,480 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketSocketTransport.h"
+#import <pthread.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <limits.h>
+#import <netdb.h>
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+#import <sys/socket.h>
+#if defined(__linux__)
+#import <sys/epoll.h>
+#else
+#import <sys/event.h>
+#endif
+
+static const int PSWebSocketPollerEventCount = 64;
+
+@interface PSWebSocketSocketTransport()
+
+- (void)pollerDidSignalReadable:(BOOL)readable writable:(BOOL)writable;
+
+@end
+
+/**
+ *  Single thread waiting on kqueue or epoll for every socket transport.
+ *  Sockets are registered edge triggered for both directions once, the
+ *  transports track readiness themselves until a read or write would block.
+ */
+@interface PSWebSocketPoller : NSObject {
+    int _pollHandle;
+    pthread_mutex_t _lock;
+    NSMapTable *_transports;
+}
+@end
+@implementation PSWebSocketPoller
+
+#pragma mark - Singleton
+
++ (instancetype)sharedPoller {
+    static id sharedPoller = nil;
+    static dispatch_once_t sharedPollerOnce = 0;
+    dispatch_once(&sharedPollerOnce, ^{
+        sharedPoller = [[self alloc] init];
+    });
+    return sharedPoller;
+}
+
+#pragma mark - Initialization
+
+- (instancetype)init {
+    if((self = [super init])) {
+#if defined(__linux__)
+        _pollHandle = epoll_create1(EPOLL_CLOEXEC);
+#else
+        _pollHandle = kqueue();
+#endif
+        NSAssert(_pollHandle >= 0, @"Failed to create poller");
+        pthread_mutex_init(&_lock, NULL);
+        _transports = [NSMapTable strongToWeakObjectsMapTable];
+
+        NSThread *thread = [[NSThread alloc] initWithTarget:self selector:@selector(main) object:nil];
+        thread.name = @"PSWebSocketPoller";
+        [thread start];
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (BOOL)addTransport:(PSWebSocketSocketTransport *)transport {
+    int handle = transport.nativeHandle;
+    pthread_mutex_lock(&_lock);
+    [_transports setObject:transport forKey:@(handle)];
+    pthread_mutex_unlock(&_lock);
+
+#if defined(__linux__)
+    struct epoll_event event = {0};
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = handle;
+    int result = epoll_ctl(_pollHandle, EPOLL_CTL_ADD, handle, &event);
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], handle, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    EV_SET(&changes[1], handle, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, NULL);
+    int result = kevent(_pollHandle, changes, 2, NULL, 0, NULL);
+#endif
+    if(result < 0) {
+        [self removeTransport:transport];
+        return NO;
+    }
+    return YES;
+}
+- (void)removeTransport:(PSWebSocketSocketTransport *)transport {
+    int handle = transport.nativeHandle;
+    pthread_mutex_lock(&_lock);
+    if([_transports objectForKey:@(handle)] == transport) {
+        [_transports removeObjectForKey:@(handle)];
+    }
+    pthread_mutex_unlock(&_lock);
+
+#if defined(__linux__)
+    epoll_ctl(_pollHandle, EPOLL_CTL_DEL, handle, NULL);
+#else
+    struct kevent changes[2];
+    EV_SET(&changes[0], handle, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+    EV_SET(&changes[1], handle, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+    kevent(_pollHandle, changes, 2, NULL, 0, NULL);
+#endif
+}
+
+#pragma mark - Polling
+
+- (void)signalHandle:(int)handle readable:(BOOL)readable writable:(BOOL)writable {
+    pthread_mutex_lock(&_lock);
+    PSWebSocketSocketTransport *transport = [_transports objectForKey:@(handle)];
+    pthread_mutex_unlock(&_lock);
+    [transport pollerDidSignalReadable:readable writable:writable];
+}
+- (void)main {
+#if defined(__linux__)
+    struct epoll_event events[PSWebSocketPollerEventCount];
+#else
+    struct kevent events[PSWebSocketPollerEventCount];
+#endif
+    while(YES) {
+        @autoreleasepool {
+#if defined(__linux__)
+            int count = epoll_wait(_pollHandle, events, PSWebSocketPollerEventCount, -1);
+            for(int i = 0; i < count; ++i) {
+                // hang ups and errors surface through the next read or write
+                uint32_t flags = events[i].events;
+                BOOL closed = (flags & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+                [self signalHandle:events[i].data.fd
+                          readable:(flags & EPOLLIN) || closed
+                          writable:(flags & EPOLLOUT) || (flags & EPOLLERR)];
+            }
+#else
+            int count = kevent(_pollHandle, NULL, 0, events, PSWebSocketPollerEventCount, NULL);
+            for(int i = 0; i < count; ++i) {
+                // EV_EOF and errors surface through the next read or write
+                [self signalHandle:(int)events[i].ident
+                          readable:events[i].filter == EVFILT_READ
+                          writable:events[i].filter == EVFILT_WRITE];
+            }
+#endif
+            if(count < 0 && errno != EINTR) {
+                [NSException raise:NSInternalInconsistencyException format:@"PSWebSocketPoller failed to wait: %d", errno];
+            }
+        }
+    }
+}
+
+@end
+
+
+@interface PSWebSocketSocketTransport() {
+    pthread_mutex_t _lock;
+    dispatch_queue_t _queue;
+    BOOL _readable;
+    BOOL _writable;
+    BOOL _signalPending;
+    NSUInteger _readSignalCount;
+    NSUInteger _writeSignalCount;
+    NSString *_host;
+    NSUInteger _port;
+}
+@end
+@implementation PSWebSocketSocketTransport
+
+@synthesize delegate = _delegate, status = _status, error = _error;
+
+#pragma mark - Properties
+
+- (NSData *)remoteAddress {
+    if(_nativeHandle < 0) {
+        return nil;
+    }
+    struct sockaddr_storage addr;
+    socklen_t addrLen = sizeof(addr);
+    if(getpeername(_nativeHandle, (struct sockaddr *)&addr, &addrLen) < 0) {
+        return nil;
+    }
+    return [NSData dataWithBytes:&addr length:addrLen];
+}
+
+#pragma mark - Initialization
+
++ (instancetype)transportWithNativeHandle:(int)handle {
+    return [[self alloc] initWithNativeHandle:handle host:nil port:0];
+}
++ (instancetype)transportWithHost:(NSString *)host port:(NSUInteger)port {
+    NSParameterAssert(host);
+    return [[self alloc] initWithNativeHandle:-1 host:host port:port];
+}
+- (instancetype)initWithNativeHandle:(int)handle host:(NSString *)host port:(NSUInteger)port {
+    if((self = [super init])) {
+        pthread_mutex_init(&_lock, NULL);
+        _nativeHandle = handle;
+        _host = [host copy];
+        _port = port;
+        _status = NSStreamStatusNotOpen;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (void)scheduleOnQueue:(dispatch_queue_t)queue {
+    pthread_mutex_lock(&_lock);
+    _queue = queue;
+    _signalPending = NO;
+    pthread_mutex_unlock(&_lock);
+
+    // readiness seen while unscheduled would otherwise never be reported
+    // again as the poller is edge triggered
+    [self pollerDidSignalReadable:NO writable:NO];
+}
+- (void)open {
+    if(_status != NSStreamStatusNotOpen) {
+        return;
+    }
+    if(_nativeHandle >= 0) {
+        _status = NSStreamStatusOpen;
+        [self configureHandle];
+        [self registerWithPoller];
+        return;
+    }
+
+    // resolve off the queue, getaddrinfo blocks
+    _status = NSStreamStatusOpening;
+    pthread_mutex_lock(&_lock);
+    dispatch_queue_t queue = _queue;
+    pthread_mutex_unlock(&_lock);
+    NSString *host = _host;
+    NSString *service = [NSString stringWithFormat:@"%lu", (unsigned long)_port];
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^{
+        struct addrinfo hints = {0};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        struct addrinfo *info = NULL;
+        int result = getaddrinfo(host.UTF8String, service.UTF8String, &hints, &info);
+        dispatch_async(queue, ^{
+            if(result != 0 || !info) {
+                [self failWithCode:EHOSTUNREACH];
+            } else {
+                [self connectToAddress:info];
+            }
+            if(info) {
+                freeaddrinfo(info);
+            }
+        });
+    });
+}
+- (void)close {
+    if(_status == NSStreamStatusClosed) {
+        return;
+    }
+    _status = NSStreamStatusClosed;
+    if(_nativeHandle >= 0) {
+        [[PSWebSocketPoller sharedPoller] removeTransport:self];
+        close(_nativeHandle);
+        _nativeHandle = -1;
+    }
+}
+- (BOOL)hasBytesAvailable {
+    pthread_mutex_lock(&_lock);
+    BOOL result = _readable;
+    pthread_mutex_unlock(&_lock);
+    return result && _status == NSStreamStatusOpen;
+}
+- (BOOL)hasSpaceAvailable {
+    pthread_mutex_lock(&_lock);
+    BOOL result = _writable;
+    pthread_mutex_unlock(&_lock);
+    return result && _status == NSStreamStatusOpen;
+}
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length {
+    if(_status != NSStreamStatusOpen) {
+        return (_status == NSStreamStatusError) ? -1 : 0;
+    }
+    pthread_mutex_lock(&_lock);
+    NSUInteger signalCount = _readSignalCount;
+    pthread_mutex_unlock(&_lock);
+    ssize_t result = recv(_nativeHandle, buffer, length, 0);
+    if(result > 0) {
+        return result;
+    }
+    if(result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+        // keep readiness signalled after the read started, that edge is
+        // the only notification there will be
+        pthread_mutex_lock(&_lock);
+        _readable = (_readSignalCount != signalCount);
+        pthread_mutex_unlock(&_lock);
+        return 0;
+    }
+    if(result == 0) {
+        _status = NSStreamStatusAtEnd;
+        [self scheduleEvent:NSStreamEventEndEncountered];
+        return 0;
+    }
+    [self failWithCode:errno];
+    return -1;
+}
+- (NSInteger)writeChunks:(const struct iovec *)chunks count:(NSUInteger)count {
+    if(_status != NSStreamStatusOpen) {
+        return (_status == NSStreamStatusError) ? -1 : 0;
+    }
+    if(count == 0) {
+        return 0;
+    }
+    pthread_mutex_lock(&_lock);
+    NSUInteger signalCount = _writeSignalCount;
+    pthread_mutex_unlock(&_lock);
+    struct msghdr message = {0};
+    message.msg_iov = (struct iovec *)chunks;
+    message.msg_iovlen = (int)MIN(count, (NSUInteger)IOV_MAX);
+#if defined(MSG_NOSIGNAL)
+    ssize_t result = sendmsg(_nativeHandle, &message, MSG_NOSIGNAL);
+#else
+    ssize_t result = sendmsg(_nativeHandle, &message, 0);
+#endif
+    if(result >= 0) {
+        return result;
+    }
+    if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+        pthread_mutex_lock(&_lock);
+        _writable = (_writeSignalCount != signalCount);
+        pthread_mutex_unlock(&_lock);
+        return 0;
+    }
+    [self failWithCode:errno];
+    return -1;
+}
+- (BOOL)setNoDelay:(BOOL)noDelay {
+    if(_nativeHandle < 0) {
+        return NO;
+    }
+    int value = (noDelay) ? 1 : 0;
+    return setsockopt(_nativeHandle, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) == 0;
+}
+
+#pragma mark - Connecting
+
+- (void)configureHandle {
+    int flags = fcntl(_nativeHandle, F_GETFL, 0);
+    fcntl(_nativeHandle, F_SETFL, flags | O_NONBLOCK);
+    fcntl(_nativeHandle, F_SETFD, FD_CLOEXEC);
+    int yes = 1;
+#if defined(SO_NOSIGPIPE)
+    setsockopt(_nativeHandle, SOL_SOCKET, SO_NOSIGPIPE, &yes, sizeof(yes));
+#endif
+    setsockopt(_nativeHandle, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+}
+- (void)registerWithPoller {
+    if(![[PSWebSocketPoller sharedPoller] addTransport:self]) {
+        [self failWithCode:errno];
+    }
+}
+- (void)connectToAddress:(struct addrinfo *)info {
+    if(_status != NSStreamStatusOpening) {
+        return;
+    }
+    int code = 0;
+    for(struct addrinfo *addr = info; addr; addr = addr->ai_next) {
+        _nativeHandle = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+        if(_nativeHandle < 0) {
+            code = errno;
+            continue;
+        }
+        [self configureHandle];
+        if(connect(_nativeHandle, addr->ai_addr, addr->ai_addrlen) == 0 || errno == EINPROGRESS) {
+            // completion is signalled as writability
+            [self registerWithPoller];
+            return;
+        }
+        code = errno;
+        close(_nativeHandle);
+        _nativeHandle = -1;
+    }
+    [self failWithCode:code ?: ECONNREFUSED];
+}
+- (void)finishConnecting {
+    int code = 0;
+    socklen_t codeLength = sizeof(code);
+    if(getsockopt(_nativeHandle, SOL_SOCKET, SO_ERROR, &code, &codeLength) < 0) {
+        code = errno;
+    }
+    if(code != 0) {
+        [self failWithCode:code];
+        return;
+    }
+    _status = NSStreamStatusOpen;
+    [_delegate transport:self handleEvent:NSStreamEventOpenCompleted];
+}
+
+#pragma mark - Events
+
+- (void)pollerDidSignalReadable:(BOOL)readable writable:(BOOL)writable {
+    // called on the poller thread, coalesced into one delivery per queue turn
+    pthread_mutex_lock(&_lock);
+    _readable |= readable;
+    _writable |= writable;
+    _readSignalCount += readable;
+    _writeSignalCount += writable;
+    dispatch_queue_t queue = _queue;
+    BOOL schedule = queue && !_signalPending && (_readable || _writable);
+    _signalPending |= schedule;
+    pthread_mutex_unlock(&_lock);
+    if(schedule) {
+        dispatch_async(queue, ^{
+            [self deliverReadinessOnQueue:queue];
+        });
+    }
+}
+- (void)deliverReadinessOnQueue:(dispatch_queue_t)queue {
+    pthread_mutex_lock(&_lock);
+    if(queue != _queue) {
+        // rescheduled since, the new queue has been signalled instead
+        pthread_mutex_unlock(&_lock);
+        return;
+    }
+    _signalPending = NO;
+    BOOL readable = _readable;
+    BOOL writable = _writable;
+    pthread_mutex_unlock(&_lock);
+
+    if(_status == NSStreamStatusOpening && writable) {
+        [self finishConnecting];
+    }
+    if(_status != NSStreamStatusOpen) {
+        return;
+    }
+    if(writable) {
+        [_delegate transport:self handleEvent:NSStreamEventHasSpaceAvailable];
+    }
+    if(readable && _status == NSStreamStatusOpen) {
+        [_delegate transport:self handleEvent:NSStreamEventHasBytesAvailable];
+    }
+}
+- (void)scheduleEvent:(NSStreamEvent)event {
+    pthread_mutex_lock(&_lock);
+    dispatch_queue_t queue = _queue;
+    pthread_mutex_unlock(&_lock);
+    if(queue) {
+        dispatch_async(queue, ^{
+            [_delegate transport:self handleEvent:event];
+        });
+    }
+}
+- (void)failWithCode:(int)code {
+    if(_status == NSStreamStatusError || _status == NSStreamStatusClosed) {
+        return;
+    }
+    _status = NSStreamStatusError;
+    _error = [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:nil];
+    [self scheduleEvent:NSStreamEventErrorOccurred];
+}
+
+#pragma mark - Dealloc
+
+- (void)dealloc {
+    [self close];
+    pthread_mutex_destroy(&_lock);
+}
+
+@end
@@ -0,0 +1,106 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+
+/**
+ *  Distribution of durations, kept in power of two microsecond buckets so
+ *  recording is a few atomic increments. Values read from it are accurate to
+ *  within a factor of two.
+ */
+@interface PSWebSocketHistogram : NSObject
+
+#pragma mark - Properties
+
+@property (nonatomic, assign, readonly) NSUInteger count;
+@property (nonatomic, assign, readonly) NSTimeInterval mean;
+@property (nonatomic, assign, readonly) NSTimeInterval maximum;
+
+/**
+ *  Number of durations recorded in each bucket, bucket i holds those from
+ *  2^(i-1) up to 2^i microseconds and the last bucket everything longer.
+ */
+@property (nonatomic, strong, readonly) NSArray *bucketCounts;
+
+#pragma mark - Actions
+
+/**
+ *  Upper bound of the bucket holding the given percentile, from 0 to 100,
+ *  never more than the maximum. 0 when nothing was recorded.
+ */
+- (NSTimeInterval)valueAtPercentile:(double)percentile;
+
+@end
+
+/**
+ *  Snapshot of a websocket's counters. Taking one never waits on the
+ *  websocket, counters keep changing while it is taken so related values may
+ *  be off by the last few frames.
+ */
+@interface PSWebSocketStatistics : NSObject
+
+#pragma mark - Properties
+
+/**
+ *  Bytes the websocket read from and wrote to its transport.
+ */
+@property (nonatomic, assign, readonly) uint64_t bytesReceived;
+@property (nonatomic, assign, readonly) uint64_t bytesSent;
+
+/**
+ *  Frames and messages, control frames only count as frames.
+ */
+@property (nonatomic, assign, readonly) uint64_t framesReceived;
+@property (nonatomic, assign, readonly) uint64_t framesSent;
+@property (nonatomic, assign, readonly) uint64_t messagesReceived;
+@property (nonatomic, assign, readonly) uint64_t messagesSent;
+
+/**
+ *  Payload bytes of compressed messages before and after permessage-deflate.
+ */
+@property (nonatomic, assign, readonly) uint64_t uncompressedBytesSent;
+@property (nonatomic, assign, readonly) uint64_t compressedBytesSent;
+@property (nonatomic, assign, readonly) uint64_t compressedBytesReceived;
+@property (nonatomic, assign, readonly) uint64_t uncompressedBytesReceived;
+
+/**
+ *  Compressed over uncompressed length of the messages sent compressed, 0
+ *  when none were.
+ */
+@property (nonatomic, assign, readonly) double compressionRatio;
+
+/**
+ *  Bytes read but not yet parsed and bytes queued but not yet written.
+ */
+@property (nonatomic, assign, readonly) NSUInteger inputBufferLength;
+@property (nonatomic, assign, readonly) NSUInteger outputBufferLength;
+
+/**
+ *  Time spent parsing input and deflating output.
+ */
+@property (nonatomic, assign, readonly) NSTimeInterval driverTime;
+@property (nonatomic, assign, readonly) NSTimeInterval deflateTime;
+
+/**
+ *  Heartbeats that went unanswered until the next one was due.
+ */
+@property (nonatomic, assign, readonly) uint64_t missedHeartbeats;
+
+/**
+ *  Round trip times of heartbeats and pings sent with a handler.
+ */
+@property (nonatomic, strong, readonly) PSWebSocketHistogram *roundTripTimes;
+
+@end
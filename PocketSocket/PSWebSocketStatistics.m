@@ -0,0 +1,109 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+
+#import "PSWebSocketStatistics.h"
+#import "PSWebSocketCounters.h"
+
+@interface PSWebSocketHistogram() {
+    uint64_t _buckets[PSWebSocketHistogramBucketCount];
+}
+@end
+@implementation PSWebSocketHistogram
+
+#pragma mark - Properties
+
+- (NSArray *)bucketCounts {
+    NSMutableArray *bucketCounts = [NSMutableArray arrayWithCapacity:PSWebSocketHistogramBucketCount];
+    for(NSUInteger i = 0; i < PSWebSocketHistogramBucketCount; ++i) {
+        [bucketCounts addObject:@(_buckets[i])];
+    }
+    return bucketCounts;
+}
+
+#pragma mark - Initialization
+
+- (instancetype)initWithCounters:(PSWebSocketHistogramCounters *)counters {
+    NSParameterAssert(counters);
+    if((self = [super init])) {
+        // the count is taken from the buckets so percentiles always add up
+        uint64_t count = 0;
+        for(NSUInteger i = 0; i < PSWebSocketHistogramBucketCount; ++i) {
+            _buckets[i] = PSWebSocketCounterGet(&counters->buckets[i]);
+            count += _buckets[i];
+        }
+        uint64_t totalMicroseconds = PSWebSocketCounterGet(&counters->totalMicroseconds);
+        _count = (NSUInteger)count;
+        _mean = (count > 0) ? (NSTimeInterval)totalMicroseconds / count / USEC_PER_SEC : 0.0;
+        _maximum = (NSTimeInterval)PSWebSocketCounterGet(&counters->maximumMicroseconds) / USEC_PER_SEC;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (NSTimeInterval)valueAtPercentile:(double)percentile {
+    if(_count == 0) {
+        return 0.0;
+    }
+    double rank = MAX(1.0, ceil(MIN(MAX(percentile, 0.0), 100.0) / 100.0 * _count));
+    uint64_t cumulative = 0;
+    for(NSUInteger i = 0; i < PSWebSocketHistogramBucketCount; ++i) {
+        cumulative += _buckets[i];
+        if(cumulative >= rank) {
+            if(i == PSWebSocketHistogramBucketCount - 1) {
+                break;
+            }
+            return MIN((NSTimeInterval)(1ull << i) / USEC_PER_SEC, _maximum);
+        }
+    }
+    return _maximum;
+}
+
+@end
+
+@implementation PSWebSocketStatistics
+
+#pragma mark - Properties
+
+- (double)compressionRatio {
+    return (_uncompressedBytesSent > 0) ? (double)_compressedBytesSent / (double)_uncompressedBytesSent : 0.0;
+}
+
+#pragma mark - Initialization
+
+- (instancetype)initWithCounters:(PSWebSocketCounters *)counters {
+    NSParameterAssert(counters);
+    if((self = [super init])) {
+        _bytesReceived = PSWebSocketCounterGet(&counters->bytesReceived);
+        _bytesSent = PSWebSocketCounterGet(&counters->bytesSent);
+        _framesReceived = PSWebSocketCounterGet(&counters->framesReceived);
+        _framesSent = PSWebSocketCounterGet(&counters->framesSent);
+        _messagesReceived = PSWebSocketCounterGet(&counters->messagesReceived);
+        _messagesSent = PSWebSocketCounterGet(&counters->messagesSent);
+        _uncompressedBytesSent = PSWebSocketCounterGet(&counters->uncompressedBytesSent);
+        _compressedBytesSent = PSWebSocketCounterGet(&counters->compressedBytesSent);
+        _compressedBytesReceived = PSWebSocketCounterGet(&counters->compressedBytesReceived);
+        _uncompressedBytesReceived = PSWebSocketCounterGet(&counters->uncompressedBytesReceived);
+        _inputBufferLength = (NSUInteger)PSWebSocketCounterGet(&counters->inputBufferLength);
+        _outputBufferLength = (NSUInteger)PSWebSocketCounterGet(&counters->outputBufferLength);
+        _driverTime = (NSTimeInterval)PSWebSocketCounterGet(&counters->driverNanoseconds) / NSEC_PER_SEC;
+        _deflateTime = (NSTimeInterval)PSWebSocketCounterGet(&counters->deflateNanoseconds) / NSEC_PER_SEC;
+        _missedHeartbeats = PSWebSocketCounterGet(&counters->missedHeartbeats);
+        _roundTripTimes = [[PSWebSocketHistogram alloc] initWithCounters:&counters->roundTripTimes];
+    }
+    return self;
+}
+
+@end
@@ -0,0 +1,33 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import "PSWebSocketTransport.h"
+
+/**
+ *  Transport backed by a CFStream pair, the default. Stream properties such
+ *  as SSL settings are set on the streams directly.
+ */
+@interface PSWebSocketStreamTransport : NSObject <PSWebSocketTransport>
+
+#pragma mark - Properties
+
+@property (nonatomic, strong, readonly) NSInputStream *inputStream;
+@property (nonatomic, strong, readonly) NSOutputStream *outputStream;
+
+#pragma mark - Initialization
+
++ (instancetype)transportWithInputStream:(NSInputStream *)inputStream outputStream:(NSOutputStream *)outputStream;
+
+@end
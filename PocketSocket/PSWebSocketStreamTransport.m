@@ -0,0 +1,143 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketStreamTransport.h"
+#import "PSWebSocketInternal.h"
+#import <netinet/in.h>
+#import <netinet/tcp.h>
+
+@interface PSWebSocketStreamTransport() <NSStreamDelegate> {
+    BOOL _inputStreamOpenCompleted;
+    BOOL _outputStreamOpenCompleted;
+    uint8_t _gatherBuffer[4096];
+}
+@end
+@implementation PSWebSocketStreamTransport
+
+@synthesize delegate = _delegate;
+
+#pragma mark - Properties
+
+- (NSStreamStatus)status {
+    return _inputStream.streamStatus;
+}
+- (NSError *)error {
+    return _inputStream.streamError ?: _outputStream.streamError;
+}
+- (NSData *)remoteAddress {
+    return PSPeerAddressOfInputStream(_inputStream);
+}
+
+#pragma mark - Initialization
+
++ (instancetype)transportWithInputStream:(NSInputStream *)inputStream outputStream:(NSOutputStream *)outputStream {
+    return [[self alloc] initWithInputStream:inputStream outputStream:outputStream];
+}
+- (instancetype)initWithInputStream:(NSInputStream *)inputStream outputStream:(NSOutputStream *)outputStream {
+    NSParameterAssert(inputStream);
+    NSParameterAssert(outputStream);
+    if((self = [super init])) {
+        _inputStream = inputStream;
+        _outputStream = outputStream;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (void)scheduleOnQueue:(dispatch_queue_t)queue {
+    _inputStream.delegate = (queue) ? self : nil;
+    _outputStream.delegate = (queue) ? self : nil;
+    CFReadStreamSetDispatchQueue((__bridge CFReadStreamRef)_inputStream, queue);
+    CFWriteStreamSetDispatchQueue((__bridge CFWriteStreamRef)_outputStream, queue);
+}
+- (void)open {
+    if(_inputStream.streamStatus == NSStreamStatusNotOpen) {
+        [_inputStream open];
+    }
+    if(_outputStream.streamStatus == NSStreamStatusNotOpen) {
+        [_outputStream open];
+    }
+}
+- (void)close {
+    _inputStream.delegate = nil;
+    _outputStream.delegate = nil;
+    [_inputStream close];
+    [_outputStream close];
+}
+- (BOOL)hasBytesAvailable {
+    return _inputStream.hasBytesAvailable;
+}
+- (BOOL)hasSpaceAvailable {
+    return _outputStream.hasSpaceAvailable;
+}
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length {
+    return [_inputStream read:buffer maxLength:length];
+}
+- (NSInteger)writeChunks:(const struct iovec *)chunks count:(NSUInteger)count {
+    if(count == 0) {
+        return 0;
+    }
+
+    // NSOutputStream has no vectored write so small leading chunks, such as
+    // frame headers and small payloads, are gathered into a single write
+    // while large chunks are written straight from the caller's memory
+    NSUInteger gatherCount = 0;
+    NSUInteger gatherLength = 0;
+    while(gatherCount < count && gatherLength + chunks[gatherCount].iov_len <= sizeof(_gatherBuffer)) {
+        gatherLength += chunks[gatherCount].iov_len;
+        ++gatherCount;
+    }
+
+    if(gatherCount > 1) {
+        uint8_t *gatherBytes = _gatherBuffer;
+        for(NSUInteger i = 0; i < gatherCount; ++i) {
+            memcpy(gatherBytes, chunks[i].iov_base, chunks[i].iov_len);
+            gatherBytes += chunks[i].iov_len;
+        }
+        return [_outputStream write:_gatherBuffer maxLength:gatherLength];
+    }
+    return [_outputStream write:chunks[0].iov_base maxLength:chunks[0].iov_len];
+}
+- (BOOL)setNoDelay:(BOOL)noDelay {
+    // only streams over a socket expose a native handle, fails harmlessly
+    // for sockets that are not TCP
+    NSData *handleData = CFBridgingRelease(CFReadStreamCopyProperty((__bridge CFReadStreamRef)_inputStream,
+                                                                    kCFStreamPropertySocketNativeHandle));
+    if(!handleData || handleData.length != sizeof(CFSocketNativeHandle)) {
+        return NO;
+    }
+    CFSocketNativeHandle handle = *(const CFSocketNativeHandle *)handleData.bytes;
+    int value = (noDelay) ? 1 : 0;
+    return setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, &value, sizeof(value)) == 0;
+}
+
+#pragma mark - NSStreamDelegate
+
+- (void)stream:(NSStream *)stream handleEvent:(NSStreamEvent)event {
+    // open completes once both streams have opened
+    if(event == NSStreamEventOpenCompleted) {
+        if(stream == _inputStream) {
+            _inputStreamOpenCompleted = YES;
+        } else if(stream == _outputStream) {
+            _outputStreamOpenCompleted = YES;
+        }
+        if(!_inputStreamOpenCompleted || !_outputStreamOpenCompleted) {
+            return;
+        }
+    }
+    [_delegate transport:self handleEvent:event];
+}
+
+@end
@@ -0,0 +1,103 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+
+#import <Foundation/Foundation.h>
+#import "PSWebSocket.h"
+
+/**
+ *  A timer that can be armed on a PSWebSocketTimingWheel any number of
+ *  times. Its handler runs on the wheel's queue.
+ */
+@interface PSWebSocketTimer : NSObject
+
+#pragma mark - Properties
+
+@property (nonatomic, copy, readonly) void (^handler)(void);
+
+#pragma mark - Initialization
+
++ (instancetype)timerWithHandler:(void (^)(void))handler;
+
+@end
+
+/**
+ *  Hierarchical timing wheel driving every deadline of an event loop off a
+ *  single GCD timer. Arming and cancelling are O(1) and the wheel's timer is
+ *  suspended while nothing is armed. Deadlines are rounded up to the wheel's
+ *  resolution. Safe to use from any thread.
+ */
+@interface PSWebSocketTimingWheel : NSObject
+
+#pragma mark - Singleton
+
+/**
+ *  Wheel for sockets that do not belong to a server, it runs on a private
+ *  serial queue.
+ */
++ (instancetype)sharedWheel;
+
+#pragma mark - Properties
+
+@property (nonatomic, strong, readonly) dispatch_queue_t queue;
+@property (nonatomic, assign, readonly) NSTimeInterval resolution;
+
+/**
+ *  Number of timers currently armed.
+ */
+@property (atomic, assign, readonly) NSUInteger armedCount;
+
+/**
+ *  YES when called on the wheel's queue. Expects a single wheel per queue.
+ */
+@property (nonatomic, assign, readonly, getter=isCurrentQueue) BOOL currentQueue;
+
+#pragma mark - Initialization
+
+/**
+ *  Initialize a wheel firing timers on the given serial queue.
+ *
+ *  @param queue      queue timer handlers run on
+ *  @param resolution length of a tick in seconds
+ */
+- (instancetype)initWithQueue:(dispatch_queue_t)queue resolution:(NSTimeInterval)resolution;
+
+#pragma mark - Actions
+
+/**
+ *  Arm the timer to fire once after the given interval, a timer that is
+ *  already armed is moved to the new deadline.
+ */
+- (void)armTimer:(PSWebSocketTimer *)timer interval:(NSTimeInterval)interval;
+
+/**
+ *  Disarm a timer armed on this wheel, does nothing if it is not armed. A
+ *  timer cancelled from another queue as it expires may still fire once so
+ *  handlers should check the state they guard.
+ */
+- (void)cancelTimer:(PSWebSocketTimer *)timer;
+
+@end
+
+@interface PSWebSocket ()
+
+/**
+ *  Wheel driving the websocket's timeouts, servers hand out the wheel of the
+ *  event loop owning the connection. Sends made on the wheel's queue never
+ *  wait out a blocking slowConsumerPolicy. Set before opening. Defaults to
+ *  +[PSWebSocketTimingWheel sharedWheel].
+ */
+@property (nonatomic, strong) PSWebSocketTimingWheel *timingWheel;
+
+@end
@@ -0,0 +1,278 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+
+#import "PSWebSocketTimingWheel.h"
+#import <mach/mach_time.h>
+#import <pthread.h>
+
+// four levels of 64 slots span 2^24 ticks, later deadlines wait in the last
+// slot of the top level and cascade again
+static const NSUInteger PSWebSocketTimingWheelLevelBits = 6;
+static const NSUInteger PSWebSocketTimingWheelSlotCount = 1 << PSWebSocketTimingWheelLevelBits;
+static const NSUInteger PSWebSocketTimingWheelLevelCount = 4;
+static const NSTimeInterval PSWebSocketTimingWheelDefaultResolution = 0.01;
+static void *PSWebSocketTimingWheelKey = &PSWebSocketTimingWheelKey;
+
+@interface PSWebSocketTimer()
+
+@property (nonatomic, strong) PSWebSocketTimer *next;
+@property (nonatomic, unsafe_unretained) PSWebSocketTimer *previous;
+@property (nonatomic, assign) uint64_t expires;
+@property (nonatomic, assign) BOOL armed;
+
+@end
+@implementation PSWebSocketTimer
+
+#pragma mark - Initialization
+
++ (instancetype)timerWithHandler:(void (^)(void))handler {
+    NSParameterAssert(handler);
+    return [[self alloc] initWithHandler:handler];
+}
+- (instancetype)initWithHandler:(void (^)(void))handler {
+    if((self = [super init])) {
+        _handler = [handler copy];
+        _armed = NO;
+    }
+    return self;
+}
+
+@end
+
+@interface PSWebSocketTimingWheel() {
+    pthread_mutex_t _lock;
+    dispatch_source_t _source;
+    BOOL _running;
+    NSArray *_slots;
+    uint64_t _tick;
+    uint64_t _origin;
+    mach_timebase_info_data_t _timebase;
+    uint64_t _tickNanoseconds;
+    NSUInteger _armedCount;
+}
+@end
+@implementation PSWebSocketTimingWheel
+
+#pragma mark - Singleton
+
++ (instancetype)sharedWheel {
+    static id sharedWheel = nil;
+    static dispatch_once_t sharedWheelOnce = 0;
+    dispatch_once(&sharedWheelOnce, ^{
+        dispatch_queue_t queue = dispatch_queue_create("PSWebSocketTimingWheel", nil);
+        sharedWheel = [[self alloc] initWithQueue:queue resolution:PSWebSocketTimingWheelDefaultResolution];
+    });
+    return sharedWheel;
+}
+
+#pragma mark - Properties
+
+- (NSUInteger)armedCount {
+    pthread_mutex_lock(&_lock);
+    NSUInteger armedCount = _armedCount;
+    pthread_mutex_unlock(&_lock);
+    return armedCount;
+}
+- (BOOL)isCurrentQueue {
+    return dispatch_get_specific(PSWebSocketTimingWheelKey) == (__bridge void *)self;
+}
+
+#pragma mark - Initialization
+
+- (instancetype)initWithQueue:(dispatch_queue_t)queue resolution:(NSTimeInterval)resolution {
+    NSParameterAssert(queue);
+    NSParameterAssert(resolution > 0.0);
+    if((self = [super init])) {
+        pthread_mutex_init(&_lock, NULL);
+        _queue = queue;
+        dispatch_queue_set_specific(_queue, PSWebSocketTimingWheelKey, (__bridge void *)self, NULL);
+        _resolution = resolution;
+        _tickNanoseconds = MAX((uint64_t)(resolution * NSEC_PER_SEC), 1);
+        mach_timebase_info(&_timebase);
+        _origin = mach_absolute_time();
+        _tick = 0;
+        _armedCount = 0;
+        _running = NO;
+        
+        // every slot is a list hanging off a sentinel timer
+        NSMutableArray *slots = [NSMutableArray arrayWithCapacity:PSWebSocketTimingWheelLevelCount * PSWebSocketTimingWheelSlotCount];
+        for(NSUInteger i = 0; i < PSWebSocketTimingWheelLevelCount * PSWebSocketTimingWheelSlotCount; ++i) {
+            [slots addObject:[[PSWebSocketTimer alloc] init]];
+        }
+        _slots = slots;
+        
+        // created suspended, it only runs while timers are armed
+        _source = dispatch_source_create(DISPATCH_SOURCE_TYPE_TIMER, 0, 0, _queue);
+        dispatch_source_set_timer(_source, dispatch_time(DISPATCH_TIME_NOW, _tickNanoseconds), _tickNanoseconds, _tickNanoseconds / 2);
+        __weak typeof(self)weakSelf = self;
+        dispatch_source_set_event_handler(_source, ^{
+            [weakSelf advance];
+        });
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (void)armTimer:(PSWebSocketTimer *)timer interval:(NSTimeInterval)interval {
+    NSParameterAssert(timer.handler);
+    uint64_t ticks = (interval > 0.0) ? (uint64_t)ceil((interval * NSEC_PER_SEC) / _tickNanoseconds) : 0;
+    
+    pthread_mutex_lock(&_lock);
+    if(timer.armed) {
+        [self unlinkTimer:timer];
+    }
+    uint64_t now = [self currentTick];
+    if(!_running) {
+        // nothing is armed so there is nothing to catch up on
+        _tick = now;
+    }
+    timer.expires = now + MAX(ticks, 1);
+    [self insertTimer:timer];
+    if(!_running) {
+        _running = YES;
+        dispatch_resume(_source);
+    }
+    pthread_mutex_unlock(&_lock);
+}
+- (void)cancelTimer:(PSWebSocketTimer *)timer {
+    if(!timer) {
+        return;
+    }
+    pthread_mutex_lock(&_lock);
+    if(timer.armed) {
+        [self unlinkTimer:timer];
+    }
+    pthread_mutex_unlock(&_lock);
+}
+
+#pragma mark - Ticking
+
+- (uint64_t)currentTick {
+    uint64_t nanoseconds = (mach_absolute_time() - _origin) * _timebase.numer / _timebase.denom;
+    return nanoseconds / _tickNanoseconds;
+}
+- (void)advance {
+    NSMutableArray *expired = nil;
+    
+    pthread_mutex_lock(&_lock);
+    uint64_t now = [self currentTick];
+    while(_tick < now) {
+        if(_armedCount == 0) {
+            _tick = now;
+            break;
+        }
+        ++_tick;
+        
+        // a higher slot is spread over the lower levels as its span begins,
+        // highest level first so its timers can cascade all the way down
+        for(NSUInteger level = PSWebSocketTimingWheelLevelCount - 1; level > 0; --level) {
+            NSUInteger shift = PSWebSocketTimingWheelLevelBits * level;
+            if((_tick & ((1ull << shift) - 1)) == 0) {
+                [self cascadeSlot:[self slotAtLevel:level block:_tick >> shift]];
+            }
+        }
+        
+        PSWebSocketTimer *head = [self slotAtLevel:0 block:_tick];
+        while(head.next) {
+            PSWebSocketTimer *timer = head.next;
+            [self unlinkTimer:timer];
+            if(!expired) {
+                expired = [NSMutableArray array];
+            }
+            [expired addObject:timer];
+        }
+    }
+    if(_armedCount == 0 && _running) {
+        _running = NO;
+        dispatch_suspend(_source);
+    }
+    pthread_mutex_unlock(&_lock);
+    
+    // handlers may arm timers again
+    for(PSWebSocketTimer *timer in expired) {
+        timer.handler();
+    }
+}
+
+#pragma mark - Slots
+
+- (PSWebSocketTimer *)slotAtLevel:(NSUInteger)level block:(uint64_t)block {
+    return _slots[level * PSWebSocketTimingWheelSlotCount + (NSUInteger)(block & (PSWebSocketTimingWheelSlotCount - 1))];
+}
+- (void)insertTimer:(PSWebSocketTimer *)timer {
+    // timers cascading down may be due on the current tick, its slot is
+    // processed right after cascading
+    uint64_t expires = MAX(timer.expires, _tick);
+    
+    // lowest level whose slots still reach the deadline
+    NSUInteger level = 0;
+    while(level < PSWebSocketTimingWheelLevelCount - 1 &&
+          (expires >> (PSWebSocketTimingWheelLevelBits * level)) - (_tick >> (PSWebSocketTimingWheelLevelBits * level)) >= PSWebSocketTimingWheelSlotCount) {
+        ++level;
+    }
+    NSUInteger shift = PSWebSocketTimingWheelLevelBits * level;
+    uint64_t block = MIN(expires >> shift, (_tick >> shift) + PSWebSocketTimingWheelSlotCount - 1);
+    
+    PSWebSocketTimer *head = [self slotAtLevel:level block:block];
+    timer.previous = head;
+    timer.next = head.next;
+    head.next.previous = timer;
+    head.next = timer;
+    timer.armed = YES;
+    ++_armedCount;
+}
+- (void)unlinkTimer:(PSWebSocketTimer *)timer {
+    // the list may hold the last reference
+    PSWebSocketTimer *strongTimer = timer;
+    PSWebSocketTimer *next = strongTimer.next;
+    next.previous = strongTimer.previous;
+    strongTimer.previous.next = next;
+    strongTimer.next = nil;
+    strongTimer.previous = nil;
+    strongTimer.armed = NO;
+    --_armedCount;
+}
+- (void)cascadeSlot:(PSWebSocketTimer *)head {
+    PSWebSocketTimer *timer = head.next;
+    head.next = nil;
+    while(timer) {
+        PSWebSocketTimer *next = timer.next;
+        timer.next = nil;
+        timer.previous = nil;
+        --_armedCount;
+        [self insertTimer:timer];
+        timer = next;
+    }
+}
+
+#pragma mark - Dealloc
+
+- (void)dealloc {
+    dispatch_source_cancel(_source);
+    if(!_running) {
+        dispatch_resume(_source);
+    }
+    
+    // unlink one by one, releasing a long list at once would recurse deeply
+    for(PSWebSocketTimer *head in _slots) {
+        while(head.next) {
+            [self unlinkTimer:head.next];
+        }
+    }
+    pthread_mutex_destroy(&_lock);
+}
+
+@end
@@ -0,0 +1,88 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import <sys/uio.h>
+
+@protocol PSWebSocketTransport;
+
+/**
+ *  PSWebSocketTransportDelegate
+ */
+@protocol PSWebSocketTransportDelegate <NSObject>
+
+@required
+
+/**
+ *  Called on the queue the transport is scheduled on. Events have the same
+ *  meaning as for NSStream. Open completed is sent once when the transport
+ *  becomes open, transports over an already connected socket may open
+ *  synchronously and never send it.
+ */
+- (void)transport:(id <PSWebSocketTransport>)transport handleEvent:(NSStreamEvent)event;
+
+@end
+
+/**
+ *  Byte pipe between a PSWebSocket and the network. Every method must be
+ *  called on the queue the transport is scheduled on.
+ */
+@protocol PSWebSocketTransport <NSObject>
+
+@required
+
+@property (nonatomic, weak) id <PSWebSocketTransportDelegate> delegate;
+@property (nonatomic, assign, readonly) NSStreamStatus status;
+@property (nonatomic, strong, readonly) NSError *error;
+
+/**
+ *  Address of the remote peer as a sockaddr, nil if not connected.
+ */
+@property (nonatomic, strong, readonly) NSData *remoteAddress;
+
+/**
+ *  Deliver readiness events on the given serial queue, NULL stops delivery.
+ */
+- (void)scheduleOnQueue:(dispatch_queue_t)queue;
+
+- (void)open;
+- (void)close;
+
+- (BOOL)hasBytesAvailable;
+- (BOOL)hasSpaceAvailable;
+
+/**
+ *  Read up to length bytes.
+ *
+ *  @return bytes read, 0 if none are available or -1 on error
+ */
+- (NSInteger)read:(uint8_t *)buffer maxLength:(NSUInteger)length;
+
+/**
+ *  Write as much of the chunks as possible in order.
+ *
+ *  @return bytes written, 0 if there was no space or -1 on error
+ */
+- (NSInteger)writeChunks:(const struct iovec *)chunks count:(NSUInteger)count;
+
+@optional
+
+/**
+ *  Enable or disable Nagle's algorithm on the underlying TCP socket.
+ *
+ *  @return NO if the transport has no TCP socket yet or the option failed
+ */
+- (BOOL)setNoDelay:(BOOL)noDelay;
+
+@end
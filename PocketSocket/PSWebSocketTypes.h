@@ -19,6 +19,20 @@ typedef NS_ENUM(NSInteger, PSWebSocketMode) {
     PSWebSocketModeServer
 };
 
+typedef NS_ENUM(NSInteger, PSWebSocketMessageType) {
+    PSWebSocketMessageTypeText = 0,
+    PSWebSocketMessageTypeBinary
+};
+
+typedef NS_ENUM(NSInteger, PSWebSocketMessageDelivery) {
+    // text as an NSString decoded from a copy, binary as an NSMutableData
+    PSWebSocketMessageDeliveryString = 0,
+    // text as an NSString viewing the message buffer, binary as an immutable view
+    PSWebSocketMessageDeliveryStringNoCopy,
+    // text as PSWebSocketUTF8Data, binary as an immutable view
+    PSWebSocketMessageDeliveryUTF8Data
+};
+
 typedef NS_ENUM(NSInteger, PSWebSocketErrorCodes) {
     PSWebSocketErrorCodeUnknown = 0,
     PSWebSocketErrorCodeTimedOut,
@@ -18,3 +18,26 @@
 #define PSWebSocketUTF8DecoderReject 1
 
 uint32_t PSWebSocketUTF8DecoderDecode(uint32_t* state, uint32_t* codep, uint32_t byte);
+
+/**
+ *  Validate a block of bytes, carrying state across calls so sequences may
+ *  be split between blocks. Runs of ASCII are skipped 8/16/32 bytes at a time
+ *  and only multibyte sequences go through the DFA. Stops early and returns
+ *  PSWebSocketUTF8DecoderReject on invalid input. If ascii is non-NULL it is
+ *  set to NO once a non-ASCII byte has been seen and is otherwise untouched.
+ */
+uint32_t PSWebSocketUTF8DecoderValidate(uint32_t* state, const uint8_t* bytes, NSUInteger length, BOOL* ascii);
+
+/**
+ *  Transcode bytes already accepted by PSWebSocketUTF8DecoderValidate to
+ *  UTF-16 without checking them again. characters must have room for length
+ *  units. Returns the number of units written. Passing bytes that have not
+ *  been validated is undefined.
+ */
+NSUInteger PSWebSocketUTF8DecoderTranscode(const uint8_t* bytes, NSUInteger length, unichar* characters);
+
+/**
+ *  Build a string from validated UTF-8 via PSWebSocketUTF8DecoderTranscode.
+ *  Returns nil if the character buffer cannot be allocated.
+ */
+NSString* PSWebSocketUTF8DecoderString(const uint8_t* bytes, NSUInteger length);
@@ -13,6 +13,11 @@
 //  limitations under the License.
 
 #import "PSWebSocketUTF8Decoder.h"
+#if defined(__AVX2__) || defined(__SSE2__)
+#import <immintrin.h>
+#elif defined(__aarch64__)
+#import <arm_neon.h>
+#endif
 
 
 // Flexible and Economical UTF-8 Decoder
@@ -47,3 +52,105 @@ uint32_t PSWebSocketUTF8DecoderDecode(uint32_t* state, uint32_t* codep, uint32_t
     return *state;
 }
 
+static inline NSUInteger PSWebSocketUTF8DecoderSkipASCII(const uint8_t* bytes, NSUInteger i, NSUInteger length) {
+#if defined(__AVX2__)
+    for(; i + 32 <= length; i += 32) {
+        if(_mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(bytes + i))) != 0) {
+            break;
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    for(; i + 16 <= length; i += 16) {
+        if(_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(bytes + i))) != 0) {
+            break;
+        }
+    }
+#elif defined(__aarch64__)
+    for(; i + 16 <= length; i += 16) {
+        if(vmaxvq_u8(vld1q_u8(bytes + i)) >= 0x80) {
+            break;
+        }
+    }
+#endif
+    for(; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, bytes + i, sizeof(word));
+        if(word & 0x8080808080808080ull) {
+            break;
+        }
+    }
+    while(i < length && bytes[i] < 0x80) {
+        ++i;
+    }
+    return i;
+}
+
+uint32_t PSWebSocketUTF8DecoderValidate(uint32_t* state, const uint8_t* bytes, NSUInteger length, BOOL* ascii) {
+    uint32_t current = *state;
+    NSUInteger i = 0;
+    while(i < length) {
+        // between sequences; skip ahead to the next non-ASCII byte
+        if(current == PSWebSocketUTF8DecoderAccept) {
+            i = PSWebSocketUTF8DecoderSkipASCII(bytes, i, length);
+            if(i == length) {
+                break;
+            }
+            if(ascii) {
+                *ascii = NO;
+            }
+        }
+        current = utf8_validator_table[256 + current*16 + utf8_validator_table[bytes[i]]];
+        if(current == PSWebSocketUTF8DecoderReject) {
+            break;
+        }
+        ++i;
+    }
+    *state = current;
+    return current;
+}
+
+NSUInteger PSWebSocketUTF8DecoderTranscode(const uint8_t* bytes, NSUInteger length, unichar* characters) {
+    NSUInteger i = 0;
+    NSUInteger n = 0;
+    while(i < length) {
+        // copy ASCII runs straight across, they map one byte to one unit
+        NSUInteger run = PSWebSocketUTF8DecoderSkipASCII(bytes, i, length);
+        for(; i < run; ++i) {
+            characters[n++] = bytes[i];
+        }
+        if(i == length) {
+            break;
+        }
+        uint8_t lead = bytes[i];
+        uint32_t codep;
+        if(lead < 0xE0) {
+            codep = ((uint32_t)(lead & 0x1F) << 6) | (bytes[i + 1] & 0x3F);
+            i += 2;
+        } else if(lead < 0xF0) {
+            codep = ((uint32_t)(lead & 0x0F) << 12) | ((uint32_t)(bytes[i + 1] & 0x3F) << 6) | (bytes[i + 2] & 0x3F);
+            i += 3;
+        } else {
+            codep = ((uint32_t)(lead & 0x07) << 18) | ((uint32_t)(bytes[i + 1] & 0x3F) << 12) | ((uint32_t)(bytes[i + 2] & 0x3F) << 6) | (bytes[i + 3] & 0x3F);
+            i += 4;
+        }
+        if(codep > 0xFFFF) {
+            codep -= 0x10000;
+            characters[n++] = (unichar)(0xD800 + (codep >> 10));
+            characters[n++] = (unichar)(0xDC00 + (codep & 0x3FF));
+        } else {
+            characters[n++] = (unichar)codep;
+        }
+    }
+    return n;
+}
+
+NSString* PSWebSocketUTF8DecoderString(const uint8_t* bytes, NSUInteger length) {
+    // every UTF-8 sequence yields no more UTF-16 units than it has bytes
+    unichar *characters = malloc(MAX(length, 1) * sizeof(unichar));
+    if(!characters) {
+        return nil;
+    }
+    NSUInteger count = PSWebSocketUTF8DecoderTranscode(bytes, length, characters);
+    return [[NSString alloc] initWithCharactersNoCopy:characters length:count freeWhenDone:YES];
+}
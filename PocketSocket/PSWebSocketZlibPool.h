@@ -0,0 +1,66 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import <Foundation/Foundation.h>
+#import <zlib.h>
+
+/**
+ *  Process wide cache of initialized zlib streams. Deflaters and inflaters
+ *  borrow a stream while they need a context and relinquish it afterwards so
+ *  connections without context takeover only hold one for a single message.
+ *  Safe to use from any thread.
+ */
+@interface PSWebSocketZlibPool : NSObject
+
+#pragma mark - Singleton
+
++ (instancetype)sharedPool;
+
+#pragma mark - Properties
+
+/**
+ *  Idle streams kept per configuration, streams relinquished beyond it are
+ *  freed. Defaults to 32.
+ */
+@property (atomic, assign) NSUInteger maximumIdleCount;
+
+/**
+ *  Number of idle streams currently held for every configuration.
+ */
+@property (atomic, assign, readonly) NSUInteger idleCount;
+
+#pragma mark - Actions
+
+/**
+ *  Borrow a deflate stream initialized with the given parameters.
+ *
+ *  @return the stream or NULL if zlib failed to initialize one
+ */
+- (z_stream *)deflateStreamWithWindowBits:(int)windowBits memoryLevel:(int)memoryLevel level:(int)level strategy:(int)strategy;
+- (void)relinquishDeflateStream:(z_stream *)stream windowBits:(int)windowBits memoryLevel:(int)memoryLevel level:(int)level strategy:(int)strategy;
+
+/**
+ *  Borrow an inflate stream initialized with the given window bits.
+ *
+ *  @return the stream or NULL if zlib failed to initialize one
+ */
+- (z_stream *)inflateStreamWithWindowBits:(int)windowBits;
+- (void)relinquishInflateStream:(z_stream *)stream windowBits:(int)windowBits;
+
+/**
+ *  Free every idle stream.
+ */
+- (void)drain;
+
+@end
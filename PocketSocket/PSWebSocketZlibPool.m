@@ -0,0 +1,171 @@
+//  Copyright 2014-Present Zwopple Limited
+//
+//  Licensed under the Apache License, Version 2.0 (the "License");
+//  you may not use this file except in compliance with the License.
+//  You may obtain a copy of the License at
+//
+//  http://www.apache.org/licenses/LICENSE-2.0
+//
+//  Unless required by applicable law or agreed to in writing, software
+//  distributed under the License is distributed on an "AS IS" BASIS,
+//  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+//  See the License for the specific language governing permissions and
+//  limitations under the License.
+
+#import "PSWebSocketZlibPool.h"
+#import <pthread.h>
+
+static inline NSNumber* PSWebSocketZlibPoolKey(BOOL deflate, int windowBits, int memoryLevel, int level, int strategy) {
+    // every parameter fits in a byte once offset to be non negative
+    uint64_t key = (deflate) ? 1 : 0;
+    key = (key << 8) | (uint8_t)(windowBits + 16);
+    key = (key << 8) | (uint8_t)memoryLevel;
+    key = (key << 8) | (uint8_t)(level + 1);
+    key = (key << 8) | (uint8_t)strategy;
+    return @(key);
+}
+
+@interface PSWebSocketZlibPool() {
+    pthread_mutex_t _lock;
+    NSMutableDictionary *_idleStreams;
+    NSUInteger _idleCount;
+}
+@end
+@implementation PSWebSocketZlibPool
+
+#pragma mark - Singleton
+
++ (instancetype)sharedPool {
+    static id sharedPool = nil;
+    static dispatch_once_t sharedPoolOnce = 0;
+    dispatch_once(&sharedPoolOnce, ^{
+        sharedPool = [[self alloc] init];
+    });
+    return sharedPool;
+}
+
+#pragma mark - Properties
+
+- (NSUInteger)idleCount {
+    pthread_mutex_lock(&_lock);
+    NSUInteger idleCount = _idleCount;
+    pthread_mutex_unlock(&_lock);
+    return idleCount;
+}
+
+#pragma mark - Initialization
+
+- (instancetype)init {
+    if((self = [super init])) {
+        pthread_mutex_init(&_lock, NULL);
+        _idleStreams = [NSMutableDictionary dictionary];
+        _idleCount = 0;
+        _maximumIdleCount = 32;
+    }
+    return self;
+}
+
+#pragma mark - Actions
+
+- (z_stream *)deflateStreamWithWindowBits:(int)windowBits memoryLevel:(int)memoryLevel level:(int)level strategy:(int)strategy {
+    z_stream *stream = [self idleStreamForKey:PSWebSocketZlibPoolKey(YES, windowBits, memoryLevel, level, strategy)];
+    if(stream) {
+        return stream;
+    }
+    stream = calloc(1, sizeof(z_stream));
+    if(deflateInit2(stream, level, Z_DEFLATED, windowBits, memoryLevel, strategy) != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+- (void)relinquishDeflateStream:(z_stream *)stream windowBits:(int)windowBits memoryLevel:(int)memoryLevel level:(int)level strategy:(int)strategy {
+    NSParameterAssert(stream);
+    if(deflateReset(stream) == Z_OK &&
+       [self addIdleStream:stream forKey:PSWebSocketZlibPoolKey(YES, windowBits, memoryLevel, level, strategy)]) {
+        return;
+    }
+    deflateEnd(stream);
+    free(stream);
+}
+- (z_stream *)inflateStreamWithWindowBits:(int)windowBits {
+    z_stream *stream = [self idleStreamForKey:PSWebSocketZlibPoolKey(NO, windowBits, 0, 0, 0)];
+    if(stream) {
+        return stream;
+    }
+    stream = calloc(1, sizeof(z_stream));
+    if(inflateInit2(stream, windowBits) != Z_OK) {
+        free(stream);
+        return NULL;
+    }
+    return stream;
+}
+- (void)relinquishInflateStream:(z_stream *)stream windowBits:(int)windowBits {
+    NSParameterAssert(stream);
+    if(inflateReset(stream) == Z_OK &&
+       [self addIdleStream:stream forKey:PSWebSocketZlibPoolKey(NO, windowBits, 0, 0, 0)]) {
+        return;
+    }
+    inflateEnd(stream);
+    free(stream);
+}
+- (void)drain {
+    pthread_mutex_lock(&_lock);
+    NSDictionary *idleStreams = _idleStreams;
+    _idleStreams = [NSMutableDictionary dictionary];
+    _idleCount = 0;
+    pthread_mutex_unlock(&_lock);
+
+    [idleStreams enumerateKeysAndObjectsUsingBlock:^(NSNumber *key, NSArray *streams, BOOL *stop) {
+        BOOL deflate = (key.unsignedLongLongValue >> 32) != 0;
+        for(NSValue *value in streams) {
+            z_stream *stream = value.pointerValue;
+            if(deflate) {
+                deflateEnd(stream);
+            } else {
+                inflateEnd(stream);
+            }
+            free(stream);
+        }
+    }];
+}
+
+#pragma mark - Private
+
+- (z_stream *)idleStreamForKey:(NSNumber *)key {
+    z_stream *stream = NULL;
+    pthread_mutex_lock(&_lock);
+    NSMutableArray *streams = _idleStreams[key];
+    if(streams.count > 0) {
+        stream = [streams.lastObject pointerValue];
+        [streams removeLastObject];
+        --_idleCount;
+    }
+    pthread_mutex_unlock(&_lock);
+    return stream;
+}
+- (BOOL)addIdleStream:(z_stream *)stream forKey:(NSNumber *)key {
+    BOOL added = NO;
+    pthread_mutex_lock(&_lock);
+    NSMutableArray *streams = _idleStreams[key];
+    if(!streams) {
+        streams = [NSMutableArray array];
+        _idleStreams[key] = streams;
+    }
+    if(streams.count < self.maximumIdleCount) {
+        [streams addObject:[NSValue valueWithPointer:stream]];
+        ++_idleCount;
+        added = YES;
+    }
+    pthread_mutex_unlock(&_lock);
+    return added;
+}
+
+#pragma mark - Dealloc
+
+- (void)dealloc {
+    [self drain];
+    pthread_mutex_destroy(&_lock);
+}
+
+@end